@@ -12,21 +12,48 @@
 
 
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_X86
+#include <immintrin.h>
+#endif
+
 
 
 enum NavInput 
 {
+    CANCEL_JOB,
+    CLIPBOARD_COPY,
+    CLIPBOARD_CUT,
+    CLIPBOARD_PASTE,
     CURSOR_DOWN,
     CURSOR_UP,
     DEBUG,
@@ -34,11 +61,289 @@ enum NavInput
     DIR_DOWN,
     HELP,
     INSPECT,
+    JUMP,
     QUIT,
+    REMOVE,
+    SEARCH_TEXT,
+    SORT_CYCLE,
+    TOGGLE_DETAILS,
+    TOGGLE_DIRS_FIRST,
     TOGGLE_HIDDEN,
+    TOGGLE_MARK,
+    TOGGLE_TREE,
+    FIND_DUPLICATES,
+    COMPARE_PANES,
+    SWITCH_PANE,
+    NEXT_DIFFERENCE,
+    COMPARE_CONTENTS,
     INVALID
 };
 
+enum JobType
+{
+    JOB_COPY,
+    JOB_MOVE,
+    JOB_DELETE,
+    JOB_HASH,
+    JOB_DUPES,
+    JOB_COMPARE,
+    JOB_EXTRACT
+};
+
+enum ResultsKind
+{
+    RESULTS_NONE,
+    RESULTS_SEARCH,
+    RESULTS_DUPLICATES
+};
+
+enum ListFormat
+{
+    LIST_PLAIN,
+    LIST_NUL,
+    LIST_JSON
+};
+
+enum WaitEvent
+{
+    WAIT_INPUT,
+    WAIT_JOB,
+    WAIT_TIMEOUT,
+    WAIT_WATCH,
+    WAIT_SEARCH
+};
+
+enum ArchiveFormat
+{
+    ARCHIVE_NONE,
+    ARCHIVE_TAR,
+    ARCHIVE_CPIO,
+    ARCHIVE_ZIP
+};
+
+enum InflateState
+{
+    INFLATE_HEADER,
+    INFLATE_BLOCK,
+    INFLATE_STORED,
+    INFLATE_CODES,
+    INFLATE_DONE,
+    INFLATE_ERROR
+};
+
+enum SortMode
+{
+    SORT_NAME,
+    SORT_NATURAL,
+    SORT_SIZE,
+    SORT_MTIME,
+    SORT_TYPE,
+    SORT_EXTENSION,
+    SORT_MODE_COUNT
+};
+
+typedef struct
+{
+    char *name;
+    char *display;
+    unsigned short width;
+    unsigned char type;
+    unsigned char flags;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t mtime;
+} DirEntry;
+
+typedef struct NameBlock
+{
+    struct NameBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} NameBlock;
+
+typedef struct
+{
+    DirEntry *entries;
+    int count;
+    int capacity;
+    int dirFd;
+    NameBlock *names;
+    int pageFd;
+    int indexFd;
+    int windowStart;
+    int windowCount;
+    off_t windowBase;
+    unsigned char *windowFlags;
+} DirListing;
+
+typedef struct
+{
+    unsigned char type;
+    unsigned char flags;
+    unsigned short nameLen;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long long size;
+    long long mtime;
+} SpillRecord;
+
+typedef struct
+{
+    int fd;
+    off_t pos;
+    char *buf;
+    size_t len;
+} SpillWriter;
+
+typedef struct
+{
+    int fd;
+    off_t pos;
+    off_t end;
+    char *buf;
+    size_t len;
+    size_t at;
+    DirEntry entry;
+    char name[NAME_MAX + 1];
+} SpillReader;
+
+typedef struct Job
+{
+    struct Job *next;
+    enum JobType type;
+    int srcFd;
+    int dstFd;
+    char **names;
+    int nameCount;
+    long long bytesDone;
+    long long bytesTotal;
+    int filesDone;
+    int filesTotal;
+    struct timespec started;
+    int errors;
+    char error[128];
+    dev_t skipDev;
+    ino_t skipIno;
+    void (*run)(struct Job *job);
+    void *data;
+    void (*freeData)(void *data);
+} Job;
+
+typedef struct
+{
+    enum JobType type;
+    int dirFd;
+    char **names;
+    int count;
+} Clipboard;
+
+typedef struct
+{
+    char magic[4];
+    unsigned int compactedBytes;
+} JumpHeader;
+
+typedef struct
+{
+    unsigned int lastVisit;
+    unsigned int visits;
+    unsigned short pathLen;
+    unsigned short reserved;
+} JumpRecord;
+
+typedef struct
+{
+    char *path;
+    size_t pathLen;
+    unsigned int visits;
+    unsigned int lastVisit;
+    double score;
+} JumpEntry;
+
+typedef struct
+{
+    JumpEntry *entries;
+    int count;
+    int capacity;
+    int *table;
+    int buckets;
+    int *matches;
+    int matchCount;
+    dev_t dev;
+    ino_t ino;
+    size_t parsed;
+} JumpIndex;
+
+typedef struct
+{
+    int fd;
+    size_t pathLen;
+} NavLevel;
+
+typedef struct
+{
+    NavLevel *levels;
+    int depth;
+    int capacity;
+    char *path;
+    size_t pathCapacity;
+} NavStack;
+
+typedef struct
+{
+    unsigned int id;
+    int valid;
+    char name[33];
+} IdCacheSlot;
+
+typedef struct
+{
+    int row;
+    int col;
+    int attrKnown;
+    unsigned char flags;
+    unsigned char fg;
+    unsigned char bg;
+} TermState;
+
+typedef struct
+{
+    unsigned int first;
+    unsigned int last;
+} CodepointRange;
+
+typedef struct
+{
+    size_t start;
+    size_t len;
+    int width;
+    int indented;
+} TextLine;
+
+typedef struct
+{
+    char *text;
+    size_t textLen;
+    unsigned int hash;
+    int width;
+    char *indent;
+    int indentWidth;
+    TextLine *lines;
+    int count;
+    unsigned long lastUsed;
+} TextLayout;
+
+typedef struct
+{
+    unsigned long long major;
+    unsigned long long minor;
+    int index;
+} SortKey;
+
 typedef struct 
 {
     char *name;
@@ -46,6 +351,66 @@ typedef struct
     int visible;
 } MenuItem;
 
+typedef struct
+{
+    pthread_t thread;
+    int running;
+    int done;
+    int cancel;
+    int ok;
+    int parentFd;
+    char *path;
+    char name[NAME_MAX + 1];
+    int dotfiles;
+    enum SortMode sortMode;
+    int dirsFirst;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    DirListing listing;
+} Prefetch;
+
+typedef struct
+{
+    DirEntry entry;
+    int parent;
+    int firstChild;
+    int childCount;
+    unsigned short depth;
+    unsigned char expanded;
+} TreeNode;
+
+typedef struct
+{
+    TreeNode *nodes;
+    int count;
+    int capacity;
+    int *rows;
+    int rowCount;
+    int rowCapacity;
+    NameBlock *names;
+    int rootFd;
+} TreeView;
+
+typedef struct
+{
+    int fd;
+    int wd;
+    char **names;
+    int count;
+    int capacity;
+    int overflow;
+    int dropped;
+    struct timespec due;
+} DirWatch;
+
+typedef struct
+{
+    NavStack nav;
+    DirListing listing;
+    int cursor;
+} Pane;
+
 
 
 #define COL_BAK_BLACK           "40"
@@ -80,31 +445,428 @@ typedef struct
 #define COL_BAK_RESET           "49"
 
 #define DT_EXE                  16
+#define DT_GROUP                17
+
+#define ROTR32(x, n)            (((x) >> (n)) | ((x) << (32 - (n))))
+#define XXH_PRIME64_1           0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2           0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3           0x165667b19e3779f9ULL
+#define XXH_PRIME64_4           0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5           0x27d4eb2f165667c5ULL
+
+#define ATTR_BOLD               0x01
+#define ATTR_UNDERLINE          0x02
+#define ATTR_BLINK              0x04
+#define ATTR_REVERSE            0x08
+
+#define COLUMN_PERMS            0x01
+#define COLUMN_USER             0x02
+#define COLUMN_GROUP            0x04
+#define COLUMN_SIZE             0x08
+#define COLUMN_MTIME            0x10
+
+#define ENTRY_STATTED           0x01
+#define ENTRY_MARKED            0x02
+#define ENTRY_RESOLVED          0x04
+#define ENTRY_LINK_DIR          0x08
+#define ENTRY_LINK_FILE         0x10
+#define ENTRY_ONLY_HERE         0x20
+#define ENTRY_DIFFERS           0x40
+
+#define ARCHIVE_STORED          0
+#define ARCHIVE_DEFLATED        8
+#define ARCHIVE_UNSUPPORTED     255
+
+#define ID_CACHE_SLOTS          64
+#define NAV_MAX_OPEN_FDS        32
+
+#define ARCHIVE_CACHE_SLOTS     4
+#define ARCHIVE_CANCEL_CHECK    (1 << 20)
+#define ARCHIVE_CHECKPOINT_SPAN (1 << 20)
+#define ARCHIVE_MAX_CHECKPOINTS 64
+#define ARCHIVE_VIEW_MAX        (256 << 10)
+#define COPY_BUFFER_SIZE        (1 << 20)
+#define COPY_CHUNK_SIZE         (8 << 20)
+#define DUPE_BLOCK_SIZE         4096
+#define JOB_REFRESH_MS          500
+#define JUMP_COMPACT_MIN        65536
+#define JUMP_MAGIC              "SHJ1"
+#define JUMP_MAX_VISITS         10000
+#define LAYOUT_CACHE_SLOTS      8
+#define NAME_BLOCK_SIZE         65536
+#define PAGE_WINDOW             512
+#define PREFETCH_DELAY_MS       200
+#define PREFETCH_MAX_ENTRIES    4096
+#define SEARCH_CHUNK_SIZE       (256 << 10)
+#define SEARCH_MAX_PATTERN      127
+#define SEARCH_QUEUE_SIZE       1024
+#define SEARCH_SNIFF_SIZE       4096
+#define SPILL_BUFFER_SIZE       16384
+#define SPILL_FAN_IN            8
+#define INFLATE_FAST_BITS       9
+#define INFLATE_IN_SIZE         16384
+#define INFLATE_WINDOW          32768
+#define TAR_MAX_META            (1 << 20)
+#define HASH_CACHE_SLOTS        16
+#define WATCH_DELAY_MS          100
+#define WATCH_MAX_PENDING       16384
+#define WORKER_MAX              8
+
+
+
+typedef struct
+{
+    unsigned short count[16];
+    unsigned short symbol[288];
+    unsigned short fast[1 << INFLATE_FAST_BITS];
+} Huffman;
+
+typedef struct
+{
+    unsigned long long inBit;
+    unsigned long long out;
+    unsigned char *window;
+} InflateCheckpoint;
+
+typedef struct
+{
+    int fd;
+    size_t inPos;
+    size_t inLen;
+    unsigned long long inOffset;
+    unsigned long bitBuf;
+    int bitCount;
+    unsigned long long out;
+    enum InflateState state;
+    int gzip;
+    int last;
+    unsigned int storedLeft;
+    unsigned int copyLen;
+    unsigned int copyDist;
+    Huffman lit;
+    Huffman dist;
+    InflateCheckpoint *checkpoints;
+    int checkpointCount;
+    int checkpointCapacity;
+    int checkpointLimit;
+    unsigned long long checkpointSpan;
+    unsigned long long nextCheckpoint;
+    unsigned char in[INFLATE_IN_SIZE];
+    unsigned char window[INFLATE_WINDOW];
+} Inflater;
+
+typedef struct
+{
+    size_t pathOffset;
+    size_t linkOffset;
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned long long compSize;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    unsigned char method;
+} ArchiveMember;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    enum ArchiveFormat format;
+    int gzipped;
+    ArchiveMember *members;
+    int count;
+    int capacity;
+    char *pool;
+    size_t poolLen;
+    size_t poolCapacity;
+    InflateCheckpoint *checkpoints;
+    int checkpointCount;
+    unsigned long lastUsed;
+} Archive;
+
+typedef struct
+{
+    int fd;
+    Inflater *inflater;
+    unsigned long long pos;
+    unsigned long long nextCancelCheck;
+    int cancelled;
+} ArchiveStream;
+
+typedef struct
+{
+    int fd;
+    Inflater *inflater;
+    unsigned long long pos;
+    unsigned long long left;
+} MemberReader;
+
+typedef struct
+{
+    Archive *archive;
+    int fd;
+    char *name;
+    char *dir;
+    char *path;
+} ArchiveView;
+
+typedef struct HashState
+{
+    unsigned int crc32;
+    unsigned int crc32c;
+    int crc32cHw;
+    unsigned long long xxhLanes[4];
+    unsigned long long xxhTotal;
+    unsigned char xxhBuffer[32];
+    size_t xxhBuffered;
+    unsigned int sha[8];
+    unsigned char shaBuffer[64];
+    size_t shaBuffered;
+    unsigned long long shaTotal;
+    void (*compress)(unsigned int *state, const unsigned char *data, size_t blocks);
+} HashState;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned long used;
+    unsigned int crc32;
+    unsigned int crc32c;
+    unsigned long long xxh64;
+    unsigned char sha256[32];
+} HashResult;
+
+typedef struct
+{
+    char *path;
+    int line;
+    int lines;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t mtime;
+} SearchHit;
+
+typedef struct
+{
+    pthread_t walker;
+    pthread_t workers[WORKER_MAX];
+    int workerCount;
+    int active;
+    int running;
+    int cancel;
+    int rootFd;
+    int dotfiles;
+    char pattern[SEARCH_MAX_PATTERN + 1];
+    size_t patternLen;
+    size_t rarePos;
+    char **queue;
+    int queueHead;
+    int queueCount;
+    int walking;
+    SearchHit *hits;
+    int hitCount;
+    int hitCapacity;
+    int filesScanned;
+    long long bytesScanned;
+    struct timespec started;
+    struct timespec shown;
+} Search;
+
+typedef struct
+{
+    char *path;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    unsigned long long partial;
+    unsigned long long full;
+    int set;
+} DupeFile;
+
+typedef struct
+{
+    int first;
+    int count;
+    long long reclaimable;
+} DupeGroup;
+
+typedef struct
+{
+    char *root;
+    DupeFile *files;
+    int fileCount;
+    DupeGroup *groups;
+    int groupCount;
+    long long reclaimable;
+} DupeResults;
+
+typedef struct
+{
+    Job *job;
+    DupeFile *files;
+    int count;
+    int next;
+    int whole;
+    HashState seed;
+    pthread_mutex_t lock;
+} DupeStage;
+
+typedef struct
+{
+    char *name;
+    off_t size;
+    time_t leftMtime;
+    time_t rightMtime;
+    int differs;
+} ContentCheck;
 
+typedef struct
+{
+    dev_t leftDev;
+    ino_t leftIno;
+    dev_t rightDev;
+    ino_t rightIno;
+    ContentCheck *checks;
+    int count;
+    int differing;
+} ContentChecks;
+
+
+
+static const unsigned int SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const CodepointRange ZERO_WIDTH_RANGES[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
+    { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F }, { 0x0670, 0x0670 },
+    { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 },
+    { 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x0900, 0x0902 }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+    { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A },
+    { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x2060, 0x2064 },
+    { 0x20D0, 0x20FF }, { 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+    { 0xFEFF, 0xFEFF }, { 0xE0100, 0xE01EF }
+};
 
+static const CodepointRange WIDE_RANGES[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x2614, 0x2615 },
+    { 0x2E80, 0x303E }, { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+    { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F },
+    { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F }, { 0x1F900, 0x1F9FF }, { 0x20000, 0x2FFFD },
+    { 0x30000, 0x3FFFD }
+};
 
+static Archive ARCHIVE_CACHE[ARCHIVE_CACHE_SLOTS];
+static unsigned long ARCHIVE_CLOCK = 0;
+static int BAUD_RATE = 0;
+static Clipboard CLIPBOARD = { JOB_COPY, -1, NULL, 0 };
 static int CODE_INSTALLED = 0;
+static unsigned int CRC32_TABLE[8][256];
+static unsigned int CRC32C_TABLE[8][256];
+static int CRC_TABLES_BUILT = 0;
+static ContentChecks CONTENT_CHECKS = { 0, 0, 0, 0, NULL, 0, 0 };
 static int COL_ENABLED = 1;
 static char *COL_FOR_ARROW = COL_FOR_BOLD_RED;
 static char *COL_FOR_CODE = COL_FOR_BOLD_RED;
 static char *COL_FOR_CURSOR = COL_FOR_BOLD_CYAN;
+static char *COL_FOR_DIFFERS = COL_FOR_BOLD_YELLOW;
 static char *COL_FOR_HEADING = COL_FOR_BOLD_CYAN;
 static char *COL_FOR_OL = COL_FOR_GREEN;
+static char *COL_FOR_ONLY = COL_FOR_BOLD_GREEN;
 static char CURSOR_CHAR = '*';
-static int DOTFILES_VISIBLE = 1;
+static int DETAIL_COLUMNS = COLUMN_PERMS | COLUMN_SIZE | COLUMN_MTIME;
+static int DETAILS_VISIBLE = 0;
+static __thread int DIRS_FIRST = 0;
+static DirWatch DIR_WATCH = { -1, -1, NULL, 0, 0, 0, 0, { 0, 0 } };
+static __thread int DOTFILES_VISIBLE = 1;
+static DupeResults DUPLICATES = { NULL, NULL, 0, NULL, 0, 0 };
 static int EMACS_INSTALLED = 0;
 static int FILE_INSTALLED = 0;
+static pthread_once_t FIXED_CODES_ONCE = PTHREAD_ONCE_INIT;
+static Huffman FIXED_DIST_CODES;
+static Huffman FIXED_LIT_CODES;
 static int FLOW_CTRL_INSTALLED = 0;
 static int GEDIT_INSTALLED = 0;
+static IdCacheSlot GROUP_CACHE[ID_CACHE_SLOTS];
+static HashResult HASH_CACHE[HASH_CACHE_SLOTS];
+static unsigned long HASH_CLOCK = 0;
 static int GTED_INSTALLED = 0;
 static int KATE_INSTALLED = 0;
+static int LAST_DIR_FD = -1;
+static TextLayout LAYOUT_CACHE[LAYOUT_CACHE_SLOTS];
+static unsigned long LAYOUT_CLOCK = 0;
+static char *LAST_DIR_FILE = NULL;
+static enum ListFormat LIST_FORMAT = LIST_PLAIN;
+static int LIST_META = 0;
+static int LIST_MODE = 0;
+static char LIST_OUT[65536];
+static size_t LIST_OUT_LEN = 0;
+static int LIST_RECURSIVE = 0;
+static int LIST_UNSORTED = 0;
+static size_t MEM_BUDGET = 0;
 static int MG_INSTALLED = 0;
 static int MOUSEPAD_INSTALLED = 0;
 static int NANO_INSTALLED = 0;
 static int NVIM_INSTALLED = 0;
+static Job *JOB_ACTIVE = NULL;
+static int JOB_CANCEL = 0;
+static pthread_cond_t JOB_COND = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t JOB_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int JOB_NOTIFY[2] = { -1, -1 };
+static Job *JOB_QUEUE = NULL;
+static int JOB_SHUTDOWN = 0;
+static pthread_t JOB_THREAD;
+static int JOB_THREAD_STARTED = 0;
+static int JUMP_DB_FD = -1;
+static JumpIndex JUMP_INDEX = { NULL, 0, 0, NULL, 0, NULL, 0, 0, 0, 0 };
 static struct termios OLD_TERMIOS;
+static int OUT_ACTIVE = 0;
+static int *OUT_BLANK_FROM = NULL;
+static int *OUT_BLANK_KEY = NULL;
+static int OUT_BLANK_ROWS = 0;
+static char OUT_BUFFER[4096];
+static size_t OUT_BUFFER_LEN = 0;
+static int OUT_CURSOR_VISIBLE = 1;
+static char *OUT_FRAME = NULL;
+static size_t OUT_FRAME_CAP = 0;
+static size_t OUT_FRAME_LEN = 0;
+static int OUT_LF_RETURNS = 1;
+static DirWatch PANE_WATCH = { -1, -1, NULL, 0, 0, 0, 0, { 0, 0 } };
 static int PLUMA_INSTALLED = 0;
+static Prefetch PREFETCH = { 0, 0, 0, 0, 0, -1, NULL, "", 0, SORT_NAME, 0, 0, 0, { 0, 0 }, { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL } };
+static pthread_mutex_t PREFETCH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static Search SEARCH;
+static pthread_cond_t SEARCH_COND = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t SEARCH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int SEARCH_NOTIFY[2] = { -1, -1 };
+static __thread enum SortMode SORT_MODE = SORT_NAME;
+static const char *SORT_NAMES[SORT_MODE_COUNT] = { "name", "natural", "size", "mtime", "type", "extension" };
+static Archive *SORTING_ARCHIVE = NULL;
+static __thread DirListing *SORTING_LISTING = NULL;
+static unsigned long STAT_CALLS = 0;
+static char STATUS_MSG[256] = "";
+static TermState TERM_PEN = { 0, 0, 0, 0, 9, 9 };
 static struct winsize TERM_SIZE;
+static TermState TERM_STATE = { 0, 0, 0, 0, 9, 9 };
+static IdCacheSlot USER_CACHE[ID_CACHE_SLOTS];
 static int VI_INSTALLED = 0;
 static int VIM_INSTALLED = 0;
 static int XED_INSTALLED = 0;
@@ -112,652 +874,9746 @@ static int XED_INSTALLED = 0;
 
 
 /**
- * Awaits for any user input.
+ * Allows qsort to compare two directory entry names.
+ * @param a First entry to compare
+ * @param b Second entry to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
  */
-void awaitInput(void)
+int compareDirName(const void *a, const void *b)
 {
-    int len = printf("Press any key to continue... ");
-    if (COL_ENABLED)
-        for (size_t i = len; i < TERM_SIZE.ws_col; i++)
-            printf(" ");
-    getchar();
+    const DirEntry *sa = (const DirEntry *)a;
+    const DirEntry *sb = (const DirEntry *)b;
+    int diff = strcasecmp(sa->name, sb->name);
+    if (diff == 0) diff = strcmp(sa->name, sb->name);
+    return diff;
 }
 
 /**
- * Moves the cursor to topleft-most position and clears below cursor.
+ * Compares two names the way a person would order them, so "file9" comes before "file10".
+ * @param a First name to compare
+ * @param b Second name to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
  */
-void clearScreen(void)
+int compareNatural(const char *a, const char *b)
 {
-    printf("\033[H\033[J");
+    while (*a && *b)
+    {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b))
+        {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+
+            size_t lenA = 0, lenB = 0;
+            while (isdigit((unsigned char)a[lenA])) lenA++;
+            while (isdigit((unsigned char)b[lenB])) lenB++;
+            if (lenA != lenB) return lenA < lenB ? -1 : 1;
+
+            int diff = strncmp(a, b, lenA);
+            if (diff) return diff;
+            a += lenA;
+            b += lenB;
+            continue;
+        }
+
+        int diff = tolower((unsigned char)*a) - tolower((unsigned char)*b);
+        if (diff) return diff;
+        a++;
+        b++;
+    }
+
+    return (unsigned char)*a - (unsigned char)*b;
 }
 
 /**
- * Allows qsort to compare two directory entry names.
- * @param a First entry to compare
- * @param b Second entry to compare
- * @return negative (a < b), 0 (a == b) or positive (a > b)
+ * @param name Entry name
+ * @return Pointer to the entry's extension (without the dot), or an empty string if it has none
  */
-int compareDirName(const void *a, const void *b)
+const char *getExtension(const char *name)
 {
-    const struct dirent *sa = *(const struct dirent **)a;
-    const struct dirent *sb = *(const struct dirent **)b;
-    return strcasecmp(sa->d_name, sb->d_name);
+    const char *dot = strrchr(name, '.');
+    if (!dot || dot == name) return "";
+    return dot + 1;
 }
 
 /**
- * Enables the terminal's canonical input. Used only when the program exits.
+ * @param type Entry type
+ * @return Character used to show the type in listings
  */
-void disableRawMode(void)
+char getTypeChar(unsigned char type)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &OLD_TERMIOS);
+    switch (type)
+    {
+        case DT_DIR: return 'd';
+        case DT_REG: return 'f';
+        case DT_EXE: return 'x';
+        case DT_GROUP: return '=';
+        case DT_LNK: return 'l';
+        case DT_FIFO: return '|';
+        case DT_CHR: return 'c';
+        case DT_BLK: return 'b';
+        case DT_SOCK: return 's';
+        default: return '?';
+    }
 }
 
 /**
- * Disables the terminal's canonical input so that things like getchar do not
- * wait until enter is pressed.
+ * @param type Entry type
+ * @return Position of the type when sorting by type
  */
-void enableRawMode(void)
+int getTypeRank(unsigned char type)
 {
-    struct termios newTERMIO;
-    tcgetattr(STDIN_FILENO, &OLD_TERMIOS);
-    newTERMIO = OLD_TERMIOS;
-    newTERMIO.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newTERMIO);
+    switch (type)
+    {
+        case DT_DIR: return 0;
+        case DT_LNK: return 1;
+        case DT_EXE: return 2;
+        case DT_REG: return 3;
+        case DT_BLK: return 4;
+        case DT_CHR: return 5;
+        case DT_FIFO: return 6;
+        case DT_SOCK: return 7;
+        default: return 8;
+    }
 }
 
 /**
- * Adds new lines to a given string based on the requested line width.
- * @param buffer Input string
- * @param width Characters per line
- * @param indent Indent to include after newly inserted new line
- * @return Number of lines in the string
+ * Compares two entries according to the current sort mode. Entries that tie on the sort mode's
+ * key fall back to name order, so every mode produces the same order on every run.
+ * @param a First entry to compare
+ * @param b Second entry to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
  */
-int formatNewLines(char *buffer, int width, char *indent)
+int compareEntries(const DirEntry *a, const DirEntry *b)
 {
-    if (!buffer || width < 1) return 0;
+    if (DIRS_FIRST && (a->type == DT_DIR) != (b->type == DT_DIR))
+        return a->type == DT_DIR ? -1 : 1;
 
-    size_t bufferStrLen = strlen(buffer);
-    size_t indentLen = indent ? strlen(indent) : 0;
-    int lines = 1;
-    int lastSpace = -1;
-    int widthCount = 1;
-
-    for (int i = 0; i < bufferStrLen; i++)
+    int diff = 0;
+    switch (SORT_MODE)
     {
-        if (buffer[i] == '\033')
-        {
-            while (i < bufferStrLen && buffer[i] != 'm') i++;
-            if (i >= bufferStrLen) break;
-            continue; 
-        }
-        
-        if (buffer[i] == ' ') lastSpace = i;
-        else if (buffer[i] == '\n')
-        {
-            lines++;
-            widthCount = 0;
-            continue;
-        }
-
-        if (widthCount == width)
-        {
-            if (lastSpace != -1)
-            {
-                buffer[lastSpace] = '\n';
-                lines++;
-
-                if (indent && indentLen > 0)
-                {
-                    memmove(buffer + lastSpace + 1 + indentLen, buffer + lastSpace + 1, bufferStrLen - lastSpace);
-                    memcpy(buffer + lastSpace + 1, indent, indentLen);
-                    bufferStrLen += indentLen;
-                    if (lastSpace <= i) i += indentLen;
-                }
-            }
-            widthCount = i - lastSpace;
-        }
-
-        widthCount++;
+        case SORT_NATURAL:
+            diff = compareNatural(a->name, b->name);
+            break;
+        case SORT_SIZE:
+            if (a->size != b->size) diff = a->size > b->size ? -1 : 1;
+            break;
+        case SORT_MTIME:
+            if (a->mtime != b->mtime) diff = a->mtime > b->mtime ? -1 : 1;
+            break;
+        case SORT_TYPE:
+            diff = getTypeRank(a->type) - getTypeRank(b->type);
+            break;
+        case SORT_EXTENSION:
+            diff = strcasecmp(getExtension(a->name), getExtension(b->name));
+            break;
+        default:
+            break;
     }
 
-    return lines;
+    if (diff == 0) diff = compareDirName(a, b);
+    return diff;
 }
 
 /**
- * Gets an integer input from the user.
- * @param prompt Prompt to give the user 
- * @param min Minimum allowed input (set to same as max to disable validation)
- * @param max Maximum allowed input (set to same as min to disable validation)
- * @param negativeIfInvalid Flags if function should return -1 if invalid input instead of looping
- * @return User's integer input
+ * Packs up to the first eight bytes of a string, lowercased, into an integer that orders the same
+ * way strcasecmp does.
+ * @param str String to pack
+ * @return Packed prefix
  */
-int getIntInput(char *prompt, int min, int max, int negativeIfInvalid)
+unsigned long long packNamePrefix(const char *str)
 {
-    if (min > max) min = max;
-    if (max < min) max = min;
-
-    int isValid;
-    char buffer[32];
-    int val;
+    unsigned long long key = 0;
+    int i = 0;
+    for (; i < 8 && str[i]; i++)
+        key = (key << 8) | (unsigned char)tolower((unsigned char)str[i]);
+    for (; i < 8; i++)
+        key <<= 8;
+    return key;
+}
 
-    do
-    {
-        disableRawMode();
+/**
+ * Allows qsort to compare two packed sort keys. Keys only settle the order when they differ; ties
+ * go to the full entry comparison and finally to the original position, keeping the sort stable.
+ * @param a First key to compare
+ * @param b Second key to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
+ */
+int compareSortKeys(const void *a, const void *b)
+{
+    const SortKey *ka = (const SortKey *)a;
+    const SortKey *kb = (const SortKey *)b;
 
-        if (COL_ENABLED)
-        {
-            printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
-            for (int i = 0; i < TERM_SIZE.ws_col; i++) printf(" ");
-            printf("\033[1G");
-        }
+    if (ka->major != kb->major) return ka->major < kb->major ? -1 : 1;
+    if (ka->minor != kb->minor) return ka->minor < kb->minor ? -1 : 1;
 
-        printf("%s", prompt);
-        if (min != max) printf(" (%d-%d)", min, max);
-        printf(": ");
+    int diff = compareEntries(&SORTING_LISTING->entries[ka->index], &SORTING_LISTING->entries[kb->index]);
+    if (diff == 0) diff = ka->index - kb->index;
+    return diff;
+}
 
-        if (fgets(buffer, sizeof(buffer), stdin) != NULL)
-        {
-            if (sscanf(buffer, "%d", &val) == 1)
-            {
-                if ((min != max) && (val >= min && val <= max))
-                    isValid = 1;
-                else if (min == max)
-                    isValid = 1;
-                else
-                    isValid = 0;
-            }
-            else isValid = 0;
-        }
-        else
-        {
-            int c;
-            while ((c = getchar()) != '\n' && c != EOF);
-            isValid = 0;
-        }
+/**
+ * @param cp Unicode codepoint
+ * @param ranges Sorted table of codepoint ranges
+ * @param count Number of ranges in the table
+ * @return 1 if the codepoint falls into one of the ranges, otherwise 0
+ */
+int isInRanges(unsigned int cp, const CodepointRange *ranges, int count)
+{
+    int lo = 0, hi = count - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cp < ranges[mid].first) hi = mid - 1;
+        else if (cp > ranges[mid].last) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
 
-        enableRawMode();
+/**
+ * @param cp Unicode codepoint
+ * @return Number of terminal columns the codepoint occupies
+ */
+int getCodepointWidth(unsigned int cp)
+{
+    if (cp >= 0x300 && isInRanges(cp, ZERO_WIDTH_RANGES, sizeof(ZERO_WIDTH_RANGES) / sizeof(ZERO_WIDTH_RANGES[0])))
+        return 0;
+    if (cp >= 0x1100 && isInRanges(cp, WIDE_RANGES, sizeof(WIDE_RANGES) / sizeof(WIDE_RANGES[0])))
+        return 2;
+    return 1;
+}
 
-        if (!isValid && negativeIfInvalid)
-            return -1;
+/**
+ * Decodes one UTF-8 sequence.
+ * @param str String to decode from
+ * @param cp Decoded codepoint (by reference)
+ * @return Number of bytes consumed, or 0 if the sequence is invalid or truncated
+ */
+int decodeUtf8(const unsigned char *str, unsigned int *cp)
+{
+    int len;
+    unsigned int min;
 
-    } while (!isValid);
+    if (str[0] < 0x80) { *cp = str[0]; return 1; }
+    else if ((str[0] & 0xE0) == 0xC0) { len = 2; min = 0x80; *cp = str[0] & 0x1F; }
+    else if ((str[0] & 0xF0) == 0xE0) { len = 3; min = 0x800; *cp = str[0] & 0x0F; }
+    else if ((str[0] & 0xF8) == 0xF0) { len = 4; min = 0x10000; *cp = str[0] & 0x07; }
+    else return 0;
 
-    if (COL_ENABLED) printf("\033[%sm", COL_RESET);
+    for (int i = 1; i < len; i++)
+    {
+        if ((str[i] & 0xC0) != 0x80) return 0;
+        *cp = (*cp << 6) | (str[i] & 0x3F);
+    }
 
-    return val;
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) return 0;
+    return len;
 }
 
 /**
- * @return The nav input action detected
+ * Appends formatted output for the terminal to the current frame. Nothing is sent until
+ * flushFrame, which optimises the whole frame first. Before the browser starts (and in --list
+ * mode) output goes straight to stdout.
+ * @param fmt printf-style format string
+ * @return Number of bytes formatted
  */
-enum NavInput getNavInput(void)
+int termPrintf(const char *fmt, ...)
 {
-    int c = getchar();
-
-    if (c == 27)
+    va_list args;
+    va_start(args, fmt);
+    if (!OUT_ACTIVE)
     {
-        getchar();
-        switch (getchar())
-        {
-            case 'A': return CURSOR_UP;
-            case 'B': return CURSOR_DOWN;
-            case 'C': return DIR_DOWN;
-            case 'D': return DIR_UP;
-        }
+        int len = vprintf(fmt, args);
+        va_end(args);
+        return len;
     }
-    else
+
+    char local[512];
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(local, sizeof(local), fmt, copy);
+    va_end(copy);
+
+    if (len > 0 && OUT_FRAME_LEN + len + 1 > OUT_FRAME_CAP)
     {
-        c = tolower(c);
-        switch (c)
+        size_t capacity = OUT_FRAME_CAP ? OUT_FRAME_CAP : 8192;
+        while (capacity < OUT_FRAME_LEN + len + 1) capacity *= 2;
+        char *frame = realloc(OUT_FRAME, capacity);
+        if (!frame)
         {
-            case 'q': return QUIT;
-            case 'w': return CURSOR_UP;
-            case 'e': return DEBUG;
-            case 'a': return DIR_UP;
-            case 's': return CURSOR_DOWN;
-            case 'd': return DIR_DOWN;
-            case 'i': return INSPECT;
-            case 'h': return DIR_UP;
-            case 'j': return CURSOR_DOWN;
-            case 'k': return CURSOR_UP;
-            case 'l': return DIR_DOWN;
-            case '.': return TOGGLE_HIDDEN;
-            case '?': return HELP;
+            va_end(args);
+            return 0;
         }
+        OUT_FRAME = frame;
+        OUT_FRAME_CAP = capacity;
     }
 
-    return INVALID;
+    if (len > 0 && (size_t)len < sizeof(local))
+        memcpy(OUT_FRAME + OUT_FRAME_LEN, local, len);
+    else if (len > 0)
+        vsnprintf(OUT_FRAME + OUT_FRAME_LEN, len + 1, fmt, args);
+    if (len > 0) OUT_FRAME_LEN += len;
+    va_end(args);
+    return len;
 }
 
 /**
- * @return winsize struct containing the current terminal size in columns and rows
+ * Appends a single character to the current frame.
+ * @param c Character to output
  */
-struct winsize getTerminalSize(void)
+void termPutc(char c)
 {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
-    {
-        ws.ws_col = 80;
-        ws.ws_row = 24;
-    }
-    return ws;
+    termPrintf("%c", c);
 }
 
 /**
- * @param currPath Current working directory path
- * @param entry Directory entry to check
+ * Writes out the optimised output gathered so far.
  */
-int isFileExecutable(char *currPath, struct dirent *entry)
+void flushOutput(void)
 {
-    char filePath[PATH_MAX + 256];
-    snprintf(filePath, PATH_MAX + 256, "%s/%s", currPath, entry->d_name);
-    if (access(filePath, X_OK) == 0) return 1;
-    else return 0;
+    for (size_t written = 0; written < OUT_BUFFER_LEN; )
+    {
+        ssize_t n = write(STDOUT_FILENO, OUT_BUFFER + written, OUT_BUFFER_LEN - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    OUT_BUFFER_LEN = 0;
 }
 
 /**
- * @param currPath Current working directory path
- * @param entryCount Number of entries in current directory (intended to be used by reference)
- * @return Pointer to one or more dirent structs for each file in the current directory
+ * Appends bytes to the optimised output of a frame.
+ * @param data Bytes to send
+ * @param len Number of bytes
  */
-struct dirent **getDirContents(char *currPath, int *entryCount)
+void emitOutput(const char *data, size_t len)
 {
-    DIR *dir;
-    *entryCount = 0;
-
-    if ((dir = opendir(currPath)) != NULL)
+    while (len > 0)
     {
-        struct dirent *entry;
-        struct dirent **entries = NULL;
+        if (OUT_BUFFER_LEN == sizeof(OUT_BUFFER)) flushOutput();
+        size_t chunk = sizeof(OUT_BUFFER) - OUT_BUFFER_LEN;
+        if (chunk > len) chunk = len;
+        memcpy(OUT_BUFFER + OUT_BUFFER_LEN, data, chunk);
+        OUT_BUFFER_LEN += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * Forgets which rows are known to be blank, e.g. after the screen scrolled.
+ */
+void forgetBlankRows(void)
+{
+    if (OUT_BLANK_ROWS != TERM_SIZE.ws_row)
+    {
+        free(OUT_BLANK_FROM);
+        free(OUT_BLANK_KEY);
+        OUT_BLANK_ROWS = TERM_SIZE.ws_row;
+        OUT_BLANK_FROM = malloc((OUT_BLANK_ROWS + 1) * sizeof(int));
+        OUT_BLANK_KEY = malloc((OUT_BLANK_ROWS + 1) * sizeof(int));
+        if (!OUT_BLANK_FROM || !OUT_BLANK_KEY) OUT_BLANK_ROWS = 0;
+    }
+
+    for (int row = 0; row <= OUT_BLANK_ROWS; row++)
+        OUT_BLANK_FROM[row] = TERM_SIZE.ws_col + 1;
+}
+
+/**
+ * @return What a cell erased with the pen's attributes looks like, or -1 if it is not tracked
+ */
+int getBlankKey(void)
+{
+    return (TERM_PEN.flags & ATTR_REVERSE) ? -1 : TERM_PEN.bg;
+}
+
+/**
+ * @param row Row to check
+ * @param col First column that needs to be blank
+ * @return 1 if the row is known to be blank from col to its end, as the pen would erase it
+ */
+int isRowBlank(int row, int col)
+{
+    if (row < 1 || row > OUT_BLANK_ROWS || getBlankKey() < 0) return 0;
+    return OUT_BLANK_FROM[row] <= col && OUT_BLANK_KEY[row] == getBlankKey();
+}
+
+/**
+ * Records what has just been drawn or erased on a row.
+ * @param row Row drawn on
+ * @param col First column drawn on
+ * @param toCol Last column drawn on, or 0 if the row was erased from col to its end
+ */
+void markRowDrawn(int row, int col, int toCol)
+{
+    if (row < 1 || row > OUT_BLANK_ROWS) return;
+    if (!toCol)
+    {
+        int key = getBlankKey();
+        if (OUT_BLANK_FROM[row] > col || OUT_BLANK_KEY[row] != key)
+        {
+            OUT_BLANK_FROM[row] = key < 0 ? TERM_SIZE.ws_col + 1 : col;
+            OUT_BLANK_KEY[row] = key;
+        }
+    }
+    else if (toCol >= OUT_BLANK_FROM[row])
+        OUT_BLANK_FROM[row] = toCol + 1;
+}
+
+/**
+ * Forgets what is known of the terminal's cursor and attributes, e.g. after something else has
+ * written to it, so the next frame positions and colours everything explicitly.
+ */
+void invalidateTermState(void)
+{
+    forgetBlankRows();
+    TERM_STATE.row = TERM_STATE.col = 0;
+    TERM_STATE.attrKnown = 0;
+    TERM_PEN = TERM_STATE;
+}
+
+/**
+ * @param buffer Output buffer (at least 16 bytes)
+ * @param code Final byte of the sequence
+ * @param n Count parameter (omitted when 1)
+ * @return Length of a cursor movement sequence moving n places
+ */
+int formatRelativeMove(char *buffer, char code, int n)
+{
+    if (n == 1) return sprintf(buffer, "\x1b[%c", code);
+    return sprintf(buffer, "\x1b[%d%c", n, code);
+}
+
+/**
+ * Finds the shortest way to move the cursor along a row: a relative move, backspaces, or a CR
+ * followed by a relative move.
+ * @param buffer Output buffer (at least 16 bytes)
+ * @param col Current column
+ * @param toCol Target column
+ * @return Length of the sequence written to buffer
+ */
+int formatColumnMove(char *buffer, int col, int toCol)
+{
+    if (toCol == col) return 0;
+    if (toCol == 1)
+    {
+        buffer[0] = '\r';
+        return 1;
+    }
+
+    int best = formatRelativeMove(buffer, toCol > col ? 'C' : 'D', abs(toCol - col));
+    if (toCol < col && col - toCol < best)
+    {
+        best = col - toCol;
+        memset(buffer, '\b', best);
+    }
+
+    char option[16] = "\r";
+    int optionLen = formatRelativeMove(option + 1, 'C', toCol - 1) + 1;
+    if (toCol < col && optionLen < best)
+    {
+        memcpy(buffer, option, optionLen);
+        best = optionLen;
+    }
+    return best;
+}
+
+/**
+ * Finds the shortest way to move the cursor to a position: an absolute move, or a relative move
+ * or LFs followed by a move along the row. LFs are only used if the tty turns them into CR LF,
+ * and then cost two bytes on the wire.
+ * @param buffer Output buffer (at least 32 bytes)
+ * @param row Current row, or 0 if unknown
+ * @param col Current column, or 0 if unknown
+ * @param toRow Target row
+ * @param toCol Target column
+ * @return Length of the sequence written to buffer
+ */
+int formatCursorMove(char *buffer, int row, int col, int toRow, int toCol)
+{
+    int best;
+    if (toCol == 1) best = toRow == 1 ? sprintf(buffer, "\x1b[H") : sprintf(buffer, "\x1b[%dH", toRow);
+    else best = sprintf(buffer, "\x1b[%d;%dH", toRow, toCol);
+    if (!row || !col) return best;
+    int bestCost = best;
+
+    for (int vertical = 0; vertical < 3; vertical++)
+    {
+        char candidate[48];
+        int len = 0;
+        int cost;
+        int fromCol = col;
+
+        if (vertical == 0 && toRow != row) continue;
+        if (vertical == 1)
+        {
+            if (toRow == row) continue;
+            len = formatRelativeMove(candidate, toRow > row ? 'B' : 'A', abs(toRow - row));
+        }
+        if (vertical == 2)
+        {
+            if (toRow <= row || !OUT_LF_RETURNS || toRow - row > 4) continue;
+            for (int i = row; i < toRow; i++) candidate[len++] = '\n';
+            fromCol = 1;
+        }
+        cost = vertical == 2 ? len * 2 : len;
+
+        int columnLen = formatColumnMove(candidate + len, fromCol, toCol);
+        if (cost + columnLen < bestCost)
+        {
+            memcpy(buffer, candidate, len + columnLen);
+            best = len + columnLen;
+            bestCost = cost + columnLen;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Brings the terminal's cursor to where the pen is.
+ */
+void syncCursor(void)
+{
+    if (TERM_PEN.row == TERM_STATE.row && TERM_PEN.col == TERM_STATE.col) return;
+    if (!TERM_PEN.row || !TERM_PEN.col || TERM_PEN.col > TERM_SIZE.ws_col) return;
+
+    char buffer[64];
+    int len;
+    int cols = TERM_SIZE.ws_col;
+    if (TERM_STATE.row && TERM_STATE.col && TERM_STATE.col <= cols)
+        len = formatCursorMove(buffer, TERM_STATE.row, TERM_STATE.col, TERM_PEN.row, TERM_PEN.col);
+    else
+        len = formatCursorMove(buffer, 0, 0, TERM_PEN.row, TERM_PEN.col);
+    emitOutput(buffer, len);
+    TERM_STATE.row = TERM_PEN.row;
+    TERM_STATE.col = TERM_PEN.col;
+}
+
+/**
+ * Brings the terminal's attributes in line with the pen's, using either a reset or only the
+ * changes, whichever is shorter.
+ * @param blankOnly Flags if only blank cells are about to be drawn, which only show the
+ * background, reverse and underline attributes
+ */
+void syncAttributes(int blankOnly)
+{
+    TermState *pen = &TERM_PEN;
+    TermState *term = &TERM_STATE;
+    if (term->attrKnown && term->flags == pen->flags && term->fg == pen->fg && term->bg == pen->bg) return;
+    if (blankOnly && term->attrKnown && term->bg == pen->bg && (term->flags & ~ATTR_BOLD) == (pen->flags & ~ATTR_BOLD)) return;
+
+    static const unsigned char flagCodes[] = { 1, 4, 5, 7 };
+    static const unsigned char flagOffCodes[] = { 22, 24, 25, 27 };
+    char full[40] = "\x1b[0";
+    int fullLen = 3;
+    for (int i = 0; i < 4; i++)
+        if (pen->flags & (1 << i)) fullLen += sprintf(full + fullLen, ";%d", flagCodes[i]);
+    if (pen->fg != 9) fullLen += sprintf(full + fullLen, ";3%d", pen->fg);
+    if (pen->bg != 9) fullLen += sprintf(full + fullLen, ";4%d", pen->bg);
+    full[fullLen++] = 'm';
+
+    char diff[40] = "\x1b[";
+    int diffLen = term->attrKnown ? 2 : 0;
+    for (int i = 0; i < 4 && diffLen; i++)
+    {
+        int bit = 1 << i;
+        if ((pen->flags & bit) != (term->flags & bit))
+            diffLen += sprintf(diff + diffLen, "%d;", (pen->flags & bit) ? flagCodes[i] : flagOffCodes[i]);
+    }
+    if (diffLen && pen->fg != term->fg) diffLen += sprintf(diff + diffLen, "3%d;", pen->fg);
+    if (diffLen && pen->bg != term->bg) diffLen += sprintf(diff + diffLen, "4%d;", pen->bg);
+    if (diffLen) diff[diffLen - 1] = 'm';
+
+    if (diffLen && diffLen < fullLen) emitOutput(diff, diffLen);
+    else emitOutput(full, fullLen);
+
+    term->flags = pen->flags;
+    term->fg = pen->fg;
+    term->bg = pen->bg;
+    term->attrKnown = 1;
+}
+
+/**
+ * Applies an SGR parameter list to the pen.
+ * @param params Parameters as sent, e.g. "1;37;44"
+ * @return 1 if every parameter was understood, otherwise 0
+ */
+int applySgr(const char *params)
+{
+    TermState *pen = &TERM_PEN;
+    const char *p = params;
+    do
+    {
+        int code = 0;
+        while (*p >= '0' && *p <= '9') code = code * 10 + (*p++ - '0');
+        if (*p && *p != ';') return 0;
+        if (*p == ';') p++;
+
+        if (code == 0) { pen->flags = 0; pen->fg = pen->bg = 9; }
+        else if (code == 1) pen->flags |= ATTR_BOLD;
+        else if (code == 4) pen->flags |= ATTR_UNDERLINE;
+        else if (code == 5) pen->flags |= ATTR_BLINK;
+        else if (code == 7) pen->flags |= ATTR_REVERSE;
+        else if (code == 22) pen->flags &= ~ATTR_BOLD;
+        else if (code == 24) pen->flags &= ~ATTR_UNDERLINE;
+        else if (code == 25) pen->flags &= ~ATTR_BLINK;
+        else if (code == 27) pen->flags &= ~ATTR_REVERSE;
+        else if ((code >= 30 && code <= 37) || code == 39) pen->fg = code - 30;
+        else if ((code >= 40 && code <= 47) || code == 49) pen->bg = code - 40;
+        else return 0;
+    } while (*p);
+    return 1;
+}
+
+/**
+ * Sends text, keeping track of where the cursor ends up. A run of blanks that reaches the right
+ * edge is sent as an erase to end of line instead.
+ * @param text Text without control characters
+ * @param len Length of text in bytes
+ */
+void emitText(const char *text, size_t len)
+{
+    int cols = TERM_SIZE.ws_col;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        // A pending wrap from a previous run lands at the start of the next line
+        if (TERM_PEN.row && TERM_PEN.col > cols)
+        {
+            if (TERM_PEN.row < TERM_SIZE.ws_row)
+            {
+                TERM_PEN.row++;
+                TERM_PEN.col = 1;
+            }
+            else
+                TERM_PEN.row = TERM_PEN.col = 0;
+        }
+
+        size_t blanks = 0;
+        while (pos + blanks < len && text[pos + blanks] == ' ') blanks++;
+        if (blanks >= 4 && TERM_PEN.row && TERM_PEN.col + (int)blanks - 1 == cols)
+        {
+            if (!isRowBlank(TERM_PEN.row, TERM_PEN.col))
+            {
+                syncCursor();
+                syncAttributes(1);
+                emitOutput("\x1b[K", 3);
+                markRowDrawn(TERM_PEN.row, TERM_PEN.col, 0);
+            }
+            TERM_PEN.col = cols + 1;
+            pos += blanks;
+            continue;
+        }
+
+        size_t runEnd = blanks ? pos + blanks : pos;
+        while (runEnd < len && text[runEnd] != ' ') runEnd++;
+
+        // With no known position (e.g. after text that wrapped) the text goes wherever the cursor is
+        syncCursor();
+        syncAttributes(blanks == runEnd - pos);
+        emitOutput(text + pos, runEnd - pos);
+
+        int width = 0;
+        for (size_t i = pos; i < runEnd; )
+        {
+            unsigned int cp = '?';
+            int n = decodeUtf8((const unsigned char *)text + i, &cp);
+            width += getCodepointWidth(cp);
+            i += n ? n : 1;
+        }
+        pos = runEnd;
+
+        if (TERM_STATE.row && TERM_STATE.col && TERM_STATE.col + width <= cols + 1)
+        {
+            markRowDrawn(TERM_STATE.row, TERM_STATE.col, TERM_STATE.col + width - 1);
+            TERM_STATE.col += width;
+        }
+        else
+        {
+            TERM_STATE.row = TERM_STATE.col = 0;
+            forgetBlankRows();
+        }
+        TERM_PEN.row = TERM_STATE.row;
+        TERM_PEN.col = TERM_STATE.col;
+    }
+}
+
+/**
+ * Sends the current frame to the terminal. The frame is rewritten on the way: cursor moves and
+ * attribute changes only take effect when something is drawn, so redundant ones cost nothing,
+ * and those that remain are sent in their shortest form given what the terminal already shows.
+ */
+void flushFrame(void)
+{
+    if (!OUT_ACTIVE) return;
+
+    const char *frame = OUT_FRAME;
+    size_t len = OUT_FRAME_LEN;
+    int rows = TERM_SIZE.ws_row;
+    size_t i = 0;
+    while (i < len)
+    {
+        unsigned char c = frame[i];
+        if (c == 0x1b && i + 1 < len && frame[i + 1] == '[')
+        {
+            size_t start = i;
+            size_t end = i + 2;
+            while (end < len && ((unsigned char)frame[end] < 0x40 || (unsigned char)frame[end] > 0x7e)) end++;
+            if (end >= len) break;
+            i = end + 1;
+
+            char params[32] = "";
+            size_t paramsLen = end - start - 2;
+            if (paramsLen < sizeof(params))
+            {
+                memcpy(params, frame + start + 2, paramsLen);
+                params[paramsLen] = '\0';
+            }
+            int privateSeq = params[0] == '?' || paramsLen >= sizeof(params);
+            int n1 = atoi(params);
+            char *second = strchr(params, ';');
+            int n2 = second ? atoi(second + 1) : 0;
+            char final = frame[end];
+
+            if (!privateSeq && (final == 'H' || final == 'f'))
+            {
+                TERM_PEN.row = n1 ? n1 : 1;
+                TERM_PEN.col = n2 ? n2 : 1;
+                continue;
+            }
+            if (!privateSeq && final == 'G' && TERM_PEN.row)
+            {
+                TERM_PEN.col = n1 ? n1 : 1;
+                continue;
+            }
+            if (!privateSeq && final == 'm' && applySgr(params))
+                continue;
+
+            if (strcmp(params, "?25") == 0 && (final == 'l' || final == 'h'))
+            {
+                OUT_CURSOR_VISIBLE = final == 'h';
+                emitOutput(frame + start, i - start);
+                continue;
+            }
+
+            // Erasing what is already blank can be skipped altogether
+            int erase = !privateSeq && (final == 'K' || final == 'J') && n1 == 0;
+            if (erase && final == 'K' && isRowBlank(TERM_PEN.row, TERM_PEN.col))
+                continue;
+
+            // Erases fill with the background colour; anything else is passed on as is, after
+            // which we stop assuming where the cursor is, what is on screen or which attributes
+            // are set
+            syncCursor();
+            syncAttributes(erase);
+            emitOutput(frame + start, i - start);
+            if (erase && TERM_STATE.row)
+            {
+                markRowDrawn(TERM_STATE.row, TERM_STATE.col, 0);
+                for (int row = TERM_STATE.row + 1; final == 'J' && row <= rows; row++)
+                    markRowDrawn(row, 1, 0);
+            }
+            else if (final == 'm')
+                TERM_STATE.attrKnown = 0;
+            else
+            {
+                TERM_STATE.row = TERM_STATE.col = 0;
+                forgetBlankRows();
+            }
+            TERM_PEN.row = TERM_STATE.row;
+            TERM_PEN.col = TERM_STATE.col;
+        }
+        else if (c == '\n' && TERM_PEN.row && TERM_PEN.row < rows)
+        {
+            TERM_PEN.row++;
+            if (OUT_LF_RETURNS) TERM_PEN.col = 1;
+            i++;
+        }
+        else if (c == '\r' && TERM_PEN.row)
+        {
+            TERM_PEN.col = 1;
+            i++;
+        }
+        else if (c == '\b' && TERM_PEN.row && TERM_PEN.col > 1 && TERM_PEN.col <= TERM_SIZE.ws_col)
+        {
+            TERM_PEN.col--;
+            i++;
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            // Other control characters, and moves we cannot track, are sent as they are
+            syncCursor();
+            if (c == '\n') syncAttributes(1);
+            emitOutput((const char *)&frame[i], 1);
+            if (c == '\n')
+            {
+                if (TERM_STATE.row && OUT_LF_RETURNS) TERM_STATE.col = 1;
+                forgetBlankRows();
+            }
+            else if (c == '\r') TERM_STATE.col = TERM_STATE.row ? 1 : 0;
+            else if (c != '\a') TERM_STATE.row = TERM_STATE.col = 0;
+            TERM_PEN.row = TERM_STATE.row;
+            TERM_PEN.col = TERM_STATE.col;
+            i++;
+        }
+        else
+        {
+            size_t end = i;
+            while (end < len && (unsigned char)frame[end] >= 0x20 && frame[end] != 0x7f) end++;
+            emitText(frame + i, end - i);
+            i = end;
+        }
+    }
+
+    // The cursor only needs to be in the right place at the end if it can be seen
+    if (OUT_CURSOR_VISIBLE) syncCursor();
+
+    OUT_FRAME_LEN = 0;
+    flushOutput();
+}
+
+/**
+ * Sends the current frame and waits for a key.
+ * @return Key read, as getchar
+ */
+int readKey(void)
+{
+    flushFrame();
+    return getchar();
+}
+
+/**
+ * Awaits for any user input.
+ * @return Key pressed
+ */
+int awaitInput(void)
+{
+    int len = termPrintf("Press any key to continue... ");
+    if (COL_ENABLED)
+        for (size_t i = len; i < TERM_SIZE.ws_col; i++)
+            termPrintf(" ");
+    return readKey();
+}
+
+/**
+ * Moves the cursor to topleft-most position and clears below cursor.
+ */
+void clearScreen(void)
+{
+    termPrintf("\033[H\033[J");
+}
+
+/**
+ * Produces a copy of a string that is safe to send to the terminal: control characters, invalid
+ * UTF-8 and bidirectional overrides become '?', so names cannot move the cursor or recolour the
+ * screen. The copy is never longer than the original.
+ * @param src String to escape
+ * @param dst Output buffer (at least strlen(src) + 1 bytes)
+ * @param width Display width of the escaped string in columns (by reference)
+ * @return Length of the escaped string in bytes
+ */
+size_t escapeDisplayName(const char *src, char *dst, int *width)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    size_t len = 0;
+    *width = 0;
+
+    while (*in)
+    {
+        unsigned int cp;
+        int n = decodeUtf8(in, &cp);
+
+        if (n == 0 || cp < 0x20 || (cp >= 0x7F && cp < 0xA0) || (cp >= 0x202A && cp <= 0x202E) || (cp >= 0x2066 && cp <= 0x2069))
+        {
+            dst[len++] = '?';
+            (*width)++;
+            in += n ? n : 1;
+            continue;
+        }
+
+        memcpy(dst + len, in, n);
+        len += n;
+        in += n;
+        *width += getCodepointWidth(cp);
+    }
+
+    dst[len] = '\0';
+    return len;
+}
+
+/**
+ * Finds how much of an already escaped string fits into a number of columns.
+ * @param str Escaped string
+ * @param maxCols Columns available
+ * @param usedCols Columns taken by the returned prefix (by reference)
+ * @return Length in bytes of the longest prefix that fits
+ */
+size_t fitDisplayColumns(const char *str, int maxCols, int *usedCols)
+{
+    const unsigned char *in = (const unsigned char *)str;
+    size_t len = 0;
+    int cols = 0;
+
+    while (in[len])
+    {
+        unsigned int cp = '?';
+        int n = decodeUtf8(in + len, &cp);
+        if (n == 0) n = 1;
+
+        int w = getCodepointWidth(cp);
+
+        if (cols + w > maxCols) break;
+        cols += w;
+        len += n;
+    }
+
+    *usedCols = cols;
+    return len;
+}
+
+/**
+ * Prints a string clipped to a number of columns, replacing its end with "..." if it had to be
+ * cut short.
+ * @param str Escaped string to print
+ * @param width Display width of str
+ * @param maxCols Columns available
+ * @return Columns printed
+ */
+int printClipped(const char *str, int width, int maxCols)
+{
+    if (maxCols <= 0) return 0;
+    if (width <= maxCols)
+    {
+        termPrintf("%s", str);
+        return width;
+    }
+
+    int ellipsis = maxCols > 6 ? 3 : 0;
+    int used;
+    size_t len = fitDisplayColumns(str, maxCols - ellipsis, &used);
+    termPrintf("%.*s%s", (int)len, str, ellipsis ? "..." : "");
+    return used + ellipsis;
+}
+
+/**
+ * Enables the terminal's canonical input. Used only when the program exits.
+ */
+void disableRawMode(void)
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &OLD_TERMIOS);
+}
+
+/**
+ * Disables the terminal's canonical input so that things like getchar do not
+ * wait until enter is pressed.
+ */
+void enableRawMode(void)
+{
+    struct termios newTERMIO;
+    tcgetattr(STDIN_FILENO, &OLD_TERMIOS);
+    newTERMIO = OLD_TERMIOS;
+    newTERMIO.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &newTERMIO);
+
+    // Whatever was typed in cooked mode has moved the cursor
+    invalidateTermState();
+}
+
+/**
+ * @param str Bytes to hash
+ * @param len Number of bytes
+ * @return FNV-1a hash of the bytes
+ */
+unsigned int hashBytes(const char *str, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Adds a line to a text layout.
+ * @param layout Layout to add to
+ * @param capacity Number of lines allocated (by reference)
+ * @param start Offset of the line in the layout's text
+ * @param end Offset just past the end of the line
+ * @param width Display width of the line, excluding any indent
+ * @param indented Whether the line continues a wrapped line and so gets the indent
+ * @return 0 on success, -1 if out of memory
+ */
+int addTextLine(TextLayout *layout, int *capacity, size_t start, size_t end, int width, int indented)
+{
+    if (layout->count == *capacity)
+    {
+        int newCapacity = *capacity ? *capacity * 2 : 32;
+        TextLine *lines = realloc(layout->lines, newCapacity * sizeof(TextLine));
+        if (!lines) return -1;
+        layout->lines = lines;
+        *capacity = newCapacity;
+    }
+
+    TextLine *line = &layout->lines[layout->count++];
+    line->start = start;
+    line->len = end - start;
+    line->width = width;
+    line->indented = indented;
+    return 0;
+}
+
+/**
+ * Wraps a layout's text into lines no wider than its width, breaking at the last space where
+ * there is one. Escape sequences take up no room and multibyte characters are measured by their
+ * display width. The text itself is never modified: lines are offsets into it.
+ * @param layout Layout whose text, width and indent are set
+ * @return 0 on success, -1 if out of memory
+ */
+int wrapText(TextLayout *layout)
+{
+    const unsigned char *text = (const unsigned char *)layout->text;
+    size_t len = layout->textLen;
+    int capacity = 0;
+    int indentWidth = layout->indentWidth < layout->width ? layout->indentWidth : 0;
+    int width = layout->width;
+
+    size_t lineStart = 0;
+    int indented = 0;
+    int col = 0;
+    size_t lastSpace = 0;
+    int hasSpace = 0;
+    int widthAtSpace = 0;
+    int widthAfterSpace = 0;
+
+    size_t i = 0;
+    while (i < len)
+    {
+        // Escape sequences are copied through but take up no columns
+        if (text[i] == '\033')
+        {
+            i++;
+            if (i < len && text[i] == '[')
+            {
+                i++;
+                while (i < len && (text[i] < 0x40 || text[i] > 0x7E)) i++;
+            }
+            if (i < len) i++;
+            continue;
+        }
+
+        if (text[i] == '\n')
+        {
+            if (addTextLine(layout, &capacity, lineStart, i, col - (indented ? indentWidth : 0), indented) != 0) return -1;
+            lineStart = ++i;
+            indented = hasSpace = col = 0;
+            continue;
+        }
+
+        unsigned int cp;
+        int n = decodeUtf8(text + i, &cp);
+        int w = 1;
+        if (n == 0) n = 1;
+        else w = getCodepointWidth(cp);
+
+        // A space that would overflow becomes the break itself
+        if (text[i] == ' ' && col + w > width)
+        {
+            if (addTextLine(layout, &capacity, lineStart, i, col - (indented ? indentWidth : 0), indented) != 0) return -1;
+            lineStart = ++i;
+            col = indentWidth;
+            indented = 1;
+            hasSpace = 0;
+            continue;
+        }
+
+        while (col + w > width && col > (indented ? indentWidth : 0))
+        {
+            int lineIndent = indented ? indentWidth : 0;
+            if (hasSpace)
+            {
+                if (addTextLine(layout, &capacity, lineStart, lastSpace, widthAtSpace - lineIndent, indented) != 0) return -1;
+                lineStart = lastSpace + 1;
+                col = indentWidth + (col - widthAfterSpace);
+            }
+            else
+            {
+                if (addTextLine(layout, &capacity, lineStart, i, col - lineIndent, indented) != 0) return -1;
+                lineStart = i;
+                col = indentWidth;
+            }
+            indented = 1;
+            hasSpace = 0;
+        }
+
+        if (text[i] == ' ')
+        {
+            lastSpace = i;
+            hasSpace = 1;
+            widthAtSpace = col;
+            widthAfterSpace = col + 1;
+        }
+
+        col += w;
+        i += n;
+    }
+
+    // A trailing new line ends the last line rather than starting an empty one
+    if (lineStart < len || layout->count == 0)
+        if (addTextLine(layout, &capacity, lineStart, len, col - (indented ? indentWidth : 0), indented) != 0) return -1;
+
+    return 0;
+}
+
+/**
+ * Empties a slot of the layout cache.
+ * @param layout Layout to free
+ */
+void freeTextLayout(TextLayout *layout)
+{
+    free(layout->text);
+    free(layout->indent);
+    free(layout->lines);
+    memset(layout, 0, sizeof(TextLayout));
+}
+
+/**
+ * Finds the layout of some text at a given width. Layouts are cached, so showing the same text
+ * again at the same width (help, dialogs, a file being re-inspected) costs no wrapping at all.
+ * @param text Text to lay out, which may contain new lines and escape sequences
+ * @param width Maximum display width of a line
+ * @param indent String to start wrapped continuation lines with, or NULL
+ * @return Layout of the text, or NULL if out of memory. It stays valid until LAYOUT_CACHE_SLOTS
+ * other layouts have been made.
+ */
+const TextLayout *getTextLayout(const char *text, int width, const char *indent)
+{
+    if (width < 1) width = 1;
+    size_t len = strlen(text);
+    unsigned int hash = hashBytes(text, len);
+    TextLayout *slot = &LAYOUT_CACHE[0];
+
+    for (int i = 0; i < LAYOUT_CACHE_SLOTS; i++)
+    {
+        TextLayout *layout = &LAYOUT_CACHE[i];
+        if (layout->text && layout->hash == hash && layout->textLen == len && layout->width == width &&
+            strcmp(layout->indent ? layout->indent : "", indent ? indent : "") == 0 &&
+            memcmp(layout->text, text, len) == 0)
+        {
+            layout->lastUsed = ++LAYOUT_CLOCK;
+            return layout;
+        }
+        if (layout->lastUsed < slot->lastUsed) slot = layout;
+    }
+
+    freeTextLayout(slot);
+    slot->text = malloc(len + 1);
+    slot->indent = indent ? strdup(indent) : NULL;
+    if (!slot->text || (indent && !slot->indent))
+    {
+        freeTextLayout(slot);
+        return NULL;
+    }
+    memcpy(slot->text, text, len + 1);
+    slot->textLen = len;
+    slot->hash = hash;
+    slot->width = width;
+    if (indent)
+    {
+        int indentWidth;
+        char escaped[strlen(indent) + 1];
+        escapeDisplayName(indent, escaped, &indentWidth);
+        slot->indentWidth = indentWidth;
+    }
+
+    if (wrapText(slot) != 0)
+    {
+        freeTextLayout(slot);
+        return NULL;
+    }
+    slot->lastUsed = ++LAYOUT_CLOCK;
+    return slot;
+}
+
+/**
+ * Prints one line of a text layout, with its indent if it is a continuation line.
+ * @param layout Layout to print from
+ * @param index Index of the line
+ */
+void printTextLine(const TextLayout *layout, int index)
+{
+    const TextLine *line = &layout->lines[index];
+    termPrintf("%s%.*s", line->indented && layout->indent ? layout->indent : "", (int)line->len, layout->text + line->start);
+}
+
+/**
+ * Gets an integer input from the user.
+ * @param prompt Prompt to give the user 
+ * @param min Minimum allowed input (set to same as max to disable validation)
+ * @param max Maximum allowed input (set to same as min to disable validation)
+ * @param negativeIfInvalid Flags if function should return -1 if invalid input instead of looping
+ * @return User's integer input
+ */
+int getIntInput(char *prompt, int min, int max, int negativeIfInvalid)
+{
+    if (min > max) min = max;
+    if (max < min) max = min;
+
+    int isValid;
+    char buffer[32];
+    int val;
+
+    do
+    {
+        disableRawMode();
+
+        if (COL_ENABLED)
+        {
+            termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+            for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+            termPrintf("\033[1G");
+        }
+
+        termPrintf("%s", prompt);
+        if (min != max) termPrintf(" (%d-%d)", min, max);
+        termPrintf(": ");
+        flushFrame();
+
+        if (fgets(buffer, sizeof(buffer), stdin) != NULL)
+        {
+            if (sscanf(buffer, "%d", &val) == 1)
+            {
+                if ((min != max) && (val >= min && val <= max))
+                    isValid = 1;
+                else if (min == max)
+                    isValid = 1;
+                else
+                    isValid = 0;
+            }
+            else isValid = 0;
+        }
+        else
+        {
+            int c;
+            while ((c = readKey()) != '\n' && c != EOF);
+            isValid = 0;
+        }
+
+        enableRawMode();
+
+        if (!isValid && negativeIfInvalid)
+            return -1;
+
+    } while (!isValid);
+
+    if (COL_ENABLED) termPrintf("\033[%sm", COL_RESET);
+
+    return val;
+}
+
+/**
+ * Maps a key to a nav input action, reading the rest of the sequence if it is an escape.
+ * @param c Key read
+ * @return The nav input action detected
+ */
+enum NavInput mapNavKey(int c)
+{
+    if (c == 27)
+    {
+        readKey();
+        switch (readKey())
+        {
+            case 'A': return CURSOR_UP;
+            case 'B': return CURSOR_DOWN;
+            case 'C': return DIR_DOWN;
+            case 'D': return DIR_UP;
+            case '3':
+                readKey();
+                return REMOVE;
+        }
+    }
+    else
+    {
+        c = tolower(c);
+        switch (c)
+        {
+            case 'q': return QUIT;
+            case ' ': return TOGGLE_MARK;
+            case 'y': return CLIPBOARD_COPY;
+            case 'x': return CLIPBOARD_CUT;
+            case 'p': return CLIPBOARD_PASTE;
+            case 'r': return REMOVE;
+            case 'c': return CANCEL_JOB;
+            case 'w': return CURSOR_UP;
+            case 'e': return DEBUG;
+            case 'a': return DIR_UP;
+            case 's': return CURSOR_DOWN;
+            case 'd': return DIR_DOWN;
+            case 'i': return INSPECT;
+            case 'h': return DIR_UP;
+            case 'j': return CURSOR_DOWN;
+            case 'k': return CURSOR_UP;
+            case 'l': return DIR_DOWN;
+            case 'z': return JUMP;
+            case '/': return SEARCH_TEXT;
+            case 'u': return FIND_DUPLICATES;
+            case 'b': return COMPARE_PANES;
+            case '\t': return SWITCH_PANE;
+            case 'n': return NEXT_DIFFERENCE;
+            case '#': return COMPARE_CONTENTS;
+            case 'o': return SORT_CYCLE;
+            case 'f': return TOGGLE_DIRS_FIRST;
+            case 'v': return TOGGLE_DETAILS;
+            case 't': return TOGGLE_TREE;
+            case '.': return TOGGLE_HIDDEN;
+            case '?': return HELP;
+        }
+    }
+
+    return INVALID;
+}
+
+/**
+ * @return The nav input action detected
+ */
+enum NavInput getNavInput(void)
+{
+    return mapNavKey(readKey());
+}
+
+/**
+ * @return winsize struct containing the current terminal size in columns and rows
+ */
+struct winsize getTerminalSize(void)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    {
+        ws.ws_col = 80;
+        ws.ws_row = 24;
+    }
+    return ws;
+}
+
+/**
+ * @param dirFd Directory file descriptor the entry belongs to
+ * @param name Name of the directory entry to check
+ */
+int isFileExecutable(int dirFd, const char *name)
+{
+    if (faccessat(dirFd, name, X_OK, 0) == 0) return 1;
+    else return 0;
+}
+
+/**
+ * Copies an entry name into the listing's name pool. Names are packed into large blocks rather
+ * than allocated one by one, and blocks are never moved so returned pointers stay valid until
+ * the listing is freed.
+ * @param listing Listing that will own the name
+ * @param name Name to store
+ * @param len Length of name in bytes
+ * @return Pointer to the stored copy
+ */
+char *storeName(DirListing *listing, const char *name, size_t len)
+{
+    NameBlock *block = listing->names;
+    if (!block || block->used + len + 1 > block->size)
+    {
+        size_t size = NAME_BLOCK_SIZE;
+        if (len + 1 > size) size = len + 1;
+        block = malloc(sizeof(NameBlock) + size);
+        if (!block) return NULL;
+        block->next = listing->names;
+        block->used = 0;
+        block->size = size;
+        listing->names = block;
+    }
+
+    char *copy = block->data + block->used;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+    return copy;
+}
+
+/**
+ * Stores an entry's name in the listing's pool. Names only get a second, escaped copy if they
+ * contain anything unsafe to print.
+ * @param listing Listing that will own the name
+ * @param entry Entry to name
+ * @param name Name as read from the directory
+ * @param nameLen Length of name in bytes (at most NAME_MAX)
+ * @return 1 on success, otherwise 0
+ */
+int setEntryName(DirListing *listing, DirEntry *entry, const char *name, size_t nameLen)
+{
+    entry->name = storeName(listing, name, nameLen);
+    if (!entry->name) return 0;
+
+    char display[NAME_MAX + 1];
+    int width;
+    size_t displayLen = escapeDisplayName(entry->name, display, &width);
+    entry->display = entry->name;
+    if (displayLen != nameLen || memcmp(display, name, nameLen) != 0)
+        entry->display = storeName(listing, display, displayLen);
+    if (!entry->display) return 0;
+    entry->width = width > 65535 ? 65535 : width;
+    return 1;
+}
+
+/**
+ * Releases all names held in a name pool.
+ * @param names Pool whose names are freed (by reference)
+ */
+void freeNameBlocks(NameBlock **names)
+{
+    NameBlock *block = *names;
+    while (block)
+    {
+        NameBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    *names = NULL;
+}
+
+/**
+ * Releases all entries and names held by a listing and closes its directory, along with the
+ * spill files of a paged listing.
+ * @param listing Listing to free
+ */
+void freeDirListing(DirListing *listing)
+{
+    freeNameBlocks(&listing->names);
+    free(listing->entries);
+    free(listing->windowFlags);
+    if (listing->dirFd >= 0) close(listing->dirFd);
+    if (listing->pageFd >= 0) close(listing->pageFd);
+    if (listing->indexFd >= 0) close(listing->indexFd);
+
+    listing->entries = NULL;
+    listing->count = 0;
+    listing->capacity = 0;
+    listing->dirFd = -1;
+    listing->pageFd = -1;
+    listing->indexFd = -1;
+    listing->windowStart = 0;
+    listing->windowCount = 0;
+    listing->windowFlags = NULL;
+}
+
+/**
+ * Fills in the metadata of a single entry.
+ * @param dirFd Directory the entry lives in
+ * @param entry Entry to stat
+ */
+void statEntry(int dirFd, DirEntry *entry)
+{
+#ifdef STATX_BASIC_STATS
+    static int statxMissing = 0;
+#endif
+
+    __atomic_fetch_add(&STAT_CALLS, 1, __ATOMIC_RELAXED);
+    entry->flags |= ENTRY_STATTED;
+
+#ifdef STATX_BASIC_STATS
+    if (!__atomic_load_n(&statxMissing, __ATOMIC_RELAXED))
+    {
+        struct statx stx;
+        unsigned int mask = STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+        if (statx(dirFd, entry->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) == 0)
+        {
+            entry->mode = stx.stx_mode;
+            entry->uid = stx.stx_uid;
+            entry->gid = stx.stx_gid;
+            entry->size = stx.stx_size;
+            entry->mtime = stx.stx_mtime.tv_sec;
+            return;
+        }
+        if (errno != ENOSYS) return;
+        __atomic_store_n(&statxMissing, 1, __ATOMIC_RELAXED);
+    }
+#endif
+
+    struct stat st;
+    if (fstatat(dirFd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        entry->mode = st.st_mode;
+        entry->uid = st.st_uid;
+        entry->gid = st.st_gid;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+    }
+}
+
+/**
+ * Writes back any marks or metadata gathered for the entries of a paged listing's window, so they
+ * survive the window being replaced.
+ * @param listing Paged listing
+ */
+void flushListingWindow(DirListing *listing)
+{
+    off_t pos = listing->windowBase;
+    for (int i = 0; i < listing->windowCount; i++)
+    {
+        DirEntry *entry = &listing->entries[i];
+        size_t nameLen = strlen(entry->name);
+        if (entry->flags != listing->windowFlags[i])
+        {
+            SpillRecord record = { entry->type, entry->flags, (unsigned short)nameLen, entry->mode, entry->uid, entry->gid, entry->size, entry->mtime };
+            if (pwrite(listing->pageFd, &record, sizeof(record), pos) == sizeof(record))
+                listing->windowFlags[i] = entry->flags;
+        }
+        pos += sizeof(SpillRecord) + nameLen;
+    }
+}
+
+/**
+ * Pages the window of a paged listing so that it contains the given entry. Windows are read with
+ * one pread of their offsets and one of their records, which are stored contiguously in order.
+ * @param listing Paged listing
+ * @param index Entry index the window must contain
+ * @return 1 on success, otherwise 0
+ */
+int loadListingWindow(DirListing *listing, int index)
+{
+    flushListingWindow(listing);
+    listing->windowCount = 0;
+    freeNameBlocks(&listing->names);
+
+    // Leave most of the window ahead of the entry, as browsing mostly moves downwards
+    int start = index - PAGE_WINDOW / 4;
+    if (start > listing->count - PAGE_WINDOW) start = listing->count - PAGE_WINDOW;
+    if (start < 0) start = 0;
+    int count = listing->count - start;
+    if (count > PAGE_WINDOW) count = PAGE_WINDOW;
+
+    long long offsets[PAGE_WINDOW + 1];
+    size_t offsetsLen = (count + 1) * sizeof(long long);
+    if (pread(listing->indexFd, offsets, offsetsLen, (off_t)start * sizeof(long long)) != (ssize_t)offsetsLen)
+        return 0;
+
+    size_t size = offsets[count] - offsets[0];
+    char *buffer = malloc(size);
+    if (!buffer) return 0;
+    if (pread(listing->pageFd, buffer, size, offsets[0]) != (ssize_t)size)
+    {
+        free(buffer);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        SpillRecord record;
+        char *data = buffer + (offsets[i] - offsets[0]);
+        memcpy(&record, data, sizeof(record));
+
+        DirEntry *entry = &listing->entries[i];
+        memset(entry, 0, sizeof(DirEntry));
+        if (!setEntryName(listing, entry, data + sizeof(record), record.nameLen)) break;
+        entry->type = record.type;
+        entry->flags = record.flags;
+        entry->mode = record.mode;
+        entry->uid = record.uid;
+        entry->gid = record.gid;
+        entry->size = record.size;
+        entry->mtime = record.mtime;
+        listing->windowFlags[i] = record.flags;
+        listing->windowCount++;
+    }
+
+    free(buffer);
+    listing->windowStart = start;
+    listing->windowBase = offsets[0];
+    return listing->windowCount > index - start;
+}
+
+/**
+ * Gets an entry of a listing. For a paged listing this may page in a different window, so the
+ * returned pointer is only valid until the next call.
+ * @param listing Listing holding the entry
+ * @param index Entry index
+ * @return Entry (a placeholder if it could not be read back)
+ */
+DirEntry *getListingEntry(DirListing *listing, int index)
+{
+    static DirEntry unreadable = { "", "?", 1, DT_UNKNOWN, ENTRY_STATTED, 0, 0, 0, 0, 0 };
+
+    if (listing->pageFd < 0) return &listing->entries[index];
+
+    int windowIndex = index - listing->windowStart;
+    if (windowIndex < 0 || windowIndex >= listing->windowCount)
+    {
+        if (!loadListingWindow(listing, index)) return &unreadable;
+        windowIndex = index - listing->windowStart;
+    }
+    return &listing->entries[windowIndex];
+}
+
+/**
+ * Fills in the metadata of a range of entries that have not been stat'd yet. Stats are issued
+ * relative to the listing's directory descriptor so no path is re-resolved per entry.
+ * @param listing Listing holding the entries
+ * @param from First entry index (inclusive)
+ * @param to Last entry index (exclusive)
+ */
+void statEntries(DirListing *listing, int from, int to)
+{
+    if (from < 0) from = 0;
+    if (to > listing->count) to = listing->count;
+
+    for (int i = from; i < to; i++)
+    {
+        DirEntry *entry = getListingEntry(listing, i);
+        if (!(entry->flags & ENTRY_STATTED))
+            statEntry(listing->dirFd, entry);
+    }
+}
+
+/**
+ * Works out the type of an entry the directory did not report one for (DT_UNKNOWN, as some network
+ * and older filesystems do) and, for symbolic links, what they point at. This is only done for
+ * entries about to be shown or opened, and the result is kept in the entry's flags. Links to
+ * executables are left unflagged, as executables are not opened in an editor.
+ * @param dirFd Directory the entry lives in
+ * @param entry Entry to resolve
+ */
+void resolveEntry(int dirFd, DirEntry *entry)
+{
+    if (entry->flags & ENTRY_RESOLVED) return;
+    entry->flags |= ENTRY_RESOLVED;
+
+    if (entry->type == DT_UNKNOWN)
+    {
+        if (!(entry->flags & ENTRY_STATTED)) statEntry(dirFd, entry);
+        if (entry->mode & S_IFMT) entry->type = IFTODT(entry->mode);
+        if (entry->type == DT_REG && isFileExecutable(dirFd, entry->name))
+            entry->type = DT_EXE;
+    }
+
+    if (entry->type == DT_LNK)
+    {
+        struct stat st;
+        __atomic_fetch_add(&STAT_CALLS, 1, __ATOMIC_RELAXED);
+        if (fstatat(dirFd, entry->name, &st, 0) == 0)
+        {
+            if (S_ISDIR(st.st_mode)) entry->flags |= ENTRY_LINK_DIR;
+            else if (S_ISREG(st.st_mode) && !isFileExecutable(dirFd, entry->name)) entry->flags |= ENTRY_LINK_FILE;
+        }
+    }
+}
+
+/**
+ * Resolves the types of a range of entries (see resolveEntry).
+ * @param listing Listing holding the entries
+ * @param from First entry index (inclusive)
+ * @param to Last entry index (exclusive)
+ */
+void resolveEntries(DirListing *listing, int from, int to)
+{
+    if (from < 0) from = 0;
+    if (to > listing->count) to = listing->count;
+
+    for (int i = from; i < to; i++)
+    {
+        DirEntry *entry = getListingEntry(listing, i);
+        if ((entry->type == DT_UNKNOWN || entry->type == DT_LNK) && !(entry->flags & ENTRY_RESOLVED))
+            resolveEntry(listing->dirFd, entry);
+    }
+}
+
+/**
+ * Sorts a listing by the current sort mode without rereading the directory. The sort works on a
+ * contiguous array of small packed keys rather than on the entries themselves, and the entries are
+ * only moved once, into their final order, at the end.
+ * @param listing Listing to sort
+ */
+void sortListing(DirListing *listing)
+{
+    int count = listing->count;
+    if (count < 2) return;
+
+    if (SORT_MODE == SORT_SIZE || SORT_MODE == SORT_MTIME)
+        statEntries(listing, 0, count);
+
+    // Only entries whose type was not reported need a stat for the order to depend on type
+    if (DIRS_FIRST || SORT_MODE == SORT_TYPE)
+        for (int i = 0; i < count; i++)
+            if (listing->entries[i].type == DT_UNKNOWN)
+                resolveEntry(listing->dirFd, &listing->entries[i]);
+
+    SortKey *keys = malloc(count * sizeof(SortKey));
+    DirEntry *sorted = malloc(count * sizeof(DirEntry));
+    if (!keys || !sorted)
+    {
+        free(keys);
+        free(sorted);
+        qsort(listing->entries, count, sizeof(DirEntry), compareDirName);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        DirEntry *entry = &listing->entries[i];
+        unsigned long long dirBit = (DIRS_FIRST && entry->type != DT_DIR) ? 1ULL << 63 : 0;
+        unsigned long long mtime = (unsigned long long)(long long)entry->mtime ^ (1ULL << 63);
+
+        keys[i].index = i;
+        keys[i].minor = packNamePrefix(entry->name);
+        switch (SORT_MODE)
+        {
+            case SORT_NAME:
+                // First seven bytes in the major key, the next eight in the minor key
+                keys[i].major = dirBit | (keys[i].minor >> 8);
+                keys[i].minor = memchr(entry->name, '\0', 7) ? 0 : packNamePrefix(entry->name + 7);
+                break;
+            case SORT_SIZE:
+                // The bit shifted out of the major key leads the minor key, so no order is lost
+                keys[i].major = dirBit | (~(unsigned long long)entry->size >> 1);
+                keys[i].minor = (~(unsigned long long)entry->size << 63) | (keys[i].minor >> 1);
+                break;
+            case SORT_MTIME:
+                keys[i].major = dirBit | (~mtime >> 1);
+                keys[i].minor = (~mtime << 63) | (keys[i].minor >> 1);
+                break;
+            case SORT_TYPE:
+                keys[i].major = dirBit | getTypeRank(entry->type);
+                break;
+            case SORT_EXTENSION:
+            {
+                // Extensions that fill the key are left to compareEntries to order by name
+                const char *extension = getExtension(entry->name);
+                unsigned long long extensionKey = packNamePrefix(extension);
+                keys[i].major = dirBit | (extensionKey >> 1);
+                keys[i].minor = (extensionKey << 63) | (strlen(extension) < 8 ? keys[i].minor >> 1 : 0);
+                break;
+            }
+            default:
+                keys[i].major = dirBit;
+                keys[i].minor = 0;
+                break;
+        }
+    }
+
+    SORTING_LISTING = listing;
+    qsort(keys, count, sizeof(SortKey), compareSortKeys);
+    SORTING_LISTING = NULL;
+
+    for (int i = 0; i < count; i++)
+        sorted[i] = listing->entries[keys[i].index];
+
+    free(listing->entries);
+    free(keys);
+    listing->entries = sorted;
+    listing->capacity = count;
+}
+
+/**
+ * Creates an anonymous temporary file for spilling listings to, in $TMPDIR or /tmp.
+ * @return Descriptor of the file, or -1 on failure
+ */
+int openTempFile(void)
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !dir[0]) dir = "/tmp";
+
+#ifdef O_TMPFILE
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+#endif
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/shorkdir.XXXXXX", dir);
+    int tmpFd = mkostemp(path, O_CLOEXEC);
+    if (tmpFd >= 0) unlink(path);
+    return tmpFd;
+}
+
+/**
+ * Writes out whatever a spill writer has buffered.
+ * @param writer Spill writer
+ * @return 1 on success, otherwise 0
+ */
+int flushSpill(SpillWriter *writer)
+{
+    for (size_t written = 0; written < writer->len; )
+    {
+        ssize_t n = pwrite(writer->fd, writer->buf + written, writer->len - written, writer->pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        written += n;
+        writer->pos += n;
+    }
+    writer->len = 0;
+    return 1;
+}
+
+/**
+ * Buffers data to be written to a spill file.
+ * @param writer Spill writer
+ * @param data Data to write
+ * @param len Length of data in bytes
+ * @return 1 on success, otherwise 0
+ */
+int writeSpill(SpillWriter *writer, const void *data, size_t len)
+{
+    if (writer->len + len > SPILL_BUFFER_SIZE && !flushSpill(writer)) return 0;
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+    return 1;
+}
+
+/**
+ * @param writer Spill writer
+ * @return File position the next write will land at
+ */
+off_t getSpillPos(SpillWriter *writer)
+{
+    return writer->pos + writer->len;
+}
+
+/**
+ * Writes an entry to a spill file as a fixed header followed by its name.
+ * @param writer Spill writer
+ * @param entry Entry to write
+ * @return 1 on success, otherwise 0
+ */
+int writeSpillEntry(SpillWriter *writer, const DirEntry *entry)
+{
+    size_t nameLen = strlen(entry->name);
+    SpillRecord record = { entry->type, entry->flags, (unsigned short)nameLen, entry->mode, entry->uid, entry->gid, entry->size, entry->mtime };
+    return writeSpill(writer, &record, sizeof(record)) && writeSpill(writer, entry->name, nameLen);
+}
+
+/**
+ * Reads the next entry of a sorted run into the reader's entry.
+ * @param reader Spill reader positioned within a run
+ * @return 1 if an entry was read, 0 at the end of the run or on error
+ */
+int readSpillEntry(SpillReader *reader)
+{
+    size_t avail = reader->len - reader->at;
+    if (avail < sizeof(SpillRecord) + NAME_MAX && reader->pos < reader->end)
+    {
+        memmove(reader->buf, reader->buf + reader->at, avail);
+        size_t want = SPILL_BUFFER_SIZE - avail;
+        if ((off_t)want > reader->end - reader->pos) want = reader->end - reader->pos;
+        ssize_t n = pread(reader->fd, reader->buf + avail, want, reader->pos);
+        if (n < 0) return 0;
+        reader->pos += n;
+        reader->len = avail + n;
+        reader->at = 0;
+        avail = reader->len;
+    }
+
+    SpillRecord record;
+    if (avail < sizeof(record)) return 0;
+    memcpy(&record, reader->buf + reader->at, sizeof(record));
+    if (record.nameLen > NAME_MAX || avail < sizeof(record) + record.nameLen) return 0;
+
+    memcpy(reader->name, reader->buf + reader->at + sizeof(record), record.nameLen);
+    reader->name[record.nameLen] = '\0';
+    reader->at += sizeof(record) + record.nameLen;
+
+    DirEntry *entry = &reader->entry;
+    entry->name = entry->display = reader->name;
+    entry->type = record.type;
+    entry->flags = record.flags;
+    entry->mode = record.mode;
+    entry->uid = record.uid;
+    entry->gid = record.gid;
+    entry->size = record.size;
+    entry->mtime = record.mtime;
+    return 1;
+}
+
+/**
+ * Restores the heap order of a merge heap from a given slot downwards.
+ * @param heap Readers ordered by their current entry
+ * @param count Number of readers in the heap
+ * @param slot Slot to sift down from
+ */
+void siftSpillHeap(SpillReader **heap, int count, int slot)
+{
+    for (;;)
+    {
+        int smallest = slot;
+        int left = slot * 2 + 1;
+        int right = left + 1;
+        if (left < count && compareEntries(&heap[left]->entry, &heap[smallest]->entry) < 0) smallest = left;
+        if (right < count && compareEntries(&heap[right]->entry, &heap[smallest]->entry) < 0) smallest = right;
+        if (smallest == slot) return;
+
+        SpillReader *swap = heap[slot];
+        heap[slot] = heap[smallest];
+        heap[smallest] = swap;
+        slot = smallest;
+    }
+}
+
+/**
+ * Merges up to SPILL_FAN_IN sorted runs into one.
+ * @param inFd File holding the runs
+ * @param bounds Start offsets of the runs, followed by the end offset of the last run
+ * @param runs Number of runs to merge
+ * @param out Writer for the merged run
+ * @param index Writer for the offset of each merged entry, or NULL if not needed
+ * @return Number of entries merged, or -1 on error
+ */
+int mergeSpillRuns(int inFd, const off_t *bounds, int runs, SpillWriter *out, SpillWriter *index)
+{
+    SpillReader readers[SPILL_FAN_IN];
+    SpillReader *heap[SPILL_FAN_IN];
+    int heapCount = 0;
+    int merged = 0;
+
+    for (int i = 0; i < runs; i++)
+    {
+        SpillReader *reader = &readers[i];
+        memset(reader, 0, sizeof(SpillReader));
+        reader->fd = inFd;
+        reader->pos = bounds[i];
+        reader->end = bounds[i + 1];
+        reader->buf = malloc(SPILL_BUFFER_SIZE);
+        if (reader->buf && readSpillEntry(reader)) heap[heapCount++] = reader;
+        else if (!reader->buf) merged = -1;
+    }
+    for (int i = heapCount / 2 - 1; i >= 0; i--)
+        siftSpillHeap(heap, heapCount, i);
+
+    while (heapCount > 0 && merged >= 0)
+    {
+        long long offset = getSpillPos(out);
+        if (!writeSpillEntry(out, &heap[0]->entry) || (index && !writeSpill(index, &offset, sizeof(offset))))
+        {
+            merged = -1;
+            break;
+        }
+        merged++;
+
+        if (!readSpillEntry(heap[0])) heap[0] = heap[--heapCount];
+        siftSpillHeap(heap, heapCount, 0);
+    }
+
+    for (int i = 0; i < runs; i++)
+        free(readers[i].buf);
+    return merged;
+}
+
+/**
+ * Sorts an in-memory chunk of a listing and writes it out as a run, leaving the listing empty.
+ * @param listing Listing holding the chunk
+ * @param runs Writer for the run file
+ * @return 1 on success, otherwise 0
+ */
+int spillListing(DirListing *listing, SpillWriter *runs)
+{
+    sortListing(listing);
+    for (int i = 0; i < listing->count; i++)
+        if (!writeSpillEntry(runs, &listing->entries[i])) return 0;
+
+    listing->count = 0;
+    freeNameBlocks(&listing->names);
+    return 1;
+}
+
+/**
+ * Merges the sorted runs spilled while reading a directory into one sorted file of entries plus an
+ * index of their offsets, and turns the listing into a paged listing over them. Runs are merged
+ * SPILL_FAN_IN at a time, so memory use stays fixed however many there are.
+ * @param listing Listing to turn into a paged listing (must hold no entries)
+ * @param runFd File holding the runs
+ * @param bounds Start offsets of the runs, followed by the end offset of the last run
+ * @param runs Number of runs
+ * @return 1 on success, otherwise 0
+ */
+int finishSpill(DirListing *listing, int runFd, off_t *bounds, int runs)
+{
+    int ok = 1;
+    char *outBuf = malloc(SPILL_BUFFER_SIZE);
+    char *indexBuf = malloc(SPILL_BUFFER_SIZE);
+    if (!outBuf || !indexBuf) ok = 0;
+
+    // Intermediate passes until the last merge can take every run at once
+    while (ok && runs > SPILL_FAN_IN)
+    {
+        SpillWriter out = { openTempFile(), 0, outBuf, 0 };
+        if (out.fd < 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        int merges = 0;
+        for (int i = 0; i < runs && ok; i += SPILL_FAN_IN)
+        {
+            int group = runs - i < SPILL_FAN_IN ? runs - i : SPILL_FAN_IN;
+            off_t start = getSpillPos(&out);
+            ok = mergeSpillRuns(runFd, bounds + i, group, &out, NULL) >= 0;
+            bounds[merges++] = start;
+        }
+        ok = ok && flushSpill(&out);
+        bounds[merges] = out.pos;
+
+        close(runFd);
+        runFd = out.fd;
+        runs = merges;
+    }
+
+    SpillWriter out = { ok ? openTempFile() : -1, 0, outBuf, 0 };
+    SpillWriter index = { ok ? openTempFile() : -1, 0, indexBuf, 0 };
+    int count = -1;
+    if (out.fd >= 0 && index.fd >= 0)
+        count = mergeSpillRuns(runFd, bounds, runs, &out, &index);
+
+    // A final offset marks where the last entry ends
+    long long end = getSpillPos(&out);
+    ok = count >= 0 && writeSpill(&index, &end, sizeof(end)) && flushSpill(&out) && flushSpill(&index);
+    close(runFd);
+    free(outBuf);
+    free(indexBuf);
+
+    DirEntry *window = ok ? realloc(listing->entries, PAGE_WINDOW * sizeof(DirEntry)) : NULL;
+    unsigned char *windowFlags = window ? malloc(PAGE_WINDOW) : NULL;
+    if (!windowFlags)
+    {
+        if (window) listing->entries = window;
+        if (out.fd >= 0) close(out.fd);
+        if (index.fd >= 0) close(index.fd);
+        return 0;
+    }
+
+    listing->entries = window;
+    listing->capacity = PAGE_WINDOW;
+    listing->count = count;
+    listing->pageFd = out.fd;
+    listing->indexFd = index.fd;
+    listing->windowStart = 0;
+    listing->windowCount = 0;
+    listing->windowFlags = windowFlags;
+    return 1;
+}
+
+/**
+ * @return 1 if the directory being prefetched is no longer wanted, otherwise 0
+ */
+int isPrefetchCancelled(void)
+{
+    pthread_mutex_lock(&PREFETCH_LOCK);
+    int cancelled = PREFETCH.cancel;
+    pthread_mutex_unlock(&PREFETCH_LOCK);
+    return cancelled;
+}
+
+/**
+ * Reads a directory into a listing. Only names and d_type are gathered; metadata for the detail
+ * columns is fetched later by statEntries for rows that actually get drawn. If the listing would
+ * take more than MEM_BUDGET bytes, it is sorted in chunks that are spilled to a temporary file and
+ * merged, and the result is a paged listing read back a window at a time by getListingEntry.
+ * Prefetches pass a limit instead: they give up rather than spill or read a huge directory, and
+ * stop early when cancelled.
+ * @param dirFd Descriptor of the directory to read (not consumed)
+ * @param listing Listing to fill (any previous contents are freed)
+ * @param limit Most entries to read for a prefetch, or 0 for a normal read
+ * @return 1 if the directory could be read, otherwise 0
+ */
+int getDirContents(int dirFd, DirListing *listing, int limit)
+{
+    freeDirListing(listing);
+
+    int readFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = readFd >= 0 ? fdopendir(readFd) : NULL;
+    if (!dir)
+    {
+        if (readFd >= 0) close(readFd);
+        return 0;
+    }
+
+    // The listing keeps its own descriptor for stats and jobs; without one it would be unusable
+    listing->dirFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    if (listing->dirFd < 0)
+    {
+        int err = errno;
+        closedir(dir);
+        errno = err;
+        return 0;
+    }
+
+    // Spill state; every entry costs its DirEntry, its sort key and sorted copy, and its names
+    SpillWriter runs = { -1, 0, NULL, 0 };
+    off_t *bounds = NULL;
+    int runCount = 0;
+    size_t used = 0;
+    int ok = 1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || (!DOTFILES_VISIBLE && entry->d_name[0] == '.'))
+            continue;
+
+        if (limit && (listing->count >= limit || (MEM_BUDGET && used > MEM_BUDGET) || (listing->count % 64 == 0 && isPrefetchCancelled())))
+        {
+            closedir(dir);
+            freeDirListing(listing);
+            errno = ECANCELED;
+            return 0;
+        }
+
+        if (MEM_BUDGET && used > MEM_BUDGET)
+        {
+            if (runs.fd < 0)
+            {
+                runs.fd = openTempFile();
+                runs.buf = malloc(SPILL_BUFFER_SIZE);
+            }
+
+            // Room for this run, the final run and the end offset
+            off_t *grown = realloc(bounds, (runCount + 3) * sizeof(off_t));
+            if (grown) bounds = grown;
+            if (runs.fd < 0 || !runs.buf || !grown)
+            {
+                ok = 0;
+                break;
+            }
+
+            bounds[runCount++] = getSpillPos(&runs);
+            if (!spillListing(listing, &runs))
+            {
+                ok = 0;
+                break;
+            }
+            used = 0;
+        }
+
+        if (listing->count == listing->capacity)
+        {
+            int capacity = listing->capacity ? listing->capacity * 2 : 64;
+            DirEntry *entries = realloc(listing->entries, capacity * sizeof(DirEntry));
+            if (!entries) break;
+            listing->entries = entries;
+            listing->capacity = capacity;
+        }
+
+        DirEntry *dst = &listing->entries[listing->count];
+        memset(dst, 0, sizeof(DirEntry));
+        size_t nameLen = strlen(entry->d_name);
+        if (!setEntryName(listing, dst, entry->d_name, nameLen)) break;
+        dst->type = entry->d_type;
+        if (dst->type == DT_REG && isFileExecutable(dirFd, entry->d_name))
+            dst->type = DT_EXE;
+        listing->count++;
+        used += 2 * sizeof(DirEntry) + sizeof(SortKey) + (nameLen + 1) * (dst->display == dst->name ? 1 : 2);
+    }
+
+    closedir(dir);
+
+    if (runs.fd >= 0)
+    {
+        // The last chunk becomes the final run
+        if (ok)
+        {
+            bounds[runCount++] = getSpillPos(&runs);
+            ok = spillListing(listing, &runs) && flushSpill(&runs);
+            bounds[runCount] = getSpillPos(&runs);
+        }
+        free(runs.buf);
+        if (ok)
+            ok = finishSpill(listing, runs.fd, bounds, runCount);
+        else
+            close(runs.fd);
+        free(bounds);
+
+        if (!ok)
+        {
+            freeDirListing(listing);
+            errno = EIO;
+            return 0;
+        }
+        return 1;
+    }
+
+    sortListing(listing);
+    return 1;
+}
+
+/**
+ * Finds where an entry belongs in a sorted listing by binary search, for paged listings where a
+ * linear search would read back the whole listing.
+ * @param listing Sorted listing
+ * @param key Entry to look for
+ * @return Index of the first entry that does not sort before key
+ */
+int findListingEntry(DirListing *listing, const DirEntry *key)
+{
+    int low = 0;
+    int high = listing->count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (compareEntries(getListingEntry(listing, mid), key) < 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+/**
+ * Rereads a directory while keeping the cursor on the same entry, or as close to its old position
+ * as possible if that entry has gone.
+ * @param dirFd Descriptor of the directory to read
+ * @param listing Listing to refresh
+ * @param cursor Current line cursor position
+ * @return New line cursor position
+ */
+int reloadListing(int dirFd, DirListing *listing, int cursor)
+{
+    DirEntry selected;
+    char *selectedName = NULL;
+    if (cursor >= 1 && cursor <= listing->count)
+    {
+        selected = *getListingEntry(listing, cursor - 1);
+        selectedName = strdup(selected.name);
+        selected.name = selected.display = selectedName;
+    }
+
+    getDirContents(dirFd, listing, 0);
+
+    if (cursor > listing->count) cursor = listing->count;
+    if (cursor < 1) cursor = 1;
+    if (selectedName && listing->pageFd >= 0)
+    {
+        // The sort order may have changed, so the old entry is looked up by its new sort key
+        if ((SORT_MODE == SORT_SIZE || SORT_MODE == SORT_MTIME) && !(selected.flags & ENTRY_STATTED))
+            statEntry(listing->dirFd, &selected);
+        int index = findListingEntry(listing, &selected);
+        cursor = index < listing->count ? index + 1 : listing->count;
+    }
+    for (int i = 0; selectedName && listing->pageFd < 0 && i < listing->count; i++)
+    {
+        if (strcmp(listing->entries[i].name, selectedName) == 0)
+        {
+            cursor = i + 1;
+            break;
+        }
+    }
+
+    free(selectedName);
+    return cursor;
+}
+
+/**
+ * Puts a listing back in order after the sort mode has changed, keeping the cursor on the same
+ * entry. Paged listings are read again instead, as only a window of them is in memory.
+ * @param dirFd Descriptor of the listing's directory
+ * @param listing Listing to re-sort
+ * @param cursor Current line cursor position
+ * @return New line cursor position
+ */
+int resortListing(int dirFd, DirListing *listing, int cursor)
+{
+    if (listing->pageFd >= 0) return reloadListing(dirFd, listing, cursor);
+    if (listing->count == 0) return cursor;
+
+    char *selectedName = listing->entries[cursor - 1].name;
+    sortListing(listing);
+    for (int i = 0; i < listing->count; i++)
+        if (listing->entries[i].name == selectedName) return i + 1;
+    return cursor;
+}
+
+/**
+ * Allows qsort and bsearch to compare two name pointers.
+ * @param a First name to compare
+ * @param b Second name to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
+ */
+int compareNamePtrs(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Allows qsort to compare two entries in the current sort order.
+ * @param a First entry to compare
+ * @param b Second entry to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
+ */
+int compareEntryOrder(const void *a, const void *b)
+{
+    return compareEntries((const DirEntry *)a, (const DirEntry *)b);
+}
+
+/**
+ * Forgets any changes waiting to be applied to a watch's listing.
+ * @param watch Watch to clear
+ */
+void clearWatchEvents(DirWatch *watch)
+{
+    for (int i = 0; i < watch->count; i++) free(watch->names[i]);
+    free(watch->names);
+    watch->names = NULL;
+    watch->count = 0;
+    watch->capacity = 0;
+    watch->overflow = 0;
+    watch->due.tv_sec = watch->due.tv_nsec = 0;
+}
+
+/**
+ * Starts watching a directory for entries being created, deleted, renamed or rewritten, in place
+ * of whichever directory the watch was on before. Changes still waiting belong to the old listing,
+ * so they are dropped. Both watches share one inotify descriptor, and the kernel hands out one
+ * watch per directory, so a watch is only removed once neither pane is on its directory.
+ * @param watch DIR_WATCH for the listing being browsed, or PANE_WATCH for the other pane
+ * @param dirFd Descriptor of the directory to watch, or -1 to stop watching
+ */
+void watchDir(DirWatch *watch, int dirFd)
+{
+    DirWatch *other = watch == &DIR_WATCH ? &PANE_WATCH : &DIR_WATCH;
+    clearWatchEvents(watch);
+    watch->dropped = 0;
+    if (watch->wd >= 0)
+    {
+        if (watch->wd != other->wd) inotify_rm_watch(DIR_WATCH.fd, watch->wd);
+        watch->wd = -1;
+    }
+    if (dirFd < 0) return;
+
+    if (DIR_WATCH.fd < 0)
+        DIR_WATCH.fd = PANE_WATCH.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (DIR_WATCH.fd < 0) return;
+
+    // The directory is only known by descriptor, so it is named through /proc
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", dirFd);
+    watch->wd = inotify_add_watch(DIR_WATCH.fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR);
+}
+
+/**
+ * Queues a changed name to be looked at again once the burst of changes it came in has passed.
+ * @param watch Watch the change was seen on
+ * @param name Name of the entry that changed
+ */
+void queueWatchName(DirWatch *watch, const char *name)
+{
+    if (watch->overflow) return;
+    if (watch->count == watch->capacity)
+    {
+        int capacity = watch->capacity ? watch->capacity * 2 : 16;
+        char **names = capacity <= WATCH_MAX_PENDING ? realloc(watch->names, capacity * sizeof(char *)) : NULL;
+        if (!names)
+        {
+            // Too many to patch in; the directory is read again instead
+            struct timespec due = watch->due;
+            clearWatchEvents(watch);
+            watch->overflow = 1;
+            watch->due = due;
+            return;
+        }
+        watch->names = names;
+        watch->capacity = capacity;
+    }
+
+    char *copy = strdup(name);
+    if (copy) watch->names[watch->count++] = copy;
+}
+
+/**
+ * Reads every change the watches have queued so far, handing each to the watch of its directory.
+ * The first change of a burst starts the delay after which the whole burst is applied at once.
+ */
+void readWatchEvents(void)
+{
+    DirWatch *watches[] = { &DIR_WATCH, &PANE_WATCH };
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while (DIR_WATCH.fd >= 0 && (len = read(DIR_WATCH.fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            // Events from a directory watched before are still in the queue, and both panes may be
+            // on the same directory
+            for (int i = 0; i < 2; i++)
+            {
+                DirWatch *watch = watches[i];
+                if (watch->wd < 0)
+                    continue;
+                else if (event->mask & IN_Q_OVERFLOW)
+                    watch->overflow = 1;
+                else if (event->wd != watch->wd)
+                    continue;
+                else if (event->mask & IN_DELETE_SELF)
+                    watch->overflow = 1;
+                else if (event->len && event->name[0])
+                    queueWatchName(watch, event->name);
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        DirWatch *watch = watches[i];
+        if ((watch->count || watch->overflow) && !watch->due.tv_sec && !watch->due.tv_nsec)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &watch->due);
+            watch->due.tv_nsec += WATCH_DELAY_MS * 1000000L;
+            watch->due.tv_sec += watch->due.tv_nsec / 1000000000L;
+            watch->due.tv_nsec %= 1000000000L;
+        }
+    }
+}
+
+/**
+ * @param watch Watch whose changes are asked about
+ * @return Milliseconds until queued changes are due to be applied (0 if they are now), or -1 if
+ * there are none
+ */
+int getWatchDelay(DirWatch *watch)
+{
+    if (!watch->count && !watch->overflow) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (watch->due.tv_sec - now.tv_sec) * 1000LL + (watch->due.tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/**
+ * Applies queued changes to a listing without reading the whole directory again. Each changed
+ * name is looked up once: its old entry, if any, is dropped, and if it still exists a fresh entry
+ * is inserted where it sorts, found by binary search. The cursor stays on the entry it was on. A
+ * full reread is only done if changes were lost, the listing is paged, or the name pool is
+ * mostly names that have since gone.
+ * @param watch Watch holding the changes
+ * @param dirFd Descriptor of the directory the listing is of
+ * @param listing Sorted listing to patch
+ * @param cursor Line cursor position, kept on the same entry (by reference)
+ * @return Index of the first entry that changed, or -1 if none did
+ */
+int applyWatchEvents(DirWatch *watch, int dirFd, DirListing *listing, int *cursor)
+{
+    char **names = watch->names;
+    int count = watch->count;
+    int reread = watch->overflow || listing->pageFd >= 0 || watch->dropped > listing->count + WATCH_MAX_PENDING;
+    watch->names = NULL;
+    watch->count = 0;
+    clearWatchEvents(watch);
+
+    unsigned char *marks = (!reread && count) ? calloc(count, 1) : NULL;
+    DirEntry *added = marks ? malloc(count * sizeof(DirEntry)) : NULL;
+    if (!reread && count && !added)
+        reread = 1;
+    if (!reread && listing->count + count > listing->capacity)
+    {
+        DirEntry *entries = realloc(listing->entries, (listing->count + count) * sizeof(DirEntry));
+        if (entries)
+        {
+            listing->entries = entries;
+            listing->capacity = listing->count + count;
+        }
+        else
+            reread = 1;
+    }
+
+    if (reread)
+    {
+        for (int i = 0; i < count; i++) free(names[i]);
+        free(names);
+        free(marks);
+        free(added);
+        watch->dropped = 0;
+        *cursor = reloadListing(dirFd, listing, *cursor);
+        return 0;
+    }
+    if (!count) return -1;
+
+    // The same entry often changes several times in a burst
+    qsort(names, count, sizeof(char *), compareNamePtrs);
+    int unique = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (unique && strcmp(names[unique - 1], names[i]) == 0) free(names[i]);
+        else names[unique++] = names[i];
+    }
+    count = unique;
+
+    // Drop the old entries, remembering whether they were selected or marked
+    char *selectedName = (*cursor >= 1 && *cursor <= listing->count) ? listing->entries[*cursor - 1].name : NULL;
+    int selectedIndex = -1;
+    int first = -1;
+    int kept = 0;
+    for (int i = 0; i < listing->count; i++)
+    {
+        DirEntry *entry = &listing->entries[i];
+        char **match = bsearch(&entry->name, names, count, sizeof(char *), compareNamePtrs);
+        if (!match)
+        {
+            listing->entries[kept++] = *entry;
+            continue;
+        }
+
+        if (first < 0) first = kept;
+        marks[match - names] = entry->flags & ENTRY_MARKED;
+        if (entry->name == selectedName) selectedIndex = match - names;
+        watch->dropped++;
+    }
+    listing->count = kept;
+
+    // Names that still exist get fresh entries, with their metadata already to hand
+    int addedCount = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct stat st;
+        DirEntry *entry = &added[addedCount];
+        __atomic_fetch_add(&STAT_CALLS, 1, __ATOMIC_RELAXED);
+        if ((!DOTFILES_VISIBLE && names[i][0] == '.') || fstatat(dirFd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        memset(entry, 0, sizeof(DirEntry));
+        if (!setEntryName(listing, entry, names[i], strlen(names[i]))) continue;
+        entry->type = IFTODT(st.st_mode);
+        if (entry->type == DT_REG && isFileExecutable(dirFd, entry->name))
+            entry->type = DT_EXE;
+        entry->flags = ENTRY_STATTED | marks[i];
+        entry->mode = st.st_mode;
+        entry->uid = st.st_uid;
+        entry->gid = st.st_gid;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        if (i == selectedIndex) selectedName = entry->name;
+        addedCount++;
+    }
+
+    // Insert from the last entry back, so each old entry is moved at most once
+    qsort(added, addedCount, sizeof(DirEntry), compareEntryOrder);
+    DirEntry *entries = listing->entries;
+    int end = kept;
+    for (int j = addedCount - 1; j >= 0; j--)
+    {
+        int low = 0;
+        int high = end;
+        while (low < high)
+        {
+            int mid = low + (high - low) / 2;
+            if (compareEntries(&entries[mid], &added[j]) < 0) low = mid + 1;
+            else high = mid;
+        }
+
+        memmove(&entries[low + j + 1], &entries[low], (end - low) * sizeof(DirEntry));
+        entries[low + j] = added[j];
+        end = low;
+        if (first < 0 || low + j < first) first = low + j;
+    }
+    listing->count = kept + addedCount;
+
+    // Keep the cursor on its entry; if that has gone, it stays where it was
+    for (int i = first; selectedName && first >= 0 && *cursor - 1 >= first && i < listing->count; i++)
+    {
+        if (listing->entries[i].name == selectedName)
+        {
+            *cursor = i + 1;
+            break;
+        }
+    }
+    if (*cursor > listing->count) *cursor = listing->count;
+    if (*cursor < 1) *cursor = 1;
+
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    free(marks);
+    free(added);
+    return first;
+}
+
+/**
+ * Makes sure the navigation stack's path buffer can hold a path of the given length.
+ * @param nav Navigation stack
+ * @param len Path length required (excluding terminator)
+ * @return 1 on success, otherwise 0
+ */
+int reserveNavPath(NavStack *nav, size_t len)
+{
+    if (len + 1 <= nav->pathCapacity) return 1;
+
+    size_t capacity = nav->pathCapacity ? nav->pathCapacity : 256;
+    while (capacity < len + 1) capacity *= 2;
+    char *path = realloc(nav->path, capacity);
+    if (!path) return 0;
+    nav->path = path;
+    nav->pathCapacity = capacity;
+    return 1;
+}
+
+/**
+ * Pushes a level onto the navigation stack. Only the most recent NAV_MAX_OPEN_FDS levels keep
+ * their descriptor open; older ones are closed and reopened by path if we climb back to them.
+ * @param nav Navigation stack
+ * @param fd Descriptor of the directory being entered
+ * @param pathLen Length of nav->path once the directory is entered
+ * @return 1 on success, otherwise 0
+ */
+int pushNavLevel(NavStack *nav, int fd, size_t pathLen)
+{
+    if (nav->depth == nav->capacity)
+    {
+        int capacity = nav->capacity ? nav->capacity * 2 : 16;
+        NavLevel *levels = realloc(nav->levels, capacity * sizeof(NavLevel));
+        if (!levels) return 0;
+        nav->levels = levels;
+        nav->capacity = capacity;
+    }
+
+    int evict = nav->depth - NAV_MAX_OPEN_FDS;
+    if (evict >= 0 && nav->levels[evict].fd >= 0)
+    {
+        close(nav->levels[evict].fd);
+        nav->levels[evict].fd = -1;
+    }
+
+    nav->levels[nav->depth].fd = fd;
+    nav->levels[nav->depth].pathLen = pathLen;
+    nav->depth++;
+    return 1;
+}
+
+/**
+ * Opens the directory navigation starts from.
+ * @param nav Navigation stack to initialise
+ * @param startPath Path of the starting directory (absolute or relative)
+ * @return 1 on success, otherwise 0
+ */
+int openNavStack(NavStack *nav, const char *startPath)
+{
+    int fd = open(startPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    // The path is only used for display and writeLastDir, so it is resolved once here
+    char *resolved = realpath(startPath, NULL);
+    if (!resolved && startPath[0] != '/')
+    {
+        char *cwd = get_current_dir_name();
+        if (cwd && (resolved = malloc(strlen(cwd) + strlen(startPath) + 2)))
+            sprintf(resolved, "%s/%s", cwd, startPath);
+        free(cwd);
+    }
+    const char *path = resolved ? resolved : startPath;
+
+    size_t len = strlen(path);
+    if (!reserveNavPath(nav, len) || !pushNavLevel(nav, fd, len))
+    {
+        free(resolved);
+        close(fd);
+        return 0;
+    }
+    memcpy(nav->path, path, len + 1);
+    free(resolved);
+    return 1;
+}
+
+/**
+ * @param nav Navigation stack
+ * @return Descriptor of the current directory
+ */
+int getNavFd(NavStack *nav)
+{
+    return nav->levels[nav->depth - 1].fd;
+}
+
+/**
+ * Enters a subdirectory of the current directory. The subdirectory is opened relative to the
+ * current directory's descriptor, so no path is resolved from / and there is no length limit.
+ * @param nav Navigation stack
+ * @param name Name of the subdirectory
+ * @return 1 on success, otherwise 0
+ */
+int enterNavDir(NavStack *nav, const char *name)
+{
+    int fd = openat(getNavFd(nav), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    size_t currLen = nav->levels[nav->depth - 1].pathLen;
+    int isRoot = currLen == 1 && nav->path[0] == '/';
+    size_t newLen = currLen + (isRoot ? 0 : 1) + strlen(name);
+    if (!reserveNavPath(nav, newLen) || !pushNavLevel(nav, fd, newLen))
+    {
+        close(fd);
+        return 0;
+    }
+
+    if (!isRoot) nav->path[currLen++] = '/';
+    strcpy(nav->path + currLen, name);
+    return 1;
+}
+
+/**
+ * Reopens a directory whose descriptor was evicted from the stack, by the path it was entered
+ * as rather than through "..", so levels entered through a symlink come back as they were.
+ * Paths too long to open in one call are walked a component at a time from /.
+ * @param nav Navigation stack
+ * @param pathLen Length of the directory's path, a prefix of nav->path
+ * @return Descriptor of the directory, or -1 on failure
+ */
+int reopenNavLevel(NavStack *nav, size_t pathLen)
+{
+    char saved = nav->path[pathLen];
+    nav->path[pathLen] = '\0';
+    int fd = open(nav->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENAMETOOLONG)
+    {
+        fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char *component = nav->path;
+        while (fd >= 0 && *component)
+        {
+            while (*component == '/') component++;
+            char *end = strchrnul(component, '/');
+            char endChar = *end;
+            *end = '\0';
+            int next = *component ? openat(fd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : fd;
+            *end = endChar;
+            if (next != fd) close(fd);
+            fd = next;
+            component = end;
+        }
+    }
+    nav->path[pathLen] = saved;
+    return fd;
+}
+
+/**
+ * Goes up to the parent directory. If the parent was entered through this stack, its still-open
+ * descriptor is reused; otherwise it is reopened by its recorded path.
+ * @param nav Navigation stack
+ * @return 1 on success, otherwise 0 (e.g. already at /)
+ */
+int leaveNavDir(NavStack *nav)
+{
+    if (strcmp(nav->path, "/") == 0) return 0;
+
+    NavLevel *top = &nav->levels[nav->depth - 1];
+    if (nav->depth > 1)
+    {
+        NavLevel *parent = &nav->levels[nav->depth - 2];
+        if (parent->fd < 0)
+        {
+            parent->fd = reopenNavLevel(nav, parent->pathLen);
+            if (parent->fd < 0) return 0;
+        }
+        close(top->fd);
+        nav->depth--;
+        nav->path[parent->pathLen] = '\0';
+        return 1;
+    }
+
+    // Already at the directory we started from, so the parent has to be opened
+    int fd = openat(top->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    close(top->fd);
+    top->fd = fd;
+
+    char *lastSlash = strrchr(nav->path, '/');
+    if (lastSlash && lastSlash != nav->path) *lastSlash = '\0';
+    else strcpy(nav->path, "/");
+    top->pathLen = strlen(nav->path);
+    return 1;
+}
+
+/**
+ * Closes all descriptors held by a navigation stack.
+ * @param nav Navigation stack to free
+ */
+void freeNavStack(NavStack *nav)
+{
+    for (int i = 0; i < nav->depth; i++)
+        if (nav->levels[i].fd >= 0) close(nav->levels[i].fd);
+    free(nav->levels);
+    free(nav->path);
+    memset(nav, 0, sizeof(NavStack));
+}
+
+/**
+ * Formats a size in bytes the short way the size column shows it, e.g. 512B, 4.0K or 23M.
+ * @param size Size in bytes
+ * @param buffer Output buffer
+ * @param bufSize Size of output buffer
+ */
+void formatSize(long long size, char *buffer, size_t bufSize)
+{
+    if (size < 1024)
+    {
+        snprintf(buffer, bufSize, "%dB", (int)size);
+        return;
+    }
+
+    const char *units = "KMGTPE";
+    double value = size / 1024.0;
+    int unit = 0;
+    while (value >= 1000.0 && unit < 5)
+    {
+        value /= 1024.0;
+        unit++;
+    }
+    if (value < 10.0) snprintf(buffer, bufSize, "%.1f%c", value, units[unit]);
+    else snprintf(buffer, bufSize, "%d%c", (int)value, units[unit]);
+}
+
+/**
+ * Sets the message shown in the footer until the next key press. Safe to call from the job thread.
+ * @param fmt printf-style format string
+ */
+void setStatus(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&JOB_LOCK);
+    vsnprintf(STATUS_MSG, sizeof(STATUS_MSG), fmt, args);
+    pthread_mutex_unlock(&JOB_LOCK);
+    va_end(args);
+}
+
+/**
+ * Clears the footer message.
+ * @return 1 if there was a message, so the footer needs drawing again, otherwise 0
+ */
+int clearStatus(void)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    int shown = STATUS_MSG[0] != '\0';
+    STATUS_MSG[0] = '\0';
+    pthread_mutex_unlock(&JOB_LOCK);
+    return shown;
+}
+
+/**
+ * Records progress on the active job.
+ * @param job Job being run
+ * @param bytes Bytes just processed
+ * @param files Files just completed
+ * @return 1 if the job has been cancelled and should stop, otherwise 0
+ */
+int addJobProgress(Job *job, long long bytes, int files)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    job->bytesDone += bytes;
+    job->filesDone += files;
+    int cancelled = JOB_CANCEL;
+    pthread_mutex_unlock(&JOB_LOCK);
+    return cancelled;
+}
+
+/**
+ * Records a failed operation on the active job. Only the first error's message is kept.
+ * @param job Job being run
+ * @param name Name of the entry that failed
+ * @param err errno describing the failure
+ */
+void addJobError(Job *job, const char *name, int err)
+{
+    if (err == ECANCELED) return;
+    pthread_mutex_lock(&JOB_LOCK);
+    if (job->errors++ == 0)
+        snprintf(job->error, sizeof(job->error), "%s: %s", name, strerror(err));
+    pthread_mutex_unlock(&JOB_LOCK);
+}
+
+/**
+ * Adds the size and file count of an entry (recursively for directories) to a job's totals, so
+ * that progress and ETA can be shown.
+ * @param job Job being sized
+ * @param dirFd Directory the entry lives in
+ * @param name Name of the entry
+ */
+void scanJobTotals(Job *job, int dirFd, const char *name)
+{
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesTotal++;
+    if (S_ISREG(st.st_mode)) job->bytesTotal += st.st_size;
+    int cancelled = JOB_CANCEL;
+    pthread_mutex_unlock(&JOB_LOCK);
+    if (cancelled || !S_ISDIR(st.st_mode)) return;
+
+    int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir)
+    {
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            scanJobTotals(job, dirfd(dir), entry->d_name);
+    closedir(dir);
+}
+
+/**
+ * Copies the contents of one open file to another. copy_file_range lets the kernel (or the
+ * filesystem itself) copy without the data passing through user space, sendfile is tried next,
+ * and a read/write loop with a large buffer is the last resort.
+ * @param job Job being run (for progress and cancellation)
+ * @param in Source file
+ * @param out Destination file
+ * @return 0 on success, otherwise -1 with errno set
+ */
+int copyFileData(Job *job, int in, int out)
+{
+    char *buffer = NULL;
+    int method = 0;
+    long long copied = 0;
+
+    for (;;)
+    {
+        ssize_t n = -1;
+        if (method == 0)
+        {
+#ifdef SYS_copy_file_range
+            n = syscall(SYS_copy_file_range, in, NULL, out, NULL, COPY_CHUNK_SIZE, 0);
+            // Some pseudo-filesystems report 0 bytes, so an empty first result is double-checked
+            if ((n < 0 && errno != EINTR && errno != EIO && errno != ENOSPC) || (n == 0 && copied == 0))
+            {
+                method = n == 0 ? 2 : 1;
+                continue;
+            }
+#else
+            method = 1;
+            continue;
+#endif
+        }
+        else if (method == 1)
+        {
+            n = sendfile(out, in, NULL, COPY_CHUNK_SIZE);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                method = 2;
+                continue;
+            }
+        }
+        else
+        {
+            if (!buffer && !(buffer = malloc(COPY_BUFFER_SIZE))) return -1;
+            n = read(in, buffer, COPY_BUFFER_SIZE);
+            for (ssize_t written = 0; n > 0 && written < n; )
+            {
+                ssize_t w = write(out, buffer + written, n - written);
+                if (w < 0 && errno != EINTR)
+                {
+                    free(buffer);
+                    return -1;
+                }
+                if (w > 0) written += w;
+            }
+        }
+
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) break;
+
+        copied += n;
+        if (addJobProgress(job, n, 0))
+        {
+            free(buffer);
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Copies an entry (recursively for directories), keeping permissions and modification times.
+ * @param job Job being run
+ * @param srcFd Directory the source lives in
+ * @param name Name of the source
+ * @param dstFd Directory to copy into
+ * @param dstName Name to give the copy
+ * @return 0 on success, otherwise -1
+ */
+int copyEntry(Job *job, int srcFd, const char *name, int dstFd, const char *dstName)
+{
+    struct stat st;
+    if (fstatat(srcFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        addJobError(job, name, errno);
+        return -1;
+    }
+
+    // Never descend into the copy being created (e.g. pasting a directory inside itself)
+    if (S_ISDIR(st.st_mode) && st.st_dev == job->skipDev && st.st_ino == job->skipIno)
+        return 0;
+
+    int result = 0;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+    if (S_ISDIR(st.st_mode))
+    {
+        if (mkdirat(dstFd, dstName, (st.st_mode & 07777) | S_IRWXU) != 0)
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+
+        int inFd = openat(srcFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int outFd = openat(dstFd, dstName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = inFd >= 0 ? fdopendir(inFd) : NULL;
+        if (!dir || outFd < 0)
+        {
+            addJobError(job, name, errno);
+            if (dir) closedir(dir);
+            else if (inFd >= 0) close(inFd);
+            if (outFd >= 0) close(outFd);
+            return -1;
+        }
+
+        if (job->skipIno == 0)
+        {
+            struct stat created;
+            if (fstat(outFd, &created) == 0)
+            {
+                job->skipDev = created.st_dev;
+                job->skipIno = created.st_ino;
+            }
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (copyEntry(job, dirfd(dir), entry->d_name, outFd, entry->d_name) != 0) result = -1;
+            if (addJobProgress(job, 0, 0)) break;
+        }
+        closedir(dir);
+
+        fchmod(outFd, st.st_mode & 07777);
+        futimens(outFd, times);
+        close(outFd);
+    }
+    else if (S_ISLNK(st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(srcFd, name, target, sizeof(target) - 1);
+        if (len < 0 || (target[len] = '\0', symlinkat(target, dstFd, dstName) != 0))
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+        utimensat(dstFd, dstName, times, AT_SYMLINK_NOFOLLOW);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        int in = openat(srcFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0)
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+
+        int out = openat(dstFd, dstName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (st.st_mode & 07777) | S_IWUSR);
+        if (out < 0)
+        {
+            addJobError(job, name, errno);
+            close(in);
+            return -1;
+        }
+
+        if (copyFileData(job, in, out) != 0)
+        {
+            // Don't leave half-written files behind
+            addJobError(job, name, errno);
+            close(out);
+            unlinkat(dstFd, dstName, 0);
+            close(in);
+            return -1;
+        }
+
+        fchmod(out, st.st_mode & 07777);
+        futimens(out, times);
+        close(out);
+        close(in);
+    }
+    else if (S_ISFIFO(st.st_mode))
+    {
+        if (mkfifoat(dstFd, dstName, st.st_mode & 07777) != 0)
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+    }
+    else
+    {
+        addJobError(job, name, ENOTSUP);
+        return -1;
+    }
+
+    addJobProgress(job, 0, 1);
+    return result;
+}
+
+/**
+ * Deletes an entry (recursively for directories).
+ * @param job Job being run
+ * @param dirFd Directory the entry lives in
+ * @param name Name of the entry
+ * @return 0 on success, otherwise -1
+ */
+int deleteEntry(Job *job, int dirFd, const char *name)
+{
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        addJobError(job, name, errno);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+
+        // Names are gathered first so entries are not removed from under readdir
+        int readFd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = readFd >= 0 ? fdopendir(readFd) : NULL;
+        DirListing children = { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL };
+        int result = dir ? 0 : -1;
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (children.count == children.capacity)
+            {
+                int capacity = children.capacity ? children.capacity * 2 : 64;
+                DirEntry *entries = realloc(children.entries, capacity * sizeof(DirEntry));
+                if (!entries) break;
+                children.entries = entries;
+                children.capacity = capacity;
+            }
+            children.entries[children.count].name = storeName(&children, entry->d_name, strlen(entry->d_name));
+            if (children.entries[children.count].name) children.count++;
+        }
+        if (dir) closedir(dir);
+        else if (readFd >= 0) close(readFd);
+
+        for (int i = 0; i < children.count && result == 0; i++)
+        {
+            if (deleteEntry(job, fd, children.entries[i].name) != 0) result = -1;
+            if (addJobProgress(job, 0, 0)) result = -1;
+        }
+        freeDirListing(&children);
+        close(fd);
+
+        if (result != 0) return -1;
+        if (unlinkat(dirFd, name, AT_REMOVEDIR) != 0)
+        {
+            addJobError(job, name, errno);
+            return -1;
+        }
+    }
+    else if (unlinkat(dirFd, name, 0) != 0)
+    {
+        addJobError(job, name, errno);
+        return -1;
+    }
+
+    addJobProgress(job, S_ISREG(st.st_mode) ? st.st_size : 0, 1);
+    return 0;
+}
+
+/**
+ * Picks a name for a copy that does not clash with anything in the destination directory,
+ * e.g. "notes.txt (copy)" when pasting into the directory the file came from.
+ * @param dstFd Destination directory
+ * @param name Original name
+ * @param buffer Output buffer for the chosen name
+ * @param size Size of output buffer
+ */
+void makeCopyName(int dstFd, const char *name, char *buffer, size_t size)
+{
+    struct stat st;
+    snprintf(buffer, size, "%s", name);
+    for (int i = 1; i < 1000 && fstatat(dstFd, buffer, &st, AT_SYMLINK_NOFOLLOW) == 0; i++)
+    {
+        if (i == 1) snprintf(buffer, size, "%s (copy)", name);
+        else snprintf(buffer, size, "%s (copy %d)", name, i);
+    }
+}
+
+/**
+ * Builds the slice-by-8 lookup tables for a reflected CRC-32 polynomial. Table k gives the effect
+ * of a byte followed by k zero bytes, so eight bytes can be folded in with eight lookups.
+ * @param table Tables to fill
+ * @param poly Reflected polynomial
+ */
+void buildCrcTables(unsigned int table[8][256], unsigned int poly)
+{
+    for (int n = 0; n < 256; n++)
+    {
+        unsigned int crc = n;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][n] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int n = 0; n < 256; n++)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+}
+
+/**
+ * Updates a CRC-32 using slice-by-8 tables.
+ * @param table Tables for the polynomial (see buildCrcTables)
+ * @param crc CRC register so far
+ * @param data Bytes to add
+ * @param len Number of bytes
+ * @return Updated CRC register
+ */
+unsigned int updateCrc(unsigned int table[8][256], unsigned int crc, const unsigned char *data, size_t len)
+{
+    while (len >= 8)
+    {
+        unsigned int low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (unsigned int)data[3] << 24);
+        unsigned int high = data[4] | data[5] << 8 | data[6] << 16 | (unsigned int)data[7] << 24;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+            table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#ifdef HASH_X86
+/**
+ * Updates a CRC-32C with the SSE4.2 crc32 instruction, which computes exactly this polynomial.
+ * @param crc CRC register so far
+ * @param data Bytes to add
+ * @param len Number of bytes
+ * @return Updated CRC register
+ */
+__attribute__((target("sse4.2")))
+unsigned int updateCrc32cHw(unsigned int crc, const unsigned char *data, size_t len)
+{
+#ifdef __x86_64__
+    unsigned long long wide = crc;
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (unsigned int)wide;
+#endif
+    for (; len >= 4; data += 4, len -= 4)
+    {
+        unsigned int word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+/**
+ * @param value Value to rotate
+ * @param bits Number of bits to rotate left by
+ * @return Rotated value
+ */
+unsigned long long rotateLeft64(unsigned long long value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * @param data Bytes to read (at least eight)
+ * @return The bytes as a little-endian 64-bit value
+ */
+unsigned long long readLittle64(const unsigned char *data)
+{
+    unsigned long long value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | data[i];
+    return value;
+}
+
+/**
+ * One xxHash64 round, mixing eight bytes of input into an accumulator.
+ * @param acc Accumulator
+ * @param input Input lane
+ * @return New accumulator
+ */
+unsigned long long xxh64Round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * XXH_PRIME64_2;
+    return rotateLeft64(acc, 31) * XXH_PRIME64_1;
+}
+
+/**
+ * Adds bytes to an xxHash64. Whole 32-byte stripes are mixed into the four lanes straight from
+ * the input; only the tail is copied aside for the next call.
+ * @param state Hash state
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+void updateXxh64(HashState *state, const unsigned char *data, size_t len)
+{
+    state->xxhTotal += len;
+    if (state->xxhBuffered + len < 32)
+    {
+        memcpy(state->xxhBuffer + state->xxhBuffered, data, len);
+        state->xxhBuffered += len;
+        return;
+    }
+
+    if (state->xxhBuffered)
+    {
+        size_t fill = 32 - state->xxhBuffered;
+        memcpy(state->xxhBuffer + state->xxhBuffered, data, fill);
+        for (int lane = 0; lane < 4; lane++)
+            state->xxhLanes[lane] = xxh64Round(state->xxhLanes[lane], readLittle64(state->xxhBuffer + lane * 8));
+        data += fill;
+        len -= fill;
+        state->xxhBuffered = 0;
+    }
+
+    unsigned long long v1 = state->xxhLanes[0], v2 = state->xxhLanes[1], v3 = state->xxhLanes[2], v4 = state->xxhLanes[3];
+    for (; len >= 32; data += 32, len -= 32)
+    {
+        v1 = xxh64Round(v1, readLittle64(data));
+        v2 = xxh64Round(v2, readLittle64(data + 8));
+        v3 = xxh64Round(v3, readLittle64(data + 16));
+        v4 = xxh64Round(v4, readLittle64(data + 24));
+    }
+    state->xxhLanes[0] = v1;
+    state->xxhLanes[1] = v2;
+    state->xxhLanes[2] = v3;
+    state->xxhLanes[3] = v4;
+
+    memcpy(state->xxhBuffer, data, len);
+    state->xxhBuffered = len;
+}
+
+/**
+ * @param state Hash state
+ * @return Final xxHash64 (seed 0)
+ */
+unsigned long long finishXxh64(HashState *state)
+{
+    unsigned long long hash;
+    if (state->xxhTotal >= 32)
+    {
+        unsigned long long *lanes = state->xxhLanes;
+        hash = rotateLeft64(lanes[0], 1) + rotateLeft64(lanes[1], 7) + rotateLeft64(lanes[2], 12) + rotateLeft64(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            hash ^= xxh64Round(0, lanes[lane]);
+            hash = hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+        }
+    }
+    else
+        hash = XXH_PRIME64_5;
+    hash += state->xxhTotal;
+
+    const unsigned char *tail = state->xxhBuffer;
+    size_t len = state->xxhBuffered;
+    for (; len >= 8; tail += 8, len -= 8)
+    {
+        hash ^= xxh64Round(0, readLittle64(tail));
+        hash = rotateLeft64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= 4)
+    {
+        hash ^= (unsigned long long)(tail[0] | tail[1] << 8 | tail[2] << 16 | (unsigned int)tail[3] << 24) * XXH_PRIME64_1;
+        hash = rotateLeft64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        tail += 4;
+        len -= 4;
+    }
+    while (len--)
+    {
+        hash ^= *tail++ * XXH_PRIME64_5;
+        hash = rotateLeft64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Runs the SHA-256 compression function over whole 64-byte blocks.
+ * @param state Hash words
+ * @param data Blocks to compress
+ * @param blocks Number of blocks
+ */
+void compressSha256(unsigned int state[8], const unsigned char *data, size_t blocks)
+{
+    for (; blocks; blocks--, data += 64)
+    {
+        unsigned int w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (unsigned int)data[i * 4] << 24 | data[i * 4 + 1] << 16 | data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            unsigned int s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            unsigned int s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+        unsigned int e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            unsigned int t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            unsigned int t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef HASH_X86
+/**
+ * Runs the SHA-256 compression function with the SHA extensions, four rounds per pair of
+ * sha256rnds2 instructions, with the message schedule computed four words at a time.
+ * @param state Hash words
+ * @param data Blocks to compress
+ * @param blocks Number of blocks
+ */
+__attribute__((target("sha,sse4.1")))
+void compressSha256Hw(unsigned int state[8], const unsigned char *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; blocks; blocks--, data += 64)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), byteSwap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), byteSwap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), byteSwap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), byteSwap);
+
+        for (int i = 0; i < 16; i++)
+        {
+            __m128i msg = _mm_add_epi32(w0, _mm_loadu_si128((const __m128i *)&SHA256_K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+
+            __m128i next = w0;
+            if (i < 12)
+                next = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3);
+            w0 = w1;
+            w1 = w2;
+            w2 = w3;
+            w3 = next;
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+/**
+ * Adds bytes to a SHA-256. Whole blocks are compressed straight from the input.
+ * @param state Hash state
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+void updateSha256(HashState *state, const unsigned char *data, size_t len)
+{
+    state->shaTotal += len;
+    if (state->shaBuffered)
+    {
+        size_t fill = 64 - state->shaBuffered;
+        if (fill > len) fill = len;
+        memcpy(state->shaBuffer + state->shaBuffered, data, fill);
+        state->shaBuffered += fill;
+        data += fill;
+        len -= fill;
+        if (state->shaBuffered < 64) return;
+        state->compress(state->sha, state->shaBuffer, 1);
+        state->shaBuffered = 0;
+    }
+
+    if (len >= 64)
+    {
+        state->compress(state->sha, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(state->shaBuffer, data, len);
+    state->shaBuffered = len;
+}
+
+/**
+ * Pads and finishes a SHA-256.
+ * @param state Hash state
+ * @param digest Where to put the 32-byte digest
+ */
+void finishSha256(HashState *state, unsigned char digest[32])
+{
+    unsigned long long bits = state->shaTotal * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padLen = (state->shaBuffered < 56 ? 56 : 120) - state->shaBuffered;
+    for (int i = 0; i < 8; i++) pad[padLen + i] = (unsigned char)(bits >> (56 - i * 8));
+    updateSha256(state, pad, padLen + 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = state->sha[i] >> 24;
+        digest[i * 4 + 1] = state->sha[i] >> 16;
+        digest[i * 4 + 2] = state->sha[i] >> 8;
+        digest[i * 4 + 3] = state->sha[i];
+    }
+}
+
+/**
+ * Prepares to compute every checksum at once, picking the fastest kernels the CPU supports.
+ * @param state Hash state to initialise
+ */
+void initHashes(HashState *state)
+{
+    static const unsigned int shaInit[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    if (!CRC_TABLES_BUILT)
+    {
+        buildCrcTables(CRC32_TABLE, 0xedb88320);
+        buildCrcTables(CRC32C_TABLE, 0x82f63b78);
+        CRC_TABLES_BUILT = 1;
+    }
+
+    memset(state, 0, sizeof(HashState));
+    state->crc32 = state->crc32c = 0xffffffff;
+    state->xxhLanes[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->xxhLanes[1] = XXH_PRIME64_2;
+    state->xxhLanes[3] = -XXH_PRIME64_1;
+    memcpy(state->sha, shaInit, sizeof(shaInit));
+    state->compress = compressSha256;
+
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    state->crc32cHw = __builtin_cpu_supports("sse4.2");
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        state->compress = compressSha256Hw;
+#endif
+}
+
+/**
+ * Adds a chunk of data to every checksum.
+ * @param state Hash state
+ * @param data Bytes to add
+ * @param len Number of bytes
+ */
+void updateHashes(HashState *state, const unsigned char *data, size_t len)
+{
+    state->crc32 = updateCrc(CRC32_TABLE, state->crc32, data, len);
+#ifdef HASH_X86
+    if (state->crc32cHw)
+        state->crc32c = updateCrc32cHw(state->crc32c, data, len);
+    else
+#endif
+        state->crc32c = updateCrc(CRC32C_TABLE, state->crc32c, data, len);
+    updateXxh64(state, data, len);
+    updateSha256(state, data, len);
+}
+
+/**
+ * Finishes every checksum.
+ * @param state Hash state
+ * @param result Where to put the checksums
+ */
+void finishHashes(HashState *state, HashResult *result)
+{
+    result->crc32 = ~state->crc32;
+    result->crc32c = ~state->crc32c;
+    result->xxh64 = finishXxh64(state);
+    finishSha256(state, result->sha256);
+}
+
+/**
+ * Looks up the checksums of a file, if they have been computed since it last changed.
+ * @param st File's metadata
+ * @param result Where to copy the checksums
+ * @return 1 if they were found, otherwise 0
+ */
+int findHashResult(const struct stat *st, HashResult *result)
+{
+    int found = 0;
+    pthread_mutex_lock(&JOB_LOCK);
+    for (int i = 0; i < HASH_CACHE_SLOTS; i++)
+    {
+        HashResult *slot = &HASH_CACHE[i];
+        if (slot->used && slot->dev == st->st_dev && slot->ino == st->st_ino && slot->size == st->st_size &&
+            slot->mtime.tv_sec == st->st_mtim.tv_sec && slot->mtime.tv_nsec == st->st_mtim.tv_nsec)
+        {
+            slot->used = ++HASH_CLOCK;
+            *result = *slot;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&JOB_LOCK);
+    return found;
+}
+
+/**
+ * Remembers the checksums of a file, in place of the least recently used ones.
+ * @param st File's metadata when it was read
+ * @param result Checksums
+ */
+void storeHashResult(const struct stat *st, HashResult *result)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    HashResult *slot = &HASH_CACHE[0];
+    for (int i = 1; i < HASH_CACHE_SLOTS; i++)
+        if (HASH_CACHE[i].used < slot->used) slot = &HASH_CACHE[i];
+
+    *slot = *result;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim;
+    slot->used = ++HASH_CLOCK;
+    pthread_mutex_unlock(&JOB_LOCK);
+}
+
+/**
+ * Computes every checksum of a file in a single pass, reading it in large aligned chunks. The
+ * result is only kept if the file did not change while it was read.
+ * @param job Job being run (for progress and cancellation)
+ * @param dirFd Directory the file lives in
+ * @param name Name of the file (symbolic links are followed)
+ */
+void hashFile(Job *job, int dirFd, const char *name)
+{
+    int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+    struct stat before, after;
+    void *buffer = NULL;
+    if (fd < 0 || fstat(fd, &before) != 0 || posix_memalign(&buffer, 4096, COPY_BUFFER_SIZE) != 0)
+    {
+        addJobError(job, name, errno);
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesTotal = 1;
+    job->bytesTotal = before.st_size;
+    pthread_mutex_unlock(&JOB_LOCK);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    HashState state;
+    initHashes(&state);
+    ssize_t n;
+    int cancelled = 0;
+    while (!cancelled && (n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0)
+    {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0)
+        {
+            addJobError(job, name, errno);
+            break;
+        }
+        updateHashes(&state, buffer, n);
+        cancelled = addJobProgress(job, n, 0);
+    }
+
+    if (!cancelled && !job->errors)
+    {
+        HashResult result;
+        finishHashes(&state, &result);
+        if (fstat(fd, &after) == 0 && after.st_size == before.st_size && after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec)
+        {
+            storeHashResult(&before, &result);
+            addJobProgress(job, 0, 1);
+        }
+        else
+            addJobError(job, name, EAGAIN);
+    }
+
+    free(buffer);
+    close(fd);
+}
+
+/**
+ * @return How many worker threads to use for work split across CPUs
+ */
+int getWorkerCount(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > WORKER_MAX ? WORKER_MAX : (int)cpus;
+}
+
+/**
+ * Frees a set of duplicate files and the paths they hold.
+ * @param files Files to free
+ * @param count Number of files
+ */
+void freeDupeFiles(DupeFile *files, int count)
+{
+    for (int i = 0; i < count; i++) free(files[i].path);
+    free(files);
+}
+
+/**
+ * Frees the results of the last duplicate search. JOB_LOCK must be held.
+ */
+void clearDuplicates(void)
+{
+    freeDupeFiles(DUPLICATES.files, DUPLICATES.fileCount);
+    free(DUPLICATES.groups);
+    free(DUPLICATES.root);
+    memset(&DUPLICATES, 0, sizeof(DupeResults));
+}
+
+/**
+ * Gathers every non-empty regular file below a directory as a duplicate candidate. Symbolic links
+ * are not followed, and directories that cannot be read are skipped.
+ * @param job Job being run
+ * @param dirFd Directory to walk (consumed)
+ * @param path Path of the directory relative to the job's directory, in a PATH_MAX buffer
+ * @param pathLen Length of path
+ * @param files Candidates found so far (by reference)
+ * @param count Number of candidates (by reference)
+ * @param capacity Capacity of files (by reference)
+ * @return 1 on success, 0 if cancelled or out of memory
+ */
+int collectDupeFiles(Job *job, int dirFd, char *path, size_t pathLen, DupeFile **files, int *count, int *capacity)
+{
+    DIR *dir = fdopendir(dirFd);
+    if (!dir)
+    {
+        close(dirFd);
+        return 1;
+    }
+
+    int ok = 1;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)))
+    {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_DIR && ent->d_type != DT_REG) continue;
+
+        size_t nameLen = strlen(name);
+        struct stat st;
+        if (pathLen + nameLen + 2 > PATH_MAX || fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+        size_t len = pathLen;
+        if (len) path[len++] = '/';
+        memcpy(path + len, name, nameLen + 1);
+        len += nameLen;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            int fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) ok = collectDupeFiles(job, fd, path, len, files, count, capacity);
+        }
+        else if (S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            if (*count == *capacity)
+            {
+                int grown = *capacity ? *capacity * 2 : 256;
+                DupeFile *resized = realloc(*files, grown * sizeof(DupeFile));
+                if (!resized) ok = 0;
+                else
+                {
+                    *files = resized;
+                    *capacity = grown;
+                }
+            }
+            char *copy = ok ? strdup(path) : NULL;
+            if (copy)
+            {
+                DupeFile *file = &(*files)[(*count)++];
+                memset(file, 0, sizeof(DupeFile));
+                file->path = copy;
+                file->size = st.st_size;
+                file->dev = st.st_dev;
+                file->ino = st.st_ino;
+                file->mtime = st.st_mtim;
+            }
+            // Files found are counted as the total still to go through, like a copy's first pass
+            pthread_mutex_lock(&JOB_LOCK);
+            job->filesTotal++;
+            ok = copy && !JOB_CANCEL;
+            pthread_mutex_unlock(&JOB_LOCK);
+        }
+        path[pathLen] = '\0';
+    }
+    closedir(dir);
+    return ok;
+}
+
+/**
+ * Orders duplicate candidates by inode, so hard links to the same file end up together.
+ */
+int compareDupeInodes(const void *a, const void *b)
+{
+    const DupeFile *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/**
+ * Orders duplicate candidates by size (largest first), then by their hashes and set, then by path.
+ */
+int compareDupeKeys(const void *a, const void *b)
+{
+    const DupeFile *x = a, *y = b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    if (x->partial != y->partial) return x->partial < y->partial ? -1 : 1;
+    if (x->full != y->full) return x->full < y->full ? -1 : 1;
+    if (x->set != y->set) return x->set - y->set;
+    return strcmp(x->path, y->path);
+}
+
+/**
+ * Sorts duplicate candidates and drops every one that shares its size, hashes and set with no other.
+ * Candidates that could not be read (size -1) are dropped too.
+ * @param files Candidates
+ * @param count Number of candidates
+ * @return Number of candidates kept
+ */
+int keepDupeRuns(DupeFile *files, int count)
+{
+    qsort(files, count, sizeof(DupeFile), compareDupeKeys);
+
+    int kept = 0;
+    for (int i = 0; i < count;)
+    {
+        int end = i + 1;
+        while (end < count && files[end].size == files[i].size && files[end].partial == files[i].partial && files[end].full == files[i].full &&
+            files[end].set == files[i].set)
+            end++;
+
+        for (int j = i; j < end; j++)
+        {
+            if (end - i > 1 && files[j].size >= 0) files[kept++] = files[j];
+            else free(files[j].path);
+        }
+        i = end;
+    }
+    return kept;
+}
+
+/**
+ * @param file Duplicate candidate or result
+ * @param st Current metadata of the file at its path
+ * @return Whether the file is still the one that was found, unchanged since
+ */
+int isSameDupeFile(const DupeFile *file, const struct stat *st)
+{
+    return S_ISREG(st->st_mode) && st->st_dev == file->dev && st->st_ino == file->ino && st->st_size == file->size &&
+        st->st_mtim.tv_sec == file->mtime.tv_sec && st->st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+/**
+ * Hashes one duplicate candidate for a stage: either just its first and last blocks, or all of it.
+ * Files of up to two blocks are wholly covered by the first stage, so they are not read again.
+ * A file that cannot be read, or has changed since it was found, gets a size of -1.
+ * @param stage Stage being run
+ * @param file Candidate to hash
+ * @param buffer Buffer of COPY_BUFFER_SIZE bytes
+ */
+void hashDupeFile(DupeStage *stage, DupeFile *file, unsigned char *buffer)
+{
+    if (stage->whole && file->size <= DUPE_BLOCK_SIZE * 2)
+    {
+        file->full = file->partial;
+        addJobProgress(stage->job, 0, 1);
+        return;
+    }
+
+    int fd = openat(stage->job->srcFd, file->path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !isSameDupeFile(file, &st))
+    {
+        if (fd >= 0) close(fd);
+        file->size = -1;
+        return;
+    }
+
+    HashState state = stage->seed;
+    long long total = 0;
+    if (!stage->whole)
+    {
+        // Same-sized copies of different files almost always differ near one end or the other
+        size_t head = file->size < DUPE_BLOCK_SIZE ? file->size : DUPE_BLOCK_SIZE;
+        off_t tailAt = file->size - DUPE_BLOCK_SIZE > DUPE_BLOCK_SIZE ? file->size - DUPE_BLOCK_SIZE : DUPE_BLOCK_SIZE;
+        size_t tail = file->size > DUPE_BLOCK_SIZE ? file->size - tailAt : 0;
+        if (pread(fd, buffer, head, 0) == (ssize_t)head && (!tail || pread(fd, buffer + head, tail, tailAt) == (ssize_t)tail))
+        {
+            updateXxh64(&state, buffer, head + tail);
+            total = head + tail;
+        }
+        addJobProgress(stage->job, total, 1);
+    }
+    else
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ssize_t n;
+        while ((n = read(fd, buffer, COPY_BUFFER_SIZE)) != 0)
+        {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 || addJobProgress(stage->job, n, 0)) break;
+            updateXxh64(&state, buffer, n);
+            total += n;
+        }
+        addJobProgress(stage->job, 0, 1);
+    }
+    close(fd);
+
+    if (total != (stage->whole ? file->size : (long long)(file->size < DUPE_BLOCK_SIZE * 2 ? file->size : DUPE_BLOCK_SIZE * 2)))
+        file->size = -1;
+    else if (stage->whole)
+        file->full = finishXxh64(&state);
+    else
+        file->partial = finishXxh64(&state);
+}
+
+/**
+ * Duplicate stage thread. Takes candidates one at a time until there are none left.
+ * @param arg Stage being run
+ */
+void *dupeStageThread(void *arg)
+{
+    DupeStage *stage = arg;
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, 4096, COPY_BUFFER_SIZE) != 0) buffer = NULL;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&stage->lock);
+        int i = stage->next++;
+        pthread_mutex_unlock(&stage->lock);
+        if (i >= stage->count || addJobProgress(stage->job, 0, 0)) break;
+
+        if (buffer) hashDupeFile(stage, &stage->files[i], buffer);
+        else stage->files[i].size = -1;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Hashes a set of duplicate candidates, split across one thread per CPU (the job thread being one
+ * of them).
+ * @param job Job being run
+ * @param files Candidates to hash
+ * @param count Number of candidates
+ * @param whole 1 to hash whole files, 0 for just their first and last blocks
+ */
+void runDupeStage(Job *job, DupeFile *files, int count, int whole)
+{
+    DupeStage stage;
+    stage.job = job;
+    stage.files = files;
+    stage.count = count;
+    stage.next = 0;
+    stage.whole = whole;
+    initHashes(&stage.seed);
+    pthread_mutex_init(&stage.lock, NULL);
+
+    long long bytes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!whole) bytes += files[i].size < DUPE_BLOCK_SIZE * 2 ? files[i].size : DUPE_BLOCK_SIZE * 2;
+        else if (files[i].size > DUPE_BLOCK_SIZE * 2) bytes += files[i].size;
+    }
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesDone = job->bytesDone = 0;
+    job->filesTotal = count;
+    job->bytesTotal = bytes;
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    pthread_t threads[WORKER_MAX];
+    int started = 0;
+    int wanted = getWorkerCount() - 1;
+    while (started < wanted && started < count - 1 && pthread_create(&threads[started], NULL, dupeStageThread, &stage) == 0)
+        started++;
+    dupeStageThread(&stage);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&stage.lock);
+}
+
+/**
+ * Orders duplicate groups by how much space removing all but one copy would free, most first.
+ */
+int compareDupeGroups(const void *a, const void *b)
+{
+    const DupeGroup *x = a, *y = b;
+    if (x->reclaimable != y->reclaimable) return x->reclaimable > y->reclaimable ? -1 : 1;
+    return x->first - y->first;
+}
+
+/**
+ * Groups files already sorted so that identical ones are next to each other, ordering the groups
+ * by the space they waste.
+ * @param results Results holding the files; groups and totals are filled in
+ * @return 1 on success, 0 if out of memory
+ */
+int groupDuplicates(DupeResults *results)
+{
+    free(results->groups);
+    results->groups = malloc((results->fileCount / 2 + 1) * sizeof(DupeGroup));
+    DupeFile *ordered = malloc((results->fileCount + 1) * sizeof(DupeFile));
+    if (!results->groups || !ordered)
+    {
+        free(ordered);
+        return 0;
+    }
+
+    results->groupCount = 0;
+    results->reclaimable = 0;
+    for (int i = 0; i < results->fileCount;)
+    {
+        int end = i + 1;
+        while (end < results->fileCount && results->files[end].size == results->files[i].size && results->files[end].full == results->files[i].full &&
+            results->files[end].set == results->files[i].set)
+            end++;
+        DupeGroup *group = &results->groups[results->groupCount++];
+        group->first = i;
+        group->count = end - i;
+        group->reclaimable = (long long)results->files[i].size * (end - i - 1);
+        results->reclaimable += group->reclaimable;
+        i = end;
+    }
+    qsort(results->groups, results->groupCount, sizeof(DupeGroup), compareDupeGroups);
+
+    int at = 0;
+    for (int g = 0; g < results->groupCount; g++)
+    {
+        DupeGroup *group = &results->groups[g];
+        memcpy(ordered + at, results->files + group->first, group->count * sizeof(DupeFile));
+        group->first = at;
+        at += group->count;
+    }
+    free(results->files);
+    results->files = ordered;
+    return 1;
+}
+
+/**
+ * Compares the contents of two files byte for byte, stopping at the first difference. Each file is
+ * only ever compared with the other, so there is nothing to gain from hashing them.
+ * @param job Job being run
+ * @param leftFd Directory holding the first file
+ * @param leftName Name of the first file
+ * @param rightFd Directory holding the second file
+ * @param rightName Name of the second file
+ * @param buffers Two buffers of COPY_BUFFER_SIZE bytes, one after the other
+ * @param check Filled in with the size and modification times compared and whether they differ
+ * @return 1 if the files were compared, 0 if they could not be read or the job was cancelled
+ */
+int compareFileContents(Job *job, int leftFd, const char *leftName, int rightFd, const char *rightName, unsigned char *buffers, ContentCheck *check)
+{
+    int left = openat(leftFd, leftName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int right = left >= 0 ? openat(rightFd, rightName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    struct stat leftSt, rightSt;
+    if (left < 0 || right < 0 || fstat(left, &leftSt) != 0 || fstat(right, &rightSt) != 0)
+    {
+        addJobError(job, left < 0 ? leftName : rightName, errno);
+        if (left >= 0) close(left);
+        if (right >= 0) close(right);
+        return 0;
+    }
+
+    check->size = leftSt.st_size;
+    check->leftMtime = leftSt.st_mtime;
+    check->rightMtime = rightSt.st_mtime;
+    check->differs = leftSt.st_size != rightSt.st_size;
+    posix_fadvise(left, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(right, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int ok = 1;
+    off_t pos = 0;
+    while (ok && !check->differs && pos < leftSt.st_size)
+    {
+        ssize_t n = pread(left, buffers, COPY_BUFFER_SIZE, pos);
+        ssize_t m = n > 0 ? pread(right, buffers + COPY_BUFFER_SIZE, n, pos) : n;
+        if ((n < 0 || m < 0) && errno == EINTR) continue;
+        if (n < 0 || m < 0)
+        {
+            addJobError(job, leftName, errno);
+            ok = 0;
+        }
+        else if (n == 0 || m != n || memcmp(buffers, buffers + COPY_BUFFER_SIZE, n) != 0)
+            check->differs = 1;
+        else
+        {
+            pos += n;
+            ok = !addJobProgress(job, 2 * n, 0);
+        }
+    }
+
+    close(left);
+    close(right);
+    return ok;
+}
+
+/**
+ * @param a First duplicate candidate
+ * @param b Second duplicate candidate
+ * @return Whether both have the same size and hashes, having been through every hashing stage
+ */
+int isSameDupeRun(const DupeFile *a, const DupeFile *b)
+{
+    return a->size == b->size && a->partial == b->partial && a->full == b->full;
+}
+
+/**
+ * Splits runs of duplicate candidates sharing a size and whole-file hash into sets of files that
+ * are byte for byte the same, so a hash collision can never offer to remove a file that differs.
+ * Each unplaced file of a run starts a set, which every later unplaced file matching it joins;
+ * files that differ from all others are left alone in a set, to be dropped by keepDupeRuns.
+ * @param job Job being run
+ * @param files Candidates sorted by keepDupeRuns
+ * @param count Number of candidates
+ */
+void verifyDupeRuns(Job *job, DupeFile *files, int count)
+{
+    unsigned char *buffers = malloc(COPY_BUFFER_SIZE * 2);
+    long long bytes = 0;
+    for (int i = 1; i < count; i++)
+        if (isSameDupeRun(&files[i], &files[i - 1])) bytes += files[i].size * 2;
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesDone = job->bytesDone = 0;
+    job->filesTotal = count;
+    job->bytesTotal = bytes;
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    for (int i = 0; i < count; i++) files[i].set = 0;
+    int sets = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].set) continue;
+        files[i].set = ++sets;
+        addJobProgress(job, 0, 1);
+        for (int j = i + 1; j < count && isSameDupeRun(&files[j], &files[i]); j++)
+        {
+            ContentCheck check;
+            if (files[j].set || !buffers || addJobProgress(job, 0, 0)) continue;
+            if (compareFileContents(job, job->srcFd, files[i].path, job->srcFd, files[j].path, buffers, &check) && !check.differs)
+            {
+                files[j].set = files[i].set;
+                addJobProgress(job, 0, 1);
+            }
+        }
+    }
+    free(buffers);
+}
+
+/**
+ * Finds duplicate files below the job's directory. Files are gathered and grouped by size, then
+ * by a hash of their first and last blocks, then by a hash of their whole contents, each stage
+ * only reading the files still sharing a group with another. Files left sharing a group are then
+ * compared byte for byte before they are reported. Hard links to a file already seen are
+ * left out, as removing them frees nothing. The results replace DUPLICATES.
+ * @param job Job being run; its first name is the path of its directory
+ */
+void findDuplicates(Job *job)
+{
+    DupeResults results = { NULL, NULL, 0, NULL, 0, 0 };
+    int capacity = 0;
+    char path[PATH_MAX] = "";
+    int fd = openat(job->srcFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || !collectDupeFiles(job, fd, path, 0, &results.files, &results.fileCount, &capacity))
+    {
+        if (fd < 0 || !addJobProgress(job, 0, 0)) addJobError(job, job->names[0], fd < 0 ? errno : ENOMEM);
+        freeDupeFiles(results.files, results.fileCount);
+        return;
+    }
+
+    int kept = 0;
+    qsort(results.files, results.fileCount, sizeof(DupeFile), compareDupeInodes);
+    for (int i = 0; i < results.fileCount; i++)
+    {
+        if (kept && results.files[kept - 1].dev == results.files[i].dev && results.files[kept - 1].ino == results.files[i].ino)
+            free(results.files[i].path);
+        else
+            results.files[kept++] = results.files[i];
+    }
+    results.fileCount = keepDupeRuns(results.files, kept);
+
+    runDupeStage(job, results.files, results.fileCount, 0);
+    if (!addJobProgress(job, 0, 0)) results.fileCount = keepDupeRuns(results.files, results.fileCount);
+    if (!addJobProgress(job, 0, 0)) runDupeStage(job, results.files, results.fileCount, 1);
+    if (!addJobProgress(job, 0, 0)) results.fileCount = keepDupeRuns(results.files, results.fileCount);
+    if (!addJobProgress(job, 0, 0)) verifyDupeRuns(job, results.files, results.fileCount);
+    if (!addJobProgress(job, 0, 0)) results.fileCount = keepDupeRuns(results.files, results.fileCount);
+
+    results.root = strdup(job->names[0]);
+    if (addJobProgress(job, 0, 0) || !results.root || !groupDuplicates(&results))
+    {
+        if (!addJobProgress(job, 0, 0)) addJobError(job, job->names[0], ENOMEM);
+        freeDupeFiles(results.files, results.fileCount);
+        free(results.groups);
+        free(results.root);
+        return;
+    }
+
+    pthread_mutex_lock(&JOB_LOCK);
+    clearDuplicates();
+    DUPLICATES = results;
+    pthread_mutex_unlock(&JOB_LOCK);
+}
+
+/**
+ * Frees the results of the last content comparison. JOB_LOCK must be held.
+ */
+void clearContentChecks(void)
+{
+    for (int i = 0; i < CONTENT_CHECKS.count; i++) free(CONTENT_CHECKS.checks[i].name);
+    free(CONTENT_CHECKS.checks);
+    memset(&CONTENT_CHECKS, 0, sizeof(ContentChecks));
+}
+
+/**
+ * Compares the contents of same-named files in two directories and publishes which differ into
+ * CONTENT_CHECKS, for the comparison view to tell apart files that match in size.
+ * @param job Job being run; srcFd is the left directory, dstFd the right one, and names are in
+ * name order
+ */
+void compareContents(Job *job)
+{
+    ContentChecks results = { 0, 0, 0, 0, NULL, 0, 0 };
+    struct stat leftDir, rightDir;
+    unsigned char *buffers = malloc(COPY_BUFFER_SIZE * 2);
+    results.checks = calloc(job->nameCount, sizeof(ContentCheck));
+    if (!buffers || !results.checks || fstat(job->srcFd, &leftDir) != 0 || fstat(job->dstFd, &rightDir) != 0)
+    {
+        addJobError(job, job->names[0], (buffers && results.checks) ? errno : ENOMEM);
+        free(buffers);
+        free(results.checks);
+        return;
+    }
+
+    long long total = 0;
+    for (int i = 0; i < job->nameCount; i++)
+    {
+        struct stat st;
+        if (fstatat(job->srcFd, job->names[i], &st, AT_SYMLINK_NOFOLLOW) == 0) total += st.st_size * 2;
+    }
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesTotal = job->nameCount;
+    job->bytesTotal = total;
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    // The names are taken over by the results, which stay in name order
+    for (int i = 0; i < job->nameCount && !addJobProgress(job, 0, 0); i++)
+    {
+        ContentCheck *check = &results.checks[results.count];
+        if (!compareFileContents(job, job->srcFd, job->names[i], job->dstFd, job->names[i], buffers, check)) continue;
+        check->name = job->names[i];
+        job->names[i] = NULL;
+        results.differing += check->differs;
+        results.count++;
+        addJobProgress(job, 0, 1);
+    }
+    free(buffers);
+
+    // Whatever was compared before a cancel is still right, so it is kept
+    results.leftDev = leftDir.st_dev;
+    results.leftIno = leftDir.st_ino;
+    results.rightDev = rightDir.st_dev;
+    results.rightIno = rightDir.st_ino;
+    pthread_mutex_lock(&JOB_LOCK);
+    clearContentChecks();
+    CONTENT_CHECKS = results;
+    pthread_mutex_unlock(&JOB_LOCK);
+}
+
+/**
+ * Checksums the job's one file.
+ * @param job Job being run
+ */
+void runHashJob(Job *job)
+{
+    hashFile(job, job->srcFd, job->names[0]);
+}
+
+/**
+ * Copies, moves or deletes the job's entries.
+ * @param job Job being run
+ */
+void runFileJob(Job *job)
+{
+    for (int i = 0; i < job->nameCount; i++)
+        scanJobTotals(job, job->srcFd, job->names[i]);
+
+    struct stat srcDir, dstDir;
+    int sameDir = job->type != JOB_DELETE && fstat(job->srcFd, &srcDir) == 0 && fstat(job->dstFd, &dstDir) == 0 &&
+        srcDir.st_dev == dstDir.st_dev && srcDir.st_ino == dstDir.st_ino;
+
+    for (int i = 0; i < job->nameCount && !addJobProgress(job, 0, 0); i++)
+    {
+        const char *name = job->names[i];
+        job->skipDev = 0;
+        job->skipIno = 0;
+
+        if (job->type == JOB_DELETE)
+            deleteEntry(job, job->srcFd, name);
+        else if (job->type == JOB_COPY)
+        {
+            char dstName[sizeof(((struct dirent *)0)->d_name) + 16];
+            makeCopyName(job->dstFd, name, dstName, sizeof(dstName));
+            copyEntry(job, job->srcFd, name, job->dstFd, dstName);
+        }
+        else if (sameDir)
+        {
+            // The UI keeps a cut from being pasted into its own directory, but it is never a no-op
+            addJobError(job, name, EEXIST);
+        }
+        else
+        {
+            // Same-filesystem moves are a single rename; anything else is copied then deleted
+            struct stat st;
+            if (fstatat(job->dstFd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                addJobError(job, name, EEXIST);
+            else if (renameat(job->srcFd, name, job->dstFd, name) == 0)
+                addJobProgress(job, 0, 1);
+            else if (errno != EXDEV)
+                addJobError(job, name, errno);
+            else
+            {
+                int errors = job->errors;
+                copyEntry(job, job->srcFd, name, job->dstFd, name);
+                if (job->errors == errors && !addJobProgress(job, 0, 0))
+                    deleteEntry(job, job->srcFd, name);
+            }
+        }
+    }
+}
+
+
+/**
+ * Frees a job and closes its descriptors.
+ * @param job Job to free
+ */
+void freeJob(Job *job)
+{
+    for (int i = 0; i < job->nameCount; i++) free(job->names[i]);
+    free(job->names);
+    if (job->data) job->freeData(job->data);
+    if (job->srcFd >= 0) close(job->srcFd);
+    if (job->dstFd >= 0) close(job->dstFd);
+    free(job);
+}
+
+/**
+ * Job thread. Runs queued jobs one at a time and pokes the main loop through JOB_NOTIFY when each
+ * one finishes.
+ */
+void *jobThread(void *arg)
+{
+    (void)arg;
+    const char *verbs[] = { "Copy", "Move", "Delete", "Checksum", "Duplicate search", "Content comparison", "Extraction" };
+
+    for (;;)
+    {
+        pthread_mutex_lock(&JOB_LOCK);
+        while (!JOB_QUEUE && !JOB_SHUTDOWN) pthread_cond_wait(&JOB_COND, &JOB_LOCK);
+        if (!JOB_QUEUE)
+        {
+            pthread_mutex_unlock(&JOB_LOCK);
+            return NULL;
+        }
+        Job *job = JOB_QUEUE;
+        JOB_QUEUE = job->next;
+        JOB_ACTIVE = job;
+        JOB_CANCEL = JOB_SHUTDOWN;
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+        pthread_mutex_unlock(&JOB_LOCK);
+
+        job->run(job);
+
+        pthread_mutex_lock(&JOB_LOCK);
+        if (JOB_CANCEL)
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "%s cancelled", verbs[job->type]);
+        else if (job->errors)
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "%s finished with %d error(s): %s", verbs[job->type], job->errors, job->error);
+        else if (job->type == JOB_HASH)
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "Checksums of %s ready, [i] to show them", job->names[0]);
+        else if (job->type == JOB_DUPES && DUPLICATES.groupCount)
+        {
+            char size[16];
+            formatSize(DUPLICATES.reclaimable, size, sizeof(size));
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "Found %d set(s) of duplicates, %s reclaimable, [u] to show them", DUPLICATES.groupCount, size);
+        }
+        else if (job->type == JOB_DUPES)
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "No duplicate files found");
+        else if (job->type == JOB_COMPARE)
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "Compared the contents of %d file(s), %d differ", CONTENT_CHECKS.count, CONTENT_CHECKS.differing);
+        else
+            snprintf(STATUS_MSG, sizeof(STATUS_MSG), "%s finished: %d item(s)", verbs[job->type], job->filesDone);
+        JOB_ACTIVE = NULL;
+        pthread_mutex_unlock(&JOB_LOCK);
+
+        freeJob(job);
+        write(JOB_NOTIFY[1], "j", 1);
+    }
+}
+
+/**
+ * Adds a filled-in job to the queue, starting the job thread on first use.
+ * @param job Job to run, with its run function set (taken over only if it is queued)
+ * @return 1 if the job was queued, otherwise 0
+ */
+int submitJob(Job *job)
+{
+    if (!JOB_THREAD_STARTED)
+    {
+        if (pipe2(JOB_NOTIFY, O_CLOEXEC | O_NONBLOCK) != 0 || pthread_create(&JOB_THREAD, NULL, jobThread, NULL) != 0)
+            return 0;
+        JOB_THREAD_STARTED = 1;
+    }
+
+    pthread_mutex_lock(&JOB_LOCK);
+    Job **tail = &JOB_QUEUE;
+    while (*tail) tail = &(*tail)->next;
+    *tail = job;
+    pthread_cond_signal(&JOB_COND);
+    pthread_mutex_unlock(&JOB_LOCK);
+    return 1;
+}
+
+/**
+ * Adds a job to the queue, starting the job thread on first use.
+ * @param type Kind of job
+ * @param srcFd Directory the names live in (consumed)
+ * @param dstFd Directory to copy or move into, or -1 for deletes (consumed)
+ * @param names Names of the entries to process (consumed)
+ * @param count Number of names
+ * @return 1 if the job was queued, otherwise 0
+ */
+int queueJob(enum JobType type, int srcFd, int dstFd, char **names, int count)
+{
+    Job *job = calloc(1, sizeof(Job));
+    if (!job) return 0;
+    job->type = type;
+    job->srcFd = srcFd;
+    job->dstFd = dstFd;
+    job->names = names;
+    job->nameCount = count;
+    switch (type)
+    {
+        case JOB_HASH:
+            job->run = runHashJob;
+            break;
+        case JOB_DUPES:
+            job->run = findDuplicates;
+            break;
+        case JOB_COMPARE:
+            job->run = compareContents;
+            break;
+        default:
+            job->run = runFileJob;
+            break;
+    }
+
+    if (submitJob(job)) return 1;
+    free(job);
+    return 0;
+}
+
+/**
+ * @return 1 if a job is running or waiting to run, otherwise 0
+ */
+int hasPendingJobs(void)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    int pending = JOB_ACTIVE != NULL || JOB_QUEUE != NULL;
+    pthread_mutex_unlock(&JOB_LOCK);
+    return pending;
+}
+
+/**
+ * @param type Kind of job
+ * @return 1 if a job of that kind is running or waiting to run, otherwise 0
+ */
+int isJobPending(enum JobType type)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    int pending = JOB_ACTIVE && JOB_ACTIVE->type == type;
+    for (Job *job = JOB_QUEUE; job && !pending; job = job->next) pending = job->type == type;
+    pthread_mutex_unlock(&JOB_LOCK);
+    return pending;
+}
+
+/**
+ * Cancels the running job and every queued job, then waits for the job thread to exit.
+ */
+void stopJobs(void)
+{
+    if (!JOB_THREAD_STARTED) return;
+
+    pthread_mutex_lock(&JOB_LOCK);
+    while (JOB_QUEUE)
+    {
+        Job *next = JOB_QUEUE->next;
+        freeJob(JOB_QUEUE);
+        JOB_QUEUE = next;
+    }
+    JOB_SHUTDOWN = 1;
+    JOB_CANCEL = 1;
+    pthread_cond_signal(&JOB_COND);
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    pthread_join(JOB_THREAD, NULL);
+    JOB_THREAD_STARTED = 0;
+}
+
+/**
+ * Describes the running job for the footer.
+ * @param buffer Output buffer
+ * @param size Size of output buffer
+ * @return 1 if a job is running, otherwise 0
+ */
+int formatJobProgress(char *buffer, size_t size)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    Job *job = JOB_ACTIVE;
+    if (!job)
+    {
+        pthread_mutex_unlock(&JOB_LOCK);
+        return 0;
+    }
+
+    int queued = 0;
+    for (Job *next = JOB_QUEUE; next; next = next->next) queued++;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+    double rate = elapsed > 0.1 ? job->bytesDone / elapsed : 0;
+
+    const char *verbs[] = { "Copying", "Moving", "Deleting", "Checksumming", "Finding duplicates", "Comparing", "Extracting" };
+    int percent = 0;
+    if (job->bytesTotal > 0) percent = (int)(job->bytesDone * 100 / job->bytesTotal);
+    else if (job->filesTotal > 0) percent = job->filesDone * 100 / job->filesTotal;
+    if (percent > 100) percent = 100;
+
+    int len = snprintf(buffer, size, "%s %d/%d %d%%", verbs[job->type], job->filesDone, job->filesTotal, percent);
+    if (rate > 0 && len < (int)size)
+    {
+        long eta = (long)((job->bytesTotal - job->bytesDone) / rate);
+        if (eta < 0) eta = 0;
+        len += snprintf(buffer + len, size - len, " %.1fM/s ETA %ld:%02ld", rate / 1048576.0, eta / 60, eta % 60);
+    }
+    if (queued && len < (int)size)
+        len += snprintf(buffer + len, size - len, " (+%d queued)", queued);
+    if (len < (int)size)
+        snprintf(buffer + len, size - len, " [c] Cancel");
+
+    pthread_mutex_unlock(&JOB_LOCK);
+    return 1;
+}
+
+/**
+ * Waits until there is something for the main loop to do.
+ * @param timeoutMs How long to wait in milliseconds (-1 to wait indefinitely)
+ * @return Which event ended the wait
+ */
+enum WaitEvent waitForEvent(int timeoutMs)
+{
+    struct pollfd fds[4] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { JOB_NOTIFY[0], POLLIN, 0 },
+        { (DIR_WATCH.wd >= 0 || PANE_WATCH.wd >= 0) ? DIR_WATCH.fd : -1, POLLIN, 0 },
+        { SEARCH_NOTIFY[0], POLLIN, 0 }
+    };
+
+    flushFrame();
+    int ready = poll(fds, 4, timeoutMs);
+    if (ready > 0 && (fds[1].revents & POLLIN))
+    {
+        char drain[16];
+        while (read(JOB_NOTIFY[0], drain, sizeof(drain)) > 0);
+        return WAIT_JOB;
+    }
+    if (ready > 0 && (fds[2].revents & POLLIN))
+        return WAIT_WATCH;
+    if (ready > 0 && (fds[3].revents & POLLIN))
+    {
+        char drain[64];
+        while (read(SEARCH_NOTIFY[0], drain, sizeof(drain)) > 0);
+        return WAIT_SEARCH;
+    }
+    if (ready > 0) return WAIT_INPUT;
+    if (ready < 0 && errno == EINTR) return WAIT_TIMEOUT;
+    return ready == 0 ? WAIT_TIMEOUT : WAIT_INPUT;
+}
+
+/**
+ * Gathers the names an action applies to: every marked entry, or the selected entry if nothing
+ * is marked. Marks are cleared afterwards.
+ * @param listing Listing of the current directory
+ * @param cursor Current line cursor position
+ * @param count Number of names returned (by reference)
+ * @return Newly allocated array of newly allocated names, or NULL if there is nothing to act on
+ */
+char **collectSelection(DirListing *listing, int cursor, int *count)
+{
+    *count = 0;
+    if (listing->count == 0) return NULL;
+
+    int marked = 0;
+    for (int i = 0; i < listing->count; i++)
+        if (getListingEntry(listing, i)->flags & ENTRY_MARKED) marked++;
+
+    char **names = malloc((marked ? marked : 1) * sizeof(char *));
+    if (!names) return NULL;
+
+    if (!marked)
+        names[(*count)++] = strdup(getListingEntry(listing, cursor - 1)->name);
+    for (int i = 0; i < listing->count && marked; i++)
+    {
+        DirEntry *entry = getListingEntry(listing, i);
+        if (entry->flags & ENTRY_MARKED)
+        {
+            names[(*count)++] = strdup(entry->name);
+            entry->flags &= ~ENTRY_MARKED;
+        }
+    }
+
+    return names;
+}
+
+/**
+ * Empties the clipboard.
+ */
+void clearClipboard(void)
+{
+    for (int i = 0; i < CLIPBOARD.count; i++) free(CLIPBOARD.names[i]);
+    free(CLIPBOARD.names);
+    if (CLIPBOARD.dirFd >= 0) close(CLIPBOARD.dirFd);
+    CLIPBOARD.names = NULL;
+    CLIPBOARD.count = 0;
+    CLIPBOARD.dirFd = -1;
+}
+
+/**
+ * @return 1 if the running search has been cancelled, otherwise 0
+ */
+int isSearchCancelled(void)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    int cancelled = SEARCH.cancel;
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return cancelled;
+}
+
+/**
+ * Records bytes scanned by a search worker.
+ * @param bytes Bytes just scanned
+ * @return 1 if the search has been cancelled and should stop, otherwise 0
+ */
+int addSearchProgress(long long bytes)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    SEARCH.bytesScanned += bytes;
+    int cancelled = SEARCH.cancel;
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return cancelled;
+}
+
+/**
+ * Picks the byte of a pattern that is least likely to turn up in text, so the scan for it (with
+ * memchr, which the C library vectorises) stops at as few false candidates as possible.
+ * @param pattern Literal being searched for
+ * @param len Length of pattern in bytes
+ * @return Offset of the rarest byte in pattern
+ */
+size_t pickRareByte(const char *pattern, size_t len)
+{
+    // Rough order of how common bytes are in text, most common first; anything else is rare
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+    size_t best = 0;
+    int bestRank = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = pattern[i];
+        const char *at = memchr(common, tolower(c), sizeof(common) - 1);
+        int rank = at ? (int)(sizeof(common) - (at - common)) : 0;
+        if (isupper(c)) rank /= 2;
+        if (i == 0 || rank < bestRank)
+        {
+            best = i;
+            bestRank = rank;
+        }
+    }
+    return best;
+}
+
+/**
+ * Finds the first occurrence of the search pattern in a block of data.
+ * @param data Data to search
+ * @param len Length of data in bytes
+ * @return Start of the first occurrence, or NULL if there is none
+ */
+const unsigned char *findSearchPattern(const unsigned char *data, size_t len)
+{
+    size_t patternLen = SEARCH.patternLen;
+    size_t rarePos = SEARCH.rarePos;
+    if (len < patternLen) return NULL;
+
+    const unsigned char *pattern = (const unsigned char *)SEARCH.pattern;
+    const unsigned char *p = data + rarePos;
+    const unsigned char *last = data + len - patternLen + rarePos;
+    while (p <= last)
+    {
+        p = memchr(p, pattern[rarePos], last - p + 1);
+        if (!p) return NULL;
+        if (memcmp(p - rarePos, pattern, patternLen) == 0) return p - rarePos;
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * @param p Start of the data
+ * @param end End of the data
+ * @return Number of new lines between p and end
+ */
+int countNewlines(const unsigned char *p, const unsigned char *end)
+{
+    int count = 0;
+    while (p < end && (p = memchr(p, '\n', end - p)))
+    {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+/**
+ * Scans a file for the search pattern a chunk at a time. Only whole lines are scanned from each
+ * chunk; the partial line at its end is carried over to the next one. Files with a NUL byte near
+ * their start are taken to be binary and skipped.
+ * @param fd File to scan
+ * @param buf Buffer of SEARCH_CHUNK_SIZE bytes
+ * @param firstLine Number of the first matching line (by reference)
+ * @return Number of matching lines
+ */
+int scanSearchFile(int fd, unsigned char *buf, int *firstLine)
+{
+    size_t patternLen = SEARCH.patternLen;
+    size_t keep = 0;
+    int line = 1;
+    int lineMatched = 0;
+    int matches = 0;
+    int sniffed = 0;
+
+    for (;;)
+    {
+        ssize_t n = read(fd, buf + keep, SEARCH_CHUNK_SIZE - keep);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) n = 0;
+
+        if (!sniffed)
+        {
+            if (memchr(buf, '\0', n < SEARCH_SNIFF_SIZE ? n : SEARCH_SNIFF_SIZE)) return 0;
+            sniffed = 1;
+        }
+
+        size_t avail = keep + n;
+        size_t end = avail;
+        if (n > 0)
+        {
+            // A line longer than the buffer is scanned in pieces that overlap by less than a match
+            const unsigned char *nl = memrchr(buf, '\n', avail);
+            if (nl) end = nl + 1 - buf;
+            else end = avail >= patternLen ? avail - (patternLen - 1) : 0;
+        }
+
+        size_t at = 0;
+        while (at < end)
+        {
+            const unsigned char *match = findSearchPattern(buf + at, avail - at);
+            size_t pos = (match && (size_t)(match - buf) < end) ? (size_t)(match - buf) : end;
+            int newlines = countNewlines(buf + at, buf + pos);
+            line += newlines;
+            if (newlines) lineMatched = 0;
+            if (pos == end) break;
+
+            // A line counts once, however often it matches
+            if (!lineMatched)
+            {
+                if (!matches) *firstLine = line;
+                matches++;
+                lineMatched = 1;
+            }
+            const unsigned char *nl = memchr(buf + pos, '\n', end - pos);
+            at = nl ? (size_t)(nl - buf) : end;
+        }
+
+        if (n == 0 || addSearchProgress(n)) break;
+        memmove(buf, buf + end, avail - end);
+        keep = avail - end;
+    }
+    return matches;
+}
+
+/**
+ * Hands a file to the search workers, waiting while the queue is full.
+ * @param path Path of the file, relative to the search root (consumed if queued)
+ * @return 1 if the file was queued, 0 if the search has been cancelled
+ */
+int pushSearchFile(char *path)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    while (SEARCH.queueCount == SEARCH_QUEUE_SIZE && !SEARCH.cancel) pthread_cond_wait(&SEARCH_COND, &SEARCH_LOCK);
+    int queued = !SEARCH.cancel;
+    if (queued)
+    {
+        SEARCH.queue[(SEARCH.queueHead + SEARCH.queueCount) % SEARCH_QUEUE_SIZE] = path;
+        SEARCH.queueCount++;
+        pthread_cond_broadcast(&SEARCH_COND);
+    }
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return queued;
+}
+
+/**
+ * Queues every regular file below a directory for the search workers. Symbolic links are not
+ * followed, so the walk cannot loop.
+ * @param dirFd Directory to walk (consumed)
+ * @param path Path of the directory relative to the search root, in a PATH_MAX buffer
+ * @param pathLen Length of path
+ */
+void walkSearchDir(int dirFd, char *path, size_t pathLen)
+{
+    DIR *dir = fdopendir(dirFd);
+    if (!dir)
+    {
+        close(dirFd);
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) && !isSearchCancelled())
+    {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        if (!SEARCH.dotfiles && name[0] == '.') continue;
+
+        size_t nameLen = strlen(name);
+        if (pathLen + nameLen + 2 > PATH_MAX) continue;
+
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            type = IFTODT(st.st_mode);
+        }
+
+        size_t len = pathLen;
+        if (len) path[len++] = '/';
+        memcpy(path + len, name, nameLen + 1);
+        len += nameLen;
+
+        if (type == DT_DIR)
+        {
+            int fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) walkSearchDir(fd, path, len);
+        }
+        else if (type == DT_REG)
+        {
+            char *copy = strdup(path);
+            if (copy && !pushSearchFile(copy)) free(copy);
+        }
+        path[pathLen] = '\0';
+    }
+    closedir(dir);
+}
+
+/**
+ * Marks one search thread as finished. The last one to finish reports the outcome and pokes the
+ * main loop through SEARCH_NOTIFY.
+ */
+void finishSearchThread(void)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    int last = --SEARCH.running == 0;
+    int cancelled = SEARCH.cancel;
+    int hits = SEARCH.hitCount;
+    int scanned = SEARCH.filesScanned;
+    pthread_mutex_unlock(&SEARCH_LOCK);
+
+    if (!last) return;
+    if (!cancelled && hits)
+        setStatus("Search finished: %d of %d file(s) match \"%s\"", hits, scanned, SEARCH.pattern);
+    else if (!cancelled)
+        setStatus("Search finished: none of %d file(s) match \"%s\"", scanned, SEARCH.pattern);
+    write(SEARCH_NOTIFY[1], "s", 1);
+}
+
+/**
+ * Search walker thread. Walks the tree below the search root and queues its files.
+ */
+void *searchWalker(void *arg)
+{
+    (void)arg;
+    char path[PATH_MAX] = "";
+    int fd = openat(SEARCH.rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) walkSearchDir(fd, path, 0);
+
+    pthread_mutex_lock(&SEARCH_LOCK);
+    SEARCH.walking = 0;
+    pthread_cond_broadcast(&SEARCH_COND);
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    finishSearchThread();
+    return NULL;
+}
+
+/**
+ * Search worker thread. Takes files off the queue and scans them, adding those that match to
+ * SEARCH.hits and poking the main loop through SEARCH_NOTIFY.
+ */
+void *searchWorker(void *arg)
+{
+    (void)arg;
+    unsigned char *buf = malloc(SEARCH_CHUNK_SIZE);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&SEARCH_LOCK);
+        while (!SEARCH.queueCount && SEARCH.walking && !SEARCH.cancel) pthread_cond_wait(&SEARCH_COND, &SEARCH_LOCK);
+        if (!SEARCH.queueCount || SEARCH.cancel)
+        {
+            pthread_mutex_unlock(&SEARCH_LOCK);
+            break;
+        }
+        char *path = SEARCH.queue[SEARCH.queueHead];
+        SEARCH.queueHead = (SEARCH.queueHead + 1) % SEARCH_QUEUE_SIZE;
+        SEARCH.queueCount--;
+        pthread_cond_broadcast(&SEARCH_COND);
+        pthread_mutex_unlock(&SEARCH_LOCK);
+
+        // O_NONBLOCK keeps a FIFO swapped in since the walk from blocking the open
+        struct stat st;
+        int line = 0;
+        int lines = 0;
+        int fd = buf ? openat(SEARCH.rootFd, path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC) : -1;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            lines = scanSearchFile(fd, buf, &line);
+        }
+        if (fd >= 0) close(fd);
+
+        pthread_mutex_lock(&SEARCH_LOCK);
+        SEARCH.filesScanned++;
+        if (lines > 0 && SEARCH.hitCount == SEARCH.hitCapacity)
+        {
+            int capacity = SEARCH.hitCapacity ? SEARCH.hitCapacity * 2 : 64;
+            SearchHit *hits = realloc(SEARCH.hits, capacity * sizeof(SearchHit));
+            if (hits)
+            {
+                SEARCH.hits = hits;
+                SEARCH.hitCapacity = capacity;
+            }
+        }
+        if (lines > 0 && SEARCH.hitCount < SEARCH.hitCapacity)
+        {
+            SearchHit *hit = &SEARCH.hits[SEARCH.hitCount++];
+            hit->path = path;
+            hit->line = line;
+            hit->lines = lines;
+            hit->mode = st.st_mode;
+            hit->uid = st.st_uid;
+            hit->gid = st.st_gid;
+            hit->size = st.st_size;
+            hit->mtime = st.st_mtime;
+            path = NULL;
+        }
+        pthread_mutex_unlock(&SEARCH_LOCK);
+
+        if (!path) write(SEARCH_NOTIFY[1], "s", 1);
+        free(path);
+    }
+
+    free(buf);
+    finishSearchThread();
+    return NULL;
+}
+
+/**
+ * Asks a running search to stop, without waiting for it.
+ */
+void cancelSearch(void)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    SEARCH.cancel = 1;
+    pthread_cond_broadcast(&SEARCH_COND);
+    pthread_mutex_unlock(&SEARCH_LOCK);
+}
+
+/**
+ * Stops the search, waits for its threads to exit and frees its results.
+ */
+void stopSearch(void)
+{
+    if (!SEARCH.active) return;
+
+    cancelSearch();
+    pthread_join(SEARCH.walker, NULL);
+    for (int i = 0; i < SEARCH.workerCount; i++) pthread_join(SEARCH.workers[i], NULL);
+
+    for (int i = 0; i < SEARCH.queueCount; i++) free(SEARCH.queue[(SEARCH.queueHead + i) % SEARCH_QUEUE_SIZE]);
+    for (int i = 0; i < SEARCH.hitCount; i++) free(SEARCH.hits[i].path);
+    free(SEARCH.queue);
+    free(SEARCH.hits);
+    close(SEARCH.rootFd);
+    SEARCH.queue = NULL;
+    SEARCH.hits = NULL;
+    SEARCH.queueCount = SEARCH.hitCount = SEARCH.hitCapacity = 0;
+    SEARCH.workerCount = 0;
+    SEARCH.rootFd = -1;
+    SEARCH.active = 0;
+}
+
+/**
+ * Starts searching the contents of every file below a directory for a literal, with one thread
+ * walking the tree and one worker per CPU scanning the files it finds. Any earlier search is
+ * stopped first.
+ * @param dirFd Directory to search
+ * @param pattern Literal to search for (case-sensitive)
+ * @return 1 if the search was started, otherwise 0
+ */
+int startSearch(int dirFd, const char *pattern)
+{
+    stopSearch();
+
+    size_t len = strlen(pattern);
+    if (!len || len > SEARCH_MAX_PATTERN)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+    if (SEARCH_NOTIFY[0] < 0 && pipe2(SEARCH_NOTIFY, O_CLOEXEC | O_NONBLOCK) != 0) return 0;
+
+    SEARCH.queue = malloc(SEARCH_QUEUE_SIZE * sizeof(char *));
+    SEARCH.rootFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    if (!SEARCH.queue || SEARCH.rootFd < 0)
+    {
+        free(SEARCH.queue);
+        if (SEARCH.rootFd >= 0) close(SEARCH.rootFd);
+        SEARCH.queue = NULL;
+        SEARCH.rootFd = -1;
+        return 0;
+    }
+
+    memcpy(SEARCH.pattern, pattern, len + 1);
+    SEARCH.patternLen = len;
+    SEARCH.rarePos = pickRareByte(pattern, len);
+    SEARCH.dotfiles = DOTFILES_VISIBLE;
+    SEARCH.queueHead = SEARCH.queueCount = 0;
+    SEARCH.hits = NULL;
+    SEARCH.hitCount = SEARCH.hitCapacity = 0;
+    SEARCH.filesScanned = 0;
+    SEARCH.bytesScanned = 0;
+    SEARCH.cancel = 0;
+    SEARCH.walking = 1;
+    clock_gettime(CLOCK_MONOTONIC, &SEARCH.started);
+
+    int wanted = getWorkerCount();
+
+    // Threads are counted as running before they start, so none can finish "last" too early
+    SEARCH.running = 1 + wanted;
+    SEARCH.workerCount = 0;
+    if (pthread_create(&SEARCH.walker, NULL, searchWalker, NULL) != 0)
+    {
+        free(SEARCH.queue);
+        close(SEARCH.rootFd);
+        SEARCH.queue = NULL;
+        SEARCH.rootFd = -1;
+        return 0;
+    }
+    SEARCH.active = 1;
+
+    for (int i = 0; i < wanted; i++)
+    {
+        if (pthread_create(&SEARCH.workers[i], NULL, searchWorker, NULL) != 0)
+        {
+            pthread_mutex_lock(&SEARCH_LOCK);
+            SEARCH.running -= wanted - i;
+            pthread_mutex_unlock(&SEARCH_LOCK);
+            break;
+        }
+        SEARCH.workerCount++;
+    }
+    if (!SEARCH.workerCount)
+    {
+        stopSearch();
+        errno = EAGAIN;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if a search is still walking or scanning, otherwise 0
+ */
+int isSearchRunning(void)
+{
+    if (!SEARCH.active) return 0;
+    pthread_mutex_lock(&SEARCH_LOCK);
+    int running = SEARCH.running > 0;
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return running;
+}
+
+/**
+ * Adds the files found since the last call to the listing of search results. Results are listed
+ * in the order they are found, so entry i of the listing is always SEARCH.hits[i].
+ * @param listing Listing of search results
+ * @return Index of the first entry added, or -1 if there were none
+ */
+int takeSearchHits(DirListing *listing)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    int first = listing->count < SEARCH.hitCount ? listing->count : -1;
+
+    while (listing->count < SEARCH.hitCount)
+    {
+        if (listing->count == listing->capacity)
+        {
+            int capacity = listing->capacity ? listing->capacity * 2 : 64;
+            DirEntry *entries = realloc(listing->entries, capacity * sizeof(DirEntry));
+            if (!entries) break;
+            listing->entries = entries;
+            listing->capacity = capacity;
+        }
+
+        // Each result is shown as its path, the first matching line and how many lines match
+        SearchHit *hit = &SEARCH.hits[listing->count];
+        DirEntry *entry = &listing->entries[listing->count];
+        char display[PATH_MAX + 48];
+        int width;
+        size_t len = escapeDisplayName(hit->path, display, &width);
+        int suffix = snprintf(display + len, sizeof(display) - len, ":%d (%d line%s)", hit->line, hit->lines, hit->lines == 1 ? "" : "s");
+
+        memset(entry, 0, sizeof(DirEntry));
+        entry->name = storeName(listing, hit->path, strlen(hit->path));
+        entry->display = entry->name ? storeName(listing, display, len + suffix) : NULL;
+        if (!entry->display) break;
+        entry->width = width + suffix > 65535 ? 65535 : width + suffix;
+        entry->type = (hit->mode & 0111) ? DT_EXE : DT_REG;
+        entry->flags = ENTRY_STATTED | ENTRY_RESOLVED;
+        entry->mode = hit->mode;
+        entry->uid = hit->uid;
+        entry->gid = hit->gid;
+        entry->size = hit->size;
+        entry->mtime = hit->mtime;
+        listing->count++;
+    }
+
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return first;
+}
+
+/**
+ * @param index Index of a search result
+ * @return Number of its first matching line, or 0 if there is no such result
+ */
+int getSearchHitLine(int index)
+{
+    pthread_mutex_lock(&SEARCH_LOCK);
+    int line = index >= 0 && index < SEARCH.hitCount ? SEARCH.hits[index].line : 0;
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return line;
+}
+
+/**
+ * Describes the running search for the footer.
+ * @param buffer Output buffer
+ * @param size Size of output buffer
+ * @return 1 if a search is running, otherwise 0
+ */
+int formatSearchProgress(char *buffer, size_t size)
+{
+    if (!SEARCH.active) return 0;
+    pthread_mutex_lock(&SEARCH_LOCK);
+    if (SEARCH.running == 0)
+    {
+        pthread_mutex_unlock(&SEARCH_LOCK);
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - SEARCH.started.tv_sec) + (now.tv_nsec - SEARCH.started.tv_nsec) / 1e9;
+    double rate = elapsed > 0.1 ? SEARCH.bytesScanned / elapsed : 0;
+    snprintf(buffer, size, "Searching: %d of %d file(s) match %.1fM/s [c] Cancel", SEARCH.hitCount, SEARCH.filesScanned, rate / 1048576.0);
+
+    pthread_mutex_unlock(&SEARCH_LOCK);
+    return 1;
+}
+
+/**
+ * Drops duplicates that have since been removed, replaced or changed, along with any set left with
+ * only one file, so the results stay right after deleting some of the copies. The files are checked
+ * from a copy taken under JOB_LOCK, without holding it, so the job thread is never held up behind
+ * the I/O.
+ * @param dirFd Directory the duplicates were searched for in
+ */
+void pruneDuplicates(int dirFd)
+{
+    pthread_mutex_lock(&JOB_LOCK);
+    int count = DUPLICATES.fileCount;
+    DupeFile *files = malloc((count + 1) * sizeof(DupeFile));
+    int copied = 0;
+    while (files && copied < count)
+    {
+        files[copied] = DUPLICATES.files[copied];
+        if (!(files[copied].path = strdup(DUPLICATES.files[copied].path))) break;
+        copied++;
+    }
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    // Files that are gone or changed get a size of -1, as with unreadable candidates
+    for (int i = 0; copied == count && i < count; i++)
+    {
+        struct stat st;
+        if (fstatat(dirFd, files[i].path, &st, AT_SYMLINK_NOFOLLOW) != 0 || !isSameDupeFile(&files[i], &st))
+            files[i].size = -1;
+    }
+
+    // A search that finished in the meantime has replaced the results with fresh ones
+    pthread_mutex_lock(&JOB_LOCK);
+    int same = copied == count && DUPLICATES.fileCount == count;
+    for (int i = 0; same && i < count; i++)
+        same = DUPLICATES.files[i].ino == files[i].ino && strcmp(DUPLICATES.files[i].path, files[i].path) == 0;
+
+    int at = 0;
+    int groupCount = 0;
+    for (int g = 0; same && g < DUPLICATES.groupCount; g++)
+    {
+        DupeGroup group = DUPLICATES.groups[g];
+        int first = at;
+        for (int i = group.first; i < group.first + group.count; i++)
+        {
+            if (files[i].size >= 0)
+                DUPLICATES.files[at++] = DUPLICATES.files[i];
+            else
+                free(DUPLICATES.files[i].path);
+        }
+
+        if (at - first < 2)
+        {
+            while (at > first) free(DUPLICATES.files[--at].path);
+            continue;
+        }
+        group.first = first;
+        group.count = at - first;
+        group.reclaimable = (long long)DUPLICATES.files[first].size * (group.count - 1);
+        DUPLICATES.groups[groupCount++] = group;
+    }
+    if (same)
+    {
+        DUPLICATES.fileCount = at;
+        DUPLICATES.groupCount = groupCount;
+        DUPLICATES.reclaimable = 0;
+        for (int g = 0; g < groupCount; g++) DUPLICATES.reclaimable += DUPLICATES.groups[g].reclaimable;
+    }
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    for (int i = 0; i < copied; i++) free(files[i].path);
+    free(files);
+}
+
+/**
+ * Fills a listing with the results of the last duplicate search: a heading row (of type DT_GROUP)
+ * for each set of identical files, followed by the paths of the files in it.
+ * @param listing Listing to fill; its directory must be the one searched
+ * @param title Newly allocated title for the header, replacing the old one (by reference)
+ * @return 1 on success, otherwise 0
+ */
+int getDuplicateContents(DirListing *listing, char **title)
+{
+    int dirFd = listing->dirFd;
+    listing->dirFd = -1;
+    freeDirListing(listing);
+    listing->dirFd = dirFd;
+
+    pthread_mutex_lock(&JOB_LOCK);
+    int ok = 1;
+    int rows = DUPLICATES.fileCount + DUPLICATES.groupCount;
+    listing->entries = rows ? malloc(rows * sizeof(DirEntry)) : NULL;
+    listing->capacity = listing->entries ? rows : 0;
+    if (rows && !listing->entries) ok = 0;
+
+    for (int g = 0; ok && g < DUPLICATES.groupCount; g++)
+    {
+        DupeGroup *group = &DUPLICATES.groups[g];
+        char size[16], reclaimable[16], heading[96];
+        formatSize(DUPLICATES.files[group->first].size, size, sizeof(size));
+        formatSize(group->reclaimable, reclaimable, sizeof(reclaimable));
+        int headingLen = snprintf(heading, sizeof(heading), "%d copies of %s each, %s reclaimable", group->count, size, reclaimable);
+
+        DirEntry *entry = &listing->entries[listing->count];
+        memset(entry, 0, sizeof(DirEntry));
+        entry->name = entry->display = storeName(listing, heading, headingLen);
+        entry->width = headingLen;
+        entry->type = DT_GROUP;
+        entry->flags = ENTRY_STATTED | ENTRY_RESOLVED;
+        if (!entry->name) ok = 0;
+        else listing->count++;
+
+        for (int i = group->first; ok && i < group->first + group->count; i++)
+        {
+            DupeFile *file = &DUPLICATES.files[i];
+            char display[PATH_MAX];
+            int width;
+            size_t len = escapeDisplayName(file->path, display, &width);
+
+            entry = &listing->entries[listing->count];
+            memset(entry, 0, sizeof(DirEntry));
+            entry->name = storeName(listing, file->path, strlen(file->path));
+            entry->display = entry->name ? storeName(listing, display, len) : NULL;
+            entry->width = width > 65535 ? 65535 : width;
+            entry->type = DT_REG;
+            entry->flags = ENTRY_RESOLVED;
+            entry->size = file->size;
+            if (!entry->display) ok = 0;
+            else listing->count++;
+        }
+    }
+
+    char reclaimable[16];
+    formatSize(DUPLICATES.reclaimable, reclaimable, sizeof(reclaimable));
+    free(*title);
+    if (asprintf(title, "Duplicates in %s: %d set(s), %s reclaimable", DUPLICATES.root ? DUPLICATES.root : "", DUPLICATES.groupCount, reclaimable) < 0)
+        *title = NULL;
+    pthread_mutex_unlock(&JOB_LOCK);
+    return ok;
+}
+
+/**
+ * Allows qsort to put indices of SORTING_LISTING's entries in name order.
+ * @param a First entry index to compare
+ * @param b Second entry index to compare
+ * @return negative (a < b), 0 (a == b) or positive (a > b)
+ */
+int compareNameOrder(const void *a, const void *b)
+{
+    return compareDirName(&SORTING_LISTING->entries[*(const int *)a], &SORTING_LISTING->entries[*(const int *)b]);
+}
+
+/**
+ * Works out the order of a listing's entries by name, which is the order two listings are walked in
+ * step when comparing them. A listing sorted by name is in that order already.
+ * @param listing Listing to order (not paged, unless sorted by name)
+ * @param order Newly allocated array of entry indices in name order, or NULL if the listing is in
+ * that order already (by reference)
+ * @return 1 on success, otherwise 0
+ */
+int getNameOrder(DirListing *listing, int **order)
+{
+    *order = NULL;
+    if (SORT_MODE == SORT_NAME && !DIRS_FIRST) return 1;
+    if (listing->pageFd >= 0)
+    {
+        errno = EFBIG;
+        return 0;
+    }
+
+    *order = malloc((listing->count + 1) * sizeof(int));
+    if (!*order) return 0;
+    for (int i = 0; i < listing->count; i++) (*order)[i] = i;
+
+    SORTING_LISTING = listing;
+    qsort(*order, listing->count, sizeof(int), compareNameOrder);
+    SORTING_LISTING = NULL;
+    return 1;
+}
+
+/**
+ * Fetches the metadata of every entry whose name is in both listings, walking both in name order
+ * at once. Entries fetched before are left alone.
+ * @param left Listing of the left pane
+ * @param right Listing of the right pane
+ * @param leftOrder Name order of the left listing, or NULL if it is in that order already
+ * @param rightOrder Name order of the right listing, or NULL if it is in that order already
+ */
+void statMatchedEntries(DirListing *left, DirListing *right, int *leftOrder, int *rightOrder)
+{
+    int i = 0;
+    int j = 0;
+    while (i < left->count && j < right->count)
+    {
+        DirEntry *l = getListingEntry(left, leftOrder ? leftOrder[i] : i);
+        DirEntry *r = getListingEntry(right, rightOrder ? rightOrder[j] : j);
+        int diff = compareDirName(l, r);
+        if (diff == 0)
+        {
+            if (!(l->flags & ENTRY_STATTED)) statEntry(left->dirFd, l);
+            if (!(r->flags & ENTRY_STATTED)) statEntry(right->dirFd, r);
+        }
+        if (diff <= 0) i++;
+        if (diff >= 0) j++;
+    }
+}
+
+/**
+ * Compares the listings of two panes by walking both in name order at once, so matching names
+ * costs no more than one pass over each. Entries found on only one side are flagged
+ * ENTRY_ONLY_HERE, and entries whose type, size or modification time differ from their namesake
+ * are flagged ENTRY_DIFFERS. Files of the same size whose contents were compared by a JOB_COMPARE
+ * job, and have not changed since, are told apart by their contents instead of their times.
+ * Metadata is only fetched for names on both sides, and only once, so comparing again after a
+ * change only costs I/O for the entries that changed. It is fetched before JOB_LOCK is taken, so
+ * the job thread is never held up behind it.
+ * @param left Listing of the left pane
+ * @param right Listing of the right pane
+ * @param counts Filled in with how many entries are only on the left, only on the right, and differ
+ * @param names If not NULL, filled in with a newly allocated array of the names of regular files
+ * of the same size on both sides, in name order, for their contents to be compared
+ * @param nameCount Number of names (by reference)
+ * @return 1 on success, otherwise 0
+ */
+int compareListings(DirListing *left, DirListing *right, int counts[3], char ***names, int *nameCount)
+{
+    int *leftOrder = NULL;
+    int *rightOrder = NULL;
+    if (!getNameOrder(left, &leftOrder) || !getNameOrder(right, &rightOrder))
+    {
+        free(leftOrder);
+        return 0;
+    }
+
+    int capacity = 0;
+    if (names)
+    {
+        *names = NULL;
+        *nameCount = 0;
+    }
+    counts[0] = counts[1] = counts[2] = 0;
+
+    statMatchedEntries(left, right, leftOrder, rightOrder);
+
+    // Content results only apply to the directories they were worked out for
+    struct stat leftSt, rightSt;
+    int checked = fstat(left->dirFd, &leftSt) == 0 && fstat(right->dirFd, &rightSt) == 0;
+    pthread_mutex_lock(&JOB_LOCK);
+    checked = checked && CONTENT_CHECKS.count && CONTENT_CHECKS.leftDev == leftSt.st_dev && CONTENT_CHECKS.leftIno == leftSt.st_ino &&
+        CONTENT_CHECKS.rightDev == rightSt.st_dev && CONTENT_CHECKS.rightIno == rightSt.st_ino;
+
+    int ok = 1;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    while (ok && (i < left->count || j < right->count))
+    {
+        DirEntry *l = i < left->count ? getListingEntry(left, leftOrder ? leftOrder[i] : i) : NULL;
+        DirEntry *r = j < right->count ? getListingEntry(right, rightOrder ? rightOrder[j] : j) : NULL;
+        int diff = !l ? 1 : !r ? -1 : compareDirName(l, r);
+        if (diff < 0)
+        {
+            l->flags = (l->flags & ~ENTRY_DIFFERS) | ENTRY_ONLY_HERE;
+            counts[0]++;
+            i++;
+            continue;
+        }
+        if (diff > 0)
+        {
+            r->flags = (r->flags & ~ENTRY_DIFFERS) | ENTRY_ONLY_HERE;
+            counts[1]++;
+            j++;
+            continue;
+        }
+
+        // Directories are the same if they are both directories; what is in them is not compared
+        int differs = (l->mode & S_IFMT) != (r->mode & S_IFMT);
+        if (!differs && !S_ISDIR(l->mode))
+            differs = l->size != r->size || l->mtime != r->mtime;
+
+        if (S_ISREG(l->mode) && S_ISREG(r->mode) && l->size == r->size)
+        {
+            // The results are in name order too, so they are walked in step with the listings
+            while (checked && k < CONTENT_CHECKS.count)
+            {
+                DirEntry key = { CONTENT_CHECKS.checks[k].name, NULL, 0, 0, 0, 0, 0, 0, 0, 0 };
+                if (compareDirName(&key, l) >= 0) break;
+                k++;
+            }
+            ContentCheck *check = (checked && k < CONTENT_CHECKS.count && strcmp(CONTENT_CHECKS.checks[k].name, l->name) == 0) ? &CONTENT_CHECKS.checks[k] : NULL;
+            if (check && check->size == l->size && check->leftMtime == l->mtime && check->rightMtime == r->mtime)
+                differs = check->differs;
+
+            if (names && *nameCount == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                char **grown = realloc(*names, capacity * sizeof(char *));
+                if (grown) *names = grown;
+                else ok = 0;
+            }
+            if (names && ok && ((*names)[*nameCount] = strdup(l->name)) != NULL) (*nameCount)++;
+            else if (names) ok = 0;
+        }
+
+        l->flags = (l->flags & ~(ENTRY_ONLY_HERE | ENTRY_DIFFERS)) | (differs ? ENTRY_DIFFERS : 0);
+        r->flags = (r->flags & ~(ENTRY_ONLY_HERE | ENTRY_DIFFERS)) | (differs ? ENTRY_DIFFERS : 0);
+        counts[2] += differs;
+        i++;
+        j++;
+    }
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    if (!ok && names)
+    {
+        for (int n = 0; n < *nameCount; n++) free((*names)[n]);
+        free(*names);
+        *names = NULL;
+        *nameCount = 0;
+    }
+    free(leftOrder);
+    free(rightOrder);
+    return ok;
+}
+
+/**
+ * @param listing Listing of a pane being compared
+ * @param cursor Line cursor position
+ * @return Line of the next entry after the cursor, wrapping around, that is only on its side or
+ * differs from the other side, or 0 if there is none
+ */
+int findNextDifference(DirListing *listing, int cursor)
+{
+    for (int n = 1; n <= listing->count; n++)
+    {
+        int index = (cursor - 1 + n) % listing->count;
+        if (getListingEntry(listing, index)->flags & (ENTRY_ONLY_HERE | ENTRY_DIFFERS)) return index + 1;
+    }
+    return 0;
+}
+
+/**
+ * Resolves a user or group ID to a name through a small direct-mapped cache, so a listing full of
+ * files owned by the same few accounts only hits the password/group databases once per account.
+ * @param cache Cache to use (USER_CACHE or GROUP_CACHE)
+ * @param id ID to resolve
+ * @param isGroup Flags if id is a group ID rather than a user ID
+ * @return Name of the ID, or the ID as a number if it has no name
+ */
+const char *lookupIdName(IdCacheSlot *cache, unsigned int id, int isGroup)
+{
+    IdCacheSlot *slot = &cache[id % ID_CACHE_SLOTS];
+    if (slot->valid && slot->id == id) return slot->name;
+
+    const char *name = NULL;
+    if (isGroup)
+    {
+        struct group *gr = getgrgid(id);
+        if (gr) name = gr->gr_name;
+    }
+    else
+    {
+        struct passwd *pw = getpwuid(id);
+        if (pw) name = pw->pw_name;
+    }
+
+    if (name) snprintf(slot->name, sizeof(slot->name), "%s", name);
+    else snprintf(slot->name, sizeof(slot->name), "%u", id);
+    slot->id = id;
+    slot->valid = 1;
+    return slot->name;
+}
+
+/**
+ * @param columns Bitmask of COLUMN_* flags
+ * @return Number of terminal columns the given detail columns occupy (including separators)
+ */
+int getDetailsWidth(int columns)
+{
+    int width = 0;
+    if (columns & COLUMN_PERMS) width += 10;
+    if (columns & COLUMN_USER) width += 9;
+    if (columns & COLUMN_GROUP) width += 9;
+    if (columns & COLUMN_SIZE) width += 7;
+    if (columns & COLUMN_MTIME) width += 17;
+    return width;
+}
+
+/**
+ * Works out which of the requested detail columns fit on screen, dropping the least important
+ * ones first so that names always keep a usable amount of space.
+ * @return Bitmask of COLUMN_* flags to draw
+ */
+int getActiveColumns(void)
+{
+    if (!DETAILS_VISIBLE) return 0;
+
+    int columns = DETAIL_COLUMNS;
+    const int dropOrder[] = { COLUMN_GROUP, COLUMN_USER, COLUMN_PERMS, COLUMN_MTIME, COLUMN_SIZE };
+    for (int i = 0; i < 5 && TERM_SIZE.ws_col - 5 - getDetailsWidth(columns) < 16; i++)
+        columns &= ~dropOrder[i];
+    return columns;
+}
+
+/**
+ * Writes the detail columns of an entry into a buffer.
+ * @param entry Entry to describe (must have been stat'd)
+ * @param columns Bitmask of COLUMN_* flags to include
+ * @param buffer Output buffer
+ * @param size Size of output buffer
+ */
+void formatEntryDetails(DirEntry *entry, int columns, char *buffer, size_t size)
+{
+    size_t len = 0;
+    buffer[0] = '\0';
+
+    if (columns & COLUMN_PERMS)
+    {
+        const char *bits = "rwxrwxrwx";
+        char perms[10];
+        for (int i = 0; i < 9; i++)
+            perms[i] = (entry->mode & (0400 >> i)) ? bits[i] : '-';
+        if (entry->mode & S_ISUID) perms[2] = (entry->mode & S_IXUSR) ? 's' : 'S';
+        if (entry->mode & S_ISGID) perms[5] = (entry->mode & S_IXGRP) ? 's' : 'S';
+        if (entry->mode & S_ISVTX) perms[8] = (entry->mode & S_IXOTH) ? 't' : 'T';
+        perms[9] = '\0';
+        len += snprintf(buffer + len, size - len, "%s ", perms);
+    }
+
+    if ((columns & COLUMN_USER) && len < size)
+        len += snprintf(buffer + len, size - len, "%-8.8s ", lookupIdName(USER_CACHE, entry->uid, 0));
+
+    if ((columns & COLUMN_GROUP) && len < size)
+        len += snprintf(buffer + len, size - len, "%-8.8s ", lookupIdName(GROUP_CACHE, entry->gid, 1));
+
+    if ((columns & COLUMN_SIZE) && len < size)
+    {
+        char sizeStr[16];
+        if (S_ISDIR(entry->mode))
+            snprintf(sizeStr, sizeof(sizeStr), "-");
+        else
+            formatSize(entry->size, sizeStr, sizeof(sizeStr));
+        len += snprintf(buffer + len, size - len, "%6s ", sizeStr);
+    }
+
+    if ((columns & COLUMN_MTIME) && len < size)
+    {
+        char timeStr[32] = "-";
+        struct tm tm;
+        if (localtime_r(&entry->mtime, &tm))
+            strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M", &tm);
+        len += snprintf(buffer + len, size - len, "%-16.16s ", timeStr);
+    }
+}
+
+/**
+ * Writes everything in the list output buffer to stdout.
+ */
+void flushListOutput(void)
+{
+    size_t written = 0;
+    while (written < LIST_OUT_LEN)
+    {
+        ssize_t n = write(STDOUT_FILENO, LIST_OUT + written, LIST_OUT_LEN - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) exit(1);
+        written += n;
+    }
+    LIST_OUT_LEN = 0;
+}
+
+/**
+ * Appends bytes to the list output buffer, flushing it when full.
+ * @param data Bytes to append
+ * @param len Number of bytes
+ */
+void writeListOutput(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (LIST_OUT_LEN == sizeof(LIST_OUT)) flushListOutput();
+        size_t chunk = sizeof(LIST_OUT) - LIST_OUT_LEN;
+        if (chunk > len) chunk = len;
+        memcpy(LIST_OUT + LIST_OUT_LEN, data, chunk);
+        LIST_OUT_LEN += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * Appends a string to the list output as a quoted JSON string. Invalid UTF-8 is replaced with
+ * U+FFFD so the output always parses.
+ * @param str String to append
+ */
+void writeJsonString(const char *str)
+{
+    const unsigned char *in = (const unsigned char *)str;
+    writeListOutput("\"", 1);
+    while (*in)
+    {
+        unsigned int cp;
+        int n = decodeUtf8(in, &cp);
+        char escaped[8];
+
+        if (n == 0)
+        {
+            writeListOutput("\xEF\xBF\xBD", 3);
+            in++;
+        }
+        else if (cp == '"' || cp == '\\')
+        {
+            escaped[0] = '\\';
+            escaped[1] = cp;
+            writeListOutput(escaped, 2);
+            in++;
+        }
+        else if (cp < 0x20)
+        {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", cp);
+            writeListOutput(escaped, 6);
+            in++;
+        }
+        else
+        {
+            writeListOutput((const char *)in, n);
+            in += n;
+        }
+    }
+    writeListOutput("\"", 1);
+}
+
+/**
+ * Writes one entry in the selected list format.
+ * @param entry Entry to write (stat'd beforehand if metadata was requested)
+ * @param prefix Path of the entry's directory relative to the listed directory ("" at the top)
+ */
+void writeListEntry(DirEntry *entry, const char *prefix)
+{
+    char buffer[160];
+    int len;
+
+    if (LIST_FORMAT == LIST_JSON)
+    {
+        const char *typeNames[] = { "directory", "symlink", "executable", "file", "block", "char", "fifo", "socket", "unknown" };
+        writeListOutput("{\"path\":", 8);
+        if (prefix[0])
+        {
+            char *path = malloc(strlen(prefix) + strlen(entry->name) + 1);
+            if (!path) exit(1);
+            sprintf(path, "%s%s", prefix, entry->name);
+            writeJsonString(path);
+            free(path);
+        }
+        else writeJsonString(entry->name);
+
+        len = snprintf(buffer, sizeof(buffer), ",\"type\":\"%s\"", typeNames[getTypeRank(entry->type)]);
+        writeListOutput(buffer, len);
+
+        if (LIST_META)
+        {
+            len = snprintf(buffer, sizeof(buffer), ",\"mode\":\"%04o\",\"size\":%lld,\"mtime\":%lld,\"user\":", (unsigned int)(entry->mode & 07777), (long long)entry->size, (long long)entry->mtime);
+            writeListOutput(buffer, len);
+            writeJsonString(lookupIdName(USER_CACHE, entry->uid, 0));
+            writeListOutput(",\"group\":", 9);
+            writeJsonString(lookupIdName(GROUP_CACHE, entry->gid, 1));
+        }
+        writeListOutput("}\n", 2);
+        return;
+    }
+
+    // Plain and NUL-separated records share a layout; the path comes last so it can hold spaces
+    buffer[0] = getTypeChar(entry->type);
+    buffer[1] = ' ';
+    len = 2;
+    if (LIST_META)
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%04o %s %s %lld %lld ", (unsigned int)(entry->mode & 07777), lookupIdName(USER_CACHE, entry->uid, 0), lookupIdName(GROUP_CACHE, entry->gid, 1), (long long)entry->size, (long long)entry->mtime);
+    writeListOutput(buffer, len);
+    writeListOutput(prefix, strlen(prefix));
+    writeListOutput(entry->name, strlen(entry->name));
+    writeListOutput(LIST_FORMAT == LIST_NUL ? "" : "\n", 1);
+}
+
+/**
+ * Streams the listing of a directory to stdout for --list mode.
+ * @param dirFd Directory to list
+ * @param prefix Path of the directory relative to the listed directory ("" at the top)
+ */
+void listDirectory(int dirFd, const char *prefix)
+{
+    size_t prefixLen = strlen(prefix);
+
+    if (!LIST_UNSORTED)
+    {
+        DirListing listing = { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL };
+        if (!getDirContents(dirFd, &listing, 0))
+        {
+            fprintf(stderr, "shorkdir: cannot read %s: %s\n", prefixLen ? prefix : ".", strerror(errno));
+            return;
+        }
+        if (LIST_META) statEntries(&listing, 0, listing.count);
+
+        for (int i = 0; i < listing.count; i++)
+        {
+            DirEntry *entry = getListingEntry(&listing, i);
+            if (entry->type == DT_UNKNOWN) resolveEntry(listing.dirFd, entry);
+            writeListEntry(entry, prefix);
+            if (!LIST_RECURSIVE || entry->type != DT_DIR) continue;
+
+            int childFd = openat(dirFd, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            char *childPrefix = malloc(prefixLen + strlen(entry->name) + 2);
+            if (childFd >= 0 && childPrefix)
+            {
+                sprintf(childPrefix, "%s%s/", prefix, entry->name);
+                listDirectory(childFd, childPrefix);
+            }
+            if (childFd >= 0) close(childFd);
+            free(childPrefix);
+        }
+
+        freeDirListing(&listing);
+        return;
+    }
+
+    // Unsorted entries are written as readdir returns them, before the directory is fully read
+    int readFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = readFd >= 0 ? fdopendir(readFd) : NULL;
+    if (!dir)
+    {
+        if (readFd >= 0) close(readFd);
+        fprintf(stderr, "shorkdir: cannot read %s: %s\n", prefixLen ? prefix : ".", strerror(errno));
+        return;
+    }
+
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL)
+    {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 || (!DOTFILES_VISIBLE && d->d_name[0] == '.'))
+            continue;
+
+        DirEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.name = d->d_name;
+        entry.type = d->d_type;
+        if (entry.type == DT_REG && isFileExecutable(dirFd, d->d_name))
+            entry.type = DT_EXE;
+        if (entry.type == DT_UNKNOWN) resolveEntry(dirFd, &entry);
+        if (LIST_META && !(entry.flags & ENTRY_STATTED)) statEntry(dirFd, &entry);
+        writeListEntry(&entry, prefix);
+
+        if (LIST_RECURSIVE && entry.type == DT_DIR)
+        {
+            int childFd = openat(dirFd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            char *childPrefix = malloc(prefixLen + strlen(d->d_name) + 2);
+            if (childFd >= 0 && childPrefix)
+            {
+                sprintf(childPrefix, "%s%s/", prefix, d->d_name);
+                listDirectory(childFd, childPrefix);
+            }
+            if (childFd >= 0) close(childFd);
+            free(childPrefix);
+        }
+    }
+
+    closedir(dir);
+}
+
+int isProgramInstalled(const char *prog)
+{
+    char *path = getenv("PATH");
+    if (!path)
+    {
+        char cmd[64];
+        snprintf(cmd, 64, "%s --version > /dev/null 2>&1", prog);
+        return (system(cmd) == 0);
+    }
+
+    char *paths = strdup(path);
+    char *dir = strtok(paths, ":");
+    while (dir)
+    {
+        char fullpath[512];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, prog);
+        if (access(fullpath, X_OK) == 0)
+        {
+            free(paths);
+            return 1;
+        }
+        dir = strtok(NULL, ":");
+    }
+    free(paths);
+
+    // Hard-coded check in /usr/libexec 
+    char libexecPath[PATH_MAX];
+    snprintf(libexecPath, PATH_MAX, "/usr/libexec/%s", prog);
+    if (access(libexecPath, X_OK) == 0) return 1;
+
+    return 0;
+}
+
+/**
+ * Shows a full-screen page of text until a key is pressed. Text taller than the terminal can be
+ * scrolled with up/down (or space for a page at a time).
+ * @param title Header's text string
+ * @param body Body's text string
+ * @return Key that closed the screen, or -1 if it could not be shown
+ */
+int printGenericScreen(char *title, char *body)
+{
+    const TextLayout *layout = getTextLayout(body, TERM_SIZE.ws_col, NULL);
+    if (!layout) return -1;
+
+    int bodyRow = COL_ENABLED ? 2 : 3;
+    int bodyHeight = TERM_SIZE.ws_row - (COL_ENABLED ? 2 : 4);
+    if (bodyHeight < 1) bodyHeight = 1;
+    int maxTop = layout->count > bodyHeight ? layout->count - bodyHeight : 0;
+    int top = 0;
+
+    clearScreen();
+    if (COL_ENABLED)
+    {
+        termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+        int len = termPrintf("%s", title);
+        for (size_t i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+        termPrintf("\033[%sm", COL_RESET);
+    }
+    else
+    {
+        termPrintf("%s\n", title);
+        for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+        termPrintf("\x1b[%d;1H", TERM_SIZE.ws_row - 1);
+        for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+    }
+
+    while (1)
+    {
+        // Only the visible slice of the layout is drawn; scrolling rewraps nothing
+        for (int i = 0; i < bodyHeight; i++)
+        {
+            termPrintf("\x1b[%d;1H", bodyRow + i);
+            if (top + i < layout->count) printTextLine(layout, top + i);
+            if (COL_ENABLED) termPrintf("\033[%sm", COL_RESET);
+            termPrintf("\x1b[K");
+        }
+
+        termPrintf("\x1b[%d;1H", TERM_SIZE.ws_row);
+        if (COL_ENABLED) termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+        if (maxTop == 0)
+        {
+            int key = awaitInput();
+            if (COL_ENABLED) termPrintf("\033[%sm", COL_RESET);
+            return key;
+        }
+
+        char prompt[128];
+        snprintf(prompt, sizeof(prompt), "Lines %d-%d of %d, up/down/space to scroll, other keys close ",
+            top + 1, top + bodyHeight, layout->count);
+        int len = termPrintf("%.*s", TERM_SIZE.ws_col - 1, prompt);
+        if (COL_ENABLED)
+        {
+            for (size_t i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+            termPrintf("\033[%sm", COL_RESET);
+        }
+        else
+            termPrintf("\x1b[K");
+
+        int key = readKey();
+        switch (mapNavKey(key))
+        {
+            case CURSOR_DOWN: top++; break;
+            case CURSOR_UP: top--; break;
+            case TOGGLE_MARK: top = top == maxTop ? 0 : top + bodyHeight; break;
+            default: return key;
+        }
+        if (top < 0) top = 0;
+        if (top > maxTop) top = maxTop;
+    }
+}
+
+/**
+ * Builds the path of a tree node relative to the tree's root directory.
+ * @param tree Tree view
+ * @param node Node index
+ * @param buffer Where to put the path ("." for the root)
+ * @param size Size of buffer
+ * @return 1 on success, 0 if the path is too long
+ */
+int getTreePath(TreeView *tree, int node, char *buffer, size_t size)
+{
+    if (node == 0)
+        return snprintf(buffer, size, ".") < (int)size;
+
+    // Names are copied in from the end of the buffer, walking up to the root
+    size_t pos = size - 1;
+    buffer[pos] = '\0';
+    for (int i = node; i > 0; i = tree->nodes[i].parent)
+    {
+        size_t len = strlen(tree->nodes[i].entry.name);
+        if (len + (i != node) > pos) return 0;
+        if (i != node) buffer[--pos] = '/';
+        pos -= len;
+        memcpy(buffer + pos, tree->nodes[i].entry.name, len);
+    }
+    memmove(buffer, buffer + pos, size - pos);
+    return 1;
+}
+
+/**
+ * @param tree Tree view
+ * @param node Index of a directory node
+ * @return New descriptor of the directory, or -1 on error
+ */
+int openTreeDir(TreeView *tree, int node)
+{
+    char path[PATH_MAX];
+    if (!getTreePath(tree, node, path, sizeof(path)))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return openat(tree->rootFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Frees a tree view's nodes, rows and names.
+ * @param tree Tree view to free
+ */
+void freeTree(TreeView *tree)
+{
+    free(tree->nodes);
+    free(tree->rows);
+    freeNameBlocks(&tree->names);
+    if (tree->rootFd >= 0) close(tree->rootFd);
+    tree->nodes = NULL;
+    tree->rows = NULL;
+    tree->count = tree->capacity = 0;
+    tree->rowCount = tree->rowCapacity = 0;
+    tree->rootFd = -1;
+}
+
+/**
+ * Reads the children of a directory node. They are appended to the node array as one contiguous
+ * run, in listing order, and their names are taken over from the listing they were read into
+ * rather than copied.
+ * @param tree Tree view
+ * @param node Index of the directory node
+ * @return 1 on success, otherwise 0 with errno set
+ */
+int loadTreeChildren(TreeView *tree, int node)
+{
+    DirListing children = { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL };
+    int fd = openTreeDir(tree, node);
+    if (fd < 0) return 0;
+    int ok = getDirContents(fd, &children, 0);
+    close(fd);
+    if (!ok) return 0;
+
+    // Listings too big for memory are paged from disk, so they cannot be kept in a tree
+    if (children.pageFd >= 0)
+    {
+        freeDirListing(&children);
+        errno = EFBIG;
+        return 0;
+    }
+
+    if (tree->count + children.count > tree->capacity)
+    {
+        int capacity = tree->capacity ? tree->capacity : 256;
+        while (capacity < tree->count + children.count) capacity *= 2;
+        TreeNode *nodes = realloc(tree->nodes, capacity * sizeof(TreeNode));
+        if (!nodes)
+        {
+            freeDirListing(&children);
+            errno = ENOMEM;
+            return 0;
+        }
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+
+    int depth = node == 0 ? 0 : tree->nodes[node].depth + 1;
+    for (int i = 0; i < children.count; i++)
+    {
+        TreeNode *child = &tree->nodes[tree->count + i];
+        child->entry = children.entries[i];
+        child->parent = node;
+        child->firstChild = -1;
+        child->childCount = 0;
+        child->depth = depth > 65535 ? 65535 : depth;
+        child->expanded = 0;
+    }
+    tree->nodes[node].firstChild = tree->count;
+    tree->nodes[node].childCount = children.count;
+    tree->count += children.count;
+
+    // Splice the listing's name blocks onto the tree's
+    NameBlock *last = children.names;
+    while (last && last->next) last = last->next;
+    if (last)
+    {
+        last->next = tree->names;
+        tree->names = children.names;
+        children.names = NULL;
+    }
+    freeDirListing(&children);
+    return 1;
+}
+
+/**
+ * @param tree Tree view
+ * @param node Node index
+ * @return Number of rows the node's descendants take up while it is expanded
+ */
+int countTreeRows(TreeView *tree, int node)
+{
+    TreeNode *parent = &tree->nodes[node];
+    int count = parent->childCount;
+    for (int i = 0; i < parent->childCount; i++)
+        if (tree->nodes[parent->firstChild + i].expanded)
+            count += countTreeRows(tree, parent->firstChild + i);
+    return count;
+}
+
+/**
+ * Writes out the rows of a node's visible descendants, in display order.
+ * @param tree Tree view
+ * @param node Node index
+ * @param rows Where to write the node indices
+ * @return Number of rows written
+ */
+int fillTreeRows(TreeView *tree, int node, int *rows)
+{
+    TreeNode *parent = &tree->nodes[node];
+    int count = 0;
+    for (int i = 0; i < parent->childCount; i++)
+    {
+        int child = parent->firstChild + i;
+        rows[count++] = child;
+        if (tree->nodes[child].expanded)
+            count += fillTreeRows(tree, child, rows + count);
+    }
+    return count;
+}
+
+/**
+ * Expands a directory in the tree, reading it first if this is the first time. The row index is
+ * updated in place: the directory's visible descendants (including any expanded before) are
+ * inserted after its row, so nothing else needs rebuilding.
+ * @param tree Tree view
+ * @param row Row of the directory (0-based), or -1 for the root
+ * @return 1 on success, otherwise 0 with errno set
+ */
+int expandTreeRow(TreeView *tree, int row)
+{
+    int node = row < 0 ? 0 : tree->rows[row];
+    if (tree->nodes[node].firstChild < 0 && !loadTreeChildren(tree, node)) return 0;
+
+    int added = countTreeRows(tree, node);
+    if (tree->rowCount + added > tree->rowCapacity)
+    {
+        int capacity = tree->rowCapacity ? tree->rowCapacity : 256;
+        while (capacity < tree->rowCount + added) capacity *= 2;
+        int *rows = realloc(tree->rows, capacity * sizeof(int));
+        if (!rows)
+        {
+            errno = ENOMEM;
+            return 0;
+        }
+        tree->rows = rows;
+        tree->rowCapacity = capacity;
+    }
+
+    if (added)
+    {
+        memmove(tree->rows + row + 1 + added, tree->rows + row + 1, (tree->rowCount - row - 1) * sizeof(int));
+        fillTreeRows(tree, node, tree->rows + row + 1);
+        tree->rowCount += added;
+    }
+    tree->nodes[node].expanded = 1;
+    return 1;
+}
+
+/**
+ * Collapses a directory in the tree. Its children stay loaded, so expanding it again is instant.
+ * @param tree Tree view
+ * @param row Row of the directory (0-based)
+ */
+void collapseTreeRow(TreeView *tree, int row)
+{
+    int depth = tree->nodes[tree->rows[row]].depth;
+    int end = row + 1;
+    while (end < tree->rowCount && tree->nodes[tree->rows[end]].depth > depth) end++;
+
+    memmove(tree->rows + row + 1, tree->rows + end, (tree->rowCount - end) * sizeof(int));
+    tree->rowCount -= end - row - 1;
+    tree->nodes[tree->rows[row]].expanded = 0;
+}
+
+/**
+ * Starts a tree view of a directory, with only its own entries shown.
+ * @param tree Tree view to (re)build
+ * @param dirFd Descriptor of the directory (not consumed)
+ * @return 1 on success, otherwise 0 with errno set
+ */
+int buildTree(TreeView *tree, int dirFd)
+{
+    freeTree(tree);
+    tree->rootFd = fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    tree->nodes = malloc(256 * sizeof(TreeNode));
+    if (tree->rootFd < 0 || !tree->nodes)
+    {
+        freeTree(tree);
+        errno = ENOMEM;
+        return 0;
+    }
+    tree->capacity = 256;
+
+    // Node 0 stands for the directory itself and is never shown
+    memset(&tree->nodes[0], 0, sizeof(TreeNode));
+    tree->nodes[0].parent = -1;
+    tree->nodes[0].firstChild = -1;
+    tree->count = 1;
+
+    if (!expandTreeRow(tree, -1))
+    {
+        int err = errno;
+        freeTree(tree);
+        errno = err;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @param tree Tree view
+ * @param row Row (0-based)
+ * @return Row of the node's parent, or -1 if it is at the top level
+ */
+int findTreeParentRow(TreeView *tree, int row)
+{
+    int depth = tree->nodes[tree->rows[row]].depth;
+    while (--row >= 0)
+        if (tree->nodes[tree->rows[row]].depth < depth) return row;
+    return -1;
+}
+
+/**
+ * Resolves and, if detail columns are shown, stats a range of tree rows. Rows are grouped by the
+ * directory they live in, so each directory is only opened once.
+ * @param tree Tree view
+ * @param from First row (inclusive)
+ * @param to Last row (exclusive)
+ * @param columns Detail columns being shown
+ */
+void prepareTreeRows(TreeView *tree, int from, int to, int columns)
+{
+    if (from < 0) from = 0;
+    if (to > tree->rowCount) to = tree->rowCount;
+
+    int dirNode = -1;
+    int dirFd = -1;
+    for (int i = from; i < to; i++)
+    {
+        TreeNode *node = &tree->nodes[tree->rows[i]];
+        int needsResolve = (node->entry.type == DT_UNKNOWN || node->entry.type == DT_LNK) && !(node->entry.flags & ENTRY_RESOLVED);
+        int needsStat = columns && !(node->entry.flags & ENTRY_STATTED);
+        if (!needsResolve && !needsStat) continue;
+
+        if (node->parent != dirNode)
+        {
+            if (dirFd >= 0) close(dirFd);
+            dirNode = node->parent;
+            dirFd = openTreeDir(tree, dirNode);
+        }
+        if (dirFd < 0) continue;
+        if (needsResolve) resolveEntry(dirFd, &node->entry);
+        if (needsStat) statEntry(dirFd, &node->entry);
+    }
+    if (dirFd >= 0) close(dirFd);
+}
+
+/**
+ * Prints the indentation and expand/collapse marker of a tree row.
+ * @param tree Tree view
+ * @param row Row (0-based)
+ * @param maxCols Columns available
+ * @return Columns used
+ */
+int printTreeIndent(TreeView *tree, int row, int maxCols)
+{
+    TreeNode *node = &tree->nodes[tree->rows[row]];
+    int isDir = node->entry.type == DT_DIR || (node->entry.flags & ENTRY_LINK_DIR);
+    int cols = node->depth * 2 + 2;
+    if (cols > maxCols / 2) cols = (maxCols / 4) * 2;
+    if (cols < 2) cols = 2;
+
+    for (int i = 0; i < cols - 2; i++) termPutc(' ');
+    termPutc(isDir ? (node->expanded ? '-' : '+') : ' ');
+    termPutc(' ');
+    return cols;
+}
+
+/**
+ * Works out which entry sits at the top of the listing for a given cursor position. Normally the
+ * cursor is kept centred; on slow serial lines (--baud of 38400 or less) the view instead moves
+ * in half-screen steps, so most cursor moves only redraw the cursor rather than every row.
+ * @param cursor Line cursor position (1-based)
+ * @param availHeight Rows available for the listing
+ * @param entryCount Number of entries in the listing
+ * @return Index of the first visible entry
+ */
+int getViewOffset(int cursor, int availHeight, int entryCount)
+{
+    int step = (BAUD_RATE && BAUD_RATE <= 38400 && availHeight > 1) ? availHeight / 2 : 1;
+    int offset = ((cursor - 1) / step) * step + step / 2 - (availHeight / 2);
+    if (offset > entryCount - availHeight) offset = entryCount - availHeight;
+    if (offset < 0) offset = 0;
+    return offset;
+}
+
+/**
+ * Prints the directory listing.
+ * @param listing Listing of the current directory
+ * @param tree Tree view to print instead of the listing, or NULL
+ * @param cursor Current line cursor position
+ * @param cursorPrev Previous line cursor position
+ * @param changedFrom Index of the first entry that changed in place, or -1 if none did
+ */
+void printDir(DirListing *listing, TreeView *tree, int cursor, int cursorPrev, int changedFrom)
+{
+    static int drawnOffset = -1;
+
+    int entryCount = tree ? tree->rowCount : listing->count;
+    int baseRow = 2;
+    int availHeight = TERM_SIZE.ws_row - 2;
+    if (!COL_ENABLED)
+    {
+        baseRow = 3;
+        availHeight = TERM_SIZE.ws_row - 4;
+    }
+
+    // If directory is empty
+    if (entryCount == 0 || (!tree && !listing->entries))
+    {
+        termPrintf("(empty)\n");
+        for (int i = 1; i < availHeight; i++) termPrintf("\n");
+        return;
+    }
+
+    int offset = getViewOffset(cursor, availHeight, entryCount);
+    int prevOffset = getViewOffset(cursorPrev, availHeight, entryCount);
+
+    int inScrolling = (prevOffset != offset);
+
+    // cursorPrev is initialised as 0 to indicate first frame should be drawn
+    if (cursorPrev == 0) inScrolling = 1;
+
+    int prevIndex = cursorPrev - 1;
+    int currIndex = cursor - 1;
+
+    // If we don't need to scroll, just update the cursor
+    if (!inScrolling && changedFrom < 0)
+    {
+        int rowPrev = baseRow + (prevIndex - offset);
+        int rowCurr = baseRow + (currIndex - offset);
+
+        // Remove old line cursor, redrawing the mark beside it as it may just have been toggled
+        DirEntry *prevEntry = tree ? &tree->nodes[tree->rows[prevIndex]].entry : getListingEntry(listing, prevIndex);
+        termPrintf("\x1b[%d;2H %c", rowPrev, (prevEntry->flags & ENTRY_MARKED) ? '+' : ' ');
+
+        // Print new line cursor
+        termPrintf("\x1b[%d;2H\033[%sm%c\033[%sm", rowCurr, COL_FOR_CURSOR, CURSOR_CHAR, COL_RESET);
+
+        return;
+    }
+
+    // Only resolve and stat what is about to be drawn, plus one screen ahead in the direction of travel
+    int columns = getActiveColumns();
+    if (tree)
+        prepareTreeRows(tree, offset, offset + availHeight, columns);
+    else
+        resolveEntries(listing, offset, offset + availHeight);
+    if (!tree && cursorPrev != 0 && offset > prevOffset)
+        resolveEntries(listing, offset + availHeight, offset + availHeight * 2);
+    else if (!tree && cursorPrev != 0 && offset < prevOffset)
+        resolveEntries(listing, offset - availHeight, offset);
+
+    if (columns && !tree)
+    {
+        statEntries(listing, offset, offset + availHeight);
+        if (cursorPrev != 0 && offset > prevOffset)
+            statEntries(listing, offset + availHeight, offset + availHeight * 2);
+        else if (cursorPrev != 0 && offset < prevOffset)
+            statEntries(listing, offset - availHeight, offset);
+    }
+
+    // Rows above the first change are still right, unless the view has moved; the last row is
+    // always redrawn as whether it shows the scroll indicator may have changed
+    int from = offset;
+    if (!inScrolling && offset == drawnOffset && changedFrom > offset)
+        from = changedFrom < offset + availHeight - 1 ? changedFrom : offset + availHeight - 1;
+    drawnOffset = offset;
+
+    int canGoUp = offset > 0;
+    int canGoDown = (offset + availHeight) < entryCount;
+    int linesPrinted = from - offset;
+    int nameCols = TERM_SIZE.ws_col - 5 - getDetailsWidth(columns);
+
+    for (int i = from; i < entryCount && i < offset + availHeight; i++)
+    {
+        DirEntry *entry = tree ? &tree->nodes[tree->rows[i]].entry : getListingEntry(listing, i);
+        termPrintf("\x1b[%d;1H\x1b[K", baseRow + linesPrinted);
+
+        char prefix = getTypeChar(entry->type);
+
+        char details[64] = "";
+        if (columns && entry->type == DT_GROUP) snprintf(details, sizeof(details), "%*s", getDetailsWidth(columns), "");
+        else if (columns) formatEntryDetails(entry, columns, details, sizeof(details));
+        char mark = (entry->flags & ENTRY_MARKED) ? '+' : ' ';
+
+        // Can scroll up indicator
+        if (canGoUp && i == offset)
+            termPrintf("\033[%sm^\033[%sm\x1b[K\n", COL_FOR_ARROW, COL_RESET);
+        // Can scroll down indicator
+        else if (canGoDown && i == offset + availHeight - 1)
+            termPrintf("\033[%smv\033[%sm\n", COL_FOR_ARROW, COL_RESET);
+        // Selected line
+        else if (i == currIndex)
+        {
+            termPrintf(" \033[%sm%c\033[%sm%c%c %s", COL_FOR_CURSOR, CURSOR_CHAR, COL_RESET, mark, prefix, details);
+            int indent = tree ? printTreeIndent(tree, i, nameCols) : 0;
+            printClipped(entry->display, entry->width, nameCols - indent);
+            termPrintf("\n");
+        }
+        // Other lines
+        else
+        {
+            termPrintf("  %c%c %s", mark, prefix, details);
+            int indent = tree ? printTreeIndent(tree, i, nameCols) : 0;
+            printClipped(entry->display, entry->width, nameCols - indent);
+            termPrintf("\n");
+        }
+
+        linesPrinted++;
+    }
+
+    // "Fill in" lines if listing is shorter than viewport, clearing any left by removed entries
+    if (!canGoUp && !canGoDown)
+        for (int i = linesPrinted; i < availHeight; i++)
+            termPrintf("\x1b[%d;1H\x1b[K\n", baseRow + i);
+}
+
+/**
+ * Draws one pane of the comparison view: the path of its directory, then its entries, each flagged
+ * if it is only on this side or differs from its namesake on the other side.
+ * @param listing Listing shown in the pane
+ * @param path Path of the pane's directory
+ * @param cursor Line cursor position in the pane
+ * @param col First screen column of the pane
+ * @param width Width of the pane in columns
+ * @param active Flags if this is the pane being browsed, the only one whose cursor is CURSOR_CHAR
+ * @param onlyChar Character flagging entries only on this side
+ * @param cursorPrev Cursor position when the pane was last drawn if only its cursor or marks have
+ * changed since, otherwise 0 to draw it on a cleared screen
+ */
+void printPane(DirListing *listing, const char *path, int cursor, int col, int width, int active, char onlyChar, int cursorPrev)
+{
+    int baseRow = COL_ENABLED ? 2 : 3;
+    int availHeight = TERM_SIZE.ws_row - (COL_ENABLED ? 3 : 5);
+    int offset = getViewOffset(cursor, availHeight, listing->count);
+
+    // Without scrolling, only the cursor column and the marks of the old and new rows change
+    if (cursorPrev > 0 && cursorPrev <= listing->count && getViewOffset(cursorPrev, availHeight, listing->count) == offset)
+    {
+        termPrintf("\x1b[%d;%dH  %c", baseRow + cursorPrev - offset, col, (getListingEntry(listing, cursorPrev - 1)->flags & ENTRY_MARKED) ? '+' : ' ');
+        termPrintf("\x1b[%d;%dH \033[%sm%c\033[%sm%c", baseRow + cursor - offset, col, COL_FOR_CURSOR, active ? CURSOR_CHAR : '-', COL_RESET,
+            (getListingEntry(listing, cursor - 1)->flags & ENTRY_MARKED) ? '+' : ' ');
+        return;
+    }
+
+    // The end of a path says the most about it, so a long one loses its start
+    char *display = malloc(strlen(path) + 1);
+    if (!display) return;
+    int pathWidth;
+    escapeDisplayName(path, display, &pathWidth);
+    const unsigned char *start = (const unsigned char *)display;
+    int clipped = pathWidth > width - 1;
+    while (*start && clipped && pathWidth > width - 4)
+    {
+        unsigned int cp = '?';
+        int n = decodeUtf8(start, &cp);
+        pathWidth -= getCodepointWidth(cp);
+        start += n ? n : 1;
+    }
+    termPrintf("\x1b[%d;%dH \033[%sm%s%s\033[%sm", baseRow, col, active ? COL_FOR_HEADING : COL_RESET, clipped ? "..." : "", start, COL_RESET);
+    free(display);
+
+    if (listing->count == 0)
+    {
+        termPrintf("\x1b[%d;%dH (empty)", baseRow + 1, col);
+        return;
+    }
+
+    int canGoUp = offset > 0;
+    int canGoDown = (offset + availHeight) < listing->count;
+    resolveEntries(listing, offset, offset + availHeight);
+
+    for (int i = offset; i < listing->count && i < offset + availHeight; i++)
+    {
+        // The other pane is next to this one, so rows are blanked to the pane's width only
+        if (cursorPrev) termPrintf("\x1b[%d;%dH%*s", baseRow + 1 + i - offset, col, width, "");
+        termPrintf("\x1b[%d;%dH", baseRow + 1 + i - offset, col);
+        if ((canGoUp && i == offset) || (canGoDown && i == offset + availHeight - 1))
+        {
+            termPrintf("\033[%sm%c\033[%sm", COL_FOR_ARROW, i == offset ? '^' : 'v', COL_RESET);
+            continue;
+        }
+
+        DirEntry *entry = getListingEntry(listing, i);
+        char mark = (entry->flags & ENTRY_MARKED) ? '+' : ' ';
+        char status = (entry->flags & ENTRY_ONLY_HERE) ? onlyChar : (entry->flags & ENTRY_DIFFERS) ? '!' : ' ';
+        if (i == cursor - 1)
+            termPrintf(" \033[%sm%c\033[%sm", COL_FOR_CURSOR, active ? CURSOR_CHAR : '-', COL_RESET);
+        else
+            termPrintf("  ");
+        termPrintf("%c%c\033[%sm%c\033[%sm ", mark, getTypeChar(entry->type), status == '!' ? COL_FOR_DIFFERS : COL_FOR_ONLY, status, COL_RESET);
+        printClipped(entry->display, entry->width, width - 6);
+    }
+}
+
+/**
+ * Draws the comparison view again after only the active pane's cursor or marks have changed.
+ * @param listing Listing of the active pane
+ * @param path Path of the active pane's directory
+ * @param cursor Line cursor position in the active pane
+ * @param cursorPrev Line cursor position when the pane was last drawn
+ * @param activeSide 0 if the left pane is being browsed, 1 if the right one is
+ */
+void printActivePane(DirListing *listing, const char *path, int cursor, int cursorPrev, int activeSide)
+{
+    int leftWidth = (TERM_SIZE.ws_col - 1) / 2;
+    if (activeSide)
+        printPane(listing, path, cursor, leftWidth + 2, TERM_SIZE.ws_col - leftWidth - 1, 1, '>', cursorPrev);
+    else
+        printPane(listing, path, cursor, 1, leftWidth, 1, '<', cursorPrev);
+}
+
+/**
+ * Draws the comparison view: the left and right panes side by side, split by a line. The screen
+ * must have been cleared first.
+ * @param left Listing of the left pane
+ * @param leftPath Path of the left pane's directory
+ * @param leftCursor Line cursor position in the left pane
+ * @param right Listing of the right pane
+ * @param rightPath Path of the right pane's directory
+ * @param rightCursor Line cursor position in the right pane
+ * @param activeSide 0 if the left pane is being browsed, 1 if the right one is
+ */
+void printPanes(DirListing *left, const char *leftPath, int leftCursor, DirListing *right, const char *rightPath, int rightCursor, int activeSide)
+{
+    int baseRow = COL_ENABLED ? 2 : 3;
+    int height = TERM_SIZE.ws_row - (COL_ENABLED ? 2 : 4);
+    int leftWidth = (TERM_SIZE.ws_col - 1) / 2;
+
+    printPane(left, leftPath, leftCursor, 1, leftWidth, !activeSide, '<', 0);
+    printPane(right, rightPath, rightCursor, leftWidth + 2, TERM_SIZE.ws_col - leftWidth - 1, activeSide, '>', 0);
+    for (int i = 0; i < height; i++)
+        termPrintf("\x1b[%d;%dH|", baseRow + i, leftWidth + 1);
+    termPrintf("\x1b[%d;1H", baseRow + height);
+}
+
+void printFooter(void)
+{
+    if (COL_ENABLED)
+        termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+    else
+        for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+
+    char *inspectStr = "";
+    if (FILE_INSTALLED)
+        inspectStr = " [i] Inspect";
+
+    char *hiddenStr = " [.] Hidden off";
+    if (!DOTFILES_VISIBLE)
+        hiddenStr = " [.] Hidden on";
+
+    // Job or search progress, or the result of the last action, replaces the key hints while there is one
+    char status[256];
+    pthread_mutex_lock(&JOB_LOCK);
+    snprintf(status, sizeof(status), "%s", STATUS_MSG);
+    pthread_mutex_unlock(&JOB_LOCK);
+
+    int len;
+    if (formatJobProgress(status, sizeof(status)) || formatSearchProgress(status, sizeof(status)) || status[0])
+    {
+        char display[256];
+        int width;
+        escapeDisplayName(status, display, &width);
+        len = printClipped(display, width, TERM_SIZE.ws_col - 1);
+    }
+    else
+        len = termPrintf("[hjkl] Navigate%s%s [?] Help [q] Quit ", inspectStr, hiddenStr);
+
+    if (COL_ENABLED)
+    {
+        for (int i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+        termPrintf("\033[%sm", COL_RESET);
+    }
+    else
+        termPrintf("\x1b[K");
+}
+
+/**
+ * Redraws only the footer, e.g. to update job progress.
+ */
+void refreshFooter(void)
+{
+    termPrintf("\x1b[%d;1H", COL_ENABLED ? TERM_SIZE.ws_row : TERM_SIZE.ws_row - 1);
+    printFooter();
+}
+
+/**
+ * @return How often to refresh job progress, in milliseconds. On a slow line (--baud) the footer
+ * is redrawn rarely enough that it never takes more than a tenth of the line's time.
+ */
+int getRefreshInterval(void)
+{
+    if (!BAUD_RATE) return JOB_REFRESH_MS;
+    long interval = (long)(TERM_SIZE.ws_col + 16) * 10 * 1000 * 10 / BAUD_RATE;
+    return interval > JOB_REFRESH_MS ? (int)interval : JOB_REFRESH_MS;
+}
+
+/**
+ * Decides whether search progress in the footer is due to be redrawn, as results can arrive far
+ * more often than it is worth redrawing it.
+ * @return 1 if it is due (and is taken to have been redrawn), otherwise 0
+ */
+int isSearchRefreshDue(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (now.tv_sec - SEARCH.shown.tv_sec) * 1000LL + (now.tv_nsec - SEARCH.shown.tv_nsec) / 1000000;
+    if (ms < getRefreshInterval()) return 0;
+    SEARCH.shown = now;
+    return 1;
+}
+
+/**
+ * @param currPath Current working directory path
+ */
+void printHeader(char *currPath)
+{
+    if (COL_ENABLED)
+        termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+
+    // Non-default sort orders are shown on the right-hand side
+    char label[40] = "";
+    if (SORT_MODE != SORT_NAME || DIRS_FIRST)
+        snprintf(label, sizeof(label), " [%s%s]", SORT_NAMES[SORT_MODE], DIRS_FIRST ? ", dirs first" : "");
+    size_t labelLen = strlen(label);
+    int room = TERM_SIZE.ws_col - (int)labelLen;
+    if (!COL_ENABLED && labelLen) room--;
+
+    // Truncation is done by display columns, not bytes, so multibyte paths never wrap
+    char *display = malloc(strlen(currPath) + 1);
+    if (!display)
+    {
+        if (COL_ENABLED)
+            termPrintf("\033[%sm", COL_RESET);
+        return;
+    }
+    int dirWidth;
+    escapeDisplayName(currPath, display, &dirWidth);
+
+    if (dirWidth <= room) 
+    {
+        termPrintf("%s", display);
+        if (COL_ENABLED || labelLen)
+            for (int i = dirWidth; i < room; i++)
+                termPrintf(" ");
+        termPrintf("%s", label);
+        if (!COL_ENABLED)
+            termPrintf("\n");
+    }
+    else
+    {
+        const unsigned char *start = (const unsigned char *)display;
+        int visibleWidth = dirWidth;
+        while (*start && visibleWidth > room - 3)
+        {
+            unsigned int cp = '?';
+            int n = decodeUtf8(start, &cp);
+            visibleWidth -= getCodepointWidth(cp);
+            start += n ? n : 1;
+        }
+        termPrintf("...%s", start);
+        if (COL_ENABLED || labelLen)
+            for (int i = visibleWidth + 3; i < room; i++)
+                termPrintf(" ");
+        termPrintf("%s", label);
+        if (!COL_ENABLED)
+            termPrintf("\n");
+    }
+    free(display);
+
+    if (COL_ENABLED)
+        termPrintf("\033[%sm", COL_RESET);
+    else
+        for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+}
+
+/**
+ * Builds the full path of an entry for display purposes.
+ * @param currPath Current working directory path
+ * @param name Entry name
+ * @return Newly allocated path (free after use), or NULL if out of memory
+ */
+char *joinEntryPath(char *currPath, const char *name)
+{
+    char *filePath = malloc(strlen(currPath) + strlen(name) + 2);
+    if (!filePath) return NULL;
+    if (strcmp(currPath, "/") == 0)
+        sprintf(filePath, "/%s", name);
+    else
+        sprintf(filePath, "%s/%s", currPath, name);
+    return filePath;
+}
+
+/**
+ * Prefetch thread. Reads and sorts the directory under the cursor into PREFETCH.listing, with the
+ * settings a normal read would have used when the prefetch was started. The settings are kept per
+ * thread, so changing them meanwhile does not affect this one.
+ */
+void *prefetchThread(void *arg)
+{
+    (void)arg;
+    DOTFILES_VISIBLE = PREFETCH.dotfiles;
+    SORT_MODE = PREFETCH.sortMode;
+    DIRS_FIRST = PREFETCH.dirsFirst;
+    int ok = 0;
+    int fd = openat(PREFETCH.parentFd, PREFETCH.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+
+    // The directory's mtime is taken first, so any change made while reading it is noticed
+    if (fd >= 0 && fstat(fd, &st) == 0)
+    {
+        PREFETCH.dev = st.st_dev;
+        PREFETCH.ino = st.st_ino;
+        PREFETCH.mtime = st.st_mtim;
+        ok = getDirContents(fd, &PREFETCH.listing, PREFETCH_MAX_ENTRIES);
+    }
+    if (fd >= 0) close(fd);
+
+    pthread_mutex_lock(&PREFETCH_LOCK);
+    PREFETCH.ok = ok && !PREFETCH.cancel;
+    PREFETCH.done = 1;
+    pthread_mutex_unlock(&PREFETCH_LOCK);
+    return NULL;
+}
+
+/**
+ * Collects the prefetch thread if it has finished.
+ * @param wait 1 to wait for it to finish, 0 to only check
+ * @return 1 if no prefetch is running any more, otherwise 0
+ */
+int reapPrefetch(int wait)
+{
+    if (!PREFETCH.running) return 1;
+
+    pthread_mutex_lock(&PREFETCH_LOCK);
+    int done = PREFETCH.done;
+    pthread_mutex_unlock(&PREFETCH_LOCK);
+    if (!done && !wait) return 0;
+
+    pthread_join(PREFETCH.thread, NULL);
+    PREFETCH.running = 0;
+    return 1;
+}
+
+/**
+ * Drops whatever has been prefetched. The prefetch thread must not be running.
+ */
+void discardPrefetch(void)
+{
+    freeDirListing(&PREFETCH.listing);
+    if (PREFETCH.parentFd >= 0) close(PREFETCH.parentFd);
+    free(PREFETCH.path);
+    PREFETCH.parentFd = -1;
+    PREFETCH.path = NULL;
+    PREFETCH.ok = 0;
+}
+
+/**
+ * Asks a running prefetch to stop, without waiting for it.
+ */
+void cancelPrefetch(void)
+{
+    pthread_mutex_lock(&PREFETCH_LOCK);
+    PREFETCH.cancel = 1;
+    pthread_mutex_unlock(&PREFETCH_LOCK);
+}
+
+/**
+ * Decides whether the entry under the cursor is worth prefetching. A prefetch of anything else
+ * (or with other sort or hidden-file settings) is cancelled, as the cursor has moved on.
+ * @param nav Navigation stack of the current directory
+ * @param entry Entry under the cursor, or NULL if there is none
+ * @return 1 if the entry should be prefetched once the cursor has rested on it, otherwise 0
+ */
+int wantPrefetch(NavStack *nav, DirEntry *entry)
+{
+    if (entry) resolveEntry(getNavFd(nav), entry);
+    int isDir = entry && (entry->type == DT_DIR || (entry->flags & ENTRY_LINK_DIR));
+    char *path = isDir ? joinEntryPath(nav->path, entry->name) : NULL;
+
+    pthread_mutex_lock(&PREFETCH_LOCK);
+    int cancelled = PREFETCH.cancel;
+    pthread_mutex_unlock(&PREFETCH_LOCK);
+    int same = path && PREFETCH.path && strcmp(path, PREFETCH.path) == 0 && PREFETCH.dotfiles == DOTFILES_VISIBLE &&
+        PREFETCH.sortMode == SORT_MODE && PREFETCH.dirsFirst == DIRS_FIRST && !cancelled;
+    free(path);
+
+    if (!same && PREFETCH.path) cancelPrefetch();
+    return isDir && !same;
+}
+
+/**
+ * Starts prefetching the entry under the cursor in the background, once any earlier prefetch has
+ * stopped.
+ * @param nav Navigation stack of the current directory
+ * @param entry Directory entry to prefetch
+ * @return 1 if the prefetch was started, 0 if an earlier one is still stopping (or on error)
+ */
+int startPrefetch(NavStack *nav, DirEntry *entry)
+{
+    if (!reapPrefetch(0)) return 0;
+    discardPrefetch();
+
+    PREFETCH.path = joinEntryPath(nav->path, entry->name);
+    PREFETCH.parentFd = fcntl(getNavFd(nav), F_DUPFD_CLOEXEC, 0);
+    if (!PREFETCH.path || PREFETCH.parentFd < 0)
+    {
+        discardPrefetch();
+        return 0;
+    }
+    snprintf(PREFETCH.name, sizeof(PREFETCH.name), "%s", entry->name);
+    PREFETCH.dotfiles = DOTFILES_VISIBLE;
+    PREFETCH.sortMode = SORT_MODE;
+    PREFETCH.dirsFirst = DIRS_FIRST;
+    PREFETCH.done = PREFETCH.cancel = 0;
+
+    if (pthread_create(&PREFETCH.thread, NULL, prefetchThread, NULL) != 0)
+    {
+        discardPrefetch();
+        return 0;
+    }
+    PREFETCH.running = 1;
+    return 1;
+}
+
+/**
+ * Uses the prefetched listing for a directory that has just been entered, if there is one and it
+ * is still current. A prefetch of that directory that is still running is waited for, since it
+ * would only be started again otherwise.
+ * @param nav Navigation stack, already in the entered directory
+ * @param listing Listing to replace
+ * @return 1 if the listing was replaced, 0 if the directory has to be read
+ */
+int takePrefetch(NavStack *nav, DirListing *listing)
+{
+    if (!PREFETCH.path || strcmp(PREFETCH.path, nav->path) != 0 || PREFETCH.dotfiles != DOTFILES_VISIBLE ||
+        PREFETCH.sortMode != SORT_MODE || PREFETCH.dirsFirst != DIRS_FIRST)
+        return 0;
+
+    reapPrefetch(1);
+    struct stat st;
+    int current = PREFETCH.ok && fstat(getNavFd(nav), &st) == 0 && st.st_dev == PREFETCH.dev && st.st_ino == PREFETCH.ino &&
+        st.st_mtim.tv_sec == PREFETCH.mtime.tv_sec && st.st_mtim.tv_nsec == PREFETCH.mtime.tv_nsec;
+    if (current)
+    {
+        freeDirListing(listing);
+        *listing = PREFETCH.listing;
+        PREFETCH.listing.entries = NULL;
+        PREFETCH.listing.names = NULL;
+        PREFETCH.listing.windowFlags = NULL;
+        PREFETCH.listing.dirFd = -1;
+        PREFETCH.listing.count = PREFETCH.listing.capacity = 0;
+    }
+    discardPrefetch();
+    return current;
+}
+
+/**
+ * Stops any prefetch and frees what it read, before exiting.
+ */
+void stopPrefetch(void)
+{
+    cancelPrefetch();
+    reapPrefetch(1);
+    discardPrefetch();
+}
+
+/**
+ * @param currPath Current working directory path
+ * @param dirFd Descriptor of the current directory
+ * @param entry Directory entry to inspect
+ */
+void inspectEntry(char *currPath, int dirFd, DirEntry *entry)
+{
+    int fds[2];
+    if (pipe(fds) != 0) return;
+
+    // file is run from inside the directory, so the entry's name is all it needs
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        if (fchdir(dirFd) == 0)
+            execlp("file", "file", "-b", "--", entry->name, (char *)NULL);
+        _exit(1);
+    }
+
+    close(fds[1]);
+    size_t capacity = 4096;
+    size_t len = 0;
+    ssize_t n;
+    char *buffer = malloc(capacity);
+    while (buffer)
+    {
+        if (len == capacity - 1)
+        {
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown) break;
+            buffer = grown;
+            capacity *= 2;
+        }
+        if ((n = read(fds[0], buffer + len, capacity - 1 - len)) <= 0) break;
+        len += n;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    if (!buffer) return;
+    buffer[len] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+
+    // Checksums of regular files are shown once computed; until then they can be asked for
+    struct stat st;
+    HashResult sums;
+    int regular = fstatat(dirFd, entry->name, &st, 0) == 0 && S_ISREG(st.st_mode);
+    int known = regular && findHashResult(&st, &sums);
+    char extra[192] = "";
+    if (known)
+    {
+        char sha[65];
+        for (int i = 0; i < 32; i++) sprintf(sha + i * 2, "%02x", sums.sha256[i]);
+        snprintf(extra, sizeof(extra), "\n\nCRC32: %08x\nCRC32C: %08x\nxxHash64: %016llx\nSHA-256: %s", sums.crc32, sums.crc32c, sums.xxh64, sha);
+    }
+    else if (regular)
+        snprintf(extra, sizeof(extra), "\n\nPress [#] to compute its checksums in the background");
+
+    char *filePath = joinEntryPath(currPath, entry->name);
+    char *body = NULL;
+    if (!filePath || asprintf(&body, "%s%s", buffer, extra) < 0)
+    {
+        free(filePath);
+        free(buffer);
+        return;
+    }
+    char *title = malloc(strlen(filePath) + 10);
+    int key = -1;
+    if (title)
+    {
+        sprintf(title, "Inspect: %s", filePath);
+        key = printGenericScreen(title, body);
+        free(title);
+    }
+    free(filePath);
+    free(body);
+    free(buffer);
+
+    if (key == '#' && regular && !known)
+    {
+        char **names = malloc(sizeof(char *));
+        if (names) names[0] = strdup(entry->name);
+        int jobFd = names && names[0] ? fcntl(dirFd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (jobFd < 0 || !queueJob(JOB_HASH, jobFd, -1, names, 1))
+        {
+            setStatus("Cannot compute checksums of %s: %s", entry->display, strerror(errno));
+            if (jobFd >= 0) close(jobFd);
+            if (names) free(names[0]);
+            free(names);
+        }
+    }
+}
+
+void showCursor(void)
+{
+    termPrintf("\033[?25h");
+    if (COL_ENABLED) termPrintf("\033[%sm", COL_RESET);
+}
+
+/**
+ * General center-justified dialog message.
+ * @param message Message the dialog should display
+ * @param width How wide the dialog should be
+ */
+void showDialog(char *message, int width)
+{
+    if (width > TERM_SIZE.ws_col - 6) width = TERM_SIZE.ws_col - 6;
+
+    const TextLayout *layout = getTextLayout(message, width, NULL);
+    if (!layout) return;
+    int lines = layout->count;
+
+    // Calculate where to begin printing the dialog
+    int startRow = (TERM_SIZE.ws_row - lines) / 2;
+    int startCol = (TERM_SIZE.ws_col - (width + 4)) / 2 + 1;  
+
+    int pad = '#';
+    if (COL_ENABLED) 
+    {
+        // Set dialog console colours
+        termPrintf("\033[%s;%sm", COL_FOR_WHITE, COL_BAK_BLUE);
+        pad = ' ';
+    }
+
+    // Print top border
+    termPrintf("\x1b[%d;%dH", startRow, startCol);
+    for (int j = 0; j < width + 4; j++) termPutc(pad);
+
+    // Print message
+    for (int i = 0; i < lines; i++)
+    {
+        termPrintf("\x1b[%d;%dH", startRow + 1 + i, startCol);
+
+        termPrintf("%c ", pad);
+        printTextLine(layout, i);
+        for (int j = layout->lines[i].width; j < width; j++) termPutc(' ');
+        termPrintf(" %c", pad);
+    }
+
+    // Print bottom border
+    termPrintf("\x1b[%d;%dH", startRow + 1 + lines, startCol);
+    for (int j = 0; j < width + 4; j++) termPutc(pad);
+
+    // Reset console colour
+    if (COL_ENABLED) termPrintf("\033[%sm", COL_RESET);
+}
+
+/**
+ * Prints text to stdout wrapped to the terminal's width.
+ * @param text Text to print
+ * @param indent String to start wrapped continuation lines with, or NULL
+ */
+void printWrapped(const char *text, const char *indent)
+{
+    const TextLayout *layout = getTextLayout(text, TERM_SIZE.ws_col, indent);
+    if (!layout)
+    {
+        printf("%s", text);
+        return;
+    }
+    for (int i = 0; i < layout->count; i++)
+    {
+        printTextLine(layout, i);
+        termPrintf("\n");
+    }
+}
+
+void showHelp(void)
+{
+    printWrapped("A terminal-based file browser, designed to provide simple, fast directory browsing and navigation. It can try to open a selected file in a installed text editor. Provided that file is installed, it can also identify and describe a selected file.\n\n", NULL);
+    printWrapped("Usage: shorkdir [OPTIONS] [DIRECTORY]\n\n", NULL);
+    printWrapped("Options:\n-h, --help        Displays help information and exits\n-nc, --no-col     Disables all coloured output\n-c, --columns     Shows detail columns from LIST: p (permissions), u (user), g (group), s (size), m (modified)\n-s, --sort        Sorts by MODE: name, natural, size, mtime, type or extension\n-df, --dirs-first Lists directories before other entries\n-nh, --no-hidden  Hides hidden entries\n-M, --mem-budget  Keeps listings within SIZE bytes (e.g. 256K), paging larger ones from a temporary file\n-b, --baud        Tunes drawing for a serial line of RATE bits per second (e.g. 9600)\n-L, --list        Prints the listing to stdout and exits instead of browsing\n-0, --null        With --list, ends each entry with NUL instead of a new line\n-j, --json        With --list, prints each entry as a JSON object on its own line\n-R, --recursive   With --list, includes the contents of subdirectories\n-m, --meta        With --list, includes mode, owner, size and mtime\n-U, --unsorted    With --list, prints entries in directory order as they are read\n\n", "                  ");
+    printWrapped("Directory:\nPath to a directory to start at. If excluded, the current directory will be opened instead.\n\n", NULL);
+    printWrapped("Notes:\nThe host terminal size must be 62x14 before starting.\n", NULL);
+}
+
+/**
+ * @return Path of the jump database, or NULL if it is disabled or has nowhere to live
+ */
+const char *getJumpDbPath(void)
+{
+    static char path[PATH_MAX];
+    char *env = getenv("SHORKDIR_JUMP_DB");
+    if (env) return env[0] ? env : NULL;
+
+    char *home = getenv("HOME");
+    if (!home || !home[0]) return NULL;
+    snprintf(path, sizeof(path), "%s/.shorkdir_jump", home);
+    return path;
+}
+
+/**
+ * Locks the jump database, checking the descriptor still refers to the file at its path.
+ * Compaction replaces the file, so a descriptor opened before then has to be reopened.
+ * @param fd Descriptor of the database
+ * @param dbPath Path of the database
+ * @param st Output status of the locked file
+ * @return 1 if locked, otherwise 0 (the path names another file or none at all)
+ */
+int lockJumpDb(int fd, const char *dbPath, struct stat *st)
+{
+    struct stat pathSt;
+    if (flock(fd, LOCK_EX) != 0) return 0;
+    if (fstat(fd, st) == 0 && stat(dbPath, &pathSt) == 0 && st->st_dev == pathSt.st_dev && st->st_ino == pathSt.st_ino)
+        return 1;
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+/**
+ * Records a visit to a directory by appending a small record to the jump database. Nothing is
+ * read; the database is opened once for appending, so a visit costs a lock, a stat and a write.
+ * @param path Directory visited
+ */
+void recordJumpVisit(const char *path)
+{
+    size_t pathLen = strlen(path);
+    if (pathLen == 0 || pathLen > 0xFFFF || JUMP_DB_FD == -2) return;
+
+    const char *dbPath = getJumpDbPath();
+    if (!dbPath)
+    {
+        JUMP_DB_FD = -2;
+        return;
+    }
+
+    struct stat st;
+    for (int attempt = 0; ; attempt++)
+    {
+        if (JUMP_DB_FD < 0)
+        {
+            // Whoever creates the database writes its header, holding the lock so nobody appends first
+            int fd = open(dbPath, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd >= 0)
+            {
+                JumpHeader header = { JUMP_MAGIC, sizeof(JumpHeader) };
+                flock(fd, LOCK_EX);
+                if (write(fd, &header, sizeof(header)) != sizeof(header))
+                {
+                    unlink(dbPath);
+                    close(fd);
+                    JUMP_DB_FD = -2;
+                    return;
+                }
+            }
+            else if (errno == EEXIST)
+                fd = open(dbPath, O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (fd < 0)
+            {
+                JUMP_DB_FD = -2;
+                return;
+            }
+            JUMP_DB_FD = fd;
+        }
+        if (lockJumpDb(JUMP_DB_FD, dbPath, &st)) break;
+
+        // Another session compacted the database into a new file since we opened it
+        close(JUMP_DB_FD);
+        JUMP_DB_FD = -1;
+        if (attempt == 2) return;
+    }
+
+    // One write per record, under the lock, so concurrent sessions never interleave. A short
+    // write is cut off again, as a partial record would hide every record appended after it.
+    if (st.st_size >= (off_t)sizeof(JumpHeader))
+    {
+        size_t recordLen = (sizeof(JumpRecord) + pathLen + 3) & ~(size_t)3;
+        char buffer[sizeof(JumpRecord) + 0x10000 + 4];
+        JumpRecord record = { (unsigned int)time(NULL), 1, (unsigned short)pathLen, 0 };
+        memset(buffer, 0, recordLen);
+        memcpy(buffer, &record, sizeof(record));
+        memcpy(buffer + sizeof(record), path, pathLen);
+        ssize_t written = write(JUMP_DB_FD, buffer, recordLen);
+        if (written > 0 && (size_t)written != recordLen) ftruncate(JUMP_DB_FD, st.st_size);
+    }
+    flock(JUMP_DB_FD, LOCK_UN);
+}
+
+/**
+ * Frees a jump index.
+ * @param index Index to free
+ */
+void freeJumpIndex(JumpIndex *index)
+{
+    for (int i = 0; i < index->count; i++) free(index->entries[i].path);
+    free(index->entries);
+    free(index->table);
+    free(index->matches);
+    memset(index, 0, sizeof(JumpIndex));
+}
+
+/**
+ * Rebuilds a jump index's hash table with the given number of buckets.
+ * @param index Index to rehash
+ * @param buckets Number of buckets, a power of two more than twice the entry count
+ * @return 1 on success, otherwise 0
+ */
+int rehashJumpIndex(JumpIndex *index, int buckets)
+{
+    int *table = malloc(buckets * sizeof(int));
+    if (!table) return 0;
+    memset(table, -1, buckets * sizeof(int));
+    for (int i = 0; i < index->count; i++)
+    {
+        int slot = hashBytes(index->entries[i].path, index->entries[i].pathLen) & (buckets - 1);
+        while (table[slot] >= 0) slot = (slot + 1) & (buckets - 1);
+        table[slot] = i;
+    }
+    free(index->table);
+    index->table = table;
+    index->buckets = buckets;
+    return 1;
+}
+
+/**
+ * Adds visits to a directory's entry in a jump index, creating the entry on its first visit.
+ * @param index Index to add to
+ * @param path Directory visited (not terminated)
+ * @param pathLen Length of path
+ * @param visits Number of visits
+ * @param lastVisit Time of the latest visit
+ * @return 1 on success, otherwise 0
+ */
+int addJumpVisits(JumpIndex *index, const char *path, size_t pathLen, unsigned int visits, unsigned int lastVisit)
+{
+    // The table is kept at most half full
+    if ((index->count + 1) * 2 > index->buckets && !rehashJumpIndex(index, index->buckets ? index->buckets * 2 : 64))
+        return 0;
+
+    int slot = hashBytes(path, pathLen) & (index->buckets - 1);
+    while (index->table[slot] >= 0)
+    {
+        JumpEntry *entry = &index->entries[index->table[slot]];
+        if (entry->pathLen == pathLen && memcmp(entry->path, path, pathLen) == 0)
+        {
+            entry->visits += visits;
+            if (lastVisit > entry->lastVisit) entry->lastVisit = lastVisit;
+            return 1;
+        }
+        slot = (slot + 1) & (index->buckets - 1);
+    }
+
+    if (index->count == index->capacity)
+    {
+        int capacity = index->capacity ? index->capacity * 2 : 64;
+        JumpEntry *entries = realloc(index->entries, capacity * sizeof(JumpEntry));
+        if (!entries) return 0;
+        index->entries = entries;
+        int *matches = realloc(index->matches, capacity * sizeof(int));
+        if (!matches) return 0;
+        index->matches = matches;
+        index->capacity = capacity;
+    }
+
+    char *copy = malloc(pathLen + 1);
+    if (!copy) return 0;
+    memcpy(copy, path, pathLen);
+    copy[pathLen] = '\0';
+
+    JumpEntry *entry = &index->entries[index->count];
+    entry->path = copy;
+    entry->pathLen = pathLen;
+    entry->visits = visits;
+    entry->lastVisit = lastVisit;
+    entry->score = 0;
+    index->table[slot] = index->count++;
+    return 1;
+}
+
+/**
+ * Rewrites the jump database with one record per directory, replacing the appended visit log.
+ * Visit counts are aged once their total grows large, so old habits fade. The caller holds the
+ * lock on the old file, so nothing is appended to it while it is replaced; sessions still
+ * holding it open notice the replacement when they next lock it.
+ * @param index Index holding the aggregated records, updated to match the new file
+ * @param dbPath Path of the database
+ * @return 1 if the database was replaced, otherwise 0
+ */
+int compactJumpDb(JumpIndex *index, const char *dbPath)
+{
+    unsigned long long total = 0;
+    for (int i = 0; i < index->count; i++) total += index->entries[i].visits;
+    int age = total > JUMP_MAX_VISITS;
+
+    size_t tmpLen = strlen(dbPath) + 5;
+    char *tmpPath = malloc(tmpLen);
+    if (!tmpPath) return 0;
+    snprintf(tmpPath, tmpLen, "%s.new", dbPath);
+
+    int tmpFd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *out = tmpFd >= 0 ? fdopen(tmpFd, "w") : NULL;
+    if (!out)
+    {
+        if (tmpFd >= 0) close(tmpFd);
+        unlink(tmpPath);
+        free(tmpPath);
+        return 0;
+    }
+
+    JumpHeader header = { JUMP_MAGIC, 0 };
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int i = 0; ok && i < index->count; i++)
+    {
+        JumpEntry *entry = &index->entries[i];
+        unsigned int visits = age ? entry->visits * 9 / 10 : entry->visits;
+        if (visits == 0) continue;
+
+        JumpRecord record = { entry->lastVisit, visits, (unsigned short)entry->pathLen, 0 };
+        static const char padding[4] = { 0 };
+        size_t padLen = ((entry->pathLen + 3) & ~3u) - entry->pathLen;
+        ok = fwrite(&record, sizeof(record), 1, out) == 1 && fwrite(entry->path, 1, entry->pathLen, out) == entry->pathLen &&
+            fwrite(padding, 1, padLen, out) == padLen;
+    }
+
+    // The header records where the compacted part ends, so we know when to compact again
+    long end = ftell(out);
+    header.compactedBytes = (unsigned int)end;
+    ok = ok && end > 0 && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    struct stat st;
+    ok = ok && fflush(out) == 0 && fstat(tmpFd, &st) == 0;
+    if (fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmpPath, dbPath) != 0)
+    {
+        unlink(tmpPath);
+        free(tmpPath);
+        return 0;
+    }
+    free(tmpPath);
+
+    // Our append descriptor points at the old file now
+    if (JUMP_DB_FD >= 0) close(JUMP_DB_FD);
+    JUMP_DB_FD = -1;
+
+    // The index is brought in line with the new file, so later loads only parse what is appended to it
+    int kept = 0;
+    for (int i = 0; i < index->count; i++)
+    {
+        JumpEntry entry = index->entries[i];
+        if (age) entry.visits = entry.visits * 9 / 10;
+        if (entry.visits == 0) free(entry.path);
+        else index->entries[kept++] = entry;
+    }
+    index->count = kept;
+    if (!rehashJumpIndex(index, index->buckets))
+    {
+        freeJumpIndex(index);
+        return 1;
+    }
+    index->dev = st.st_dev;
+    index->ino = st.st_ino;
+    index->parsed = header.compactedBytes;
+    return 1;
+}
+
+/**
+ * Brings a jump index up to date with the database, aggregating visits into one entry per
+ * directory. The index is kept between prompts, so only the records appended since the last
+ * load are read; it is rebuilt from scratch if another session has replaced the file.
+ * @param index Index to update
+ * @return 1 if the database could be read, otherwise 0
+ */
+int loadJumpIndex(JumpIndex *index)
+{
+    const char *dbPath = getJumpDbPath();
+    if (!dbPath) return 0;
+
+    int fd = -1;
+    struct stat st;
+    for (int attempt = 0; attempt < 3 && fd < 0; attempt++)
+    {
+        fd = open(dbPath, O_RDWR | O_CLOEXEC);
+        if (fd < 0) return 0;
+        if (!lockJumpDb(fd, dbPath, &st))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) return 0;
+
+    // The log is mapped while the lock is held, so no other session can be part way through
+    // appending to it or replacing it
+    size_t size = st.st_size;
+    char *data = size >= sizeof(JumpHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    JumpHeader header;
+    if (data != MAP_FAILED) memcpy(&header, data, sizeof(header));
+    if (data == MAP_FAILED || memcmp(header.magic, JUMP_MAGIC, 4) != 0)
+    {
+        if (data != MAP_FAILED) munmap(data, size);
+        close(fd);
+        return 0;
+    }
+
+    if (st.st_dev != index->dev || st.st_ino != index->ino || (size_t)st.st_size < index->parsed)
+    {
+        freeJumpIndex(index);
+        index->dev = st.st_dev;
+        index->ino = st.st_ino;
+        index->parsed = sizeof(JumpHeader);
+    }
+
+    // Only records appended since the last prompt are parsed; the index copies their paths out
+    size_t pos = index->parsed;
+    while (pos + sizeof(JumpRecord) <= size)
+    {
+        JumpRecord record;
+        memcpy(&record, data + pos, sizeof(record));
+        size_t next = pos + ((sizeof(record) + record.pathLen + 3) & ~(size_t)3);
+        if (record.pathLen == 0 || next > size) break;
+        if (!addJumpVisits(index, data + pos + sizeof(record), record.pathLen, record.visits, record.lastVisit)) break;
+        pos = next;
+    }
+    index->parsed = pos;
+    munmap(data, size);
+
+    // The lock is held while compacting so two sessions never rewrite the file at once
+    size_t appended = size - (header.compactedBytes ? header.compactedBytes : sizeof(JumpHeader));
+    if (appended > JUMP_COMPACT_MIN && appended > header.compactedBytes) compactJumpDb(index, dbPath);
+    close(fd);
+
+    // Frecency: how often, weighted by how recently
+    time_t now = time(NULL);
+    for (int i = 0; i < index->count; i++)
+    {
+        JumpEntry *entry = &index->entries[i];
+        long age = now - (time_t)entry->lastVisit;
+        double weight = age < 3600 ? 4.0 : age < 86400 ? 2.0 : age < 604800 ? 0.5 : 0.25;
+        entry->score = entry->visits * weight;
+    }
+
+    for (int i = 0; i < index->count; i++) index->matches[i] = i;
+    index->matchCount = index->count;
+    return 1;
+}
+
+/**
+ * @param path Path to test
+ * @param query Space-separated terms
+ * @return 1 if every term appears in the path, in order and ignoring case, otherwise 0
+ */
+int matchJumpQuery(const char *path, const char *query)
+{
+    char term[256];
+    while (*query)
+    {
+        while (*query == ' ') query++;
+        size_t len = strcspn(query, " ");
+        if (len == 0) break;
+        if (len >= sizeof(term)) len = sizeof(term) - 1;
+        memcpy(term, query, len);
+        term[len] = '\0';
+        query += len;
+
+        const char *found = strcasestr(path, term);
+        if (!found) return 0;
+        path = found + len;
+    }
+    return 1;
+}
+
+/**
+ * Narrows the index's matches to a new query. If the query only extends the previous one, only
+ * the previous matches need checking; otherwise every entry is checked again.
+ * @param index Index to filter
+ * @param query New query
+ * @param extends Flags if query starts with the previous query
+ */
+void filterJumpIndex(JumpIndex *index, const char *query, int extends)
+{
+    if (!extends)
+    {
+        for (int i = 0; i < index->count; i++) index->matches[i] = i;
+        index->matchCount = index->count;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < index->matchCount; i++)
+        if (matchJumpQuery(index->entries[index->matches[i]].path, query))
+            index->matches[kept++] = index->matches[i];
+    index->matchCount = kept;
+}
+
+/**
+ * Picks the best-scoring matches without sorting them all.
+ * @param index Index to pick from
+ * @param best Output array of entry indices, best first
+ * @param max Maximum number to pick
+ * @return Number picked
+ */
+int getTopJumpMatches(JumpIndex *index, int *best, int max)
+{
+    int count = 0;
+    for (int i = 0; i < index->matchCount; i++)
+    {
+        int candidate = index->matches[i];
+        double score = index->entries[candidate].score;
+        if (count == max && score <= index->entries[best[count - 1]].score) continue;
+
+        int pos = count < max ? count++ : max - 1;
+        while (pos > 0 && index->entries[best[pos - 1]].score < score)
+        {
+            best[pos] = best[pos - 1];
+            pos--;
+        }
+        best[pos] = candidate;
+    }
+    return count;
+}
+
+/**
+ * Shows the jump prompt: as the user types, the most frecent visited directories matching the
+ * query are listed. Enter jumps to the selected one, Esc cancels.
+ * @return Newly allocated path of the chosen directory, or NULL if cancelled
+ */
+char *showJumpPrompt(void)
+{
+    JumpIndex *index = &JUMP_INDEX;
+    if (!loadJumpIndex(index))
+    {
+        setStatus("No visited directories recorded yet");
+        return NULL;
+    }
+
+    int baseRow = COL_ENABLED ? 2 : 3;
+    int availHeight = TERM_SIZE.ws_row - (COL_ENABLED ? 2 : 4);
+    int *best = malloc(availHeight * sizeof(int));
+    char query[128] = "";
+    char prevQuery[128] = "";
+    int selected = 0;
+    char *result = NULL;
+
+    clearScreen();
+    printHeader("Jump to a recently visited directory");
+
+    for (;;)
+    {
+        if (strcmp(query, prevQuery) != 0)
+        {
+            filterJumpIndex(index, query, prevQuery[0] && strncmp(query, prevQuery, strlen(prevQuery)) == 0);
+            strcpy(prevQuery, query);
+            selected = 0;
+        }
+        int shown = best ? getTopJumpMatches(index, best, availHeight) : 0;
+        if (selected >= shown) selected = shown ? shown - 1 : 0;
+
+        for (int i = 0; i < availHeight; i++)
+        {
+            termPrintf("\x1b[%d;1H\x1b[K", baseRow + i);
+            if (i >= shown) continue;
+
+            JumpEntry *entry = &index->entries[best[i]];
+            char *display = malloc(entry->pathLen + 1);
+            if (!display) continue;
+            int width;
+            escapeDisplayName(entry->path, display, &width);
+            if (i == selected) termPrintf(" \033[%sm%c\033[%sm ", COL_FOR_CURSOR, CURSOR_CHAR, COL_RESET);
+            else termPrintf("   ");
+            printClipped(display, width, TERM_SIZE.ws_col - 3);
+            free(display);
+        }
+
+        termPrintf("\x1b[%d;1H", COL_ENABLED ? TERM_SIZE.ws_row : TERM_SIZE.ws_row - 1);
+        if (COL_ENABLED) termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+        else for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+        int len = termPrintf("Jump (%d): %.*s_", index->matchCount, TERM_SIZE.ws_col - 20, query);
+        if (COL_ENABLED)
+        {
+            for (int i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+            termPrintf("\033[%sm", COL_RESET);
+        }
+        else termPrintf("\x1b[K");
+
+        int c = readKey();
+        if (c == '\n' || c == '\r')
+        {
+            if (shown) result = strdup(index->entries[best[selected]].path);
+            break;
+        }
+        else if (c == 27)
+        {
+            // A lone Esc cancels; arrow keys arrive as Esc [ A/B
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if (poll(&pfd, 1, 50) <= 0) break;
+            if (readKey() != '[') continue;
+            c = readKey();
+            if (c == 'A' && selected > 0) selected--;
+            else if (c == 'B' && selected + 1 < shown) selected++;
+        }
+        else if (c == 16 && selected > 0) selected--;
+        else if (c == 14 && selected + 1 < shown) selected++;
+        else if ((c == 127 || c == 8) && query[0])
+            query[strlen(query) - 1] = '\0';
+        else if (c == EOF)
+            break;
+        else if (c >= 32 && c != 127 && strlen(query) + 1 < sizeof(query))
+        {
+            size_t qlen = strlen(query);
+            query[qlen] = c;
+            query[qlen + 1] = '\0';
+        }
+    }
+
+    free(best);
+    return result;
+}
+
+/**
+ * Asks for the text to search file contents for, on the footer line.
+ * @return Newly allocated text to search for, or NULL if cancelled
+ */
+char *showSearchPrompt(void)
+{
+    char query[SEARCH_MAX_PATTERN + 1] = "";
+
+    for (;;)
+    {
+        char display[SEARCH_MAX_PATTERN + 1];
+        int width;
+        escapeDisplayName(query, display, &width);
+
+        termPrintf("\x1b[%d;1H", COL_ENABLED ? TERM_SIZE.ws_row : TERM_SIZE.ws_row - 1);
+        if (COL_ENABLED) termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+        else for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
+        int len = termPrintf("Search file contents for: ");
+        len += printClipped(display, width, TERM_SIZE.ws_col - len - 2);
+        len += termPrintf("_");
+        if (COL_ENABLED)
+        {
+            for (int i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+            termPrintf("\033[%sm", COL_RESET);
+        }
+        else termPrintf("\x1b[K");
+
+        int c = readKey();
+        if (c == '\n' || c == '\r')
+            return query[0] ? strdup(query) : NULL;
+        else if (c == 27)
+        {
+            // A lone Esc cancels; the rest of any other escape sequence is ignored
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if (poll(&pfd, 1, 50) <= 0) return NULL;
+            if (readKey() == '[') readKey();
+        }
+        else if ((c == 127 || c == 8) && query[0])
+            query[strlen(query) - 1] = '\0';
+        else if (c == EOF)
+            return NULL;
+        else if (c >= 32 && c != 127 && strlen(query) < SEARCH_MAX_PATTERN)
+        {
+            size_t qlen = strlen(query);
+            query[qlen] = c;
+            query[qlen + 1] = '\0';
+        }
+    }
+}
+
+/**
+ * @param inf Inflater
+ * @return Next byte of compressed input, or -1 at the end of the file
+ */
+int readInflateByte(Inflater *inf)
+{
+    if (inf->inPos == inf->inLen)
+    {
+        ssize_t n = pread(inf->fd, inf->in, INFLATE_IN_SIZE, inf->inOffset);
+        if (n <= 0) return -1;
+        inf->inOffset += n;
+        inf->inPos = 0;
+        inf->inLen = n;
+    }
+    return inf->in[inf->inPos++];
+}
+
+/**
+ * Makes sure at least a number of input bits are buffered.
+ * @param inf Inflater
+ * @param bits Number of bits needed (at most 24)
+ * @return 1 on success, 0 if the input ran out first
+ */
+int needBits(Inflater *inf, int bits)
+{
+    while (inf->bitCount < bits)
+    {
+        int c = readInflateByte(inf);
+        if (c < 0) return 0;
+        inf->bitBuf |= (unsigned long)c << inf->bitCount;
+        inf->bitCount += 8;
+    }
+    return 1;
+}
+
+/**
+ * @param inf Inflater
+ * @param bits Number of bits to take (at most 16)
+ * @return The bits, least significant first as deflate stores them, or -1 if the input ran out
+ */
+int getBits(Inflater *inf, int bits)
+{
+    if (!needBits(inf, bits)) return -1;
+    int value = inf->bitBuf & ((1UL << bits) - 1);
+    inf->bitBuf >>= bits;
+    inf->bitCount -= bits;
+    return value;
+}
+
+/**
+ * Builds a canonical Huffman decoder from code lengths. Codes of up to INFLATE_FAST_BITS bits are
+ * also put in a lookup table so most symbols decode with a single peek.
+ * @param h Decoder to build
+ * @param lengths Code length of each symbol (0 if unused)
+ * @param n Number of symbols
+ * @return 1 on success, 0 if the lengths are over-subscribed
+ */
+int buildHuffman(Huffman *h, const unsigned char *lengths, int n)
+{
+    unsigned short offsets[16];
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < n; i++) h->count[lengths[i]]++;
+    if (h->count[0] == n) return 1;
+
+    int left = 1;
+    for (int len = 1; len < 16; len++)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0) return 0;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + h->count[len];
+    for (int i = 0; i < n; i++)
+        if (lengths[i]) h->symbol[offsets[lengths[i]]++] = i;
+
+    // Codes are sent most significant bit first, so the table is indexed by the reversed code
+    int code = 0;
+    int index = 0;
+    for (int len = 1; len <= INFLATE_FAST_BITS; len++)
+    {
+        for (int i = 0; i < h->count[len]; i++, index++, code++)
+        {
+            int reversed = 0;
+            for (int b = 0; b < len; b++) reversed |= ((code >> b) & 1) << (len - 1 - b);
+            for (int j = reversed; j < (1 << INFLATE_FAST_BITS); j += 1 << len)
+                h->fast[j] = (len << 9) | h->symbol[index];
+        }
+        code <<= 1;
+    }
+    return 1;
+}
+
+/**
+ * Builds the decoders for blocks compressed with the fixed codes. Run once through
+ * FIXED_CODES_ONCE, as archives can be read on the job thread and the UI thread at once.
+ */
+void buildFixedCodes(void)
+{
+    unsigned char lengths[288];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    buildHuffman(&FIXED_LIT_CODES, lengths, 288);
+    memset(lengths, 5, 30);
+    buildHuffman(&FIXED_DIST_CODES, lengths, 30);
+}
+
+/**
+ * @param inf Inflater
+ * @param h Decoder to use
+ * @return Next symbol, or -1 if the input is invalid or ran out
+ */
+int decodeSymbol(Inflater *inf, const Huffman *h)
+{
+    needBits(inf, INFLATE_FAST_BITS);
+    unsigned short entry = h->fast[inf->bitBuf & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (entry && (entry >> 9) <= inf->bitCount)
+    {
+        inf->bitBuf >>= entry >> 9;
+        inf->bitCount -= entry >> 9;
+        return entry & 0x1FF;
+    }
+
+    // Longer codes are decoded a bit at a time
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        int bit = getBits(inf, 1);
+        if (bit < 0) return -1;
+        code |= bit;
+        int count = h->count[len];
+        if (code - count < first) return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+/**
+ * Reads the code lengths of a dynamic Huffman block and builds its decoders.
+ * @param inf Inflater
+ * @return 1 on success, otherwise 0
+ */
+int readDynamicCodes(Inflater *inf)
+{
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char lengths[286 + 30];
+
+    int nlen = getBits(inf, 5) + 257;
+    int ndist = getBits(inf, 5) + 1;
+    int ncode = getBits(inf, 4) + 4;
+    if (ncode < 4 || nlen > 286 || ndist > 30) return 0;
+
+    memset(lengths, 0, 19);
+    for (int i = 0; i < ncode; i++)
+    {
+        int len = getBits(inf, 3);
+        if (len < 0) return 0;
+        lengths[order[i]] = len;
+    }
+    if (!buildHuffman(&inf->lit, lengths, 19)) return 0;
+
+    int index = 0;
+    while (index < nlen + ndist)
+    {
+        int sym = decodeSymbol(inf, &inf->lit);
+        if (sym < 0) return 0;
+        if (sym < 16)
+        {
+            lengths[index++] = sym;
+            continue;
+        }
+
+        int len = 0;
+        int repeat;
+        if (sym == 16)
+        {
+            if (index == 0) return 0;
+            len = lengths[index - 1];
+            repeat = getBits(inf, 2) + 3;
+        }
+        else if (sym == 17)
+            repeat = getBits(inf, 3) + 3;
+        else
+            repeat = getBits(inf, 7) + 11;
+        if (repeat < 3 || index + repeat > nlen + ndist) return 0;
+        while (repeat--) lengths[index++] = len;
+    }
+
+    if (lengths[256] == 0) return 0;
+    return buildHuffman(&inf->lit, lengths, nlen) && buildHuffman(&inf->dist, lengths + nlen, ndist);
+}
+
+/**
+ * Skips a gzip member header.
+ * @param inf Inflater, positioned at the start of a member
+ * @return 1 on success, otherwise 0
+ */
+int readGzipHeader(Inflater *inf)
+{
+    if (getBits(inf, 8) != 0x1F || getBits(inf, 8) != 0x8B || getBits(inf, 8) != 8) return 0;
+    int flags = getBits(inf, 8);
+    for (int i = 0; i < 6; i++)
+        if (getBits(inf, 8) < 0) return 0;
+    if (flags < 0) return 0;
+
+    if (flags & 4)
+    {
+        int extra = getBits(inf, 16);
+        if (extra < 0) return 0;
+        while (extra--)
+            if (getBits(inf, 8) < 0) return 0;
+    }
+    for (int field = 8; field <= 16; field <<= 1)
+    {
+        if (!(flags & field)) continue;
+        int c;
+        while ((c = getBits(inf, 8)) > 0);
+        if (c < 0) return 0;
+    }
+    if ((flags & 2) && getBits(inf, 16) < 0) return 0;
+    return 1;
+}
+
+/**
+ * Remembers where the inflater is, so that reading can later be restarted from here rather than
+ * from the start of the stream. Only done between blocks, where no decoding state is pending.
+ * Once checkpointLimit is reached, every other checkpoint is dropped and the span between them
+ * doubled, so a bigger stream gets sparser checkpoints rather than more of them.
+ * @param inf Inflater
+ */
+void addInflateCheckpoint(Inflater *inf)
+{
+    if (inf->checkpointCount >= inf->checkpointLimit)
+    {
+        int kept = 0;
+        for (int i = 0; i < inf->checkpointCount; i++)
+        {
+            if (i % 2) free(inf->checkpoints[i].window);
+            else inf->checkpoints[kept++] = inf->checkpoints[i];
+        }
+        inf->checkpointCount = kept;
+        inf->checkpointSpan *= 2;
+    }
+
+    if (inf->checkpointCount == inf->checkpointCapacity)
+    {
+        int capacity = inf->checkpointCapacity ? inf->checkpointCapacity * 2 : 16;
+        InflateCheckpoint *grown = realloc(inf->checkpoints, capacity * sizeof(InflateCheckpoint));
+        if (!grown) return;
+        inf->checkpoints = grown;
+        inf->checkpointCapacity = capacity;
+    }
+
+    unsigned char *window = malloc(INFLATE_WINDOW);
+    if (!window) return;
+    memcpy(window, inf->window, INFLATE_WINDOW);
+
+    InflateCheckpoint *cp = &inf->checkpoints[inf->checkpointCount++];
+    cp->inBit = (inf->inOffset - (inf->inLen - inf->inPos)) * 8 - inf->bitCount;
+    cp->out = inf->out;
+    cp->window = window;
+}
+
+/**
+ * Prepares an inflater to read a stream.
+ * @param inf Inflater
+ * @param fd File holding the compressed data
+ * @param offset Where the compressed data starts
+ * @param gzip 1 for a gzip file, 0 for raw deflate data (as in zip archives)
+ */
+void initInflater(Inflater *inf, int fd, unsigned long long offset, int gzip)
+{
+    memset(inf, 0, offsetof(Inflater, in));
+    inf->fd = fd;
+    inf->inOffset = offset;
+    inf->gzip = gzip;
+    inf->state = gzip ? INFLATE_HEADER : INFLATE_BLOCK;
+}
+
+/**
+ * Restarts an inflater at a checkpoint taken by an earlier pass over the same stream.
+ * @param inf Inflater, already initialised for the stream
+ * @param cp Checkpoint to restart from
+ * @return 1 on success, otherwise 0
+ */
+int seekInflater(Inflater *inf, const InflateCheckpoint *cp)
+{
+    inf->inOffset = cp->inBit / 8;
+    inf->inPos = inf->inLen = 0;
+    inf->bitBuf = 0;
+    inf->bitCount = 0;
+    if (cp->inBit % 8 && getBits(inf, cp->inBit % 8) < 0) return 0;
+
+    memcpy(inf->window, cp->window, INFLATE_WINDOW);
+    inf->out = cp->out;
+    inf->state = INFLATE_BLOCK;
+    inf->last = 0;
+    inf->copyLen = 0;
+    return 1;
+}
+
+/**
+ * Decompresses the next part of a deflate or gzip stream. Concatenated gzip members are read as
+ * one stream, as gzip itself does.
+ * @param inf Inflater
+ * @param out Where to put the data, or NULL to discard it
+ * @param len Number of bytes wanted
+ * @return Number of bytes produced; fewer than len only at the end of the stream or on error
+ */
+size_t inflateRead(Inflater *inf, unsigned char *out, size_t len)
+{
+    static const unsigned short lenBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const unsigned char lenExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const unsigned short distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const unsigned char distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    size_t produced = 0;
+    while (produced < len)
+    {
+        switch (inf->state)
+        {
+            case INFLATE_HEADER:
+                inf->state = readGzipHeader(inf) ? INFLATE_BLOCK : INFLATE_ERROR;
+                break;
+
+            case INFLATE_BLOCK:
+            {
+                if (inf->last)
+                {
+                    // Skip the gzip trailer and carry on if another member follows
+                    inf->state = INFLATE_DONE;
+                    if (!inf->gzip) break;
+                    getBits(inf, inf->bitCount % 8);
+                    for (int i = 0; i < 8; i++) getBits(inf, 8);
+                    if (needBits(inf, 16) && (inf->bitBuf & 0xFFFF) == 0x8B1F)
+                    {
+                        inf->last = 0;
+                        inf->state = INFLATE_HEADER;
+                    }
+                    break;
+                }
+
+                if (inf->checkpointSpan && inf->out >= inf->nextCheckpoint)
+                {
+                    addInflateCheckpoint(inf);
+                    inf->nextCheckpoint = inf->out + inf->checkpointSpan;
+                }
+
+                inf->last = getBits(inf, 1);
+                int type = getBits(inf, 2);
+                if (type == 0)
+                {
+                    getBits(inf, inf->bitCount % 8);
+                    int stored = getBits(inf, 16);
+                    int check = getBits(inf, 16);
+                    if (stored < 0 || check < 0 || stored != (~check & 0xFFFF))
+                    {
+                        inf->state = INFLATE_ERROR;
+                        break;
+                    }
+                    inf->storedLeft = stored;
+                    inf->state = INFLATE_STORED;
+                }
+                else if (type == 1)
+                {
+                    pthread_once(&FIXED_CODES_ONCE, buildFixedCodes);
+                    inf->lit = FIXED_LIT_CODES;
+                    inf->dist = FIXED_DIST_CODES;
+                    inf->state = INFLATE_CODES;
+                }
+                else if (type == 2 && readDynamicCodes(inf))
+                    inf->state = INFLATE_CODES;
+                else
+                    inf->state = INFLATE_ERROR;
+                break;
+            }
+
+            case INFLATE_STORED:
+                while (produced < len && inf->storedLeft)
+                {
+                    int c = getBits(inf, 8);
+                    if (c < 0)
+                    {
+                        inf->state = INFLATE_ERROR;
+                        return produced;
+                    }
+                    inf->window[inf->out++ & (INFLATE_WINDOW - 1)] = c;
+                    if (out) out[produced] = c;
+                    produced++;
+                    inf->storedLeft--;
+                }
+                if (!inf->storedLeft) inf->state = INFLATE_BLOCK;
+                break;
+
+            case INFLATE_CODES:
+                while (produced < len)
+                {
+                    if (inf->copyLen)
+                    {
+                        unsigned char c = inf->window[(inf->out - inf->copyDist) & (INFLATE_WINDOW - 1)];
+                        inf->window[inf->out++ & (INFLATE_WINDOW - 1)] = c;
+                        if (out) out[produced] = c;
+                        produced++;
+                        inf->copyLen--;
+                        continue;
+                    }
+
+                    int sym = decodeSymbol(inf, &inf->lit);
+                    if (sym < 256)
+                    {
+                        if (sym < 0)
+                        {
+                            inf->state = INFLATE_ERROR;
+                            return produced;
+                        }
+                        inf->window[inf->out++ & (INFLATE_WINDOW - 1)] = sym;
+                        if (out) out[produced] = sym;
+                        produced++;
+                        continue;
+                    }
+                    if (sym == 256)
+                    {
+                        inf->state = INFLATE_BLOCK;
+                        break;
+                    }
+
+                    sym -= 257;
+                    int lenBits = sym < 29 ? getBits(inf, lenExtra[sym]) : -1;
+                    int dsym = lenBits < 0 ? -1 : decodeSymbol(inf, &inf->dist);
+                    int distBits = (dsym >= 0 && dsym < 30) ? getBits(inf, distExtra[dsym]) : -1;
+                    if (distBits < 0 || (unsigned long long)(distBase[dsym] + distBits) > inf->out)
+                    {
+                        inf->state = INFLATE_ERROR;
+                        return produced;
+                    }
+                    inf->copyLen = lenBase[sym] + lenBits;
+                    inf->copyDist = distBase[dsym] + distBits;
+                }
+                break;
+
+            default:
+                return produced;
+        }
+    }
+    return produced;
+}
+
+/**
+ * Reads from the stream an archive is being indexed from.
+ * @param stream Stream to read
+ * @param buf Where to put the data
+ * @param len Number of bytes wanted
+ * @return Number of bytes read; fewer than len only at the end of the archive
+ */
+size_t readArchiveStream(ArchiveStream *stream, void *buf, size_t len)
+{
+    size_t done = 0;
+    if (stream->inflater)
+        done = inflateRead(stream->inflater, buf, len);
+    else
+    {
+        while (done < len)
+        {
+            ssize_t n = pread(stream->fd, (char *)buf + done, len - done, stream->pos + done);
+            if (n <= 0) break;
+            done += n;
+        }
+    }
+    stream->pos += done;
+    return done;
+}
+
+/**
+ * Checks, without waiting, whether c has been pressed to stop something slow being done on the
+ * UI thread. Any other keys pressed in the meantime are dropped.
+ * @return 1 if c was pressed, otherwise 0
+ */
+int isCancelKeyPressed(void)
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    while (poll(&pfd, 1, 0) > 0)
+    {
+        int c = readKey();
+        if (c == EOF || tolower(c) == 'c') return 1;
+    }
+    return 0;
+}
+
+/**
+ * Checks whether indexing an archive has been cancelled, looking for a key press once every
+ * ARCHIVE_CANCEL_CHECK bytes of the stream.
+ * @param stream Stream the archive is being indexed from
+ * @return 1 if cancelled, otherwise 0
+ */
+int isArchiveStreamCancelled(ArchiveStream *stream)
+{
+    if (!stream->cancelled && stream->pos >= stream->nextCancelCheck)
+    {
+        stream->nextCancelCheck = stream->pos + ARCHIVE_CANCEL_CHECK;
+        stream->cancelled = isCancelKeyPressed();
+    }
+    return stream->cancelled;
+}
+
+/**
+ * Skips over data in an archive stream. Uncompressed archives are simply seeked over.
+ * @param stream Stream to skip in
+ * @param len Number of bytes to skip
+ * @return 1 on success, 0 if the archive ended first or indexing was cancelled
+ */
+int skipArchiveStream(ArchiveStream *stream, unsigned long long len)
+{
+    if (isArchiveStreamCancelled(stream)) return 0;
+    if (!stream->inflater)
+    {
+        stream->pos += len;
+        return 1;
+    }
+
+    while (len)
+    {
+        size_t chunk = len > ARCHIVE_CANCEL_CHECK ? ARCHIVE_CANCEL_CHECK : len;
+        size_t n = inflateRead(stream->inflater, NULL, chunk);
+        stream->pos += n;
+        if (n < chunk || isArchiveStreamCancelled(stream)) return 0;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Adds a string to an archive's string pool. Offsets are returned rather than pointers as the
+ * pool moves as it grows.
+ * @param archive Archive owning the pool
+ * @param str String to add
+ * @param len Length of the string in bytes
+ * @return Offset of the copy in the pool, or 0 if out of memory (offset 0 always holds "")
+ */
+size_t storeArchiveString(Archive *archive, const char *str, size_t len)
+{
+    if (archive->poolLen + len + 1 > archive->poolCapacity)
+    {
+        size_t capacity = archive->poolCapacity ? archive->poolCapacity : 4096;
+        while (capacity < archive->poolLen + len + 1) capacity *= 2;
+        char *grown = realloc(archive->pool, capacity);
+        if (!grown) return 0;
+        archive->pool = grown;
+        archive->poolCapacity = capacity;
+    }
+
+    size_t offset = archive->poolLen;
+    memcpy(archive->pool + offset, str, len);
+    archive->pool[offset + len] = '\0';
+    archive->poolLen += len + 1;
+    return offset;
+}
+
+/**
+ * Adds a member to an archive's index. Paths are stored relative to the archive's root, without
+ * leading "./" or "/" or a trailing "/". Members whose path would climb out of the archive with
+ * ".." are left out, so extracting can never write outside the chosen directory.
+ * @param archive Archive being indexed
+ * @param path Path of the member as stored in the archive
+ * @param len Length of the path in bytes
+ * @return The new member, or NULL if it was left out or memory ran out
+ */
+ArchiveMember *addArchiveMember(Archive *archive, const char *path, size_t len)
+{
+    char clean[PATH_MAX];
+    size_t cleanLen = 0;
+
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t start = i;
+        while (i < len && path[i] != '/') i++;
+        size_t partLen = i - start;
+        i++;
+
+        if (partLen == 0 || (partLen == 1 && path[start] == '.')) continue;
+        if (partLen == 2 && path[start] == '.' && path[start + 1] == '.') return NULL;
+        if (memchr(path + start, '\0', partLen) || cleanLen + partLen + 2 > sizeof(clean)) return NULL;
+
+        if (cleanLen) clean[cleanLen++] = '/';
+        memcpy(clean + cleanLen, path + start, partLen);
+        cleanLen += partLen;
+    }
+    if (!cleanLen) return NULL;
+
+    if (archive->count == archive->capacity)
+    {
+        int capacity = archive->capacity ? archive->capacity * 2 : 256;
+        ArchiveMember *grown = realloc(archive->members, capacity * sizeof(ArchiveMember));
+        if (!grown) return NULL;
+        archive->members = grown;
+        archive->capacity = capacity;
+    }
+
+    size_t pathOffset = storeArchiveString(archive, clean, cleanLen);
+    if (!pathOffset) return NULL;
+
+    ArchiveMember *member = &archive->members[archive->count++];
+    memset(member, 0, sizeof(ArchiveMember));
+    member->pathOffset = pathOffset;
+    return member;
+}
+
+/**
+ * @param field Numeric tar header field
+ * @param len Size of the field
+ * @return Value of the field, which is octal text or (for large values) base-256 binary
+ */
+unsigned long long parseTarNumber(const unsigned char *field, int len)
+{
+    unsigned long long value = 0;
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x7F;
+        for (int i = 1; i < len; i++) value = (value << 8) | field[i];
+        return value;
+    }
+
+    int i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) i++;
+    while (i < len && field[i] >= '0' && field[i] <= '7') value = (value << 3) | (field[i++] - '0');
+    return value;
+}
+
+/**
+ * @param header 512-byte block
+ * @return 1 if the block is a tar header with a valid checksum, otherwise 0
+ */
+int isTarHeader(const unsigned char *header)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    return sum == parseTarNumber(header + 148, 8);
+}
+
+/**
+ * Reads the data of a tar member that describes the next member (GNU long names and pax headers).
+ * @param stream Stream positioned at the data
+ * @param size Size of the data
+ * @return The data as a string, or NULL if it is unreadable or unreasonably large
+ */
+char *readTarMeta(ArchiveStream *stream, unsigned long long size)
+{
+    char *data = size <= TAR_MAX_META ? malloc(size + 1) : NULL;
+    if (data && readArchiveStream(stream, data, size) == size)
+    {
+        data[size] = '\0';
+        skipArchiveStream(stream, ((size + 511) & ~511ULL) - size);
+        return data;
+    }
+    free(data);
+    return NULL;
+}
+
+/**
+ * Indexes a tar archive in one pass over its headers, skipping (not reading) member data. GNU long
+ * names and pax path, link and size records are understood.
+ * @param archive Archive to fill in
+ * @param stream Stream positioned at the first header
+ */
+void indexTar(Archive *archive, ArchiveStream *stream)
+{
+    unsigned char header[512];
+    char *longName = NULL;
+    char *longLink = NULL;
+    long long paxSize = -1;
+
+    while (readArchiveStream(stream, header, sizeof(header)) == sizeof(header))
+    {
+        if (header[0] == '\0' || !isTarHeader(header)) break;
+
+        unsigned long long size = parseTarNumber(header + 124, 12);
+        char type = header[156];
+
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g')
+        {
+            char *data = readTarMeta(stream, size);
+            if (!data && size > TAR_MAX_META && !skipArchiveStream(stream, (size + 511) & ~511ULL)) break;
+            if (type == 'L')
+            {
+                free(longName);
+                longName = data;
+            }
+            else if (type == 'K')
+            {
+                free(longLink);
+                longLink = data;
+            }
+            else if (type == 'x' && data)
+            {
+                // Records are "<length> <key>=<value>\n"
+                char *record = data;
+                while (*record)
+                {
+                    char *space = strchr(record, ' ');
+                    long recordLen = strtol(record, NULL, 10);
+                    if (!space || recordLen <= 0 || recordLen > (long)strlen(record)) break;
+                    char *end = record + recordLen;
+                    end[-1] = '\0';
+                    char *key = space + 1;
+                    char *value = strchr(key, '=');
+                    if (value)
+                    {
+                        *value++ = '\0';
+                        if (strcmp(key, "path") == 0) { free(longName); longName = strdup(value); }
+                        else if (strcmp(key, "linkpath") == 0) { free(longLink); longLink = strdup(value); }
+                        else if (strcmp(key, "size") == 0) paxSize = strtoll(value, NULL, 10);
+                    }
+                    record = end;
+                }
+            }
+            if (type != 'L' && type != 'K') free(data);
+            continue;
+        }
 
-        while ((entry = readdir(dir)) != NULL)
+        if (paxSize >= 0) size = paxSize;
+
+        char name[257];
+        if (!longName)
         {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || (!DOTFILES_VISIBLE && entry->d_name[0] == '.'))
-                continue;
-            if (entry->d_type == DT_REG && isFileExecutable(currPath, entry))
-                entry->d_type = DT_EXE;
-            entries = realloc(entries, (*entryCount + 1) * sizeof(struct dirent *));
-            entries[*entryCount] = malloc(sizeof(struct dirent));
-            memcpy(entries[*entryCount], entry, sizeof(struct dirent));
-            (*entryCount)++;
+            // ustar splits long paths into a prefix and a name
+            int prefixLen = (memcmp(header + 257, "ustar", 5) == 0) ? strnlen((char *)header + 345, 155) : 0;
+            int nameLen = strnlen((char *)header, 100);
+            memcpy(name, header + 345, prefixLen);
+            if (prefixLen) name[prefixLen++] = '/';
+            memcpy(name + prefixLen, header, nameLen);
+            name[prefixLen + nameLen] = '\0';
         }
+        const char *path = longName ? longName : name;
 
-        closedir(dir);
-        qsort(entries, *entryCount, sizeof(struct dirent*), compareDirName);
-        return entries;
+        char link[101];
+        memcpy(link, header + 157, 100);
+        link[100] = '\0';
+        const char *linkPath = longLink ? longLink : link;
+
+        mode_t mode = parseTarNumber(header + 100, 8) & 07777;
+        switch (type)
+        {
+            case '1': mode |= S_IFREG; break;
+            case '2': mode |= S_IFLNK; break;
+            case '3': mode |= S_IFCHR; break;
+            case '4': mode |= S_IFBLK; break;
+            case '5': mode |= S_IFDIR; break;
+            case '6': mode |= S_IFIFO; break;
+            default: mode |= S_IFREG; break;
+        }
+
+        ArchiveMember *member = addArchiveMember(archive, path, strlen(path));
+        if (member)
+        {
+            member->mode = mode;
+            member->uid = parseTarNumber(header + 108, 8);
+            member->gid = parseTarNumber(header + 116, 8);
+            member->mtime = parseTarNumber(header + 136, 12);
+            member->offset = stream->pos;
+            member->size = (type == '1' || type == '2' || type == '5') ? 0 : size;
+            member->method = ARCHIVE_STORED;
+            if ((type == '1' || type == '2') && linkPath[0])
+                member->linkOffset = storeArchiveString(archive, linkPath, strlen(linkPath));
+        }
+
+        free(longName);
+        free(longLink);
+        longName = longLink = NULL;
+        paxSize = -1;
+
+        if (!skipArchiveStream(stream, (size + 511) & ~511ULL)) break;
     }
 
-    return NULL;
+    free(longName);
+    free(longLink);
 }
 
-int isProgramInstalled(const char *prog)
+/**
+ * @param field Hexadecimal or octal text field of a cpio header
+ * @param len Length of the field
+ * @param base 16 for "newc" archives, 8 for "odc" ones
+ * @return Value of the field
+ */
+unsigned long long parseCpioNumber(const unsigned char *field, int len, int base)
 {
-    char *path = getenv("PATH");
-    if (!path)
+    char text[12];
+    memcpy(text, field, len);
+    text[len] = '\0';
+    return strtoull(text, NULL, base);
+}
+
+/**
+ * Indexes a cpio archive ("newc", "crc" or "odc" format, as used for initramfs images). newc
+ * archives store the data of a hard-linked file only once, with its last link, so earlier links
+ * are held back until that turns up.
+ * @param archive Archive to fill in
+ * @param stream Stream positioned at the first header
+ */
+void indexCpio(Archive *archive, ArchiveStream *stream)
+{
+    unsigned char header[110];
+    char name[PATH_MAX];
+    unsigned long long *links = NULL;
+    int linkCount = 0;
+
+    while (readArchiveStream(stream, header, 6) == 6)
     {
-        char cmd[64];
-        snprintf(cmd, 64, "%s --version > /dev/null 2>&1", prog);
-        return (system(cmd) == 0);
+        int newc = memcmp(header, "070701", 6) == 0 || memcmp(header, "070702", 6) == 0;
+        if (!newc && memcmp(header, "070707", 6) != 0) break;
+
+        unsigned long long ino = 0, nlink = 1, mode, uid, gid, mtime, size, nameSize;
+        if (newc)
+        {
+            if (readArchiveStream(stream, header + 6, 104) != 104) break;
+            ino = parseCpioNumber(header + 6, 8, 16);
+            nlink = parseCpioNumber(header + 38, 8, 16);
+            mode = parseCpioNumber(header + 14, 8, 16);
+            uid = parseCpioNumber(header + 22, 8, 16);
+            gid = parseCpioNumber(header + 30, 8, 16);
+            mtime = parseCpioNumber(header + 46, 8, 16);
+            size = parseCpioNumber(header + 54, 8, 16);
+            nameSize = parseCpioNumber(header + 94, 8, 16);
+        }
+        else
+        {
+            if (readArchiveStream(stream, header + 6, 70) != 70) break;
+            mode = parseCpioNumber(header + 18, 6, 8);
+            uid = parseCpioNumber(header + 24, 6, 8);
+            gid = parseCpioNumber(header + 30, 6, 8);
+            mtime = parseCpioNumber(header + 48, 11, 8);
+            nameSize = parseCpioNumber(header + 59, 6, 8);
+            size = parseCpioNumber(header + 65, 11, 8);
+        }
+
+        if (nameSize == 0 || nameSize > sizeof(name) || readArchiveStream(stream, name, nameSize) != nameSize) break;
+        name[nameSize - 1] = '\0';
+
+        // newc pads the header and name, and the data, to multiples of four bytes
+        if (newc) skipArchiveStream(stream, (4 - (110 + nameSize) % 4) % 4);
+        if (strcmp(name, "TRAILER!!!") == 0) break;
+
+        ArchiveMember *member = addArchiveMember(archive, name, strlen(name));
+        if (member)
+        {
+            member->mode = mode;
+            member->uid = uid;
+            member->gid = gid;
+            member->mtime = mtime;
+            member->offset = stream->pos;
+            member->size = size;
+            member->method = ARCHIVE_STORED;
+
+            // Pending links are kept as pairs of inode and member index
+            if (newc && nlink > 1 && S_ISREG(mode) && size == 0)
+            {
+                unsigned long long *grown = realloc(links, (linkCount + 1) * 2 * sizeof(unsigned long long));
+                if (grown)
+                {
+                    links = grown;
+                    links[linkCount * 2] = ino;
+                    links[linkCount * 2 + 1] = member - archive->members;
+                    linkCount++;
+                }
+            }
+            else if (newc && nlink > 1 && S_ISREG(mode))
+            {
+                for (int i = 0; i < linkCount; i++)
+                {
+                    if (links[i * 2] != ino) continue;
+                    archive->members[links[i * 2 + 1]].offset = member->offset;
+                    archive->members[links[i * 2 + 1]].size = size;
+                    links[i * 2] = links[--linkCount * 2];
+                    links[i * 2 + 1] = links[linkCount * 2 + 1];
+                    i--;
+                }
+            }
+        }
+
+        if (!skipArchiveStream(stream, size + (newc ? (4 - size % 4) % 4 : 0))) break;
     }
+    free(links);
+}
 
-    char *paths = strdup(path);
-    char *dir = strtok(paths, ":");
-    while (dir)
+/**
+ * @param p Little-endian bytes
+ * @param len Number of bytes (2, 4 or 8)
+ * @return Value of the bytes
+ */
+unsigned long long getLittleEndian(const unsigned char *p, int len)
+{
+    unsigned long long value = 0;
+    while (len--) value = (value << 8) | p[len];
+    return value;
+}
+
+/**
+ * Indexes a zip archive from its central directory, without reading any member data. Zip64
+ * archives and Unix permissions (as stored by Info-ZIP) are understood.
+ * @param archive Archive to fill in
+ * @param fd Archive file
+ * @param fileSize Size of the archive file
+ */
+void indexZip(Archive *archive, int fd, off_t fileSize)
+{
+    // The end of central directory record is within the last 64K (its comment) + 22 bytes
+    size_t tailLen = fileSize < 65557 ? fileSize : 65557;
+    unsigned char *tail = malloc(tailLen);
+    if (!tail || pread(fd, tail, tailLen, fileSize - tailLen) != (ssize_t)tailLen || tailLen < 22)
     {
-        char fullpath[512];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, prog);
-        if (access(fullpath, X_OK) == 0)
+        free(tail);
+        return;
+    }
+
+    long end = tailLen - 22;
+    while (end >= 0 && memcmp(tail + end, "PK\5\6", 4) != 0) end--;
+    if (end < 0)
+    {
+        free(tail);
+        return;
+    }
+
+    unsigned long long entries = getLittleEndian(tail + end + 10, 2);
+    unsigned long long cdSize = getLittleEndian(tail + end + 12, 4);
+    unsigned long long cdOffset = getLittleEndian(tail + end + 16, 4);
+    if ((cdOffset == 0xFFFFFFFF || entries == 0xFFFF) && end >= 20 && memcmp(tail + end - 20, "PK\6\7", 4) == 0)
+    {
+        unsigned char record[56];
+        unsigned long long recordOffset = getLittleEndian(tail + end - 20 + 8, 8);
+        if (pread(fd, record, sizeof(record), recordOffset) == sizeof(record) && memcmp(record, "PK\6\6", 4) == 0)
         {
-            free(paths);
+            entries = getLittleEndian(record + 32, 8);
+            cdSize = getLittleEndian(record + 40, 8);
+            cdOffset = getLittleEndian(record + 48, 8);
+        }
+    }
+    free(tail);
+
+    unsigned char *cd = cdSize <= (unsigned long long)fileSize ? malloc(cdSize) : NULL;
+    if (!cd || pread(fd, cd, cdSize, cdOffset) != (ssize_t)cdSize)
+    {
+        free(cd);
+        return;
+    }
+
+    size_t pos = 0;
+    for (unsigned long long i = 0; i < entries && pos + 46 <= cdSize; i++)
+    {
+        unsigned char *p = cd + pos;
+        if (memcmp(p, "PK\1\2", 4) != 0) break;
+
+        int host = p[5];
+        int flags = getLittleEndian(p + 8, 2);
+        int method = getLittleEndian(p + 10, 2);
+        int dosTime = getLittleEndian(p + 12, 2);
+        int dosDate = getLittleEndian(p + 14, 2);
+        unsigned long long compSize = getLittleEndian(p + 20, 4);
+        unsigned long long size = getLittleEndian(p + 24, 4);
+        size_t nameLen = getLittleEndian(p + 28, 2);
+        size_t extraLen = getLittleEndian(p + 30, 2);
+        size_t commentLen = getLittleEndian(p + 32, 2);
+        unsigned long attributes = getLittleEndian(p + 38, 4);
+        unsigned long long offset = getLittleEndian(p + 42, 4);
+        if (pos + 46 + nameLen + extraLen + commentLen > cdSize) break;
+
+        // Sizes and offsets too big for 32 bits are in the zip64 extra field, in this order
+        unsigned char *extra = p + 46 + nameLen;
+        for (size_t x = 0; x + 4 <= extraLen; )
+        {
+            int id = getLittleEndian(extra + x, 2);
+            size_t len = getLittleEndian(extra + x + 2, 2);
+            if (x + 4 + len > extraLen) break;
+            if (id == 1)
+            {
+                unsigned char *field = extra + x + 4;
+                unsigned char *fieldEnd = field + len;
+                if (size == 0xFFFFFFFF && field + 8 <= fieldEnd) { size = getLittleEndian(field, 8); field += 8; }
+                if (compSize == 0xFFFFFFFF && field + 8 <= fieldEnd) { compSize = getLittleEndian(field, 8); field += 8; }
+                if (offset == 0xFFFFFFFF && field + 8 <= fieldEnd) offset = getLittleEndian(field, 8);
+            }
+            x += 4 + len;
+        }
+
+        int isDir = nameLen > 0 && p[46 + nameLen - 1] == '/';
+        ArchiveMember *member = addArchiveMember(archive, (char *)p + 46, nameLen);
+        if (member)
+        {
+            mode_t mode = (host == 3) ? attributes >> 16 : 0;
+            if (!(mode & S_IFMT)) mode = isDir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+            member->mode = mode;
+            member->uid = getuid();
+            member->gid = getgid();
+
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            tm.tm_year = ((dosDate >> 9) & 0x7F) + 80;
+            tm.tm_mon = ((dosDate >> 5) & 0x0F) - 1;
+            tm.tm_mday = dosDate & 0x1F;
+            tm.tm_hour = (dosTime >> 11) & 0x1F;
+            tm.tm_min = (dosTime >> 5) & 0x3F;
+            tm.tm_sec = (dosTime & 0x1F) * 2;
+            tm.tm_isdst = -1;
+            member->mtime = mktime(&tm);
+
+            member->offset = offset;
+            member->size = size;
+            member->compSize = compSize;
+            member->method = ((flags & 1) || (method != ARCHIVE_STORED && method != ARCHIVE_DEFLATED)) ? ARCHIVE_UNSUPPORTED : method;
+        }
+
+        pos += 46 + nameLen + extraLen + commentLen;
+    }
+    free(cd);
+}
+
+/**
+ * Allows qsort to order archive members by path. Members with the same path keep the order they
+ * were added in (their paths were stored in that order).
+ * @param a First member to compare
+ * @param b Second member to compare
+ */
+int compareArchiveMembers(const void *a, const void *b)
+{
+    const ArchiveMember *ma = a;
+    const ArchiveMember *mb = b;
+    int diff = strcmp(SORTING_ARCHIVE->pool + ma->pathOffset, SORTING_ARCHIVE->pool + mb->pathOffset);
+    if (diff) return diff;
+    return (ma->pathOffset > mb->pathOffset) - (ma->pathOffset < mb->pathOffset);
+}
+
+/**
+ * @param archive Indexed archive
+ * @param count Number of members (from the start) that are sorted
+ * @param path Path to look for
+ * @param len Length of path
+ * @return Index of the first member whose path, cut to len bytes, does not sort before path
+ */
+int findArchiveBound(Archive *archive, int count, const char *path, size_t len)
+{
+    int low = 0;
+    int high = count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (strncmp(archive->pool + archive->members[mid].pathOffset, path, len) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * @param archive Indexed archive
+ * @param count Number of members (from the start) that are sorted
+ * @param path Path of the member
+ * @return Index of the member, or -1 if there is none with that path
+ */
+int findArchiveMember(Archive *archive, int count, const char *path)
+{
+    size_t len = strlen(path);
+    int index = findArchiveBound(archive, count, path, len);
+    if (index < count && strcmp(archive->pool + archive->members[index].pathOffset, path) == 0)
+        return index;
+    return -1;
+}
+
+/**
+ * Sorts a freshly read index by path, so directories can be listed with a binary search. Later
+ * copies of the same path replace earlier ones (as when extracting), directories that only exist
+ * implicitly in member paths are added, and hard links take on their target's data.
+ * @param archive Archive whose members have all been added
+ */
+void finishArchiveIndex(Archive *archive)
+{
+    if (archive->count == 0) return;
+    SORTING_ARCHIVE = archive;
+    qsort(archive->members, archive->count, sizeof(ArchiveMember), compareArchiveMembers);
+
+    // Add any parent directories that were not stored themselves
+    int count = archive->count;
+    char lastAdded[PATH_MAX] = "";
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s", archive->pool + archive->members[i].pathOffset);
+        for (char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+            *slash = '\0';
+            if (strcmp(path, lastAdded) != 0 && findArchiveMember(archive, count, path) < 0)
+            {
+                ArchiveMember *parent = addArchiveMember(archive, path, strlen(path));
+                if (parent)
+                {
+                    parent->mode = S_IFDIR | 0755;
+                    parent->mtime = archive->members[i].mtime;
+                    parent->uid = archive->members[i].uid;
+                    parent->gid = archive->members[i].gid;
+                }
+                snprintf(lastAdded, sizeof(lastAdded), "%s", path);
+            }
+            *slash = '/';
+        }
+    }
+    if (archive->count != count)
+        qsort(archive->members, archive->count, sizeof(ArchiveMember), compareArchiveMembers);
+
+    // Keep only the last copy of each path
+    int kept = 0;
+    for (int i = 0; i < archive->count; i++)
+    {
+        if (i + 1 < archive->count && strcmp(archive->pool + archive->members[i].pathOffset, archive->pool + archive->members[i + 1].pathOffset) == 0)
+            continue;
+        archive->members[kept++] = archive->members[i];
+    }
+    archive->count = kept;
+
+    for (int i = 0; i < archive->count; i++)
+    {
+        ArchiveMember *member = &archive->members[i];
+        if (!S_ISREG(member->mode) || !member->linkOffset) continue;
+        const char *targetPath = archive->pool + member->linkOffset;
+        while (targetPath[0] == '/' || (targetPath[0] == '.' && targetPath[1] == '/'))
+            targetPath += targetPath[0] == '/' ? 1 : 2;
+        int target = findArchiveMember(archive, archive->count, targetPath);
+        if (target >= 0 && S_ISREG(archive->members[target].mode) && !archive->members[target].linkOffset)
+        {
+            member->offset = archive->members[target].offset;
+            member->size = archive->members[target].size;
+        }
+    }
+}
+
+/**
+ * Frees an archive index, leaving its cache slot empty.
+ * @param archive Archive to free
+ */
+void freeArchive(Archive *archive)
+{
+    for (int i = 0; i < archive->checkpointCount; i++) free(archive->checkpoints[i].window);
+    free(archive->checkpoints);
+    free(archive->members);
+    free(archive->pool);
+    memset(archive, 0, sizeof(Archive));
+}
+
+/**
+ * Works out whether a file is an archive that can be browsed, going by its contents rather than
+ * its name. Gzip-compressed files are looked into.
+ * @param fd File to check
+ * @param gzipped Whether the archive is gzip-compressed (by reference)
+ * @return Format of the archive, or ARCHIVE_NONE
+ */
+enum ArchiveFormat detectArchive(int fd, int *gzipped)
+{
+    unsigned char head[512];
+    ssize_t len = pread(fd, head, sizeof(head), 0);
+    if (len < 6) return ARCHIVE_NONE;
+
+    *gzipped = head[0] == 0x1F && head[1] == 0x8B && head[2] == 8;
+    if (*gzipped)
+    {
+        Inflater *inf = malloc(sizeof(Inflater));
+        if (!inf) return ARCHIVE_NONE;
+        initInflater(inf, fd, 0, 1);
+        len = inflateRead(inf, head, sizeof(head));
+        free(inf);
+        if (len < 6) return ARCHIVE_NONE;
+    }
+    else if (memcmp(head, "PK\3\4", 4) == 0 || memcmp(head, "PK\5\6", 4) == 0)
+        return ARCHIVE_ZIP;
+
+    if (memcmp(head, "070701", 6) == 0 || memcmp(head, "070702", 6) == 0 || memcmp(head, "070707", 6) == 0)
+        return ARCHIVE_CPIO;
+    if (len == sizeof(head) && isTarHeader(head))
+        return ARCHIVE_TAR;
+    return ARCHIVE_NONE;
+}
+
+/**
+ * Finds the index of an archive, building it if it is not cached. Indexes are cached by device,
+ * inode, size and modification time, so going back into an archive costs nothing. Gzip archives
+ * get a checkpoint every ARCHIVE_CHECKPOINT_SPAN bytes of output while being indexed, so members
+ * can later be read without decompressing everything before them. Each checkpoint holds a copy of
+ * the window, so there are at most ARCHIVE_MAX_CHECKPOINTS of them, fewer if the windows of a
+ * full cache would not fit in the memory budget. Indexing can be cancelled by pressing c.
+ * @param fd Open archive file
+ * @param st Status of the file
+ * @param archive Index of the archive (by reference)
+ * @return 1 on success, 0 if the file is not an archive, -1 if it could not be indexed (errno is
+ * ECANCELED if indexing was cancelled)
+ */
+int loadArchive(int fd, const struct stat *st, Archive **archive)
+{
+    Archive *slot = &ARCHIVE_CACHE[0];
+    for (int i = 0; i < ARCHIVE_CACHE_SLOTS; i++)
+    {
+        Archive *cached = &ARCHIVE_CACHE[i];
+        if (cached->format != ARCHIVE_NONE && cached->dev == st->st_dev && cached->ino == st->st_ino &&
+            cached->size == st->st_size && cached->mtime == st->st_mtim.tv_sec && cached->mtimeNsec == st->st_mtim.tv_nsec)
+        {
+            cached->lastUsed = ++ARCHIVE_CLOCK;
+            *archive = cached;
             return 1;
         }
-        dir = strtok(NULL, ":");
+        if (cached->lastUsed < slot->lastUsed) slot = cached;
     }
-    free(paths);
 
-    // Hard-coded check in /usr/libexec 
-    char libexecPath[PATH_MAX];
-    snprintf(libexecPath, PATH_MAX, "/usr/libexec/%s", prog);
-    if (access(libexecPath, X_OK) == 0) return 1;
+    int gzipped = 0;
+    enum ArchiveFormat format = detectArchive(fd, &gzipped);
+    if (format == ARCHIVE_NONE) return 0;
+
+    showDialog("Indexing archive... [c] to cancel", 40);
+    flushFrame();
+
+    freeArchive(slot);
+    slot->pool = malloc(4096);
+    if (!slot->pool) return -1;
+    slot->pool[0] = '\0';
+    slot->poolLen = 1;
+    slot->poolCapacity = 4096;
+
+    if (format == ARCHIVE_ZIP)
+        indexZip(slot, fd, st->st_size);
+    else
+    {
+        ArchiveStream stream = { fd, NULL, 0, ARCHIVE_CANCEL_CHECK, 0 };
+        if (gzipped)
+        {
+            stream.inflater = malloc(sizeof(Inflater));
+            if (!stream.inflater)
+            {
+                freeArchive(slot);
+                return -1;
+            }
+            size_t limit = ARCHIVE_MAX_CHECKPOINTS;
+            if (MEM_BUDGET && MEM_BUDGET / (ARCHIVE_CACHE_SLOTS * INFLATE_WINDOW) < limit)
+                limit = MEM_BUDGET / (ARCHIVE_CACHE_SLOTS * INFLATE_WINDOW);
+            initInflater(stream.inflater, fd, 0, 1);
+            if (limit >= 2)
+            {
+                stream.inflater->checkpointLimit = limit;
+                stream.inflater->checkpointSpan = ARCHIVE_CHECKPOINT_SPAN;
+                stream.inflater->nextCheckpoint = ARCHIVE_CHECKPOINT_SPAN;
+            }
+        }
+
+        if (format == ARCHIVE_TAR)
+            indexTar(slot, &stream);
+        else
+            indexCpio(slot, &stream);
+
+        if (stream.inflater)
+        {
+            slot->checkpoints = stream.inflater->checkpoints;
+            slot->checkpointCount = stream.inflater->checkpointCount;
+            free(stream.inflater);
+        }
+        if (stream.cancelled)
+        {
+            freeArchive(slot);
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+
+    finishArchiveIndex(slot);
+    slot->format = format;
+    slot->gzipped = gzipped;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim.tv_sec;
+    slot->mtimeNsec = st->st_mtim.tv_nsec;
+    slot->lastUsed = ++ARCHIVE_CLOCK;
+    *archive = slot;
+    return 1;
+}
+
+/**
+ * @param reader Member reader to finish with
+ */
+void closeMemberReader(MemberReader *reader)
+{
+    free(reader->inflater);
+    reader->inflater = NULL;
+}
+
+/**
+ * Moves a reader to the start of a member's data. Uncompressed archives are read in place, and
+ * deflated zip members are decompressed from their own start. A gzip archive carries on from
+ * where the reader already is if the member lies ahead (and no checkpoint lies in between), so
+ * members read in archive order are decompressed in one pass; otherwise decompression restarts
+ * from the nearest checkpoint before the member.
+ * @param archive Archive holding the member
+ * @param fd Open archive file
+ * @param member Member to read
+ * @param reader Reader, either zeroed or last used for another member of the same archive
+ * @return 1 on success, otherwise 0 with errno set
+ */
+int seekMemberReader(Archive *archive, int fd, const ArchiveMember *member, MemberReader *reader)
+{
+    reader->fd = fd;
+    reader->left = member->size;
+    reader->pos = member->offset;
+
+    if (archive->format == ARCHIVE_ZIP)
+    {
+        unsigned char local[30];
+        closeMemberReader(reader);
+        if (member->method == ARCHIVE_UNSUPPORTED)
+        {
+            errno = ENOTSUP;
+            return 0;
+        }
+        if (pread(fd, local, sizeof(local), member->offset) != sizeof(local) || memcmp(local, "PK\3\4", 4) != 0)
+        {
+            errno = EIO;
+            return 0;
+        }
+        reader->pos = member->offset + 30 + getLittleEndian(local + 26, 2) + getLittleEndian(local + 28, 2);
+        if (member->method == ARCHIVE_STORED) return 1;
+
+        reader->inflater = malloc(sizeof(Inflater));
+        if (!reader->inflater) return 0;
+        initInflater(reader->inflater, fd, reader->pos, 0);
+        return 1;
+    }
+
+    if (!archive->gzipped) return 1;
+
+    if (!reader->inflater)
+    {
+        reader->inflater = malloc(sizeof(Inflater));
+        if (!reader->inflater) return 0;
+        initInflater(reader->inflater, fd, 0, 1);
+    }
+    Inflater *inf = reader->inflater;
+
+    int low = 0;
+    int high = archive->checkpointCount;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (archive->checkpoints[mid].out <= member->offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    const InflateCheckpoint *cp = low > 0 ? &archive->checkpoints[low - 1] : NULL;
+    if (inf->out > member->offset || inf->state == INFLATE_ERROR || (cp && cp->out > inf->out))
+    {
+        if (cp && !seekInflater(inf, cp))
+        {
+            closeMemberReader(reader);
+            errno = EIO;
+            return 0;
+        }
+        if (!cp) initInflater(inf, fd, 0, 1);
+    }
+
+    unsigned long long skip = member->offset - inf->out;
+    while (skip)
+    {
+        size_t chunk = skip > (1 << 30) ? (1 << 30) : skip;
+        if (inflateRead(inf, NULL, chunk) != chunk)
+        {
+            closeMemberReader(reader);
+            errno = EIO;
+            return 0;
+        }
+        skip -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Starts reading a member's data.
+ * @param archive Archive holding the member
+ * @param fd Open archive file
+ * @param member Member to read
+ * @param reader Reader to set up
+ * @return 1 on success, otherwise 0 with errno set
+ */
+int openMemberReader(Archive *archive, int fd, const ArchiveMember *member, MemberReader *reader)
+{
+    memset(reader, 0, sizeof(MemberReader));
+    return seekMemberReader(archive, fd, member, reader);
+}
+
+/**
+ * @param reader Member reader
+ * @param buf Where to put the data
+ * @param len Number of bytes wanted
+ * @return Number of bytes read (0 at the end of the member), or -1 on error
+ */
+ssize_t readMember(MemberReader *reader, void *buf, size_t len)
+{
+    if (len > reader->left) len = reader->left;
+    if (len == 0) return 0;
+
+    ssize_t n;
+    if (reader->inflater)
+    {
+        n = inflateRead(reader->inflater, buf, len);
+        if (n == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+    else
+    {
+        n = pread(reader->fd, buf, len, reader->pos);
+        if (n == 0) errno = EIO;
+        if (n <= 0) return -1;
+    }
+
+    reader->pos += n;
+    reader->left -= n;
+    return n;
+}
+
+/**
+ * Rebuilds the path shown in the header while browsing an archive.
+ * @param view Archive being browsed
+ * @param nav Navigation stack of the directory holding the archive
+ * @return 1 on success, otherwise 0
+ */
+int updateArchivePath(ArchiveView *view, NavStack *nav)
+{
+    char *archivePath = joinEntryPath(nav->path, view->name);
+    if (!archivePath) return 0;
+    char *path = view->dir[0] ? joinEntryPath(archivePath, view->dir) : strdup(archivePath);
+    free(archivePath);
+    if (!path) return 0;
+
+    free(view->path);
+    view->path = path;
+    return 1;
+}
+
+/**
+ * Closes the archive being browsed (its index stays cached).
+ * @param view Archive view to close
+ */
+void closeArchiveView(ArchiveView *view)
+{
+    if (view->fd >= 0) close(view->fd);
+    free(view->name);
+    free(view->dir);
+    free(view->path);
+    view->archive = NULL;
+    view->fd = -1;
+    view->name = view->dir = view->path = NULL;
+}
+
+/**
+ * Starts browsing an archive in the current directory, if the file is one.
+ * @param view Archive view to fill in
+ * @param nav Navigation stack of the current directory
+ * @param name Name of the file
+ * @return 1 if the archive was opened, 0 if the file is not an archive (or cannot be read to
+ * tell), -1 if it is one but could not be opened
+ */
+int openArchiveView(ArchiveView *view, NavStack *nav, const char *name)
+{
+    int fd = openat(getNavFd(nav), name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return 0;
+    }
+
+    Archive *archive;
+    int result = loadArchive(fd, &st, &archive);
+    if (result <= 0)
+    {
+        close(fd);
+        return result;
+    }
 
-    return 0;
+    view->archive = archive;
+    view->fd = fd;
+    view->name = strdup(name);
+    view->dir = strdup("");
+    if (!view->name || !view->dir || !updateArchivePath(view, nav))
+    {
+        closeArchiveView(view);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 1;
 }
 
 /**
- * @param title Header's text string
- * @param body Body's text string
+ * Moves to another directory inside the archive being browsed.
+ * @param view Archive view
+ * @param nav Navigation stack of the directory holding the archive
+ * @param name Subdirectory to enter, or NULL to go up a level
+ * @return 1 on success, 0 if already at the archive's root (when going up) or out of memory
  */
-void printGenericScreen(char *title, char *body)
+int changeArchiveDir(ArchiveView *view, NavStack *nav, const char *name)
 {
-    clearScreen();
-
-    if (COL_ENABLED)
+    char *dir;
+    if (name)
     {
-        printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
-        int len = printf("%s", title);
-        for (size_t i = len; i < TERM_SIZE.ws_col; i++) printf(" ");
-        printf("\033[%sm", COL_RESET);
-
-        int lines = formatNewLines(body, TERM_SIZE.ws_col, NULL);
-        int availHeight = TERM_SIZE.ws_row - lines - 1;
-
-        printf("%s\n", body);
-        for (int i = 1; i < availHeight; i++) printf("\n");
-        printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
-        awaitInput();
-        printf("\033[%sm", COL_RESET);
+        dir = malloc(strlen(view->dir) + strlen(name) + 2);
+        if (!dir) return 0;
+        sprintf(dir, "%s%s%s", view->dir, view->dir[0] ? "/" : "", name);
     }
     else
     {
-        printf("%s\n", title);
-        for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
-
-        int lines = formatNewLines(body, TERM_SIZE.ws_col, NULL);
-        int availHeight = TERM_SIZE.ws_row - lines - 3;
-
-        printf("%s\n", body);
-        for (int i = 1; i < availHeight; i++) printf("\n");
-        for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
-        awaitInput();
+        if (!view->dir[0]) return 0;
+        dir = strdup(view->dir);
+        if (!dir) return 0;
+        char *slash = strrchr(dir, '/');
+        *(slash ? slash : dir) = '\0';
     }
+
+    free(view->dir);
+    view->dir = dir;
+    updateArchivePath(view, nav);
+    return 1;
 }
 
 /**
- * Prints the directory listing.
- * @param dirContents Pointer to one or more dirent structs for each file in the current directory
- * @param entryCount Number of entries in current directory
- * @param cursor Current line cursor position
- * @param cursorPrev Previous line cursor position
+ * Lists a directory inside an archive. The members are found with a binary search of the index,
+ * and whole subdirectories are skipped over the same way, so this costs nothing like a scan of
+ * the archive. Metadata comes from the index, so entries never need to be stat'd.
+ * @param view Archive being browsed
+ * @param listing Listing to fill
+ * @return 1 on success, otherwise 0
  */
-void printDir(struct dirent **dirContents, int entryCount, int cursor, int cursorPrev)
+int getArchiveContents(ArchiveView *view, DirListing *listing)
 {
-    int baseRow = 2;
-    int availHeight = TERM_SIZE.ws_row - 2;
-    if (!COL_ENABLED)
-    {
-        baseRow = 3;
-        availHeight = TERM_SIZE.ws_row - 4;
-    }
+    Archive *archive = view->archive;
+    freeDirListing(listing);
 
-    // If directory is empty
-    if (!dirContents || entryCount == 0)
-    {
-        printf("(empty)\n");
-        for (int i = 1; i < availHeight; i++) printf("\n");
-        return;
-    }
+    char prefix[PATH_MAX];
+    size_t prefixLen = snprintf(prefix, sizeof(prefix), "%s%s", view->dir, view->dir[0] ? "/" : "");
+    int i = findArchiveBound(archive, archive->count, prefix, prefixLen);
 
-    // Viewport offset and clamping for current line cursor
-    int offset = (cursor - 1) - (availHeight / 2);
-    if (offset < 0) offset = 0;
-    if (offset > entryCount - availHeight) offset = entryCount - availHeight;
-    if (offset < 0) offset = 0;
+    while (i < archive->count)
+    {
+        ArchiveMember *member = &archive->members[i];
+        const char *path = archive->pool + member->pathOffset;
+        if (strncmp(path, prefix, prefixLen) != 0) break;
 
-    // Viewport offset and clamping for previous line cursor
-    int prevOffset = (cursorPrev - 1) - (availHeight / 2);
-    if (prevOffset < 0) prevOffset = 0;
-    if (prevOffset > entryCount - availHeight) prevOffset = entryCount - availHeight;
-    if (prevOffset < 0) prevOffset = 0;
+        const char *name = path + prefixLen;
+        size_t nameLen = strcspn(name, "/");
+        if (name[nameLen] == '/')
+        {
+            // Skip the rest of this subdirectory: '0' sorts just after '/'
+            char next[PATH_MAX];
+            int nextLen = snprintf(next, sizeof(next), "%.*s0", (int)(prefixLen + nameLen), path);
+            i = findArchiveBound(archive, archive->count, next, nextLen);
+            continue;
+        }
+        i++;
 
-    int inScrolling = (prevOffset != offset);
+        if (nameLen > NAME_MAX || (!DOTFILES_VISIBLE && name[0] == '.')) continue;
 
-    // cursorPrev is initialised as 0 to indicate first frame should be drawn
-    if (cursorPrev == 0) inScrolling = 1;
+        if (listing->count == listing->capacity)
+        {
+            int capacity = listing->capacity ? listing->capacity * 2 : 64;
+            DirEntry *entries = realloc(listing->entries, capacity * sizeof(DirEntry));
+            if (!entries) return 0;
+            listing->entries = entries;
+            listing->capacity = capacity;
+        }
 
-    int prevIndex = cursorPrev - 1;
-    int currIndex = cursor - 1;
+        DirEntry *entry = &listing->entries[listing->count];
+        memset(entry, 0, sizeof(DirEntry));
+        if (!setEntryName(listing, entry, name, nameLen)) return 0;
+        entry->type = IFTODT(member->mode);
+        if (entry->type == DT_REG && (member->mode & 0111)) entry->type = DT_EXE;
+        entry->flags = ENTRY_STATTED | ENTRY_RESOLVED;
+        entry->mode = member->mode;
+        entry->uid = member->uid;
+        entry->gid = member->gid;
+        entry->size = member->size;
+        entry->mtime = member->mtime;
+        listing->count++;
+    }
 
-    // If we don't need to scroll, just update the cursor
-    if (!inScrolling)
-    {
-        int rowPrev = baseRow + (prevIndex - offset);
-        int rowCurr = baseRow + (currIndex - offset);
+    sortListing(listing);
+    return 1;
+}
 
-        // Remove old line cursor
-        printf("\x1b[%d;1H   ", rowPrev);
+/**
+ * @param view Archive being browsed
+ * @param name Name of an entry in the current archive directory
+ * @return Index of its member, or -1 if there is none
+ */
+int findViewMember(ArchiveView *view, const char *name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", view->dir, view->dir[0] ? "/" : "", name);
+    return findArchiveMember(view->archive, view->archive->count, path);
+}
 
-        // Print new line cursor
-        printf("\x1b[%d;1H \033[%sm%c\033[%sm ", rowCurr, COL_FOR_CURSOR, CURSOR_CHAR, COL_RESET);
+/**
+ * Shows the start of an archive member as text.
+ * @param view Archive being browsed
+ * @param name Name of the member in the current archive directory
+ */
+void viewArchiveMember(ArchiveView *view, const char *name)
+{
+    int index = findViewMember(view, name);
+    if (index < 0) return;
+    ArchiveMember *member = &view->archive->members[index];
 
+    MemberReader reader;
+    if (!openMemberReader(view->archive, view->fd, member, &reader))
+    {
+        setStatus("Cannot read %s: %s", name, strerror(errno));
         return;
     }
 
-    int canGoUp = offset > 0;
-    int canGoDown = (offset + availHeight) < entryCount;
-    int linesPrinted = 0;
+    size_t want = member->size < ARCHIVE_VIEW_MAX ? member->size : ARCHIVE_VIEW_MAX;
+    unsigned char *data = malloc(want + 1);
+    size_t len = 0;
+    ssize_t n = 0;
+    while (data && len < want && (n = readMember(&reader, data + len, want - len)) > 0) len += n;
+    closeMemberReader(&reader);
+    if (!data || n < 0)
+    {
+        setStatus("Cannot read %s: %s", name, strerror(data ? errno : ENOMEM));
+        free(data);
+        return;
+    }
 
-    for (int i = offset; i < entryCount && i < offset + availHeight; i++)
+    // Each line is escaped like a file name, so the member cannot control the terminal
+    char *text = malloc(len + 128);
+    size_t textLen = 0;
+    int binary = memchr(data, '\0', len) != NULL;
+    if (text && binary)
+        textLen = sprintf(text, "Binary member, %llu bytes. Use [y] to extract it.", member->size);
+    for (size_t start = 0; text && !binary && start < len; )
     {
-        printf("\x1b[%d;1H\x1b[K", baseRow + linesPrinted);
+        unsigned char *newline = memchr(data + start, '\n', len - start);
+        size_t lineLen = (newline ? (size_t)(newline - data) : len) - start;
+        data[start + lineLen] = '\0';
+        for (size_t i = start; i < start + lineLen; i++)
+            if (data[i] == '\t') data[i] = ' ';
+        int width;
+        textLen += escapeDisplayName((char *)data + start, text + textLen, &width);
+        text[textLen++] = '\n';
+        start += lineLen + 1;
+    }
+    if (text && !binary && member->size > len)
+        textLen += sprintf(text + textLen, "\n(first %zu of %llu bytes shown)", len, member->size);
 
-        char prefix = '?';
-        switch (dirContents[i]->d_type)
+    if (text)
+    {
+        text[textLen] = '\0';
+        char *title = malloc(strlen(view->path) + strlen(name) + 8);
+        if (title)
         {
-            case DT_DIR: prefix = 'd'; break;
-            case DT_REG: prefix = 'f'; break;
-            case DT_EXE: prefix = 'x'; break;
-            case DT_LNK: prefix = 'l'; break;
-            case DT_FIFO: prefix = '|'; break;
-            case DT_CHR: prefix = 'c'; break;
-            case DT_BLK: prefix = 'b'; break;
-            case DT_SOCK: prefix = 's'; break;
-            default: prefix = '?'; break;
+            sprintf(title, "View: %s/%s", view->path, name);
+            printGenericScreen(title, text);
+            free(title);
         }
-
-        // Can scroll up indicator
-        if (canGoUp && i == offset)
-            printf("\033[%sm^\033[%sm\x1b[K\n", COL_FOR_ARROW, COL_RESET);
-        // Can scroll down indicator
-        else if (canGoDown && i == offset + availHeight - 1)
-            printf("\033[%smv\033[%sm\n", COL_FOR_ARROW, COL_RESET);
-        // Selected line
-        else if (i == currIndex)
-            printf(" \033[%sm%c\033[%sm %c %s\n", COL_FOR_CURSOR, CURSOR_CHAR, COL_RESET, prefix, dirContents[i]->d_name);
-        // Other lines
-        else
-            printf("   %c %s\n", prefix, dirContents[i]->d_name);
-
-        linesPrinted++;
     }
-
-    // "Fill in" lines if listing is shorter than viewport
-    if (!canGoUp && !canGoDown)
-        for (int i = linesPrinted; i < availHeight; i++)
-            printf("\n");
+    free(text);
+    free(data);
 }
 
-void printFooter(void)
+/**
+ * Opens the directory an extracted member goes in, refusing to follow symbolic links on the way
+ * so that a link extracted earlier cannot redirect later members elsewhere.
+ * @param dstFd Directory being extracted into
+ * @param relPath Path of the member relative to dstFd
+ * @param base Last component of relPath (by reference)
+ * @return Descriptor of the parent directory, or -1 on error
+ */
+int openExtractParent(int dstFd, const char *relPath, const char **base)
 {
-    if (COL_ENABLED)
-        printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
-    else
-        for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
-
-    char *inspectStr = "";
-    if (FILE_INSTALLED)
-        inspectStr = " [i] Inspect";
-
-    char *hiddenStr = " [.] Hidden off";
-    if (!DOTFILES_VISIBLE)
-        hiddenStr = " [.] Hidden on";
-
-    int len = printf("[hjkl] Navigate%s%s [?] Help [q] Quit ", inspectStr, hiddenStr);
-
-    if (COL_ENABLED)
+    int fd = fcntl(dstFd, F_DUPFD_CLOEXEC, 0);
+    const char *part = relPath;
+    const char *slash;
+    while (fd >= 0 && (slash = strchr(part, '/')) != NULL)
     {
-        for (int i = len; i < TERM_SIZE.ws_col; i++) printf(" ");
-        printf("\033[%sm", COL_RESET);
+        char component[NAME_MAX + 1];
+        snprintf(component, sizeof(component), "%.*s", (int)(slash - part), part);
+        int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+        part = slash + 1;
     }
+    *base = part;
+    return fd;
 }
 
 /**
- * @param currPath Current working directory path
+ * Extracts one member.
+ * @param job Extraction job, extracting from its srcFd into its dstFd
+ * @param archive Archive holding the member
+ * @param member Member to extract
+ * @param reader Reader shared by the job's members, so compressed data is only read once
+ * @return 1 if extracted, 0 if skipped (an unsupported type), -1 on error with errno set
  */
-void printHeader(char *currPath)
+int extractArchiveMember(Job *job, Archive *archive, const ArchiveMember *member, MemberReader *reader)
 {
-    if (COL_ENABLED)
-        printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+    const char *base;
+    int parentFd = openExtractParent(job->dstFd, archive->pool + member->pathOffset, &base);
+    if (parentFd < 0) return -1;
 
-    size_t dirLen = strlen(currPath);
-    if (dirLen <= TERM_SIZE.ws_col) 
+    int result = 1;
+    if (S_ISDIR(member->mode))
     {
-        printf("%s", currPath);
-        if (COL_ENABLED)
-            for (size_t i = dirLen; i < TERM_SIZE.ws_col; i++)
-                printf(" ");
+        struct stat st;
+        if (mkdirat(parentFd, base, (member->mode & 07777) | 0700) != 0 &&
+            (errno != EEXIST || fstatat(parentFd, base, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)))
+            result = -1;
+    }
+    else if (S_ISLNK(member->mode))
+    {
+        // Tar keeps link targets in the header; cpio and zip keep them as the member's data
+        char target[PATH_MAX];
+        if (member->linkOffset)
+            snprintf(target, sizeof(target), "%s", archive->pool + member->linkOffset);
         else
-            printf("\n");
+        {
+            ssize_t n = -1;
+            if (member->size < sizeof(target) && seekMemberReader(archive, job->srcFd, member, reader))
+                n = readMember(reader, target, member->size);
+            if (n != (ssize_t)member->size)
+            {
+                close(parentFd);
+                errno = EIO;
+                return -1;
+            }
+            target[n] = '\0';
+        }
+        if (symlinkat(target, parentFd, base) != 0) result = -1;
     }
-    else
+    else if (S_ISREG(member->mode))
     {
-        size_t visibleLen = TERM_SIZE.ws_col - 3;
-        char *start = currPath + (dirLen - visibleLen);
-        printf("...%s\n", start);
+        int out = openat(parentFd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, member->mode & 0777);
+        if (out < 0)
+            result = -1;
+        else if (!seekMemberReader(archive, job->srcFd, member, reader))
+        {
+            // The empty file would otherwise stop a retry, which never overwrites
+            int err = errno;
+            unlinkat(parentFd, base, 0);
+            errno = err;
+            result = -1;
+        }
+        else
+        {
+            char buffer[65536];
+            ssize_t n;
+            while ((n = readMember(reader, buffer, sizeof(buffer))) > 0)
+            {
+                if (write(out, buffer, n) != n)
+                {
+                    n = -1;
+                    break;
+                }
+                if (addJobProgress(job, n, 0))
+                {
+                    errno = ECANCELED;
+                    n = -1;
+                    break;
+                }
+            }
+            if (n < 0)
+            {
+                int err = errno;
+                unlinkat(parentFd, base, 0);
+                errno = err;
+                result = -1;
+            }
+            else
+            {
+                struct timespec times[2] = { { 0, UTIME_OMIT }, { member->mtime, 0 } };
+                futimens(out, times);
+            }
+        }
+        if (out >= 0)
+        {
+            int err = errno;
+            close(out);
+            errno = err;
+        }
     }
-
-    if (COL_ENABLED)
-        printf("\033[%sm", COL_RESET);
     else
-        for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
+        result = 0;
+
+    int err = errno;
+    close(parentFd);
+    errno = err;
+    return result;
 }
 
 /**
- * @param currPath Current working directory path
- * @param entry Directory entry to inspect
+ * Orders members by where their data starts in the archive.
+ * @param a First member (pointer to an ArchiveMember pointer)
+ * @param b Second member (pointer to an ArchiveMember pointer)
+ * @return Negative, zero or positive as with strcmp
  */
-void inspectEntry(char *currPath, struct dirent *entry)
+int compareMemberOffsets(const void *a, const void *b)
 {
-    char filePath[PATH_MAX + 256];
-    if (strcmp(currPath, "/") == 0)
-        snprintf(filePath, PATH_MAX + 256, "/%s", entry->d_name);
-    else
-        snprintf(filePath, PATH_MAX + 256, "%s/%s", currPath, entry->d_name);
+    const ArchiveMember *memberA = *(const ArchiveMember **)a;
+    const ArchiveMember *memberB = *(const ArchiveMember **)b;
+    return (memberA->offset > memberB->offset) - (memberA->offset < memberB->offset);
+}
+
+/**
+ * Extraction job. Directories are made first, in path order so parents come before their
+ * contents. Everything else follows in the order it is stored in, through one reader, so a
+ * compressed archive is decompressed in a single pass however many members are picked.
+ * @param job Job whose data is a copy of the archive index holding only the members to extract
+ */
+void runExtractJob(Job *job)
+{
+    Archive *archive = job->data;
+    ArchiveMember **order = malloc((archive->count ? archive->count : 1) * sizeof(ArchiveMember *));
+    if (!order)
+    {
+        addJobError(job, "archive", ENOMEM);
+        return;
+    }
+
+    long long bytesTotal = 0;
+    int fileCount = 0;
+    for (int i = 0; i < archive->count; i++)
+    {
+        if (S_ISDIR(archive->members[i].mode)) continue;
+        if (S_ISREG(archive->members[i].mode)) bytesTotal += archive->members[i].size;
+        order[fileCount++] = &archive->members[i];
+    }
+    qsort(order, fileCount, sizeof(ArchiveMember *), compareMemberOffsets);
+
+    pthread_mutex_lock(&JOB_LOCK);
+    job->filesTotal = archive->count;
+    job->bytesTotal = bytesTotal;
+    pthread_mutex_unlock(&JOB_LOCK);
 
-    char cmd[PATH_MAX + 256 + 8];
-    snprintf(cmd, PATH_MAX + 256 + 8, "file -b %s", filePath);
-    char buffer[2048];
-    FILE *stream = popen(cmd, "r");
-    if (stream)
+    MemberReader reader;
+    memset(&reader, 0, sizeof(MemberReader));
+    int cancelled = 0;
+    for (int pass = 0; pass < 2 && !cancelled; pass++)
     {
-        if (fgets(buffer, sizeof(buffer), stream) != NULL)
-            buffer[strcspn(buffer, "\n")] = '\0';
-        pclose(stream);
-        char title[PATH_MAX + 266];
-        snprintf(title, PATH_MAX + 266, "Inspect: %s", filePath);
-        printGenericScreen(title, buffer);
+        int count = pass ? fileCount : archive->count;
+        for (int i = 0; i < count && !cancelled; i++)
+        {
+            ArchiveMember *member = pass ? order[i] : &archive->members[i];
+            if (!pass && !S_ISDIR(member->mode)) continue;
+
+            int result = extractArchiveMember(job, archive, member, &reader);
+            if (result < 0) addJobError(job, archive->pool + member->pathOffset, errno);
+            if (result == 0)
+            {
+                pthread_mutex_lock(&JOB_LOCK);
+                job->filesTotal--;
+                pthread_mutex_unlock(&JOB_LOCK);
+            }
+            cancelled = addJobProgress(job, 0, result > 0);
+        }
     }
+    closeMemberReader(&reader);
+    free(order);
 }
 
-void showCursor(void)
+/**
+ * Frees the archive index copy an extraction job works from.
+ * @param data Archive to free
+ */
+void freeExtractData(void *data)
 {
-    printf("\033[?25h");
-    if (COL_ENABLED) printf("\033[%sm", COL_RESET);
+    freeArchive(data);
+    free(data);
 }
 
 /**
- * General center-justified dialog message.
- * @param message Message the dialog should display
- * @param width How wide the dialog should be
+ * Copies a member into the index an extraction job works from, with its path made relative to
+ * the directory being extracted into.
+ * @param copy Index being built
+ * @param archive Archive being browsed
+ * @param member Member to copy
+ * @param relPath Path of the member relative to the extraction directory
+ * @return 1 on success, otherwise 0
  */
-void showDialog(char *message, int width)
+int copyExtractMember(Archive *copy, Archive *archive, const ArchiveMember *member, const char *relPath)
 {
-    if (width > TERM_SIZE.ws_col - 6) width = TERM_SIZE.ws_col - 6;
-    
-    // Modify message to fit the given width
-    size_t msgLen = strlen(message) + 1;
-    char buf[msgLen + 1];
-    strncpy(buf, message, msgLen - 1);
-    buf[msgLen - 1] = '\0';
-    int lines = formatNewLines(buf, width, NULL);
-
-    // Calculate where to begin printing the dialog
-    int startRow = (TERM_SIZE.ws_row - lines) / 2;
-    int startCol = (TERM_SIZE.ws_col - (width + 4)) / 2 + 1;  
-
-    int pad = '#';
-    if (COL_ENABLED) 
+    if (copy->count == copy->capacity)
     {
-        // Set dialog console colours
-        printf("\033[%s;%sm", COL_FOR_WHITE, COL_BAK_BLUE);
-        pad = ' ';
+        int capacity = copy->capacity ? copy->capacity * 2 : 256;
+        ArchiveMember *grown = realloc(copy->members, capacity * sizeof(ArchiveMember));
+        if (!grown) return 0;
+        copy->members = grown;
+        copy->capacity = capacity;
     }
 
-    // Print top border
-    printf("\x1b[%d;%dH", startRow, startCol);
-    for (int j = 0; j < width + 4; j++) putchar(pad);
+    ArchiveMember *added = &copy->members[copy->count];
+    *added = *member;
+    added->pathOffset = storeArchiveString(copy, relPath, strlen(relPath));
+    if (!added->pathOffset) return 0;
+    if (member->linkOffset)
+    {
+        const char *link = archive->pool + member->linkOffset;
+        added->linkOffset = storeArchiveString(copy, link, strlen(link));
+        if (!added->linkOffset) return 0;
+    }
+    copy->count++;
+    return 1;
+}
 
-    // Print message
-    char *currPos = buf;
-    for (int i = 0; i < lines; i++)
+/**
+ * Queues the extraction of the marked entries (or the selected one) of the current archive
+ * directory, with everything below any directories among them, into the directory holding the
+ * archive. Existing files are never overwritten. The job gets its own copy of the needed part of
+ * the index, as the cached one may be dropped while the job runs.
+ * @param view Archive being browsed
+ * @param listing Listing of the current archive directory
+ * @param cursor Current line cursor position
+ * @param dstFd Directory to extract into
+ */
+void extractArchiveSelection(ArchiveView *view, DirListing *listing, int cursor, int dstFd)
+{
+    int count;
+    char **names = collectSelection(listing, cursor, &count);
+    if (!names) return;
+
+    Archive *archive = view->archive;
+    size_t prefixLen = view->dir[0] ? strlen(view->dir) + 1 : 0;
+    Archive *copy = calloc(1, sizeof(Archive));
+    int ok = copy && storeArchiveString(copy, "", 0) == 0 && copy->poolLen == 1;
+    if (ok)
     {
-        char *lineStart = currPos;
-        char *nextNL = strchr(currPos, '\n');
+        copy->format = archive->format;
+        copy->gzipped = archive->gzipped;
+    }
 
-        int len;
-        // If future newline found, prepare to print until reaching it
-        if (nextNL)
+    for (int n = 0; n < count; n++)
+    {
+        int index = ok && names[n] ? findViewMember(view, names[n]) : -1;
+        free(names[n]);
+        if (index < 0) continue;
+
+        // A directory is followed by everything inside it
+        const char *path = archive->pool + archive->members[index].pathOffset;
+        size_t pathLen = strlen(path);
+        for (int i = index; ok && i < archive->count; i++)
         {
-            len = nextNL - currPos;
-            currPos = nextNL + 1;
+            ArchiveMember *member = &archive->members[i];
+            const char *memberPath = archive->pool + member->pathOffset;
+            if (i > index && (strncmp(memberPath, path, pathLen) != 0 || memberPath[pathLen] != '/'))
+            {
+                if (strncmp(memberPath, path, pathLen) != 0) break;
+                continue;
+            }
+            ok = copyExtractMember(copy, archive, member, memberPath + prefixLen);
         }
-        // If no future newline, prepare to print the rest of message
-        else
+    }
+    free(names);
+
+    if (ok && copy->count && archive->checkpointCount)
+    {
+        copy->checkpoints = calloc(archive->checkpointCount, sizeof(InflateCheckpoint));
+        ok = copy->checkpoints != NULL;
+        for (int i = 0; ok && i < archive->checkpointCount; i++)
         {
-            len = strlen(currPos);
-            currPos += len;
+            copy->checkpoints[i] = archive->checkpoints[i];
+            copy->checkpoints[i].window = malloc(INFLATE_WINDOW);
+            ok = copy->checkpoints[i].window != NULL;
+            if (ok) memcpy(copy->checkpoints[i].window, archive->checkpoints[i].window, INFLATE_WINDOW);
+            copy->checkpointCount = ok ? i + 1 : i;
         }
-
-        printf("\x1b[%d;%dH", startRow + 1 + i, startCol);
-
-        printf("%c ", pad);
-        printf("%.*s", len, lineStart);
-        for (int j = len; j < width; j++) putchar(' ');
-        printf(" %c", pad);
     }
 
-    // Print bottom border
-    printf("\x1b[%d;%dH", startRow + 1 + lines, startCol);
-    for (int j = 0; j < width + 4; j++) putchar(pad);
+    if (ok && !copy->count)
+    {
+        setStatus("Nothing to extract");
+        freeExtractData(copy);
+        return;
+    }
 
-    // Reset console colour
-    if (COL_ENABLED) printf("\033[%sm", COL_RESET);
+    Job *job = ok ? calloc(1, sizeof(Job)) : NULL;
+    if (job)
+    {
+        job->type = JOB_EXTRACT;
+        job->srcFd = fcntl(view->fd, F_DUPFD_CLOEXEC, 0);
+        job->dstFd = job->srcFd >= 0 ? fcntl(dstFd, F_DUPFD_CLOEXEC, 0) : -1;
+        job->run = runExtractJob;
+        job->data = copy;
+        job->freeData = freeExtractData;
+        if (job->dstFd >= 0 && submitJob(job)) return;
+        int err = errno;
+        freeJob(job);
+        errno = err;
+    }
+    else if (copy)
+        freeExtractData(copy);
+    setStatus("Cannot extract: %s", strerror(ok ? errno : ENOMEM));
 }
 
-void showHelp(void)
+/**
+ * Hands the final directory back to whoever started us: written to the descriptor given with
+ * --last-dir-fd (usually the shell integration's command substitution) or to the file given with
+ * --last-dir-file. Nothing is written if neither was given. Only the first call has any effect.
+ * @param currDir Current working directory path
+ */
+void writeLastDir(char *currDir)
 {
-    char cmdDesc[300] = "A terminal-based file browser, designed to provide simple, fast directory browsing and navigation. It can try to open a selected file in a installed text editor. Provided that file is installed, it can also identify and describe a selected file.\n";
-    formatNewLines(cmdDesc, TERM_SIZE.ws_col, NULL);
-    printf("%s\n", cmdDesc);
-
-    char usage[60] = "Usage: shorkdir [OPTIONS] [DIRECTORY]\n\n";
-    formatNewLines(usage, TERM_SIZE.ws_col, NULL);
-    printf("%s", usage);
+    int fd = LAST_DIR_FD;
+    if (fd < 0 && LAST_DIR_FILE)
+        fd = open(LAST_DIR_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
 
-    char options[130] = "Options:\n-h, --help       Displays help information and exits\n-nc, --no-col    Disables all coloured output\n\n";
-    formatNewLines(options, TERM_SIZE.ws_col, "                 ");
-    printf("%s", options);
-
-    char directory[120] = "Directory:\nPath to a directory to start at. If excluded, the current directory will be opened instead.\n\n";
-    formatNewLines(directory, TERM_SIZE.ws_col, NULL);
-    printf("%s", directory);
+    size_t len = strlen(currDir);
+    for (size_t written = 0; written < len; )
+    {
+        ssize_t n = write(fd, currDir + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
 
-    char notes[80] = "Notes:\nThe host terminal size must be 62x14 before starting.\n";
-    formatNewLines(notes, TERM_SIZE.ws_col, NULL);
-    printf("%s", notes);
+    close(fd);
+    LAST_DIR_FD = -1;
+    LAST_DIR_FILE = NULL;
 }
 
 /**
- * @param currPath Current working directory path
+ * Prints a shell function that wraps shorkdir-exec and changes the calling shell's directory when
+ * it exits, for use as: eval "$(shorkdir-exec --shell-init sh)". The same function works in sh,
+ * bash and zsh. The directory comes back over descriptor 4 while stdout stays on the terminal.
  */
-void writeLastDir(char *currDir)
+void printShellInit(void)
 {
-    const char *tmpFile = "/tmp/shorkdir_last_dir.txt";
-    FILE *stream = fopen(tmpFile, "w");
-    if (stream)
-    {
-        fprintf(stream, "%s\n", currDir);
-        fclose(stream);
-    }
+    printf("shorkdir() {\n"
+           "    { _shorkdir_dir=$(command shorkdir-exec --last-dir-fd 4 \"$@\" 4>&1 1>&3 3>&-); } 3>&1\n"
+           "    _shorkdir_status=$?\n"
+           "    if [ -n \"$_shorkdir_dir\" ] && [ -d \"$_shorkdir_dir\" ]; then\n"
+           "        cd -- \"$_shorkdir_dir\" || _shorkdir_status=1\n"
+           "    fi\n"
+           "    unset _shorkdir_dir\n"
+           "    return $_shorkdir_status\n"
+           "}\n");
 }
 
 /**
@@ -769,6 +10625,7 @@ void onExit(void)
     disableRawMode();
     showCursor();
     clearScreen();
+    flushFrame();
 }
 
 /**
@@ -780,10 +10637,12 @@ void onSigInt(int sig)
 }
 
 /**
- * @param currPath Current working directory path
+ * @param currDir Current working directory path
+ * @param dirFd Descriptor of the current directory
  * @param entry Directory entry to open
+ * @param line Line to open the file at, or 0 for the editor's default
  */
-void openFile(char *currDir, struct dirent *entry)
+void openFile(char *currDir, int dirFd, DirEntry *entry, int line)
 {
     if (!CODE_INSTALLED &&
         !EMACS_INSTALLED &&
@@ -801,8 +10660,8 @@ void openFile(char *currDir, struct dirent *entry)
         !XED_INSTALLED)
         return;
 
-    char filePath[PATH_MAX + 256];
-    snprintf(filePath, PATH_MAX + 256, "%s/%s", currDir, entry->d_name);
+    char *filePath = joinEntryPath(currDir, entry->name);
+    if (!filePath) return;
 
     MenuItem menu[] = {
         { "Go back", "", 1 },
@@ -831,15 +10690,15 @@ void openFile(char *currDir, struct dirent *entry)
 
         if (COL_ENABLED)
         {
-            printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
-            int len = printf("Open: %s", filePath);
-            for (size_t i = len; i < TERM_SIZE.ws_col; i++) printf(" ");
-            printf("\033[%sm\n", COL_RESET);
+            termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+            int len = termPrintf("Open: %s", filePath);
+            for (size_t i = len; i < TERM_SIZE.ws_col; i++) termPrintf(" ");
+            termPrintf("\033[%sm\n", COL_RESET);
         }
         else
         {
-            printf("Open: %s\n", filePath);
-            for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
+            termPrintf("Open: %s\n", filePath);
+            for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
         }        
 
         int count = 0;
@@ -848,7 +10707,7 @@ void openFile(char *currDir, struct dirent *entry)
         {
             if (menu[i].visible)
             {
-                printf("\033[%sm%d:\033[%sm %s\n", COL_FOR_OL, count + 1, COL_RESET, menu[i].name);
+                termPrintf("\033[%sm%d:\033[%sm %s\n", COL_FOR_OL, count + 1, COL_RESET, menu[i].name);
                 indices[count++] = i;
             }
         }
@@ -856,15 +10715,15 @@ void openFile(char *currDir, struct dirent *entry)
         if (COL_ENABLED)
         {
             int availHeight = TERM_SIZE.ws_row - count - 1;
-            for (int i = 1; i < availHeight; i++) printf("\n");
-            printf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
+            for (int i = 1; i < availHeight; i++) termPrintf("\n");
+            termPrintf("\033[%s;%sm", COL_FOR_BOLD_WHITE, COL_BAK_BLUE);
             choice = getIntInput("Select option", 1, count, 1);
         }
         else
         {
             int availHeight = TERM_SIZE.ws_row - count - 3;
-            for (int i = 1; i < availHeight; i++) printf("\n");
-            for (int i = 0; i < TERM_SIZE.ws_col; i++) printf("-");
+            for (int i = 1; i < availHeight; i++) termPrintf("\n");
+            for (int i = 0; i < TERM_SIZE.ws_col; i++) termPrintf("-");
             choice = getIntInput("Select option", 1, count, 1);
         }
 
@@ -873,7 +10732,7 @@ void openFile(char *currDir, struct dirent *entry)
         {
             if (COL_ENABLED)
             {
-                printf("\033[0m");
+                termPrintf("\033[0m");
                 clearScreen();
             }
             continue;
@@ -882,30 +10741,94 @@ void openFile(char *currDir, struct dirent *entry)
         break;
     }
 
-    if (choice == 1) return;
+    if (choice == 1)
+    {
+        free(filePath);
+        return;
+    }
 
     showCursor();
     disableRawMode();
     writeLastDir(currDir);
     clearScreen();
 
-    char *argv[] = { 
-        menu[indices[choice - 1]].payload,
-        filePath,
-        NULL
-    };
+    // The editor is started from inside the directory and given the entry's name only
+    char target[sizeof(((struct dirent *)0)->d_name) + 2];
+    snprintf(target, sizeof(target), "%s%s", entry->name[0] == '-' ? "./" : "", entry->name);
+    flushFrame();
+    if (fchdir(dirFd) != 0)
+    {
+        printf("ERROR: failed to open editor\n");
+        exit(1);
+    }
+
+    // Editors that can start at a line are told it in their own way; the rest just open the file
+    char *editor = menu[indices[choice - 1]].payload;
+    char lineArg[sizeof(target) + 16];
+    char *argv[] = { editor, target, NULL, NULL, NULL };
+    if (line > 0 && strcmp(editor, "code") == 0)
+    {
+        snprintf(lineArg, sizeof(lineArg), "%s:%d", target, line);
+        argv[1] = "-g";
+        argv[2] = lineArg;
+    }
+    else if (line > 0 && strcmp(editor, "kate") == 0)
+    {
+        snprintf(lineArg, sizeof(lineArg), "%d", line);
+        argv[1] = "-l";
+        argv[2] = lineArg;
+        argv[3] = target;
+    }
+    else if (line > 0 && strcmp(editor, "flow") != 0 && strcmp(editor, "gnome-text-editor") != 0 && strcmp(editor, "mousepad") != 0)
+    {
+        snprintf(lineArg, sizeof(lineArg), "+%d", line);
+        argv[1] = lineArg;
+        argv[2] = target;
+    }
     execvp(argv[0], argv);
     printf("ERROR: failed to open editor\n");
     exit(1);
 }
 
+/**
+ * Opens a file listed by its path below the current directory, as search and duplicate results
+ * are. The editor is started from the directory the file is in.
+ * @param nav Navigation stack of the directory the path is relative to
+ * @param entry Entry whose name is the path
+ * @param line Line to open the file at, or 0 for the editor's default
+ */
+void openResultFile(NavStack *nav, DirEntry *entry, int line)
+{
+    DirEntry file = *entry;
+    char *slash = strrchr(file.name, '/');
+    char *dirPath = NULL;
+    int dirFd = -1;
+    if (slash)
+    {
+        *slash = '\0';
+        dirPath = joinEntryPath(nav->path, file.name);
+        dirFd = openat(getNavFd(nav), file.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        *slash = '/';
+        file.name = slash + 1;
+    }
+    else
+    {
+        dirPath = strdup(nav->path);
+        dirFd = fcntl(getNavFd(nav), F_DUPFD_CLOEXEC, 0);
+    }
+
+    if (dirFd >= 0 && dirPath) openFile(dirPath, dirFd, &file, line);
+    else setStatus("Cannot open %s: %s", entry->display, strerror(errno));
+    if (dirFd >= 0) close(dirFd);
+    free(dirPath);
+}
+
 
 
 int main(int argc, char *argv[])
 {
     TERM_SIZE = getTerminalSize();
-    char currPath[PATH_MAX];
-    currPath[0] = '\0';
+    char *startPath = NULL;
 
     for (int i = 1; i < argc; i++)
     {
@@ -920,28 +10843,143 @@ int main(int argc, char *argv[])
             COL_FOR_ARROW = COL_RESET;
             COL_FOR_CODE = COL_RESET;
             COL_FOR_CURSOR = COL_RESET;
+            COL_FOR_DIFFERS = COL_RESET;
             COL_FOR_HEADING = COL_RESET;
             COL_FOR_OL = COL_RESET;
+            COL_FOR_ONLY = COL_RESET;
+        }
+        else if ((strcmp(argv[i], "-c") == 0) || (strcmp(argv[i], "--columns") == 0))
+        {
+            if (i + 1 >= argc)
+            {
+                printf("ERROR: %s requires a list of columns\n", argv[i]);
+                return 1;
+            }
+
+            DETAIL_COLUMNS = 0;
+            for (char *c = argv[++i]; *c; c++)
+            {
+                switch (*c)
+                {
+                    case 'p': DETAIL_COLUMNS |= COLUMN_PERMS; break;
+                    case 'u': DETAIL_COLUMNS |= COLUMN_USER; break;
+                    case 'g': DETAIL_COLUMNS |= COLUMN_GROUP; break;
+                    case 's': DETAIL_COLUMNS |= COLUMN_SIZE; break;
+                    case 'm': DETAIL_COLUMNS |= COLUMN_MTIME; break;
+                    default:
+                        printf("ERROR: unknown column '%c' (valid columns are p, u, g, s and m)\n", *c);
+                        return 1;
+                }
+            }
+            DETAILS_VISIBLE = DETAIL_COLUMNS != 0;
+        }
+        else if ((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--sort") == 0))
+        {
+            int found = 0;
+            if (i + 1 < argc)
+            {
+                i++;
+                for (int mode = 0; mode < SORT_MODE_COUNT; mode++)
+                {
+                    if (strcmp(argv[i], SORT_NAMES[mode]) == 0)
+                    {
+                        SORT_MODE = mode;
+                        found = 1;
+                    }
+                }
+            }
+
+            if (!found)
+            {
+                printf("ERROR: sort mode must be one of name, natural, size, mtime, type or extension\n");
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "-df") == 0) || (strcmp(argv[i], "--dirs-first") == 0))
+        {
+            DIRS_FIRST = 1;
+        }
+        else if (strcmp(argv[i], "--last-dir-fd") == 0 && i + 1 < argc)
+        {
+            LAST_DIR_FD = atoi(argv[++i]);
+            if (LAST_DIR_FD < 0 || fcntl(LAST_DIR_FD, F_SETFD, FD_CLOEXEC) != 0)
+                LAST_DIR_FD = -1;
         }
-        else
+        else if (strcmp(argv[i], "--last-dir-file") == 0 && i + 1 < argc)
+            LAST_DIR_FILE = argv[++i];
+        else if (strcmp(argv[i], "--shell-init") == 0)
+        {
+            printShellInit();
+            return 0;
+        }
+        else if ((strcmp(argv[i], "-L") == 0) || (strcmp(argv[i], "--list") == 0))
+            LIST_MODE = 1;
+        else if ((strcmp(argv[i], "-0") == 0) || (strcmp(argv[i], "--null") == 0))
+            LIST_FORMAT = LIST_NUL;
+        else if ((strcmp(argv[i], "-j") == 0) || (strcmp(argv[i], "--json") == 0))
+            LIST_FORMAT = LIST_JSON;
+        else if ((strcmp(argv[i], "-R") == 0) || (strcmp(argv[i], "--recursive") == 0))
+            LIST_RECURSIVE = 1;
+        else if ((strcmp(argv[i], "-m") == 0) || (strcmp(argv[i], "--meta") == 0))
+            LIST_META = 1;
+        else if ((strcmp(argv[i], "-U") == 0) || (strcmp(argv[i], "--unsorted") == 0))
+            LIST_UNSORTED = 1;
+        else if ((strcmp(argv[i], "-M") == 0) || (strcmp(argv[i], "--mem-budget") == 0))
         {
-            DIR *dir = opendir(argv[i]);
-            if (dir != NULL)
+            char *end = NULL;
+            unsigned long long budget = i + 1 < argc ? strtoull(argv[++i], &end, 10) : 0;
+            if (end && (*end == 'k' || *end == 'K')) budget <<= 10, end++;
+            else if (end && (*end == 'm' || *end == 'M')) budget <<= 20, end++;
+            else if (end && (*end == 'g' || *end == 'G')) budget <<= 30, end++;
+
+            if (!end || *end || budget < 65536)
             {
-                strncpy(currPath, argv[i], PATH_MAX - 1);
-                closedir(dir);
+                printf("ERROR: %s requires a size of at least 64K (e.g. 256K or 4M)\n", argv[i - 1]);
+                return 1;
             }
-            else
+            MEM_BUDGET = budget;
+        }
+        else if ((strcmp(argv[i], "-b") == 0) || (strcmp(argv[i], "--baud") == 0))
+        {
+            char *end = NULL;
+            long baud = i + 1 < argc ? strtol(argv[++i], &end, 10) : 0;
+            if (!end || *end || baud < 50)
             {
-                printf("ERROR: the specified start directory path appears to be invalid\n");
+                printf("ERROR: %s requires the line speed in bits per second (e.g. 9600)\n", argv[i - 1]);
                 return 1;
             }
+            BAUD_RATE = (int)(baud > 100000000 ? 100000000 : baud);
+        }
+        else if ((strcmp(argv[i], "-nh") == 0) || (strcmp(argv[i], "--no-hidden") == 0))
+            DOTFILES_VISIBLE = 0;
+        else
+        {
+            startPath = argv[i];
+        }
+    }
+
+    // Headless listing, for scripts; nothing below this (raw mode, colours, editors) is needed
+    if (LIST_MODE)
+    {
+        int dirFd = open(startPath ? startPath : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0)
+        {
+            fprintf(stderr, "ERROR: the specified start directory path appears to be invalid\n");
+            return 1;
         }
+        listDirectory(dirFd, "");
+        flushListOutput();
+        close(dirFd);
+        return 0;
     }
 
-    if (currPath[0] == '\0' && getcwd(currPath, sizeof(currPath)) == NULL)
+    NavStack nav = { NULL, 0, 0, NULL, 0 };
+    if (!openNavStack(&nav, startPath ? startPath : "."))
     {
-        printf("ERROR: failed to get current directory path\n");
+        if (startPath)
+            printf("ERROR: the specified start directory path appears to be invalid\n");
+        else
+            printf("ERROR: failed to get current directory path\n");
         return 1;
     }
 
@@ -954,6 +10992,7 @@ int main(int argc, char *argv[])
 
 
     setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stdin, NULL, _IONBF, 0);
     atexit(onExit);
     signal(SIGINT, onSigInt);
 
@@ -974,139 +11013,814 @@ int main(int argc, char *argv[])
     XED_INSTALLED = isProgramInstalled("xed");
 
     enableRawMode();
-    printf("\033[?25l");
+    OUT_LF_RETURNS = (OLD_TERMIOS.c_oflag & OPOST) && (OLD_TERMIOS.c_oflag & ONLCR);
+    OUT_ACTIVE = 1;
+    termPrintf("\033[?25l");
 
     int running = 1;
-    struct dirent **dirContents = NULL;
-    int entryCount = 0;
-    size_t currPathLen;
+    DirListing listing = { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL };
     int cursor = 1;
     int cursorPrev = 0;
     int updateDirContents = 1;
     int fullRedraw = 1;
-
-    char debugScreen[200] = "Term cols: %d, term rows: %d, dir entries: %d, cursor pos: %d";
-
-    char helpScreen[700];
-    snprintf(helpScreen, 700, "\033[%smKey binds\033[%sm\n\033[%sm[H/A/left]\033[%sm up directory \033[%sm[J/S/down]\033[%sm cursor down \033[%sm[K/W/up]\033[%sm cursor up \033[%sm[L/D/right]\033[%sm open directory/file \033[%sm[i]\033[%sm inspect selected (if file installed) \033[%sm[.]\033[%sm toggle hidden entires \033[%sm[h]\033[%sm show help \033[%sm[q]\033[%sm quit\n\n\033[%smEntry types\033[%sm\n\033[%sm'd'\033[%sm directory \033[%sm'f'\033[%sm regular file \033[%sm'x'\033[%sm executable file \033[%sm'b'\033[%sm block device \033[%sm'c'\033[%sm character device \033[%sm'l'\033[%sm symbolic link \033[%sm's'\033[%sm UNIX domain socket \033[%sm'|'\033[%sm named pipe (FIFO) \033[%sm'?'\033[%sm unknown", COL_FOR_HEADING, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_HEADING, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET);
+    int footerDirty = 0;
+    int visited = 1;
+    ArchiveView view = { NULL, -1, NULL, NULL, NULL };
+    TreeView tree = { NULL, 0, 0, NULL, 0, 0, NULL, -1 };
+    int treeMode = 0;
+    int changedFrom = -1;
+    enum ResultsKind resultsMode = RESULTS_NONE;
+    int resultsCursor = 1;
+    char *resultsTitle = NULL;
+    Pane other = { { NULL, 0, 0, NULL, 0 }, { NULL, 0, 0, -1, NULL, -1, -1, 0, 0, 0, NULL }, 1 };
+    int compareMode = 0;
+    int compareDirty = 0;
+    int activeSide = 0;
+    int differences[3] = { 0, 0, 0 };
+
+    char debugScreen[200] = "Term cols: %d, term rows: %d, dir entries: %d, cursor pos: %d, stat calls: %lu";
+
+    char *helpScreen = NULL;
+    if (asprintf(&helpScreen, "\033[%smKey binds\033[%sm\n\033[%sm[H/A/left]\033[%sm up directory \033[%sm[J/S/down]\033[%sm cursor down \033[%sm[K/W/up]\033[%sm cursor up \033[%sm[L/D/right]\033[%sm open directory/file \033[%sm[i]\033[%sm inspect selected (if file installed) \033[%sm[.]\033[%sm toggle hidden entires \033[%sm[v]\033[%sm toggle detail columns \033[%sm[o]\033[%sm cycle sort mode \033[%sm[f]\033[%sm toggle directories first \033[%sm[t]\033[%sm toggle tree view \033[%sm[/]\033[%sm search file contents \033[%sm[u]\033[%sm find duplicates \033[%sm[b]\033[%sm compare two directories side by side \033[%sm[space]\033[%sm mark entry \033[%sm[y]\033[%sm copy \033[%sm[x]\033[%sm cut \033[%sm[p]\033[%sm paste \033[%sm[r]\033[%sm delete \033[%sm[c]\033[%sm cancel file operation \033[%sm[z]\033[%sm jump to a recent directory \033[%sm[h]\033[%sm show help \033[%sm[q]\033[%sm quit\n\n\033[%smEntry types\033[%sm\n\033[%sm'd'\033[%sm directory \033[%sm'f'\033[%sm regular file \033[%sm'x'\033[%sm executable file \033[%sm'b'\033[%sm block device \033[%sm'c'\033[%sm character device \033[%sm'l'\033[%sm symbolic link \033[%sm's'\033[%sm UNIX domain socket \033[%sm'|'\033[%sm named pipe (FIFO) \033[%sm'?'\033[%sm unknown", COL_FOR_HEADING, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_HEADING, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET, COL_FOR_CODE, COL_RESET) < 0)
+        helpScreen = NULL;
 
     while (running)
     {
         if (updateDirContents)
         {
-            if (dirContents)
+            // The watch is set up first so nothing that changes while reading is missed
+            if (view.fd >= 0)
             {
-                for (int i = 0; i < entryCount; i++) free(dirContents[i]);
-                free(dirContents);
+                watchDir(&DIR_WATCH, -1);
+                getArchiveContents(&view, &listing);
             }
-
-            dirContents = getDirContents(currPath, &entryCount);
-            currPathLen = strlen(currPath);
-            if (dirContents == NULL && entryCount > 0)
+            else
             {
-                printf("ERROR: cannot get directory contents\n");
-                disableRawMode();
-                return 1;
+                watchDir(&DIR_WATCH, getNavFd(&nav));
+                getDirContents(getNavFd(&nav), &listing, 0);
             }
             updateDirContents = 0;
+            compareDirty = 1;
+            if (cursor > listing.count) cursor = listing.count > 0 ? listing.count : 1;
+
+            if (treeMode && !buildTree(&tree, getNavFd(&nav)))
+            {
+                setStatus("Tree view closed: %s", strerror(errno));
+                treeMode = 0;
+            }
+        }
+
+        if (visited && view.fd < 0)
+        {
+            recordJumpVisit(nav.path);
+            visited = 0;
+        }
+
+        // The panes are compared again whenever either of them has changed
+        int compared = compareMode && compareDirty;
+        if (compared)
+        {
+            DirListing *left = activeSide ? &other.listing : &listing;
+            DirListing *right = activeSide ? &listing : &other.listing;
+            if (compareListings(left, right, differences, NULL, NULL))
+                compareDirty = 0;
+            else if (errno == EFBIG)
+                setStatus("Directories this large can only be compared when sorted by name");
+            else
+                setStatus("Cannot compare: %s", strerror(errno));
         }
 
-        if (fullRedraw)
+        if (compareMode && !fullRedraw && !compared && cursorPrev > 0)
+        {
+            // Moving the cursor or marking only changes the active pane
+            printActivePane(&listing, nav.path, cursor, cursorPrev, activeSide);
+            if (footerDirty) refreshFooter();
+        }
+        else if (compareMode)
+        {
+            // Both panes are drawn in full after anything else, as either may have changed
+            char title[128];
+            snprintf(title, sizeof(title), "Comparing: %d only on the left, %d only on the right, %d differ", differences[0], differences[1], differences[2]);
+            clearScreen();
+            printHeader(title);
+            if (activeSide)
+                printPanes(&other.listing, other.nav.path, other.cursor, &listing, nav.path, cursor, 1);
+            else
+                printPanes(&listing, nav.path, cursor, &other.listing, other.nav.path, other.cursor, 0);
+            printFooter();
+        }
+        else if (fullRedraw)
         {
             clearScreen();
-            printHeader(currPath);
-            printDir(dirContents, entryCount, cursor, cursorPrev);
+            printHeader(resultsMode ? resultsTitle : view.fd >= 0 ? view.path : nav.path);
+            printDir(&listing, treeMode ? &tree : NULL, cursor, cursorPrev, changedFrom);
             printFooter();
         }
         else
         {
             if (COL_ENABLED)
-                printf("\x1b[2;1H");
+                termPrintf("\x1b[2;1H");
             else
-                printf("\x1b[3;1H");
-            printDir(dirContents, entryCount, cursor, cursorPrev);
+                termPrintf("\x1b[3;1H");
+            printDir(&listing, treeMode ? &tree : NULL, cursor, cursorPrev, changedFrom);
+            if (footerDirty) refreshFooter();
         }
+        changedFrom = -1;
+        footerDirty = 0;
+
+        // Wait for a key, keeping any job or search progress in the footer up to date in the
+        // meantime, prefetching the directory under the cursor if it rests there for a moment, and
+        // gathering changes to the directory until a burst of them has passed
+        DirEntry *underCursor = (view.fd < 0 && !treeMode && !resultsMode && listing.count > 0) ? getListingEntry(&listing, cursor - 1) : NULL;
+        int prefetchDue = wantPrefetch(&nav, underCursor);
+        enum WaitEvent event;
+        int searchAdded = -1;
+        for (;;)
+        {
+            int timeout = (hasPendingJobs() || isSearchRunning()) ? getRefreshInterval() : -1;
+            if (prefetchDue && (timeout < 0 || timeout > PREFETCH_DELAY_MS)) timeout = PREFETCH_DELAY_MS;
+            int watchDelay = getWatchDelay(&DIR_WATCH);
+            int paneDelay = getWatchDelay(&PANE_WATCH);
+            if (paneDelay >= 0 && (watchDelay < 0 || watchDelay > paneDelay)) watchDelay = paneDelay;
+            if (watchDelay >= 0 && (timeout < 0 || timeout > watchDelay)) timeout = watchDelay;
+
+            if ((event = waitForEvent(timeout)) == WAIT_WATCH)
+                readWatchEvents();
+            else if (event == WAIT_SEARCH && resultsMode == RESULTS_SEARCH)
+            {
+                // Results that land below the screen only show up in the footer's count until the
+                // search ends, so a search matching thousands of files does not redraw for each one
+                int availHeight = TERM_SIZE.ws_row - (COL_ENABLED ? 2 : 4);
+                searchAdded = takeSearchHits(&listing);
+                if (searchAdded >= 0 && searchAdded < getViewOffset(cursor, availHeight, listing.count) + availHeight) break;
+                if (!isSearchRunning()) break;
+                if (isSearchRefreshDue()) refreshFooter();
+                searchAdded = -1;
+                continue;
+            }
+            else if (event != WAIT_TIMEOUT)
+                break;
+            if (getWatchDelay(&DIR_WATCH) == 0 || getWatchDelay(&PANE_WATCH) == 0)
+            {
+                event = WAIT_WATCH;
+                break;
+            }
+            if (event == WAIT_WATCH) continue;
 
-        enum NavInput input = getNavInput();
+            if (prefetchDue) prefetchDue = !startPrefetch(&nav, underCursor);
+            if (hasPendingJobs() || isSearchRunning()) refreshFooter();
+        }
 
         fullRedraw = 1;
         cursorPrev = 0;
+
+        if (event == WAIT_JOB)
+        {
+            // Content comparisons land in CONTENT_CHECKS; changes the job made to the other pane
+            // come in through its watch
+            compareDirty = 1;
+
+            // Duplicates that were deleted are dropped from the results
+            if (resultsMode == RESULTS_DUPLICATES)
+            {
+                pruneDuplicates(getNavFd(&nav));
+                getDuplicateContents(&listing, &resultsTitle);
+                if (cursor > listing.count) cursor = listing.count > 0 ? listing.count : 1;
+            }
+
+            // The tree keeps showing what was read when it was expanded
+            if (view.fd < 0 && !resultsMode)
+            {
+                int reloaded = reloadListing(getNavFd(&nav), &listing, cursor);
+                if (!treeMode) cursor = reloaded;
+            }
+
+            // The header is unchanged, so only the rows and the finished job's message are drawn
+            fullRedraw = 0;
+            cursorPrev = cursor;
+            changedFrom = treeMode ? -1 : 0;
+            footerDirty = 1;
+            continue;
+        }
+
+        if (event == WAIT_WATCH)
+        {
+            // The other pane is patched the same way as the listing
+            compareDirty = 1;
+            if (compareMode && getWatchDelay(&PANE_WATCH) == 0)
+                applyWatchEvents(&PANE_WATCH, getNavFd(&other.nav), &other.listing, &other.cursor);
+            if (getWatchDelay(&DIR_WATCH) != 0) continue;
+
+            // Only the rows from the first change down are drawn again, unless the tree is shown
+            int listCursor = cursor;
+            int patched = applyWatchEvents(&DIR_WATCH, getNavFd(&nav), &listing, &listCursor);
+            if (!treeMode) cursor = listCursor;
+            if (listing.count > 0 || treeMode)
+            {
+                fullRedraw = 0;
+                cursorPrev = cursor;
+                changedFrom = treeMode ? -1 : patched;
+            }
+            continue;
+        }
+
+        if (event == WAIT_SEARCH)
+        {
+            // New results are added to the end, so only they are drawn
+            fullRedraw = 0;
+            cursorPrev = cursor;
+            changedFrom = searchAdded;
+            refreshFooter();
+            continue;
+        }
+
+        enum NavInput input = getNavInput();
+        int rowCount = treeMode ? tree.rowCount : listing.count;
+        footerDirty = clearStatus();
+
+        // Results are spread over many directories and listed in their own order; only duplicates
+        // can be marked and deleted, to get rid of spare copies
+        if (resultsMode && (input == CLIPBOARD_COPY || input == CLIPBOARD_CUT || input == CLIPBOARD_PASTE || input == SORT_CYCLE ||
+            input == TOGGLE_DIRS_FIRST || input == TOGGLE_HIDDEN || input == TOGGLE_TREE || input == COMPARE_PANES ||
+            (resultsMode == RESULTS_SEARCH && (input == TOGGLE_MARK || input == REMOVE))))
+        {
+            setStatus("Not available in %s, [h] to leave them", resultsMode == RESULTS_SEARCH ? "search results" : "duplicates");
+            continue;
+        }
+
+        // The panes only ever show plain listings
+        if (compareMode && (input == TOGGLE_TREE || input == SEARCH_TEXT || input == FIND_DUPLICATES))
+        {
+            setStatus("Not available while comparing, [b] to stop");
+            continue;
+        }
+
+        // Actions on marked or nested entries only work on the plain listing
+        if (treeMode && (input == INSPECT || input == TOGGLE_MARK || input == CLIPBOARD_COPY || input == CLIPBOARD_CUT || input == REMOVE || input == SEARCH_TEXT || input == FIND_DUPLICATES || input == COMPARE_PANES))
+        {
+            setStatus("Not available in tree view, [t] to leave it");
+            continue;
+        }
+
         switch (input)
         {
             case CURSOR_UP:
                 cursorPrev = cursor;
                 cursor--;
-                if (cursor < 1) cursor = entryCount;
+                if (cursor < 1) cursor = rowCount;
                 fullRedraw = 0;
                 break;
 
             case CURSOR_DOWN:
                 cursorPrev = cursor;
                 cursor++;
-                if (cursor > entryCount) cursor = 1;
+                if (cursor > rowCount) cursor = 1;
                 fullRedraw = 0;
                 break;
 
             case DIR_UP:
-                if (currPathLen > 1 && currPath[currPathLen - 1] == '/')
-                    currPath[currPathLen - 1] = '\0';
-                char *lastSlash = strrchr(currPath, '/');
-                if (lastSlash)
+                if (resultsMode)
                 {
-                    if (lastSlash != currPath)
-                        *lastSlash = '\0';
-                    else
-                        currPath[1] = '\0';
+                    // Back in the directory, the cursor goes back to where it was
+                    stopSearch();
+                    free(resultsTitle);
+                    resultsTitle = NULL;
+                    resultsMode = RESULTS_NONE;
+                    updateDirContents = 1;
+                    cursor = resultsCursor;
+                    break;
+                }
+
+                if (treeMode && rowCount > 0)
+                {
+                    // Collapse the selected directory, or else move to its parent
+                    int parentRow = findTreeParentRow(&tree, cursor - 1);
+                    if (tree.nodes[tree.rows[cursor - 1]].expanded)
+                    {
+                        collapseTreeRow(&tree, cursor - 1);
+                        break;
+                    }
+                    if (parentRow >= 0)
+                    {
+                        cursor = parentRow + 1;
+                        break;
+                    }
                 }
-                updateDirContents = cursor = 1;
+
+                if (view.fd >= 0)
+                {
+                    // Leaving the archive's root goes back to the directory holding it
+                    if (!changeArchiveDir(&view, &nav, NULL)) closeArchiveView(&view);
+                    updateDirContents = cursor = 1;
+                }
+                else if (leaveNavDir(&nav))
+                    updateDirContents = visited = cursor = 1;
                 break;
 
             case DEBUG:
                 char debugMsgProcessed[200];
-                snprintf(debugMsgProcessed, 200, debugScreen, TERM_SIZE.ws_col, TERM_SIZE.ws_row, entryCount, cursor);
+                snprintf(debugMsgProcessed, 200, debugScreen, TERM_SIZE.ws_col, TERM_SIZE.ws_row, listing.count, cursor, __atomic_load_n(&STAT_CALLS, __ATOMIC_RELAXED));
                 printGenericScreen("Debug", debugMsgProcessed);
                 break;
 
             case DIR_DOWN:
-                if (entryCount > 0)
+                if (treeMode && rowCount > 0)
                 {
-                    if (dirContents[cursor - 1]->d_type == DT_REG)
-                        openFile(currPath, dirContents[cursor - 1]);
-                    else if (dirContents[cursor - 1]->d_type == DT_DIR)
+                    // Expand the selected directory, or step into it if it already is
+                    prepareTreeRows(&tree, cursor - 1, cursor, 0);
+                    int node = tree.rows[cursor - 1];
+                    DirEntry *selected = &tree.nodes[node].entry;
+                    if (selected->type == DT_DIR || (selected->flags & ENTRY_LINK_DIR))
+                    {
+                        if (!tree.nodes[node].expanded && !expandTreeRow(&tree, cursor - 1))
+                            setStatus("Cannot expand %s: %s", tree.nodes[node].entry.display, strerror(errno));
+                        else if (tree.nodes[node].expanded && tree.nodes[node].childCount && tree.nodes[node].firstChild >= 0)
+                            cursor++;
+                    }
+                    else if (selected->type == DT_REG || (selected->flags & ENTRY_LINK_FILE))
                     {
-                        size_t entryLen = strlen(dirContents[cursor - 1]->d_name);
-                        if (currPathLen + entryLen + 1 >= PATH_MAX) break;
+                        char relPath[PATH_MAX];
+                        int parent = tree.nodes[node].parent;
+                        int dirFd = openTreeDir(&tree, parent);
+                        char *dirPath = (parent > 0 && getTreePath(&tree, parent, relPath, sizeof(relPath))) ? joinEntryPath(nav.path, relPath) : strdup(nav.path);
+                        if (dirFd >= 0 && dirPath) openFile(dirPath, dirFd, selected, 0);
+                        if (dirFd >= 0) close(dirFd);
+                        free(dirPath);
+                    }
+                    break;
+                }
 
-                        if (strcmp(currPath, "/") != 0)
-                        {
-                            currPath[currPathLen] = '/';
-                            strcpy(currPath + currPathLen + 1, dirContents[cursor - 1]->d_name);
-                        }
-                        else strcpy(currPath + 1, dirContents[cursor - 1]->d_name);  
+                if (resultsMode && listing.count > 0)
+                {
+                    // Results are paths below the current directory; a set heading just steps into its set
+                    DirEntry *selected = getListingEntry(&listing, cursor - 1);
+                    if (selected->type == DT_GROUP)
+                        cursor++;
+                    else
+                        openResultFile(&nav, selected, resultsMode == RESULTS_SEARCH ? getSearchHitLine(cursor - 1) : 0);
+                    break;
+                }
+
+                if (listing.count > 0)
+                {
+                    DirEntry *selected = getListingEntry(&listing, cursor - 1);
+                    if (view.fd >= 0)
+                    {
+                        if (selected->type == DT_DIR && changeArchiveDir(&view, &nav, selected->name))
+                            updateDirContents = cursor = 1;
+                        else if (selected->type == DT_REG || selected->type == DT_EXE)
+                            viewArchiveMember(&view, selected->name);
+                        break;
+                    }
 
+                    resolveEntry(getNavFd(&nav), selected);
+                    int archive = 0;
+                    if (selected->type == DT_REG || selected->type == DT_EXE || (selected->flags & ENTRY_LINK_FILE))
+                        archive = openArchiveView(&view, &nav, selected->name);
+                    if (archive > 0 && compareMode)
+                    {
+                        closeArchiveView(&view);
+                        setStatus("Archives cannot be browsed while comparing");
+                    }
+                    else if (archive > 0)
                         updateDirContents = cursor = 1;
+                    else if (archive < 0)
+                        setStatus("Cannot open archive %s: %s", selected->display, strerror(errno));
+                    else if (selected->type == DT_REG || (selected->flags & ENTRY_LINK_FILE))
+                        openFile(nav.path, getNavFd(&nav), selected, 0);
+                    else if ((selected->type == DT_DIR || (selected->flags & ENTRY_LINK_DIR)) && enterNavDir(&nav, selected->name))
+                    {
+                        watchDir(&DIR_WATCH, getNavFd(&nav));
+                        updateDirContents = !takePrefetch(&nav, &listing);
+                        visited = cursor = compareDirty = 1;
                     }
                 }
                 break;
 
             case INSPECT:
-                if (FILE_INSTALLED && entryCount > 0)
+                if (view.fd >= 0)
+                    setStatus("Inspecting is not available inside archives");
+                else if (FILE_INSTALLED && listing.count > 0 && getListingEntry(&listing, cursor - 1)->type != DT_GROUP)
                 {
                     showDialog("The selected item is currently being inspected. This may take a while on 486 or Pentium (P5) era hardware. Please do not press any keys until it completes.", 50);
-                    inspectEntry(currPath, dirContents[cursor - 1]);
+                    inspectEntry(nav.path, getNavFd(&nav), getListingEntry(&listing, cursor - 1));
                 }
                 break;
                 
+            case SORT_CYCLE:
+            case TOGGLE_DIRS_FIRST:
+                if (input == SORT_CYCLE)
+                    SORT_MODE = (SORT_MODE + 1) % SORT_MODE_COUNT;
+                else
+                    DIRS_FIRST = !DIRS_FIRST;
+
+                // The tree is simply read again in the new order
+                if (treeMode)
+                {
+                    updateDirContents = cursor = 1;
+                    break;
+                }
+
+                // Keep the cursor on the same entry after re-sorting; archive listings are never
+                // paged, so they are always sorted in memory rather than read again
+                cursor = resortListing(getNavFd(&nav), &listing, cursor);
+                if (compareMode)
+                {
+                    other.cursor = resortListing(getNavFd(&other.nav), &other.listing, other.cursor);
+                    compareDirty = 1;
+                }
+                break;
+
+            case JUMP:
+            {
+                char *target = showJumpPrompt();
+                if (!target) break;
+
+                // Jumping starts a fresh stack rooted at the target, like starting there
+                NavStack jumped = { NULL, 0, 0, NULL, 0 };
+                if (openNavStack(&jumped, target))
+                {
+                    stopSearch();
+                    free(resultsTitle);
+                    resultsTitle = NULL;
+                    resultsMode = RESULTS_NONE;
+                    closeArchiveView(&view);
+                    freeNavStack(&nav);
+                    nav = jumped;
+                    updateDirContents = visited = cursor = 1;
+                }
+                else
+                {
+                    int err = errno;
+                    freeNavStack(&jumped);
+                    setStatus("Cannot open %s: %s", target, strerror(err));
+                }
+                free(target);
+                break;
+            }
+
+            case SEARCH_TEXT:
+            {
+                if (view.fd >= 0)
+                {
+                    setStatus("Searching is not available inside archives");
+                    break;
+                }
+
+                char *pattern = showSearchPrompt();
+                if (!pattern) break;
+
+                // Results replace the listing until [h] goes back to the directory
+                if (startSearch(getNavFd(&nav), pattern))
+                {
+                    if (!resultsMode) resultsCursor = cursor;
+                    free(resultsTitle);
+                    if (asprintf(&resultsTitle, "Search: \"%s\" in %s", pattern, nav.path) < 0) resultsTitle = NULL;
+                    resultsMode = RESULTS_SEARCH;
+                    cursor = 1;
+                    watchDir(&DIR_WATCH, -1);
+                    freeDirListing(&listing);
+                    listing.dirFd = fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0);
+                }
+                else
+                    setStatus("Cannot search: %s", strerror(errno));
+                free(pattern);
+                break;
+            }
+
+            case FIND_DUPLICATES:
+                if (view.fd >= 0)
+                    setStatus("Finding duplicates is not available inside archives");
+                else if (isJobPending(JOB_DUPES))
+                    setStatus("Already looking for duplicates");
+                else if (resultsMode != RESULTS_DUPLICATES && DUPLICATES.root && strcmp(DUPLICATES.root, nav.path) == 0)
+                {
+                    // Results for this directory are kept until they are replaced, so [u] shows them again
+                    stopSearch();
+                    if (!resultsMode) resultsCursor = cursor;
+                    resultsMode = RESULTS_DUPLICATES;
+                    cursor = 1;
+                    watchDir(&DIR_WATCH, -1);
+                    freeDirListing(&listing);
+                    listing.dirFd = fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0);
+                    pruneDuplicates(listing.dirFd);
+                    getDuplicateContents(&listing, &resultsTitle);
+                }
+                else
+                {
+                    // Pressed again while shown, the directory is looked through afresh
+                    char **names = malloc(sizeof(char *));
+                    if (names) names[0] = strdup(nav.path);
+                    int jobFd = names && names[0] ? fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0) : -1;
+                    if (jobFd >= 0 && queueJob(JOB_DUPES, jobFd, -1, names, 1))
+                        setStatus("Looking for duplicates, [c] to cancel");
+                    else
+                    {
+                        if (jobFd >= 0) close(jobFd);
+                        if (names) free(names[0]);
+                        free(names);
+                        setStatus("Cannot look for duplicates: %s", strerror(errno));
+                    }
+                }
+                break;
+
+            case COMPARE_PANES:
+                if (compareMode)
+                {
+                    // The pane being browsed carries on as the only one
+                    watchDir(&PANE_WATCH, -1);
+                    freeDirListing(&other.listing);
+                    freeNavStack(&other.nav);
+                    compareMode = 0;
+                }
+                else if (view.fd >= 0)
+                    setStatus("Comparing is not available inside archives");
+                else if (openNavStack(&other.nav, nav.path) && getDirContents(getNavFd(&other.nav), &other.listing, 0))
+                {
+                    // The other pane starts out on the same directory, on the right
+                    watchDir(&PANE_WATCH, getNavFd(&other.nav));
+                    other.cursor = 1;
+                    activeSide = 0;
+                    compareMode = compareDirty = 1;
+                    setStatus("[tab] switch pane [n] next difference [#] compare contents [b] stop");
+                }
+                else
+                {
+                    setStatus("Cannot compare: %s", strerror(errno));
+                    freeDirListing(&other.listing);
+                    freeNavStack(&other.nav);
+                }
+                break;
+
+            case SWITCH_PANE:
+                if (!compareMode)
+                    setStatus("Only available while comparing, [b] to compare");
+                else
+                {
+                    // The other pane's listing, cursor and watch become the ones being browsed
+                    Pane held = { nav, listing, cursor };
+                    nav = other.nav;
+                    listing = other.listing;
+                    cursor = other.cursor;
+                    other = held;
+                    DirWatch watch = DIR_WATCH;
+                    DIR_WATCH = PANE_WATCH;
+                    PANE_WATCH = watch;
+                    activeSide = !activeSide;
+                }
+                break;
+
+            case NEXT_DIFFERENCE:
+                if (!compareMode)
+                    setStatus("Only available while comparing, [b] to compare");
+                else if (listing.count > 0)
+                {
+                    int next = findNextDifference(&listing, cursor);
+                    if (next)
+                    {
+                        cursorPrev = cursor;
+                        cursor = next;
+                        fullRedraw = 0;
+                    }
+                    else
+                        setStatus("No differences on this side");
+                }
+                break;
+
+            case COMPARE_CONTENTS:
+                if (!compareMode)
+                    setStatus("Only available while comparing, [b] to compare");
+                else if (isJobPending(JOB_COMPARE))
+                    setStatus("Already comparing contents");
+                else
+                {
+                    // Only files of the same size can have the same contents
+                    DirListing *left = activeSide ? &other.listing : &listing;
+                    DirListing *right = activeSide ? &listing : &other.listing;
+                    char **names;
+                    int count;
+                    int leftFd = -1;
+                    int rightFd = -1;
+                    if (!compareListings(left, right, differences, &names, &count))
+                        setStatus("Cannot compare: %s", strerror(errno));
+                    else if (!count)
+                        setStatus("No files of the same size to compare");
+                    else if ((leftFd = fcntl(left->dirFd, F_DUPFD_CLOEXEC, 0)) >= 0 && (rightFd = fcntl(right->dirFd, F_DUPFD_CLOEXEC, 0)) >= 0 &&
+                        queueJob(JOB_COMPARE, leftFd, rightFd, names, count))
+                        setStatus("Comparing the contents of %d file(s), [c] to cancel", count);
+                    else
+                    {
+                        int err = errno;
+                        if (leftFd >= 0) close(leftFd);
+                        if (rightFd >= 0) close(rightFd);
+                        for (int i = 0; i < count; i++) free(names[i]);
+                        free(names);
+                        setStatus("Cannot compare contents: %s", strerror(err));
+                    }
+                }
+                break;
+
+            case TOGGLE_DETAILS:
+                DETAILS_VISIBLE = !DETAILS_VISIBLE;
+                break;
+
+            case TOGGLE_TREE:
+                if (view.fd >= 0)
+                    setStatus("Tree view is not available inside archives");
+                else if (treeMode)
+                {
+                    // Back in the listing, the cursor goes to the top-level entry it was under
+                    int node = rowCount > 0 ? tree.rows[cursor - 1] : 0;
+                    while (node > 0 && tree.nodes[node].parent > 0) node = tree.nodes[node].parent;
+                    cursor = 1;
+                    for (int i = 0; node > 0 && i < listing.count; i++)
+                    {
+                        if (strcmp(getListingEntry(&listing, i)->name, tree.nodes[node].entry.name) == 0)
+                        {
+                            cursor = i + 1;
+                            break;
+                        }
+                    }
+                    freeTree(&tree);
+                    treeMode = 0;
+                }
+                else if (listing.pageFd >= 0)
+                    setStatus("This directory is too large for the tree view");
+                else if (buildTree(&tree, getNavFd(&nav)))
+                {
+                    // The top level is in listing order, so the cursor stays where it is
+                    treeMode = 1;
+                    if (cursor > tree.rowCount) cursor = tree.rowCount > 0 ? tree.rowCount : 1;
+                }
+                else
+                    setStatus("Cannot show tree view: %s", strerror(errno));
+                break;
+
             case TOGGLE_HIDDEN:
                 DOTFILES_VISIBLE = !DOTFILES_VISIBLE;
                 cursor = updateDirContents = 1;
+                if (compareMode) other.cursor = reloadListing(getNavFd(&other.nav), &other.listing, other.cursor);
                 break;
 
             case HELP:
-                printGenericScreen("Help", helpScreen);
+                if (helpScreen) printGenericScreen("Help", helpScreen);
+                break;
+
+            case TOGGLE_MARK:
+            {
+                int markedFrom = cursor;
+                if (listing.count > 0 && getListingEntry(&listing, cursor - 1)->type == DT_GROUP)
+                {
+                    // Marking a set marks every copy but the first, which is the one kept, and moves on to the next set
+                    int first = cursor + 1;
+                    int last = first;
+                    while (last < listing.count && getListingEntry(&listing, last)->type != DT_GROUP) last++;
+                    int marked = first < last && (getListingEntry(&listing, first)->flags & ENTRY_MARKED);
+                    for (int i = first; i < last; i++)
+                    {
+                        if (marked) getListingEntry(&listing, i)->flags &= ~ENTRY_MARKED;
+                        else getListingEntry(&listing, i)->flags |= ENTRY_MARKED;
+                    }
+                    if (last < listing.count) cursor = last + 1;
+                }
+                else if (listing.count > 0)
+                {
+                    getListingEntry(&listing, cursor - 1)->flags ^= ENTRY_MARKED;
+                    if (cursor < listing.count) cursor++;
+                }
+
+                // A single mark is drawn with the cursor move; marking a set redraws it from its first row
+                if (listing.count > 0)
+                {
+                    fullRedraw = 0;
+                    changedFrom = getListingEntry(&listing, markedFrom - 1)->type == DT_GROUP ? markedFrom - 1 : -1;
+                    cursorPrev = markedFrom;
+                }
+                break;
+            }
+
+            case CLIPBOARD_COPY:
+            case CLIPBOARD_CUT:
+            {
+                // Archives are read-only, so copying out of one extracts next to it instead
+                if (view.fd >= 0)
+                {
+                    if (input == CLIPBOARD_CUT)
+                        setStatus("Archives are read-only, use [y] to extract");
+                    else
+                        extractArchiveSelection(&view, &listing, cursor, getNavFd(&nav));
+                    break;
+                }
+
+                int count;
+                char **names = collectSelection(&listing, cursor, &count);
+                if (names)
+                {
+                    clearClipboard();
+                    CLIPBOARD.dirFd = fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0);
+                    if (CLIPBOARD.dirFd < 0)
+                    {
+                        setStatus("Cannot %s: %s", input == CLIPBOARD_CUT ? "cut" : "copy", strerror(errno));
+                        for (int i = 0; i < count; i++) free(names[i]);
+                        free(names);
+                        break;
+                    }
+                    CLIPBOARD.type = input == CLIPBOARD_CUT ? JOB_MOVE : JOB_COPY;
+                    CLIPBOARD.names = names;
+                    CLIPBOARD.count = count;
+                    setStatus("%d item(s) %s, [p] to paste", count, input == CLIPBOARD_CUT ? "cut" : "copied");
+                }
+                break;
+            }
+
+            case CLIPBOARD_PASTE:
+                if (view.fd >= 0)
+                    setStatus("Archives are read-only");
+                else if (CLIPBOARD.count > 0)
+                {
+                    // Moving entries onto themselves would do nothing, so the clipboard is kept for another directory
+                    struct stat srcDir, dstDir;
+                    if (CLIPBOARD.type == JOB_MOVE && fstat(CLIPBOARD.dirFd, &srcDir) == 0 && fstat(getNavFd(&nav), &dstDir) == 0 &&
+                        srcDir.st_dev == dstDir.st_dev && srcDir.st_ino == dstDir.st_ino)
+                    {
+                        setStatus("%d item(s) already here, open another directory to paste", CLIPBOARD.count);
+                        break;
+                    }
+
+                    int dstFd = fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0);
+                    if (dstFd < 0)
+                        setStatus("Cannot paste: %s", strerror(errno));
+                    else if (queueJob(CLIPBOARD.type, CLIPBOARD.dirFd, dstFd, CLIPBOARD.names, CLIPBOARD.count))
+                    {
+                        // The job now owns the clipboard's descriptor and names
+                        CLIPBOARD.dirFd = -1;
+                        CLIPBOARD.names = NULL;
+                        CLIPBOARD.count = 0;
+                    }
+                    else
+                        close(dstFd);
+                }
+                break;
+
+            case REMOVE:
+                if (view.fd >= 0)
+                    setStatus("Archives are read-only");
+                else if (listing.count > 0)
+                {
+                    int count = 0;
+                    for (int i = 0; i < listing.count; i++)
+                        if (getListingEntry(&listing, i)->flags & ENTRY_MARKED) count++;
+
+                    char message[160];
+                    if (!count && getListingEntry(&listing, cursor - 1)->type == DT_GROUP)
+                    {
+                        setStatus("Mark the copies to delete, [space] on a set marks all but the first");
+                        break;
+                    }
+                    if (count)
+                        snprintf(message, sizeof(message), "Delete %d marked item(s)? Press y to confirm or any other key to cancel.", count);
+                    else
+                        snprintf(message, sizeof(message), "Delete %.80s? Press y to confirm or any other key to cancel.", getListingEntry(&listing, cursor - 1)->display);
+                    showDialog(message, 50);
+
+                    if (tolower(readKey()) == 'y')
+                    {
+                        char **names = collectSelection(&listing, cursor, &count);
+                        int dirFd = names ? fcntl(getNavFd(&nav), F_DUPFD_CLOEXEC, 0) : -1;
+                        if (names && (dirFd < 0 || !queueJob(JOB_DELETE, dirFd, -1, names, count)))
+                        {
+                            if (dirFd < 0)
+                                setStatus("Cannot delete: %s", strerror(errno));
+                            else
+                                close(dirFd);
+                            for (int i = 0; i < count; i++) free(names[i]);
+                            free(names);
+                        }
+                    }
+                }
+                break;
+
+            case CANCEL_JOB:
+            {
+                // A running file operation is cancelled first, then a running search
+                pthread_mutex_lock(&JOB_LOCK);
+                int jobActive = JOB_ACTIVE != NULL;
+                if (jobActive) JOB_CANCEL = 1;
+                pthread_mutex_unlock(&JOB_LOCK);
+                if (!jobActive && isSearchRunning())
+                {
+                    cancelSearch();
+                    setStatus("Search cancelled");
+                }
                 break;
+            }
 
             case QUIT:
+                if (hasPendingJobs())
+                {
+                    showDialog("File operations are still running. Press y to cancel them and quit, or any other key to keep browsing.", 50);
+                    if (tolower(readKey()) != 'y') break;
+                }
                 running = 0;
                 break;
 
@@ -1116,12 +11830,18 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (dirContents)
-    {
-        for (int i = 0; i < entryCount; i++) free(dirContents[i]);
-        free(dirContents);
-    }
-
-    writeLastDir(currPath);
+    stopJobs();
+    stopPrefetch();
+    stopSearch();
+    free(resultsTitle);
+    clearClipboard();
+    freeDirListing(&listing);
+    freeDirListing(&other.listing);
+    freeNavStack(&other.nav);
+    freeTree(&tree);
+    closeArchiveView(&view);
+
+    writeLastDir(nav.path);
+    freeNavStack(&nav);
     return 0;  
 }